@@ -0,0 +1,880 @@
+// Benchmarks every matcher configuration on every dataset, reporting speed
+// and accuracy against the ground truth.
+
+// Compile cmd:
+// gcc -O3 bench.c -o bench.o -lpthread -lm
+
+// Usage: ./bench.o [-t threads] [-r repeats] [-d dataset] [-c config] [-k kernels] [-o results.jsonl] [-i image_dir]
+//   Datasets are the cache files in cache/ (see dataset_convert.c), or the
+//   tsukuba PPMs when there is no cache of it. -d and -c keep only the
+//   datasets and configurations whose name contains the given text, -k forces
+//   a kernel set (scalar, sse2, avx2 or neon). Each result is a line of
+//   results.jsonl (default bench_results.jsonl), and with -i the disparity
+//   maps are written to image_dir as <dataset>_<config>.ppm.
+//   Where the CPU and kernel expose hardware counters, the L1 data cache and
+//   last level cache misses of the matching are counted as well.
+//   The tsukuba-sequence dataset is the five tsukuba views played as video,
+//   matched frame by frame in full and with temporal_match_frame().
+
+// stereo.c defines _GNU_SOURCE, so it comes before any system header
+#include "stereo.c"
+
+#include <dirent.h>
+#include <getopt.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+
+// Default number of block matching threads, as for a stereo context
+#define BENCH_THREADS STEREO_THREADS
+// Directory of the dataset cache files
+#define BENCH_CACHE_DIR "cache"
+// Disparity error counted as a bad pixel
+#define BAD_PIXEL_THRESHOLD 1.0
+// Largest 8 path semi-global matching cost volume run, in bytes. Bigger
+// scenes skip the configuration rather than swap.
+#define BENCH_MAX_SGM_VOLUME (512UL << 20)
+// Most timed stages of a run, pyramid levels have two each
+#define BENCH_MAX_STAGES (2 * PYRAMID_MAX_LEVELS + 1)
+
+// A matcher configuration
+struct bench_config
+{
+    const char *name;
+    enum match_cost cost;
+    // Pyramid levels, 1 for plain block matching
+    int levels;
+    // Semi-global matching paths, 0 for block matching
+    int paths;
+    // Match the greyscale planes instead of RGB
+    int grey;
+    // Search per-tile ranges from search_ranges_estimate()
+    int ranges;
+    // Match with block_match_tiled(), tuned by match_tiling_tune()
+    int tiled;
+    // Post-filter the disparities with disparity_median3(), then with
+    // speckle_filter_apply()
+    int median;
+    int speckle;
+    // Kernel edge size of plain block matching, 0 for KERNEL_EDGE_SIZE
+    int edge;
+};
+
+static const struct bench_config bench_configs[] = {
+    {"sad", MATCH_COST_SAD, 1, 0, 0, 0, 0, 0, 0, 0},
+    {"sad-grey", MATCH_COST_SAD, 1, 0, 1, 0, 0, 0, 0, 0},
+    {"census", MATCH_COST_CENSUS, 1, 0, 0, 0, 0, 0, 0, 0},
+    {"sad-ranges", MATCH_COST_SAD, 1, 0, 0, 1, 0, 0, 0, 0},
+    {"census-ranges", MATCH_COST_CENSUS, 1, 0, 0, 1, 0, 0, 0, 0},
+    {"sad-tiled", MATCH_COST_SAD, 1, 0, 0, 0, 1, 0, 0, 0},
+    {"census-tiled", MATCH_COST_CENSUS, 1, 0, 0, 0, 1, 0, 0, 0},
+    {"sad-3x3", MATCH_COST_SAD, 1, 0, 0, 0, 0, 0, 0, 1},
+    {"sad-7x7", MATCH_COST_SAD, 1, 0, 0, 0, 0, 0, 0, 3},
+    {"sad-15x15", MATCH_COST_SAD, 1, 0, 0, 0, 0, 0, 0, 7},
+    {"census-7x7", MATCH_COST_CENSUS, 1, 0, 0, 0, 0, 0, 0, 3},
+    {"sad-speckle", MATCH_COST_SAD, 1, 0, 0, 0, 0, 0, 1, 0},
+    {"sad-median-speckle", MATCH_COST_SAD, 1, 0, 0, 0, 0, 1, 1, 0},
+    {"census-speckle", MATCH_COST_CENSUS, 1, 0, 0, 0, 0, 0, 1, 0},
+    {"sad-pyramid3", MATCH_COST_SAD, 3, 0, 0, 0, 0, 0, 0, 0},
+    {"census-pyramid3", MATCH_COST_CENSUS, 3, 0, 0, 0, 0, 0, 0, 0},
+    {"sgm4-sad", MATCH_COST_SAD, 1, 4, 0, 0, 0, 0, 0, 0},
+    {"sgm4-census", MATCH_COST_CENSUS, 1, 4, 0, 0, 0, 0, 0, 0},
+    {"sgm8-census", MATCH_COST_CENSUS, 1, 8, 0, 0, 0, 0, 0, 0},
+};
+
+// A loaded stereo pair
+struct bench_dataset
+{
+    char name[64];
+    struct ppm_array rgb[2];
+    struct ppm_array grey[2];
+    // Ground truth of the left view, no data if unknown
+    struct ppm_array truth;
+    int truth_scale;
+    int search_len;
+    double load_seconds;
+    // Cache file, or the tsukuba images when mapped_files is set
+    struct dataset set;
+    int mapped_files;
+    struct mapped_image files[3];
+};
+
+// Timings of one run
+struct bench_timing
+{
+    int stages;
+    const char *stage_name[BENCH_MAX_STAGES];
+    double stage_seconds[BENCH_MAX_STAGES];
+    double total_seconds;
+    // Fraction of the cost volume the search ranges skipped
+    double skipped;
+    // Fraction of the pixels the speckle filter invalidated
+    double removed;
+    // Cache misses while matching, -1 if not counted
+    long long misses[2];
+};
+
+static void bench_stage(struct bench_timing *timing, const char *name, double seconds)
+{
+    timing->stage_name[timing->stages] = name;
+    timing->stage_seconds[timing->stages++] = seconds;
+    timing->total_seconds += seconds;
+}
+
+// Hardware cache events counted while matching
+enum bench_counter
+{
+    BENCH_L1D_MISSES,
+    BENCH_CACHE_MISSES,
+    BENCH_COUNTERS
+};
+
+// perf_event counters of the main thread (index 0) and of each pool worker,
+// which only count the thread that opened them. -1 where the system doesn't
+// have them, as in most virtual machines.
+struct bench_counters
+{
+    int threads;
+    int (*fd)[BENCH_COUNTERS];
+};
+
+static int bench_counter_open(enum bench_counter counter)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    if (counter == BENCH_L1D_MISSES)
+    {
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    }
+    else
+    {
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    }
+    // User space only, which perf_event_paranoid 2 still allows
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void bench_counters_open_thread(void *arg, int worker)
+{
+    struct bench_counters *counters = (struct bench_counters *)arg;
+    for (int c = 0; c < BENCH_COUNTERS; c++)
+    {
+        counters->fd[worker + 1][c] = bench_counter_open((enum bench_counter)c);
+    }
+}
+
+// Opens the counters on this thread and every worker of the pool.
+static void bench_counters_open(struct bench_counters *counters, struct thread_pool *pool)
+{
+    counters->threads = pool->workers + 1;
+    counters->fd = (int (*)[BENCH_COUNTERS])malloc(sizeof(*counters->fd) * counters->threads);
+    if (!counters->fd)
+    {
+        fprintf(stderr, "Unable to allocate memory\n");
+        exit(1);
+    }
+    bench_counters_open_thread(counters, -1);
+    thread_pool_run_each(pool, bench_counters_open_thread, counters);
+}
+
+// Sums each counter over the threads, -1 if it isn't available.
+static void bench_counters_read(struct bench_counters *counters, long long counts[BENCH_COUNTERS])
+{
+    for (int c = 0; c < BENCH_COUNTERS; c++)
+    {
+        counts[c] = 0;
+        for (int t = 0; t < counters->threads; t++)
+        {
+            long long value;
+            if (counters->fd[t][c] < 0 || read(counters->fd[t][c], &value, sizeof(value)) != sizeof(value))
+            {
+                counts[c] = -1;
+                break;
+            }
+            counts[c] += value;
+        }
+    }
+}
+
+static void bench_counters_close(struct bench_counters *counters)
+{
+    for (int t = 0; t < counters->threads; t++)
+    {
+        for (int c = 0; c < BENCH_COUNTERS; c++)
+        {
+            if (counters->fd[t][c] >= 0)
+            {
+                close(counters->fd[t][c]);
+            }
+        }
+    }
+    free(counters->fd);
+}
+
+// Sets the timing's cache misses to the counts since before.
+static void bench_counters_since(struct bench_counters *counters, const long long before[BENCH_COUNTERS],
+                                 struct bench_timing *timing)
+{
+    long long after[BENCH_COUNTERS];
+    bench_counters_read(counters, after);
+    for (int c = 0; c < BENCH_COUNTERS; c++)
+    {
+        timing->misses[c] = before[c] < 0 || after[c] < 0 ? -1 : after[c] - before[c];
+    }
+}
+
+// Search range of a dataset: the calibration's, else enough for the largest
+// ground truth disparity, and never less than main.c's BLOCK_SIZE.
+static int bench_search_len(struct bench_dataset *data, const struct dataset_header *header)
+{
+    int search_len = BLOCK_SIZE;
+    if (header && header->has_calib && header->calib.ndisp > search_len)
+    {
+        search_len = header->calib.ndisp;
+    }
+    if (data->truth.data && data->truth_scale > 0)
+    {
+        int max = 0;
+        for (int y = 0; y < data->truth.height; y++)
+        {
+            for (int x = 0; x < data->truth.width; x++)
+            {
+                int value = *ppm_array_at(&data->truth, x, y);
+                max = value > max ? value : max;
+            }
+        }
+        int needed = (max + data->truth_scale - 1) / data->truth_scale + 1;
+        search_len = needed > search_len ? needed : search_len;
+    }
+    return search_len;
+}
+
+// Opens a cache file as a dataset named after the file.
+static void bench_open_cache(const char *filename, const char *name, struct bench_dataset *data)
+{
+    memset(data, 0, sizeof(*data));
+    snprintf(data->name, sizeof(data->name), "%s", name);
+    double start = seconds_now();
+    dataset_open(filename, &data->set);
+    data->load_seconds = seconds_now() - start;
+    data->rgb[0] = data->set.plane[DATASET_LEFT_RGB];
+    data->rgb[1] = data->set.plane[DATASET_RIGHT_RGB];
+    data->grey[0] = data->set.plane[DATASET_LEFT_GREY];
+    data->grey[1] = data->set.plane[DATASET_RIGHT_GREY];
+    data->truth = data->set.plane[DATASET_TRUTH];
+    data->truth_scale = data->set.header->truth_scale;
+    data->search_len = bench_search_len(data, data->set.header);
+}
+
+// Maps the tsukuba images, for when there is no cache of them.
+static void bench_open_tsukuba(struct bench_dataset *data)
+{
+    memset(data, 0, sizeof(*data));
+    snprintf(data->name, sizeof(data->name), "tsukuba");
+    double start = seconds_now();
+    mapped_image_open("tsukuba/scene1.row3.col3.ppm", &data->files[0]);
+    mapped_image_open("tsukuba/scene1.row3.col4.ppm", &data->files[1]);
+    mapped_image_open("tsukuba/truedisp.row3.col3.pgm", &data->files[2]);
+    mapped_image_view(&data->files[0], &data->rgb[0]);
+    mapped_image_view(&data->files[1], &data->rgb[1]);
+    mapped_image_view(&data->files[2], &data->truth);
+    to_greyscale_plane(&data->rgb[0], &data->grey[0]);
+    to_greyscale_plane(&data->rgb[1], &data->grey[1]);
+    data->load_seconds = seconds_now() - start;
+    data->mapped_files = 1;
+    data->truth_scale = 16;
+    data->search_len = bench_search_len(data, NULL);
+}
+
+static void bench_close(struct bench_dataset *data)
+{
+    if (data->mapped_files)
+    {
+        for (int i = 0; i < 3; i++)
+        {
+            mapped_image_close(&data->files[i]);
+        }
+        free_ppm_array(&data->grey[0]);
+        free_ppm_array(&data->grey[1]);
+    }
+    else
+    {
+        dataset_close(&data->set);
+    }
+}
+
+// Runs a configuration once, timing its stages and counting the cache misses
+// of the matching. A tiled configuration with tiling still zeroed tunes it
+// first.
+static void bench_run(const struct bench_config *config, struct bench_dataset *data, struct disparity_map *map,
+                      struct thread_pool *pool, struct bench_counters *counters, struct match_tiling *tiling,
+                      struct bench_timing *timing)
+{
+    struct ppm_array *left = config->grey ? &data->grey[0] : &data->rgb[0];
+    struct ppm_array *right = config->grey ? &data->grey[1] : &data->rgb[1];
+    long long before[BENCH_COUNTERS];
+    memset(timing, 0, sizeof(*timing));
+    if (config->levels > 1)
+    {
+        // Made outside the timed stages, as a camera loop makes them once
+        struct image_pyramid pyr[2];
+        struct pyramid_match_buffers buffers;
+        struct pyramid_timing levels;
+        image_pyramid_init(&pyr[0], left->width, left->height, left->channels, config->levels);
+        image_pyramid_init(&pyr[1], right->width, right->height, right->channels, config->levels);
+        pyramid_match_buffers_init(&buffers, &pyr[0], config->cost);
+        bench_counters_read(counters, before);
+        pyramid_block_match_pyramids(&pyr[0], &pyr[1], left, right, map, data->search_len, config->cost, &buffers, pool,
+                                     &levels);
+        bench_counters_since(counters, before, timing);
+        pyramid_match_buffers_free(&buffers);
+        image_pyramid_free(&pyr[0]);
+        image_pyramid_free(&pyr[1]);
+        static const char *resize_names[] = {"resize0", "resize1", "resize2", "resize3",
+                                             "resize4", "resize5", "resize6", "resize7"};
+        static const char *match_names[] = {"match0", "match1", "match2", "match3",
+                                            "match4", "match5", "match6", "match7"};
+        for (int l = levels.levels - 1; l >= 0; l--)
+        {
+            bench_stage(timing, resize_names[l], levels.resize_seconds[l]);
+            bench_stage(timing, match_names[l], levels.match_seconds[l]);
+        }
+        return;
+    }
+
+    struct ppm_array match_left;
+    struct ppm_array match_right;
+    struct search_ranges sr;
+    struct speckle_filter filter;
+    struct disparity_map unfiltered;
+    // With the median filter the matcher writes to a map of its own, the
+    // median goes to map
+    struct disparity_map *matched = config->median ? &unfiltered : map;
+    if (config->ranges)
+    {
+        // Made outside the timed stages, like the pyramids above
+        search_ranges_init(&sr, left->width, left->height, left->channels, data->search_len);
+    }
+    if (config->median)
+    {
+        unfiltered.width = map->width;
+        unfiltered.height = map->height;
+        allocate_disparity_map(&unfiltered);
+    }
+    if (config->speckle)
+    {
+        speckle_filter_init(&filter, map->width, map->height);
+    }
+    double start = seconds_now();
+    match_cost_prepare(left, &match_left, config->cost);
+    match_cost_prepare(right, &match_right, config->cost);
+    bench_stage(timing, "prepare", seconds_now() - start);
+    if (config->ranges)
+    {
+        start = seconds_now();
+        search_ranges_estimate(&sr, left, right, pool);
+        bench_stage(timing, "ranges", seconds_now() - start);
+    }
+    if (config->tiled && !tiling->tile_width)
+    {
+        // Untimed, as a camera loop tunes once at startup
+        match_tiling_tune(&match_left, &match_right, data->search_len, pool, tiling);
+    }
+    bench_counters_read(counters, before);
+    start = seconds_now();
+    if (config->paths)
+    {
+        sgm_match(&match_left, &match_right, matched, data->search_len, config->paths);
+    }
+    else if (config->ranges)
+    {
+        block_match_ranges(&match_left, &match_right, matched, &sr, pool);
+    }
+    else if (config->tiled)
+    {
+        block_match_tiled(&match_left, &match_right, matched, data->search_len, tiling, pool);
+    }
+    else
+    {
+        block_match_edge(&match_left, &match_right, matched, NULL, data->search_len,
+                         config->edge ? config->edge : KERNEL_EDGE_SIZE, pool);
+    }
+    bench_stage(timing, "match", seconds_now() - start);
+    bench_counters_since(counters, before, timing);
+    if (config->median)
+    {
+        start = seconds_now();
+        disparity_median3(&unfiltered, map);
+        bench_stage(timing, "median", seconds_now() - start);
+        free_disparity_map(&unfiltered);
+    }
+    if (config->speckle)
+    {
+        start = seconds_now();
+        int removed = speckle_filter_apply(&filter, map, speckle_max_region(map->width, map->height), SPECKLE_MAX_DIFF);
+        bench_stage(timing, "speckle", seconds_now() - start);
+        timing->removed = (double)removed / ((double)map->width * map->height);
+        speckle_filter_free(&filter);
+    }
+    if (config->ranges)
+    {
+        timing->skipped = search_ranges_skipped(&sr);
+        search_ranges_free(&sr);
+    }
+    free_ppm_array(&match_left);
+    free_ppm_array(&match_right);
+}
+
+// Returns the fraction of pixels whose disparity in map is more than the bad
+// pixel threshold away from a full search with the configuration's cost, for
+// the search ranges' accuracy where there is no ground truth.
+static double bench_ranges_changed(const struct bench_config *config, struct bench_dataset *data,
+                                   struct disparity_map *map, struct thread_pool *pool)
+{
+    struct ppm_array match_left;
+    struct ppm_array match_right;
+    struct disparity_map full;
+    full.width = map->width;
+    full.height = map->height;
+    allocate_disparity_map(&full);
+    match_cost_prepare(&data->rgb[0], &match_left, config->cost);
+    match_cost_prepare(&data->rgb[1], &match_right, config->cost);
+    block_match_parallel(&match_left, &match_right, &full, data->search_len, pool);
+    int changed = 0;
+    for (int y = 0; y < map->height; y++)
+    {
+        for (int x = 0; x < map->width; x++)
+        {
+            double dif = fabs(disparity_from_fixed(*disparity_map_at(map, x, y)) -
+                              disparity_from_fixed(*disparity_map_at(&full, x, y)));
+            changed += !(dif <= BAD_PIXEL_THRESHOLD);
+        }
+    }
+    free_disparity_map(&full);
+    free_ppm_array(&match_left);
+    free_ppm_array(&match_right);
+    return (double)changed / ((double)map->width * map->height);
+}
+
+// Returns the fraction of the pixels with a known disparity that the map has
+// one for, but more than the bad pixel threshold off. Unlike the bad pixels of
+// disparity_error(), pixels the post-filters invalidated don't count.
+static double bench_bad_valid(struct bench_dataset *data, struct disparity_map *map)
+{
+    int known = 0;
+    int wrong = 0;
+    for (int y = 0; y < map->height && y < data->truth.height; y++)
+    {
+        for (int x = 0; x < map->width && x < data->truth.width; x++)
+        {
+            int value = *ppm_array_at(&data->truth, x, y);
+            uint16_t disparity = *disparity_map_at(map, x, y);
+            if (value == 0 || disparity == DISPARITY_INVALID)
+            {
+                continue;
+            }
+            known++;
+            wrong += !(fabs(disparity_from_fixed(disparity) - (double)value / data->truth_scale) <= BAD_PIXEL_THRESHOLD);
+        }
+    }
+    return known ? (double)wrong / known : 0;
+}
+
+// Writes one result as a line of JSON.
+static void bench_write_result(FILE *out, const struct bench_config *config, struct bench_dataset *data, int threads,
+                               int repeats, struct bench_timing *best, double throughput, int has_truth, double error,
+                               double bad, double changed, double bad_valid, const struct match_tiling *tiling)
+{
+    fprintf(out, "{\"dataset\":\"%s\",\"config\":\"%s\",\"kernels\":\"%s\",\"width\":%d,\"height\":%d,"
+                 "\"search_len\":%d,\"threads\":%d,\"repeats\":%d,\"load_seconds\":%.6f,\"seconds\":%.6f,"
+                 "\"mpix_disparities_per_second\":%.3f,\"stages\":{",
+            data->name, config->name, sad_kernels_get()->name, data->rgb[0].width, data->rgb[0].height, data->search_len,
+            config->paths ? 1 : threads, repeats, data->load_seconds, best->total_seconds, throughput);
+    for (int s = 0; s < best->stages; s++)
+    {
+        fprintf(out, "%s\"%s\":%.6f", s ? "," : "", best->stage_name[s], best->stage_seconds[s]);
+    }
+    fprintf(out, "}");
+    if (config->ranges)
+    {
+        fprintf(out, ",\"skipped_percent\":%.3f,\"changed_percent\":%.3f", 100 * best->skipped, 100 * changed);
+    }
+    if (config->tiled)
+    {
+        fprintf(out, ",\"tile_width\":%d,\"tile_height\":%d,\"disparity_block\":%d", tiling->tile_width,
+                tiling->tile_height, tiling->disparity_block);
+    }
+    if (config->speckle)
+    {
+        fprintf(out, ",\"removed_percent\":%.3f", 100 * best->removed);
+        if (has_truth)
+        {
+            fprintf(out, ",\"bad_valid_percent\":%.3f", 100 * bad_valid);
+        }
+        else
+        {
+            fprintf(out, ",\"bad_valid_percent\":null");
+        }
+    }
+    const char *counter_names[BENCH_COUNTERS] = {"l1d_misses", "cache_misses"};
+    for (int c = 0; c < BENCH_COUNTERS; c++)
+    {
+        if (best->misses[c] >= 0)
+        {
+            fprintf(out, ",\"%s\":%lld", counter_names[c], best->misses[c]);
+        }
+        else
+        {
+            fprintf(out, ",\"%s\":null", counter_names[c]);
+        }
+    }
+    if (has_truth)
+    {
+        fprintf(out, ",\"mean_error\":%.4f,\"bad_percent\":%.3f}\n", error, 100 * bad);
+    }
+    else
+    {
+        fprintf(out, ",\"mean_error\":null,\"bad_percent\":null}\n");
+    }
+}
+
+// Runs every selected configuration on a dataset, keeping the fastest of the
+// repeats.
+static void bench_dataset(struct bench_dataset *data, const char *config_filter, struct thread_pool *pool,
+                          struct bench_counters *counters, int repeats, FILE *out, const char *image_dir)
+{
+    struct disparity_map map;
+    map.height = data->rgb[0].height;
+    map.width = data->rgb[0].width;
+    allocate_disparity_map(&map);
+    int has_truth = data->truth.data && data->truth_scale > 0;
+
+    for (size_t c = 0; c < sizeof(bench_configs) / sizeof(bench_configs[0]); c++)
+    {
+        const struct bench_config *config = &bench_configs[c];
+        if (config_filter && !strstr(config->name, config_filter))
+        {
+            continue;
+        }
+        size_t lanes = (data->search_len + SGM_LANES) / SGM_LANES * SGM_LANES;
+        if (config->paths == 8 && (size_t)map.width * map.height * lanes * sizeof(uint16_t) > BENCH_MAX_SGM_VOLUME)
+        {
+            printf("%-12s %-18s skipped, the cost volume is too large\n", data->name, config->name);
+            continue;
+        }
+
+        struct bench_timing best;
+        struct bench_timing timing;
+        struct match_tiling tiling;
+        memset(&best, 0, sizeof(best));
+        memset(&tiling, 0, sizeof(tiling));
+        for (int r = 0; r < repeats; r++)
+        {
+            bench_run(config, data, &map, pool, counters, &tiling, &timing);
+            if (r == 0 || timing.total_seconds < best.total_seconds)
+            {
+                best = timing;
+            }
+        }
+
+        // Candidate disparities tested by a full search, per second
+        double throughput = (double)map.width * map.height * data->search_len / best.total_seconds / 1e6;
+        double bad = 0;
+        double error = has_truth ? disparity_error(&map, &data->truth, data->truth_scale, BAD_PIXEL_THRESHOLD, &bad) : 0;
+        printf("%-12s %-18s %9.2f ms %10.1f Mpix*disp/s", data->name, config->name, 1000 * best.total_seconds,
+               throughput);
+        if (has_truth)
+        {
+            printf("  %.3f px error, %6.2f%% bad", error, 100 * bad);
+        }
+        double changed = 0;
+        if (config->ranges)
+        {
+            changed = bench_ranges_changed(config, data, &map, pool);
+            printf("  %.1f%% skipped, %.2f%% changed", 100 * best.skipped, 100 * changed);
+        }
+        if (config->tiled)
+        {
+            printf("  %dx%d tiles, %d disparities a pass", tiling.tile_width, tiling.tile_height,
+                   tiling.disparity_block);
+        }
+        double bad_valid = 0;
+        if (config->speckle)
+        {
+            printf("  %.2f%% removed", 100 * best.removed);
+            if (has_truth)
+            {
+                bad_valid = bench_bad_valid(data, &map);
+                printf(", %.2f%% of the rest bad", 100 * bad_valid);
+            }
+        }
+        if (best.misses[BENCH_L1D_MISSES] >= 0 && best.misses[BENCH_CACHE_MISSES] >= 0)
+        {
+            printf("  %.1fM L1d misses, %.1fM cache misses", best.misses[BENCH_L1D_MISSES] / 1e6,
+                   best.misses[BENCH_CACHE_MISSES] / 1e6);
+        }
+        printf("\n");
+        for (int s = 0; s < best.stages; s++)
+        {
+            printf("    %-9s %9.2f ms\n", best.stage_name[s], 1000 * best.stage_seconds[s]);
+        }
+        bench_write_result(out, config, data, pool->workers, repeats, &best, throughput, has_truth, error, bad, changed,
+                           bad_valid, &tiling);
+
+        if (image_dir)
+        {
+            char filename[512];
+            struct ppm_array img;
+            img.width = map.width;
+            img.height = map.height;
+            img.channels = 3;
+            ppm_array_allocate(&img);
+            disparity_map_to_img(&map, &img);
+            snprintf(filename, sizeof(filename), "%s/%s_%s.ppm", image_dir, data->name, config->name);
+            write_array(filename, &img);
+            free_ppm_array(&img);
+        }
+    }
+    free_disparity_map(&map);
+}
+
+// Views of the tsukuba sequence, the camera moves one baseline to the right
+// from each column to the next
+#define SEQUENCE_VIEWS 5
+// Frames of the sequence, going back and forth over the pairs of neighbouring
+// views
+#define SEQUENCE_FRAMES 32
+// Focal length given to the sequence's calibration. For a sideways move only
+// the baseline matters, so this is nominal.
+#define SEQUENCE_FOCAL 615
+
+// A way of matching the frames of the sequence
+struct sequence_config
+{
+    const char *name;
+    int temporal;
+    int odometry;
+};
+
+static const struct sequence_config sequence_configs[] = {
+    {"sad", 0, 0},
+    {"temporal-sad", 1, 0},
+    {"temporal-sad-odometry", 1, 1},
+};
+
+// Matches a video-like sequence of the tsukuba views, the pair of columns
+// k and k + 1 being frame k, every frame in full or temporally.
+static void bench_sequence(const char *config_filter, struct thread_pool *pool, int repeats, FILE *out)
+{
+    struct mapped_image files[SEQUENCE_VIEWS + 1];
+    struct ppm_array views[SEQUENCE_VIEWS];
+    struct ppm_array truth;
+    char filename[64];
+    for (int i = 0; i < SEQUENCE_VIEWS; i++)
+    {
+        snprintf(filename, sizeof(filename), "tsukuba/scene1.row3.col%d.ppm", i + 1);
+        mapped_image_open(filename, &files[i]);
+        mapped_image_view(&files[i], &views[i]);
+    }
+    // The ground truth is for col3
+    mapped_image_open("tsukuba/truedisp.row3.col3.pgm", &files[SEQUENCE_VIEWS]);
+    mapped_image_view(&files[SEQUENCE_VIEWS], &truth);
+    int width = views[0].width;
+    int height = views[0].height;
+    int search_len = BLOCK_SIZE;
+    struct stereo_calib calib = {SEQUENCE_FOCAL, width / 2.0, height / 2.0, 1, 0, width, height, search_len};
+
+    // Left views of the frames, back and forth over cols 1 to 4
+    int left[SEQUENCE_FRAMES];
+    int period = 2 * (SEQUENCE_VIEWS - 2);
+    for (int f = 0; f < SEQUENCE_FRAMES; f++)
+    {
+        int phase = f % period;
+        left[f] = phase < SEQUENCE_VIEWS - 1 ? phase : period - phase;
+    }
+
+    struct disparity_map map;
+    map.width = width;
+    map.height = height;
+    allocate_disparity_map(&map);
+    struct temporal_match tm;
+    temporal_match_init(&tm, width, height, search_len);
+    for (size_t c = 0; c < sizeof(sequence_configs) / sizeof(sequence_configs[0]); c++)
+    {
+        const struct sequence_config *config = &sequence_configs[c];
+        if (config_filter && !strstr(config->name, config_filter))
+        {
+            continue;
+        }
+        double best = 0;
+        double error = 0;
+        double bad = 0;
+        long window_pixels = 0;
+        for (int r = 0; r < repeats; r++)
+        {
+            double seconds = 0;
+            double run_error = 0;
+            double run_bad = 0;
+            int scored = 0;
+            long run_window = 0;
+            temporal_match_reset(&tm);
+            for (int f = 0; f < SEQUENCE_FRAMES; f++)
+            {
+                struct ppm_array *img_left = &views[left[f]];
+                struct ppm_array *img_right = &views[left[f] + 1];
+                struct camera_motion motion = {f > 0 ? left[f] - left[f - 1] : 0, 0, 0, 0};
+                double start = seconds_now();
+                if (config->temporal)
+                {
+                    temporal_match_frame(&tm, img_left, img_right, &map, config->odometry ? &calib : NULL,
+                                         config->odometry ? &motion : NULL, pool);
+                    run_window += tm.window_pixels;
+                }
+                else
+                {
+                    block_match_parallel(img_left, img_right, &map, search_len, pool);
+                }
+                seconds += seconds_now() - start;
+                if (left[f] == 2)
+                {
+                    double frame_bad;
+                    run_error += disparity_error(&map, &truth, 16, BAD_PIXEL_THRESHOLD, &frame_bad);
+                    run_bad += frame_bad;
+                    scored++;
+                }
+            }
+            if (r == 0 || seconds < best)
+            {
+                best = seconds;
+                error = run_error / scored;
+                bad = run_bad / scored;
+                window_pixels = run_window;
+            }
+        }
+
+        double per_frame = best / SEQUENCE_FRAMES;
+        double throughput = (double)width * height * search_len / per_frame / 1e6;
+        double window = 100.0 * window_pixels / ((double)width * height * SEQUENCE_FRAMES);
+        printf("%-16s %-22s %7.2f ms/frame %7.1f fps %8.1f Mpix*disp/s  %5.1f%% windowed  %.3f px error, %6.2f%% bad\n",
+               "tsukuba-seq", config->name, 1000 * per_frame, 1 / per_frame, throughput, window, error, 100 * bad);
+        fprintf(out, "{\"dataset\":\"tsukuba-sequence\",\"config\":\"%s\",\"kernels\":\"%s\",\"width\":%d,\"height\":%d,"
+                     "\"search_len\":%d,\"threads\":%d,\"repeats\":%d,\"frames\":%d,\"seconds_per_frame\":%.6f,"
+                     "\"frames_per_second\":%.2f,\"mpix_disparities_per_second\":%.3f,\"window_percent\":%.2f,"
+                     "\"mean_error\":%.4f,\"bad_percent\":%.3f}\n",
+                config->name, sad_kernels_get()->name, width, height, search_len, pool->workers, repeats,
+                SEQUENCE_FRAMES, per_frame, 1 / per_frame, throughput, window, error, 100 * bad);
+    }
+
+    temporal_match_free(&tm);
+    free_disparity_map(&map);
+    for (int i = 0; i <= SEQUENCE_VIEWS; i++)
+    {
+        mapped_image_close(&files[i]);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int threads = BENCH_THREADS;
+    int repeats = 3;
+    const char *dataset_filter = NULL;
+    const char *config_filter = NULL;
+    const char *results = "bench_results.jsonl";
+    const char *image_dir = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:r:d:c:k:o:i:")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'r':
+            repeats = atoi(optarg) > 0 ? atoi(optarg) : 1;
+            break;
+        case 'd':
+            dataset_filter = optarg;
+            break;
+        case 'c':
+            config_filter = optarg;
+            break;
+        case 'k':
+            if (!sad_kernels_use(optarg))
+            {
+                fprintf(stderr, "Kernels '%s' are not supported\n", optarg);
+                return 1;
+            }
+            break;
+        case 'o':
+            results = optarg;
+            break;
+        case 'i':
+            image_dir = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-t threads] [-r repeats] [-d dataset] [-c config] [-k kernels] [-o results.jsonl] [-i image_dir]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    FILE *out = fopen(results, "w");
+    if (!out)
+    {
+        perror(results);
+        return 1;
+    }
+    struct thread_pool pool;
+    thread_pool_create(&pool, threads, 0);
+    struct bench_counters counters;
+    bench_counters_open(&counters, &pool);
+    printf("%d threads, %s kernels, best of %d\n", pool.workers, sad_kernels_get()->name, repeats);
+
+    // The cache files in name order, then tsukuba if it has none
+    struct dirent **entries = NULL;
+    int count = scandir(BENCH_CACHE_DIR, &entries, NULL, alphasort);
+    int cached_tsukuba = 0;
+    struct bench_dataset data;
+    for (int i = 0; i < count; i++)
+    {
+        char name[64];
+        char filename[512];
+        size_t len = strlen(entries[i]->d_name);
+        if (len > 4 && len - 4 < sizeof(name) && strcmp(entries[i]->d_name + len - 4, ".stc") == 0)
+        {
+            memcpy(name, entries[i]->d_name, len - 4);
+            name[len - 4] = '\0';
+            cached_tsukuba |= strcmp(name, "tsukuba") == 0;
+            if (!dataset_filter || strstr(name, dataset_filter))
+            {
+                snprintf(filename, sizeof(filename), "%s/%s", BENCH_CACHE_DIR, entries[i]->d_name);
+                bench_open_cache(filename, name, &data);
+                bench_dataset(&data, config_filter, &pool, &counters, repeats, out, image_dir);
+                bench_close(&data);
+            }
+        }
+        free(entries[i]);
+    }
+    free(entries);
+    if (!cached_tsukuba && (!dataset_filter || strstr("tsukuba", dataset_filter)))
+    {
+        bench_open_tsukuba(&data);
+        bench_dataset(&data, config_filter, &pool, &counters, repeats, out, image_dir);
+        bench_close(&data);
+    }
+    if (!dataset_filter || strstr("tsukuba-sequence", dataset_filter))
+    {
+        bench_sequence(config_filter, &pool, repeats, out);
+    }
+
+    fclose(out);
+    bench_counters_close(&counters);
+    thread_pool_destroy(&pool);
+    match_scratch_release();
+    return 0;
+}
@@ -0,0 +1,175 @@
+// Census transform. Every pixel is replaced by a bit string recording which of
+// its neighbours are darker than it, and the matching cost of two pixels is the
+// Hamming distance between their strings. Only the ordering of the pixels
+// matters, so the cost doesn't change when one camera is brighter than the
+// other, and a cost is an XOR and a popcount instead of an absolute difference
+// per channel.
+//
+// Census images are ppm_arrays with CENSUS_CHANNELS bytes per pixel holding one
+// uint64_t descriptor. block_match, get_disparity and sgm_match use the census
+// cost when given a pair of them, pyramid_block_match takes the plain images
+// and transforms every level itself.
+
+// Pixels left/right and above/below of a pixel in its census window, 9x7
+// pixels gives 62 comparisons, which fits a 64 bit descriptor
+#define CENSUS_EDGE_X 4
+#define CENSUS_EDGE_Y 3
+// Bytes per pixel of a census image
+#define CENSUS_CHANNELS ((int)sizeof(uint64_t))
+
+// Matching cost used by the matchers that build their own images
+enum match_cost
+{
+    MATCH_COST_SAD,
+    MATCH_COST_CENSUS,
+};
+
+// Returns non-zero if the array holds census descriptors.
+static inline int ppm_array_is_census(struct ppm_array *obj)
+{
+    return obj->channels == CENSUS_CHANNELS;
+}
+
+// Returns a pointer to the census descriptor of the pixel at x, y.
+static inline uint64_t *census_at(struct ppm_array *obj, int x, int y)
+{
+    return (uint64_t *)ppm_array_at(obj, x, y);
+}
+
+// Census transform a greyscale or RGB array into img_out, an allocated census
+// array of the same size, RGB is converted to grey like to_greyscale_plane().
+// Pixels outside the image repeat the nearest edge pixel. grey is an
+// allocated single channel array of the same size for the greyscale copy.
+void census_transform_into(struct ppm_array *img_in, struct ppm_array *grey, struct ppm_array *img_out)
+{
+    if (grey->width != img_in->width || grey->height != img_in->height || grey->channels != 1 ||
+        img_out->width != img_in->width || img_out->height != img_in->height || !ppm_array_is_census(img_out))
+    {
+        fprintf(stderr, "Census buffers must have the image's size\n");
+        exit(1);
+    }
+    // Greyscale copy with its border filled, so the window never needs clipping
+    for (int y = 0; y < img_in->height; y++)
+    {
+        unsigned char *pix = ppm_array_at(img_in, 0, y);
+        unsigned char *out = ppm_array_at(grey, 0, y);
+        for (int x = 0; x < img_in->width; x++, pix += img_in->channels)
+        {
+            out[x] = img_in->channels == 3 ? (pix[0] + pix[1] + pix[2]) / 3 : pix[0];
+        }
+        memset(out - CENSUS_EDGE_X, out[0], CENSUS_EDGE_X);
+        memset(out + img_in->width, out[img_in->width - 1], CENSUS_EDGE_X);
+    }
+    for (int j = 1; j <= CENSUS_EDGE_Y; j++)
+    {
+        int row_len = img_in->width + 2 * CENSUS_EDGE_X;
+        memcpy(ppm_array_at(grey, -CENSUS_EDGE_X, -j), ppm_array_at(grey, -CENSUS_EDGE_X, 0), row_len);
+        memcpy(ppm_array_at(grey, -CENSUS_EDGE_X, img_in->height - 1 + j), ppm_array_at(grey, -CENSUS_EDGE_X, img_in->height - 1), row_len);
+    }
+
+    // One neighbour at a time across the whole row, which the compiler can
+    // vectorize
+    for (int y = 0; y < img_in->height; y++)
+    {
+        uint64_t *desc = census_at(img_out, 0, y);
+        const unsigned char *center = ppm_array_at(grey, 0, y);
+        memset(desc, 0, sizeof(uint64_t) * img_in->width);
+        int bit = 0;
+        for (int j = -CENSUS_EDGE_Y; j <= CENSUS_EDGE_Y; j++)
+        {
+            for (int i = -CENSUS_EDGE_X; i <= CENSUS_EDGE_X; i++)
+            {
+                if (i == 0 && j == 0)
+                {
+                    continue;
+                }
+                const unsigned char *neighbour = ppm_array_at(grey, i, y + j);
+                for (int x = 0; x < img_in->width; x++)
+                {
+                    desc[x] |= (uint64_t)(neighbour[x] < center[x]) << bit;
+                }
+                bit++;
+            }
+        }
+    }
+}
+
+// Census transform a greyscale or RGB array, see census_transform_into().
+// Allocates img_out.
+void census_transform(struct ppm_array *img_in, struct ppm_array *img_out)
+{
+    struct ppm_array grey;
+    grey.height = img_in->height;
+    grey.width = img_in->width;
+    grey.channels = 1;
+    ppm_array_allocate(&grey);
+    img_out->height = img_in->height;
+    img_out->width = img_in->width;
+    img_out->channels = CENSUS_CHANNELS;
+    ppm_array_allocate(img_out);
+    census_transform_into(img_in, &grey, img_out);
+    free_ppm_array(&grey);
+}
+
+// Prepares an image for matching with the given cost. SAD matches the image
+// itself, so img_out just shares its pixels, census allocates img_out.
+void match_cost_prepare(struct ppm_array *img_in, struct ppm_array *img_out, enum match_cost cost)
+{
+    if (cost == MATCH_COST_CENSUS)
+    {
+        census_transform(img_in, img_out);
+    }
+    else
+    {
+        *img_out = *img_in;
+        img_out->buffer = NULL;
+    }
+}
+
+// Buffers of match_cost_prepare_into() for images of one size, so preparing
+// frame after frame allocates nothing. SAD needs none.
+struct match_cost_buffers
+{
+    enum match_cost cost;
+    // Greyscale copy the census is computed from, and the census image
+    struct ppm_array grey;
+    struct ppm_array census;
+};
+
+void match_cost_buffers_init(struct match_cost_buffers *buffers, int width, int height, enum match_cost cost)
+{
+    memset(buffers, 0, sizeof(*buffers));
+    buffers->cost = cost;
+    if (cost == MATCH_COST_CENSUS)
+    {
+        buffers->grey.width = buffers->census.width = width;
+        buffers->grey.height = buffers->census.height = height;
+        buffers->grey.channels = 1;
+        buffers->census.channels = CENSUS_CHANNELS;
+        ppm_array_allocate(&buffers->grey);
+        ppm_array_allocate(&buffers->census);
+    }
+}
+
+void match_cost_buffers_free(struct match_cost_buffers *buffers)
+{
+    free_ppm_array(&buffers->grey);
+    free_ppm_array(&buffers->census);
+}
+
+// Prepares an image for matching with the buffers' cost like
+// match_cost_prepare(), img_out is a view of the image or of the buffers'
+// census image and needs no freeing.
+void match_cost_prepare_into(struct ppm_array *img_in, struct ppm_array *img_out, struct match_cost_buffers *buffers)
+{
+    if (buffers->cost == MATCH_COST_CENSUS)
+    {
+        census_transform_into(img_in, &buffers->grey, &buffers->census);
+        *img_out = buffers->census;
+    }
+    else
+    {
+        *img_out = *img_in;
+    }
+    img_out->buffer = NULL;
+}
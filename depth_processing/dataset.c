@@ -0,0 +1,213 @@
+// Dataset cache files. A stereo pair, its ground truth and its calibration
+// are decoded once (by dataset_convert.c, which reads the PNG datasets) into a
+// single file that is memory mapped to load it. Every plane starts on a page
+// and is stored the way ppm_array_allocate() lays it out, IMAGE_PAD border
+// included, so the mapped planes are used in place as ordinary arrays.
+//
+// Files are in the native byte order, they are a cache to be rebuilt on each
+// machine rather than an exchange format.
+
+// Identifies a cache file, the last byte is the format version
+#define DATASET_MAGIC "STEREOC1"
+// Alignment of the planes in a cache file
+#define DATASET_PAGE 4096
+
+// Planes of a cache file
+enum dataset_plane
+{
+    DATASET_LEFT_RGB,
+    DATASET_RIGHT_RGB,
+    DATASET_LEFT_GREY,
+    DATASET_RIGHT_GREY,
+    DATASET_TRUTH,
+    DATASET_PLANES,
+};
+
+// First page of a cache file
+struct dataset_header
+{
+    char magic[8];
+    int32_t width;
+    int32_t height;
+    // Ground truth pixels are disparity * truth_scale, 0 where unknown. 0 if
+    // the file has no ground truth.
+    int32_t truth_scale;
+    // Non-zero if calib holds the pair's calibration
+    int32_t has_calib;
+    struct stereo_calib calib;
+    // Channels and byte offset of each plane, 0 offset for missing planes
+    int32_t channels[DATASET_PLANES];
+    uint64_t offset[DATASET_PLANES];
+};
+
+// A mapped cache file
+struct dataset
+{
+    struct dataset_header *header;
+    // Views of the planes, a missing plane has NULL data
+    struct ppm_array plane[DATASET_PLANES];
+    void *map;
+    size_t map_len;
+};
+
+// Bytes of a plane of the given size, rounded up to whole pages.
+static size_t dataset_plane_size(int width, int height, int channels)
+{
+    size_t size = (size_t)(width + 2 * IMAGE_PAD) * channels * (height + 2 * IMAGE_PAD);
+    return (size + DATASET_PAGE - 1) / DATASET_PAGE * DATASET_PAGE;
+}
+
+// Writes a cache file of an RGB pair, with its greyscale planes. truth (a
+// single channel array of disparity * truth_scale) and calib may be NULL.
+// Exits on failure.
+void dataset_write(const char *filename, struct ppm_array *left, struct ppm_array *right, struct ppm_array *truth,
+                   int truth_scale, const struct stereo_calib *calib)
+{
+    if (left->channels != 3 || right->channels != 3 || left->width != right->width || left->height != right->height ||
+        (truth && (truth->channels != 1 || truth->width != left->width || truth->height != left->height)))
+    {
+        fprintf(stderr, "Dataset images must be an RGB pair of the same size\n");
+        exit(1);
+    }
+
+    // Copy every plane into the allocated layout, which is what gets stored
+    struct ppm_array planes[DATASET_PLANES];
+    struct ppm_array *sources[] = {left, right};
+    for (int i = 0; i < 2; i++)
+    {
+        planes[DATASET_LEFT_RGB + i].width = left->width;
+        planes[DATASET_LEFT_RGB + i].height = left->height;
+        planes[DATASET_LEFT_RGB + i].channels = 3;
+        ppm_array_allocate(&planes[DATASET_LEFT_RGB + i]);
+        for (int y = 0; y < left->height; y++)
+        {
+            memcpy(ppm_array_at(&planes[DATASET_LEFT_RGB + i], 0, y), ppm_array_at(sources[i], 0, y), left->width * 3);
+        }
+        to_greyscale_plane(sources[i], &planes[DATASET_LEFT_GREY + i]);
+    }
+    int count = truth ? DATASET_PLANES : DATASET_TRUTH;
+    if (truth)
+    {
+        planes[DATASET_TRUTH].width = truth->width;
+        planes[DATASET_TRUTH].height = truth->height;
+        planes[DATASET_TRUTH].channels = 1;
+        ppm_array_allocate(&planes[DATASET_TRUTH]);
+        for (int y = 0; y < truth->height; y++)
+        {
+            memcpy(ppm_array_at(&planes[DATASET_TRUTH], 0, y), ppm_array_at(truth, 0, y), truth->width);
+        }
+    }
+
+    struct dataset_header *header = (struct dataset_header *)calloc(1, DATASET_PAGE);
+    unsigned char *zero = (unsigned char *)calloc(1, DATASET_PAGE);
+    if (!header || !zero)
+    {
+        fprintf(stderr, "Unable to allocate memory\n");
+        exit(1);
+    }
+    memcpy(header->magic, DATASET_MAGIC, 8);
+    header->width = left->width;
+    header->height = left->height;
+    header->truth_scale = truth ? truth_scale : 0;
+    header->has_calib = calib != NULL;
+    if (calib)
+    {
+        header->calib = *calib;
+    }
+
+    // The header page, then each plane and the zeros up to the next page
+    struct iovec iov[1 + 2 * DATASET_PLANES];
+    int iov_count = 0;
+    iov[iov_count].iov_base = header;
+    iov[iov_count++].iov_len = DATASET_PAGE;
+    uint64_t offset = DATASET_PAGE;
+    for (int p = 0; p < count; p++)
+    {
+        size_t used = (size_t)planes[p].stride * (planes[p].height + 2 * IMAGE_PAD);
+        size_t size = dataset_plane_size(planes[p].width, planes[p].height, planes[p].channels);
+        header->channels[p] = planes[p].channels;
+        header->offset[p] = offset;
+        iov[iov_count].iov_base = planes[p].buffer;
+        iov[iov_count++].iov_len = used;
+        if (size > used)
+        {
+            iov[iov_count].iov_base = zero;
+            iov[iov_count++].iov_len = size - used;
+        }
+        offset += size;
+    }
+
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int ok = fd >= 0 && write_all(fd, iov, iov_count);
+    ok &= fd >= 0 && close(fd) == 0;
+    if (!ok)
+    {
+        perror(filename);
+        exit(1);
+    }
+    for (int p = 0; p < count; p++)
+    {
+        free_ppm_array(&planes[p]);
+    }
+    free(header);
+    free(zero);
+}
+
+// Maps a cache file, its planes can be used until dataset_close(). Exits if
+// the file is missing or damaged.
+void dataset_open(const char *filename, struct dataset *set)
+{
+    int fd = open(filename, O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0)
+    {
+        fprintf(stderr, "Unable to open file '%s'\n", filename);
+        exit(1);
+    }
+    set->map_len = info.st_size;
+    set->map = set->map_len >= DATASET_PAGE ? mmap(NULL, set->map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    set->header = (struct dataset_header *)set->map;
+    if (set->map == MAP_FAILED || memcmp(set->header->magic, DATASET_MAGIC, 8) != 0 || set->header->width < 1 ||
+        set->header->height < 1)
+    {
+        fprintf(stderr, "Invalid dataset cache '%s'\n", filename);
+        exit(1);
+    }
+    for (int p = 0; p < DATASET_PLANES; p++)
+    {
+        struct ppm_array *plane = &set->plane[p];
+        memset(plane, 0, sizeof(*plane));
+        uint64_t offset = set->header->offset[p];
+        int channels = set->header->channels[p];
+        if (!offset)
+        {
+            continue;
+        }
+        if (channels < 1 || channels > 3 || offset % DATASET_PAGE ||
+            offset + dataset_plane_size(set->header->width, set->header->height, channels) > set->map_len)
+        {
+            fprintf(stderr, "Invalid dataset cache '%s'\n", filename);
+            exit(1);
+        }
+        plane->width = set->header->width;
+        plane->height = set->header->height;
+        plane->channels = channels;
+        plane->pad = IMAGE_PAD;
+        plane->stride = (plane->width + 2 * IMAGE_PAD) * channels;
+        plane->data = (unsigned char *)set->map + offset + IMAGE_PAD * plane->stride + IMAGE_PAD * channels;
+        plane->buffer = NULL;
+    }
+    if (!set->plane[DATASET_LEFT_RGB].data || !set->plane[DATASET_RIGHT_RGB].data)
+    {
+        fprintf(stderr, "Invalid dataset cache '%s'\n", filename);
+        exit(1);
+    }
+}
+
+// Unmaps the file, its planes become invalid.
+void dataset_close(struct dataset *set)
+{
+    munmap(set->map, set->map_len);
+    memset(set, 0, sizeof(*set));
+}
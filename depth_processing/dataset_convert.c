@@ -0,0 +1,166 @@
+// Converts stereo datasets into dataset cache files (see dataset.c), decoding
+// their PNG images once so the matchers can map them instead.
+
+// Compile cmd:
+// gcc -O3 dataset_convert.c -o dataset_convert.o -lpthread -lm -lpng
+
+// Usage: ./dataset_convert.o
+//   Converts tsukuba, cones and every scene in all/data into cache/
+// Usage: ./dataset_convert.o out.stc left right [truth truth_scale] [calib.txt]
+//   Converts one pair, images may be PNG, PPM or PGM
+
+// stereo.c defines _GNU_SOURCE, so it comes before any system header
+#include "stereo.c"
+
+#include <dirent.h>
+#include <png.h>
+
+// Directory the known scenes are written to
+#define CACHE_DIR "cache"
+
+// Reads a PNG, PPM or PGM image into a newly allocated array of the given
+// channels (1 or 3), converting it if it has the other.
+void load_image(const char *filename, int channels, struct ppm_array *obj)
+{
+    const char *extension = strrchr(filename, '.');
+    if (extension && strcmp(extension, ".png") == 0)
+    {
+        png_image png;
+        memset(&png, 0, sizeof(png));
+        png.version = PNG_IMAGE_VERSION;
+        if (!png_image_begin_read_from_file(&png, filename))
+        {
+            fprintf(stderr, "Error loading image '%s': %s\n", filename, png.message);
+            exit(1);
+        }
+        png.format = channels == 3 ? PNG_FORMAT_RGB : PNG_FORMAT_GRAY;
+        obj->width = png.width;
+        obj->height = png.height;
+        obj->channels = channels;
+        ppm_array_allocate(obj);
+        if (!png_image_finish_read(&png, NULL, obj->data, obj->stride, NULL))
+        {
+            fprintf(stderr, "Error loading image '%s': %s\n", filename, png.message);
+            exit(1);
+        }
+        return;
+    }
+
+    struct mapped_image file;
+    struct ppm_array view;
+    mapped_image_open(filename, &file);
+    obj->width = file.width;
+    obj->height = file.height;
+    obj->channels = channels;
+    ppm_array_allocate(obj);
+    if (file.sample_bytes == 1 && file.channels == channels)
+    {
+        mapped_image_view(&file, &view);
+        for (int y = 0; y < obj->height; y++)
+        {
+            memcpy(ppm_array_at(obj, 0, y), ppm_array_at(&view, 0, y), obj->width * channels);
+        }
+    }
+    else
+    {
+        for (int y = 0; y < obj->height; y++)
+        {
+            unsigned char *out = ppm_array_at(obj, 0, y);
+            for (int x = 0; x < obj->width; x++, out += channels)
+            {
+                int sum = 0;
+                for (int c = 0; c < file.channels; c++)
+                {
+                    sum += mapped_image_sample(&file, x, y, c) * 255 / file.max_value;
+                }
+                for (int c = 0; c < channels; c++)
+                {
+                    out[c] = file.channels == 1 ? sum : sum / 3;
+                }
+            }
+        }
+    }
+    mapped_image_close(&file);
+}
+
+// Converts one pair, truth and calib_file may be NULL.
+void convert(const char *out, const char *left_file, const char *right_file, const char *truth_file, int truth_scale,
+             const char *calib_file)
+{
+    struct ppm_array left;
+    struct ppm_array right;
+    struct ppm_array truth;
+    struct stereo_calib calib;
+    load_image(left_file, 3, &left);
+    load_image(right_file, 3, &right);
+    if (truth_file)
+    {
+        load_image(truth_file, 1, &truth);
+    }
+    if (calib_file)
+    {
+        read_calib(calib_file, &calib);
+    }
+    dataset_write(out, &left, &right, truth_file ? &truth : NULL, truth_scale, calib_file ? &calib : NULL);
+    printf("%s: %dx%d%s%s\n", out, left.width, left.height, truth_file ? ", ground truth" : "", calib_file ? ", calibration" : "");
+    free_ppm_array(&left);
+    free_ppm_array(&right);
+    if (truth_file)
+    {
+        free_ppm_array(&truth);
+    }
+}
+
+// Converts every scene of a Middlebury directory like all/data, one
+// subdirectory per scene holding im0.png, im1.png and calib.txt.
+void convert_scenes(const char *dir)
+{
+    DIR *scenes = opendir(dir);
+    if (!scenes)
+    {
+        fprintf(stderr, "Unable to open directory '%s'\n", dir);
+        exit(1);
+    }
+    struct dirent *entry;
+    while ((entry = readdir(scenes)))
+    {
+        if (entry->d_name[0] == '.')
+        {
+            continue;
+        }
+        char left[512], right[512], calib[512], out[512];
+        snprintf(left, sizeof(left), "%s/%s/im0.png", dir, entry->d_name);
+        snprintf(right, sizeof(right), "%s/%s/im1.png", dir, entry->d_name);
+        snprintf(calib, sizeof(calib), "%s/%s/calib.txt", dir, entry->d_name);
+        snprintf(out, sizeof(out), "%s/%s.stc", CACHE_DIR, entry->d_name);
+        if (access(left, R_OK) == 0 && access(right, R_OK) == 0)
+        {
+            convert(out, left, right, NULL, 0, access(calib, R_OK) == 0 ? calib : NULL);
+        }
+    }
+    closedir(scenes);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc == 1)
+    {
+        mkdir(CACHE_DIR, 0755);
+        // Same views as main.c, the ground truth is for col3
+        convert(CACHE_DIR "/tsukuba.stc", "tsukuba/scene1.row3.col3.ppm", "tsukuba/scene1.row3.col4.ppm",
+                "tsukuba/truedisp.row3.col3.pgm", 16, NULL);
+        convert(CACHE_DIR "/cones.stc", "cones/im2.png", "cones/im6.png", "cones/disp2.png", 4, NULL);
+        convert_scenes("all/data");
+        return 0;
+    }
+    if (argc < 4 || argc > 7)
+    {
+        fprintf(stderr, "Usage: %s [out.stc left right [truth truth_scale] [calib.txt]]\n", argv[0]);
+        return 1;
+    }
+    const char *truth = argc >= 6 ? argv[4] : NULL;
+    int truth_scale = argc >= 6 ? atoi(argv[5]) : 0;
+    const char *calib = argc == 5 ? argv[4] : argc == 7 ? argv[6] : NULL;
+    convert(argv[1], argv[2], argv[3], truth, truth_scale, calib);
+    return 0;
+}
@@ -0,0 +1,251 @@
+// Image files. PPM (P6) and PGM (P5) files are memory mapped and their pixels
+// used where they lie in the mapping, so loading an image costs a header parse
+// and the page faults of the pixels actually read. Samples are 8 bit, or 16 bit
+// big-endian when the maximum value is above 255. Files are written with a
+// single writev() of the header and the pixel rows.
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// A PPM or PGM file mapped into memory
+struct mapped_image
+{
+    int width;
+    int height;
+    // 1 for PGM, 3 for PPM
+    int channels;
+    int max_value;
+    // Bytes per sample, 1 or 2
+    int sample_bytes;
+    // First pixel, rows are width * channels * sample_bytes bytes apart.
+    // Writable, writes stay private to the mapping and never reach the file.
+    unsigned char *data;
+    void *map;
+    size_t map_len;
+};
+
+// Reads the next number of a PPM/PGM header at *pos, skipping whitespace and
+// comments. Returns 0 if there is none.
+static int netpbm_number(const unsigned char *text, size_t len, size_t *pos, int *value)
+{
+    size_t i = *pos;
+    while (i < len && (isspace(text[i]) || text[i] == '#'))
+    {
+        if (text[i] == '#')
+        {
+            while (i < len && text[i] != '\n')
+            {
+                i++;
+            }
+        }
+        else
+        {
+            i++;
+        }
+    }
+    if (i >= len || !isdigit(text[i]))
+    {
+        return 0;
+    }
+    long number = 0;
+    while (i < len && isdigit(text[i]) && number <= INT_MAX)
+    {
+        number = number * 10 + (text[i++] - '0');
+    }
+    if (number > INT_MAX)
+    {
+        return 0;
+    }
+    *value = (int)number;
+    *pos = i;
+    return 1;
+}
+
+// Maps a P5 or P6 file. Exits if it can't be read or isn't a valid image.
+void mapped_image_open(const char *filename, struct mapped_image *img)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Unable to open file '%s'\n", filename);
+        exit(1);
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size < 2)
+    {
+        fprintf(stderr, "Error loading image '%s'\n", filename);
+        exit(1);
+    }
+    img->map_len = info.st_size;
+    img->map = mmap(NULL, img->map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (img->map == MAP_FAILED)
+    {
+        perror(filename);
+        exit(1);
+    }
+    const unsigned char *text = (const unsigned char *)img->map;
+    if (text[0] != 'P' || (text[1] != '5' && text[1] != '6'))
+    {
+        fprintf(stderr, "Invalid image format (must be 'P5' or 'P6')\n");
+        exit(1);
+    }
+    img->channels = text[1] == '6' ? 3 : 1;
+
+    // The maximum value is followed by exactly one whitespace byte
+    size_t pos = 2;
+    if (!netpbm_number(text, img->map_len, &pos, &img->width) || !netpbm_number(text, img->map_len, &pos, &img->height) ||
+        !netpbm_number(text, img->map_len, &pos, &img->max_value) || pos >= img->map_len || !isspace(text[pos]))
+    {
+        fprintf(stderr, "Invalid image header (error loading '%s')\n", filename);
+        exit(1);
+    }
+    pos++;
+    if (img->width < 1 || img->height < 1 || img->max_value < 1 || img->max_value > 65535)
+    {
+        fprintf(stderr, "Invalid image size (error loading '%s')\n", filename);
+        exit(1);
+    }
+    img->sample_bytes = img->max_value > 255 ? 2 : 1;
+    size_t row = (size_t)img->width * img->channels * img->sample_bytes;
+    if ((img->map_len - pos) / row < (size_t)img->height)
+    {
+        fprintf(stderr, "Error loading image '%s'\n", filename);
+        exit(1);
+    }
+    img->data = (unsigned char *)img->map + pos;
+    madvise(img->map, img->map_len, MADV_WILLNEED);
+}
+
+// Unmaps the file, any view of it becomes invalid.
+void mapped_image_close(struct mapped_image *img)
+{
+    munmap(img->map, img->map_len);
+    memset(img, 0, sizeof(*img));
+}
+
+// Returns channel c of the pixel at x, y.
+static inline int mapped_image_sample(struct mapped_image *img, int x, int y, int c)
+{
+    size_t index = ((size_t)y * img->width + x) * img->channels + c;
+    if (img->sample_bytes == 2)
+    {
+        return img->data[2 * index] << 8 | img->data[2 * index + 1];
+    }
+    return img->data[index];
+}
+
+// Makes obj an array over the mapped pixels of an 8 bit image, without
+// copying them. Like a wrapped array, it has no padding and doesn't own its
+// pixels.
+void mapped_image_view(struct mapped_image *img, struct ppm_array *obj)
+{
+    if (img->sample_bytes != 1)
+    {
+        fprintf(stderr, "Only 8-bit images can be viewed in place\n");
+        exit(1);
+    }
+    obj->height = img->height;
+    obj->width = img->width;
+    obj->channels = img->channels;
+    obj->stride = img->width * img->channels;
+    obj->pad = 0;
+    obj->data = img->data;
+    obj->buffer = NULL;
+}
+
+// Copies the image's pixels to out, which holds width * channels bytes per row
+// with rows stride bytes apart. 16 bit samples are scaled to 8 bits.
+void mapped_image_copy(struct mapped_image *img, unsigned char *out, int stride)
+{
+    int row_len = img->width * img->channels;
+    for (int y = 0; y < img->height; y++, out += stride)
+    {
+        if (img->sample_bytes == 1)
+        {
+            memcpy(out, img->data + (size_t)y * row_len, row_len);
+            continue;
+        }
+        const unsigned char *in = img->data + (size_t)y * row_len * 2;
+        for (int i = 0; i < row_len; i++)
+        {
+            int value = in[2 * i] << 8 | in[2 * i + 1];
+            out[i] = (value * 255 + img->max_value / 2) / img->max_value;
+        }
+    }
+}
+
+// Writes every buffer of iov to fd, in as few writev() calls as IOV_MAX and
+// partial writes allow. Returns 0 on failure.
+static int write_all(int fd, struct iovec *iov, int count)
+{
+    while (count > 0)
+    {
+        ssize_t written = writev(fd, iov, count < IOV_MAX ? count : IOV_MAX);
+        if (written < 0)
+        {
+            return 0;
+        }
+        while (count > 0 && (size_t)written >= iov->iov_len)
+        {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 1;
+}
+
+// Writes a header and the given pixel rows as an 8 bit P5 (1 channel) or P6
+// (3 channels) file. Exits on failure.
+static void write_netpbm(const char *filename, const unsigned char *data, int width, int height, int channels, int stride)
+{
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Unable to open file '%s'\n", filename);
+        exit(1);
+    }
+    char header[64];
+    int header_len = snprintf(header, sizeof(header), "P%c\n%d %d\n%d\n", channels == 3 ? '6' : '5', width, height,
+                              RGB_COMPONENT_COLOR);
+
+    // Contiguous pixels go in one buffer, padded rows in one buffer each
+    int row_len = width * channels;
+    int rows = stride == row_len ? 1 : height;
+    struct iovec stack_iov[64];
+    struct iovec *iov = rows + 1 <= 64 ? stack_iov : (struct iovec *)malloc(sizeof(struct iovec) * (rows + 1));
+    if (!iov)
+    {
+        fprintf(stderr, "Unable to allocate memory\n");
+        exit(1);
+    }
+    iov[0].iov_base = header;
+    iov[0].iov_len = header_len;
+    for (int y = 0; y < rows; y++)
+    {
+        iov[y + 1].iov_base = (void *)(data + (size_t)y * stride);
+        iov[y + 1].iov_len = rows == 1 ? (size_t)row_len * height : (size_t)row_len;
+    }
+    int ok = write_all(fd, iov, rows + 1);
+    ok &= close(fd) == 0;
+    if (iov != stack_iov)
+    {
+        free(iov);
+    }
+    if (!ok)
+    {
+        perror(filename);
+        exit(1);
+    }
+}
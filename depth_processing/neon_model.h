@@ -0,0 +1,607 @@
+// Lane by lane C model of the NEON intrinsics the kernels use, so the NEON set
+// can be built and tested on any CPU: test.c built with 
+// -DSAD_KERNELS_NEON_MODEL compares it against the scalar set like any other.
+// Only the results are modelled, not the speed. The vector types are GCC 
+// vectors, so mixing them up without a vreinterpret fails to build as it does
+// with arm_neon.h, and the shift and lane arguments have to be constants.
+// Targets 32 bit ARM: vminvq_u16 is left out like in the kernels without 
+// __aarch64__.
+
+#include <stdint.h>
+#include <string.h>
+
+typedef uint8_t uint8x8_t __attribute__((vector_size(8)));
+typedef uint8_t uint8x16_t __attribute__((vector_size(16)));
+typedef uint16_t uint16x4_t __attribute__((vector_size(8)));
+typedef uint16_t uint16x8_t __attribute__((vector_size(16)));
+typedef uint32_t uint32x4_t __attribute__((vector_size(16)));
+typedef uint64_t uint64x2_t __attribute__((vector_size(16)));
+
+typedef struct
+{
+    uint8x16_t val[2];
+} uint8x16x2_t;
+
+typedef struct
+{
+    uint8x16_t val[3];
+} uint8x16x3_t;
+
+
+static inline uint8x8_t vld1_u8(const uint8_t *p)
+{
+    uint8x8_t r;
+    memcpy(&r, p, sizeof(r));
+    return r;
+}
+
+static inline uint8x16_t vld1q_u8(const uint8_t *p)
+{
+    uint8x16_t r;
+    memcpy(&r, p, sizeof(r));
+    return r;
+}
+
+static inline uint16x4_t vld1_u16(const uint16_t *p)
+{
+    uint16x4_t r;
+    memcpy(&r, p, sizeof(r));
+    return r;
+}
+
+static inline uint16x8_t vld1q_u16(const uint16_t *p)
+{
+    uint16x8_t r;
+    memcpy(&r, p, sizeof(r));
+    return r;
+}
+
+static inline uint64x2_t vld1q_u64(const uint64_t *p)
+{
+    uint64x2_t r;
+    memcpy(&r, p, sizeof(r));
+    return r;
+}
+
+static inline void vst1_u8(uint8_t *p, uint8x8_t v)
+{
+    memcpy(p, &v, sizeof(v));
+}
+
+static inline void vst1q_u8(uint8_t *p, uint8x16_t v)
+{
+    memcpy(p, &v, sizeof(v));
+}
+
+static inline void vst1q_u16(uint16_t *p, uint16x8_t v)
+{
+    memcpy(p, &v, sizeof(v));
+}
+
+static inline uint8x16x2_t vld2q_u8(const uint8_t *p)
+{
+    uint8x16x2_t r;
+    for (int i = 0; i < 16; i++)
+    {
+        r.val[0][i] = p[2 * i];
+        r.val[1][i] = p[2 * i + 1];
+    }
+    return r;
+}
+
+static inline uint8x16x3_t vld3q_u8(const uint8_t *p)
+{
+    uint8x16x3_t r;
+    for (int i = 0; i < 16; i++)
+    {
+        r.val[0][i] = p[3 * i];
+        r.val[1][i] = p[3 * i + 1];
+        r.val[2][i] = p[3 * i + 2];
+    }
+    return r;
+}
+
+static inline uint8x8_t vget_low_u8(uint8x16_t v)
+{
+    uint8x8_t r;
+    for (int i = 0; i < 8; i++)
+    {
+        r[i] = v[i];
+    }
+    return r;
+}
+
+static inline uint8x8_t vget_high_u8(uint8x16_t v)
+{
+    uint8x8_t r;
+    for (int i = 0; i < 8; i++)
+    {
+        r[i] = v[i + 8];
+    }
+    return r;
+}
+
+static inline uint16x4_t vget_low_u16(uint16x8_t v)
+{
+    uint16x4_t r;
+    for (int i = 0; i < 4; i++)
+    {
+        r[i] = v[i];
+    }
+    return r;
+}
+
+static inline uint16x4_t vget_high_u16(uint16x8_t v)
+{
+    uint16x4_t r;
+    for (int i = 0; i < 4; i++)
+    {
+        r[i] = v[i + 4];
+    }
+    return r;
+}
+
+static inline uint8x16_t vcombine_u8(uint8x8_t a, uint8x8_t b)
+{
+    uint8x16_t r;
+    for (int i = 0; i < 8; i++)
+    {
+        r[i] = a[i];
+        r[i + 8] = b[i];
+    }
+    return r;
+}
+
+static inline uint16x8_t vcombine_u16(uint16x4_t a, uint16x4_t b)
+{
+    uint16x8_t r;
+    for (int i = 0; i < 4; i++)
+    {
+        r[i] = a[i];
+        r[i + 4] = b[i];
+    }
+    return r;
+}
+
+static inline uint8x8_t vdup_n_u8(uint8_t x)
+{
+    uint8x8_t r;
+    for (int i = 0; i < 8; i++)
+    {
+        r[i] = x;
+    }
+    return r;
+}
+
+static inline uint16x4_t vdup_n_u16(uint16_t x)
+{
+    uint16x4_t r;
+    for (int i = 0; i < 4; i++)
+    {
+        r[i] = x;
+    }
+    return r;
+}
+
+static inline uint16x8_t vdupq_n_u16(uint16_t x)
+{
+    uint16x8_t r;
+    for (int i = 0; i < 8; i++)
+    {
+        r[i] = x;
+    }
+    return r;
+}
+
+static inline uint32x4_t vdupq_n_u32(uint32_t x)
+{
+    uint32x4_t r;
+    for (int i = 0; i < 4; i++)
+    {
+        r[i] = x;
+    }
+    return r;
+}
+
+static inline uint8x16_t vreinterpretq_u8_u64(uint64x2_t v)
+{
+    uint8x16_t r;
+    memcpy(&r, &v, sizeof(r));
+    return r;
+}
+
+static inline uint8x16_t vreinterpretq_u8_u32(uint32x4_t v)
+{
+    uint8x16_t r;
+    memcpy(&r, &v, sizeof(r));
+    return r;
+}
+
+static inline uint16x8_t vreinterpretq_u16_u8(uint8x16_t v)
+{
+    uint16x8_t r;
+    memcpy(&r, &v, sizeof(r));
+    return r;
+}
+
+static inline uint16x8_t vaddq_u16(uint16x8_t a, uint16x8_t b)
+{
+    return a + b;
+}
+
+static inline uint16x8_t vsubq_u16(uint16x8_t a, uint16x8_t b)
+{
+    return a - b;
+}
+
+static inline uint8x8_t vsub_u8(uint8x8_t a, uint8x8_t b)
+{
+    return a - b;
+}
+
+static inline uint8x8_t vand_u8(uint8x8_t a, uint8x8_t b)
+{
+    return a & b;
+}
+
+static inline uint16x4_t vand_u16(uint16x4_t a, uint16x4_t b)
+{
+    return a & b;
+}
+
+static inline uint8x16_t vandq_u8(uint8x16_t a, uint8x16_t b)
+{
+    return a & b;
+}
+
+static inline uint8x16_t veorq_u8(uint8x16_t a, uint8x16_t b)
+{
+    return a ^ b;
+}
+
+static inline uint32x4_t vmulq_n_u32(uint32x4_t a, uint32_t b)
+{
+    return a * b;
+}
+
+static inline uint16x8_t vmlaq_n_u16(uint16x8_t a, uint16x8_t b, uint16_t c)
+{
+    return a + b * c;
+}
+
+static inline uint16x8_t vqaddq_u16(uint16x8_t a, uint16x8_t b)
+{
+    uint16x8_t r;
+    for (int i = 0; i < 8; i++)
+    {
+        r[i] = a[i] + b[i] > 0xffff ? 0xffff : a[i] + b[i];
+    }
+    return r;
+}
+
+static inline uint16x8_t vminq_u16(uint16x8_t a, uint16x8_t b)
+{
+    uint16x8_t r;
+    for (int i = 0; i < 8; i++)
+    {
+        r[i] = a[i] < b[i] ? a[i] : b[i];
+    }
+    return r;
+}
+
+static inline uint16x8_t vmaxq_u16(uint16x8_t a, uint16x8_t b)
+{
+    uint16x8_t r;
+    for (int i = 0; i < 8; i++)
+    {
+        r[i] = a[i] > b[i] ? a[i] : b[i];
+    }
+    return r;
+}
+
+static inline uint8x16_t vabdq_u8(uint8x16_t a, uint8x16_t b)
+{
+    uint8x16_t r;
+    for (int i = 0; i < 16; i++)
+    {
+        r[i] = a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+    }
+    return r;
+}
+
+static inline uint8x16_t vcntq_u8(uint8x16_t a)
+{
+    uint8x16_t r;
+    for (int i = 0; i < 16; i++)
+    {
+        r[i] = __builtin_popcount(a[i]);
+    }
+    return r;
+}
+
+static inline uint16x8_t vaddl_u8(uint8x8_t a, uint8x8_t b)
+{
+    uint16x8_t r;
+    for (int i = 0; i < 8; i++)
+    {
+        r[i] = a[i] + b[i];
+    }
+    return r;
+}
+
+static inline uint16x8_t vaddw_u8(uint16x8_t a, uint8x8_t b)
+{
+    uint16x8_t r;
+    for (int i = 0; i < 8; i++)
+    {
+        r[i] = a[i] + b[i];
+    }
+    return r;
+}
+
+static inline uint16x8_t vsubw_u8(uint16x8_t a, uint8x8_t b)
+{
+    uint16x8_t r;
+    for (int i = 0; i < 8; i++)
+    {
+        r[i] = a[i] - b[i];
+    }
+    return r;
+}
+
+static inline uint16x8_t vabal_u8(uint16x8_t a, uint8x8_t b, uint8x8_t c)
+{
+    uint16x8_t r;
+    for (int i = 0; i < 8; i++)
+    {
+        r[i] = a[i] + (b[i] > c[i] ? b[i] - c[i] : c[i] - b[i]);
+    }
+    return r;
+}
+
+static inline uint16x8_t vmull_u8(uint8x8_t a, uint8x8_t b)
+{
+    uint16x8_t r;
+    for (int i = 0; i < 8; i++)
+    {
+        r[i] = a[i] * b[i];
+    }
+    return r;
+}
+
+static inline uint16x8_t vmlal_u8(uint16x8_t a, uint8x8_t b, uint8x8_t c)
+{
+    uint16x8_t r;
+    for (int i = 0; i < 8; i++)
+    {
+        r[i] = a[i] + b[i] * c[i];
+    }
+    return r;
+}
+
+static inline uint32x4_t vmull_u16(uint16x4_t a, uint16x4_t b)
+{
+    uint32x4_t r;
+    for (int i = 0; i < 4; i++)
+    {
+        r[i] = (uint32_t)a[i] * b[i];
+    }
+    return r;
+}
+
+static inline uint32x4_t vmlal_u16(uint32x4_t a, uint16x4_t b, uint16x4_t c)
+{
+    uint32x4_t r;
+    for (int i = 0; i < 4; i++)
+    {
+        r[i] = a[i] + (uint32_t)b[i] * c[i];
+    }
+    return r;
+}
+
+static inline uint16x8_t vmovl_u8(uint8x8_t a)
+{
+    uint16x8_t r;
+    for (int i = 0; i < 8; i++)
+    {
+        r[i] = a[i];
+    }
+    return r;
+}
+
+static inline uint32x4_t vmovl_u16(uint16x4_t a)
+{
+    uint32x4_t r;
+    for (int i = 0; i < 4; i++)
+    {
+        r[i] = a[i];
+    }
+    return r;
+}
+
+static inline uint8x8_t vmovn_u16(uint16x8_t a)
+{
+    uint8x8_t r;
+    for (int i = 0; i < 8; i++)
+    {
+        r[i] = (uint8_t)a[i];
+    }
+    return r;
+}
+
+static inline uint16x4_t vpmin_u16(uint16x4_t a, uint16x4_t b)
+{
+    uint16x4_t r;
+    for (int i = 0; i < 2; i++)
+    {
+        r[i] = a[2 * i] < a[2 * i + 1] ? a[2 * i] : a[2 * i + 1];
+        r[i + 2] = b[2 * i] < b[2 * i + 1] ? b[2 * i] : b[2 * i + 1];
+    }
+    return r;
+}
+
+static inline uint16x8_t vpaddlq_u8(uint8x16_t a)
+{
+    uint16x8_t r;
+    for (int i = 0; i < 8; i++)
+    {
+        r[i] = a[2 * i] + a[2 * i + 1];
+    }
+    return r;
+}
+
+static inline uint32x4_t vpaddlq_u16(uint16x8_t a)
+{
+    uint32x4_t r;
+    for (int i = 0; i < 4; i++)
+    {
+        r[i] = a[2 * i] + a[2 * i + 1];
+    }
+    return r;
+}
+
+static inline uint64x2_t vpaddlq_u32(uint32x4_t a)
+{
+    uint64x2_t r;
+    for (int i = 0; i < 2; i++)
+    {
+        r[i] = (uint64_t)a[2 * i] + a[2 * i + 1];
+    }
+    return r;
+}
+
+static inline uint16x8_t vpadalq_u8(uint16x8_t a, uint8x16_t b)
+{
+    uint16x8_t r;
+    for (int i = 0; i < 8; i++)
+    {
+        r[i] = a[i] + b[2 * i] + b[2 * i + 1];
+    }
+    return r;
+}
+
+static inline uint32x4_t vpadalq_u16(uint32x4_t a, uint16x8_t b)
+{
+    uint32x4_t r;
+    for (int i = 0; i < 4; i++)
+    {
+        r[i] = a[i] + b[2 * i] + b[2 * i + 1];
+    }
+    return r;
+}
+
+static inline uint8x8_t neon_model_vshrn_n_u16(uint16x8_t a, int n)
+{
+    uint8x8_t r;
+    for (int i = 0; i < 8; i++)
+    {
+        r[i] = (uint8_t)(a[i] >> n);
+    }
+    return r;
+}
+
+static inline uint16x4_t neon_model_vshrn_n_u32(uint32x4_t a, int n)
+{
+    uint16x4_t r;
+    for (int i = 0; i < 4; i++)
+    {
+        r[i] = (uint16_t)(a[i] >> n);
+    }
+    return r;
+}
+
+static inline uint8x8_t neon_model_vrshrn_n_u16(uint16x8_t a, int n)
+{
+    uint8x8_t r;
+    for (int i = 0; i < 8; i++)
+    {
+        r[i] = (uint8_t)((a[i] + (1u << (n - 1))) >> n);
+    }
+    return r;
+}
+
+static inline uint16x4_t neon_model_vrshrn_n_u32(uint32x4_t a, int n)
+{
+    uint16x4_t r;
+    for (int i = 0; i < 4; i++)
+    {
+        r[i] = (uint16_t)(((uint64_t)a[i] + (1u << (n - 1))) >> n);
+    }
+    return r;
+}
+
+static inline uint16x4_t neon_model_vshr_n_u16(uint16x4_t a, int n)
+{
+    uint16x4_t r;
+    for (int i = 0; i < 4; i++)
+    {
+        r[i] = a[i] >> n;
+    }
+    return r;
+}
+
+static inline uint16x8_t neon_model_vshrq_n_u16(uint16x8_t a, int n)
+{
+    uint16x8_t r;
+    for (int i = 0; i < 8; i++)
+    {
+        r[i] = a[i] >> n;
+    }
+    return r;
+}
+
+static inline uint16x8_t neon_model_vshlq_n_u16(uint16x8_t a, int n)
+{
+    uint16x8_t r;
+    for (int i = 0; i < 8; i++)
+    {
+        r[i] = a[i] << n;
+    }
+    return r;
+}
+
+static inline uint16x8_t neon_model_vshll_n_u8(uint8x8_t a, int n)
+{
+    uint16x8_t r;
+    for (int i = 0; i < 8; i++)
+    {
+        r[i] = a[i] << n;
+    }
+    return r;
+}
+
+static inline uint16_t neon_model_vget_lane_u16(uint16x4_t a, int n)
+{
+    return a[n];
+}
+
+static inline uint32_t neon_model_vgetq_lane_u32(uint32x4_t a, int n)
+{
+    return a[n];
+}
+
+static inline uint64_t neon_model_vgetq_lane_u64(uint64x2_t a, int n)
+{
+    return a[n];
+}
+
+static inline uint32x4_t neon_model_vsetq_lane_u32(uint32_t x, uint32x4_t a, int n)
+{
+    a[n] = x;
+    return a;
+}
+
+// The enum fails to build if n isn't a constant, as it has to be for NEON
+#define NEON_MODEL_CONSTANT(n, call) __extension__({ enum { neon_model_constant = (n) }; call; })
+#define vshrn_n_u16(a, n) NEON_MODEL_CONSTANT(n, neon_model_vshrn_n_u16(a, n))
+#define vshrn_n_u32(a, n) NEON_MODEL_CONSTANT(n, neon_model_vshrn_n_u32(a, n))
+#define vrshrn_n_u16(a, n) NEON_MODEL_CONSTANT(n, neon_model_vrshrn_n_u16(a, n))
+#define vrshrn_n_u32(a, n) NEON_MODEL_CONSTANT(n, neon_model_vrshrn_n_u32(a, n))
+#define vshr_n_u16(a, n) NEON_MODEL_CONSTANT(n, neon_model_vshr_n_u16(a, n))
+#define vshrq_n_u16(a, n) NEON_MODEL_CONSTANT(n, neon_model_vshrq_n_u16(a, n))
+#define vshlq_n_u16(a, n) NEON_MODEL_CONSTANT(n, neon_model_vshlq_n_u16(a, n))
+#define vshll_n_u8(a, n) NEON_MODEL_CONSTANT(n, neon_model_vshll_n_u8(a, n))
+#define vget_lane_u16(a, n) NEON_MODEL_CONSTANT(n, neon_model_vget_lane_u16(a, n))
+#define vgetq_lane_u32(a, n) NEON_MODEL_CONSTANT(n, neon_model_vgetq_lane_u32(a, n))
+#define vgetq_lane_u64(a, n) NEON_MODEL_CONSTANT(n, neon_model_vgetq_lane_u64(a, n))
+#define vsetq_lane_u32(x, a, n) NEON_MODEL_CONSTANT(n, neon_model_vsetq_lane_u32(x, a, n))
@@ -0,0 +1,198 @@
+// Image pyramids for coarse to fine matching. Each level is the one below it
+// filtered with the separable 1 4 6 4 1 binomial kernel and halved, with the
+// pixels outside the image repeating the nearest edge pixel.
+//
+// A pyramid is made once for a camera resolution and owns the buffers of
+// every level but the first, which is a view of the frame it was built from.
+// Building it again for the next frame reuses the buffers, so it doesn't
+// allocate, and the levels are ordinary arrays the matchers take directly.
+
+// Output pixels per column tile of a pyramid row, its buffers live on the
+// stack
+#define PYRAMID_TILE 128
+
+struct image_pyramid
+{
+    int levels;
+    // Level 0 is the width x height input, each level after it half the size
+    // of the one before, rounding down
+    struct ppm_array level[PYRAMID_MAX_LEVELS];
+};
+
+// Returns how many of the requested levels fit an image of the given size,
+// levels are dropped while the coarsest would be smaller than the kernel.
+int pyramid_levels(int width, int height, int levels)
+{
+    if (levels > PYRAMID_MAX_LEVELS)
+    {
+        levels = PYRAMID_MAX_LEVELS;
+    }
+    while (levels > 1 && ((width >> (levels - 1)) < 2 * KERNEL_EDGE_SIZE + 1 ||
+                          (height >> (levels - 1)) < 2 * KERNEL_EDGE_SIZE + 1))
+    {
+        levels--;
+    }
+    return levels < 1 ? 1 : levels;
+}
+
+// Allocates the levels of a pyramid of images of the given size and channels,
+// with as many of the requested levels as pyramid_levels() allows.
+void image_pyramid_init(struct image_pyramid *pyr, int width, int height, int channels, int levels)
+{
+    memset(pyr, 0, sizeof(*pyr));
+    pyr->levels = pyramid_levels(width, height, levels);
+    pyr->level[0].width = width;
+    pyr->level[0].height = height;
+    pyr->level[0].channels = channels;
+    for (int l = 1; l < pyr->levels; l++)
+    {
+        pyr->level[l].width = pyr->level[l - 1].width / 2;
+        pyr->level[l].height = pyr->level[l - 1].height / 2;
+        pyr->level[l].channels = channels;
+        ppm_array_allocate(&pyr->level[l]);
+    }
+}
+
+void image_pyramid_free(struct image_pyramid *pyr)
+{
+    for (int l = 1; l < pyr->levels; l++)
+    {
+        free_ppm_array(&pyr->level[l]);
+    }
+    pyr->levels = 0;
+}
+
+// Builds row j of dst from src, which is twice its size: the even pixels of
+// rows 2j - 2 to 2j + 2 of src, filtered. Works in column tiles so the
+// vertical sums stay in cache.
+static void pyramid_down_row(struct ppm_array *src, struct ppm_array *dst, int j)
+{
+    const struct sad_kernels *k = sad_kernels_get();
+    int ch = src->channels;
+    // Vertical sums of the even and odd columns, from the pair before the tile
+    // to the even column after it
+    uint16_t even_sums[(PYRAMID_TILE + 2) * 3];
+    uint16_t odd_sums[(PYRAMID_TILE + 2) * 3];
+    uint16_t *even = even_sums + ch;
+    uint16_t *odd = odd_sums + ch;
+    const uint8_t *rows[5];
+    for (int r = 0; r < 5; r++)
+    {
+        int y = 2 * j - 2 + r;
+        rows[r] = ppm_array_at(src, 0, y < 0 ? 0 : y >= src->height ? src->height - 1 : y);
+    }
+    uint8_t *out = ppm_array_at(dst, 0, j);
+
+    for (int o0 = 0; o0 < dst->width; o0 += PYRAMID_TILE)
+    {
+        int o1 = o0 + PYRAMID_TILE < dst->width ? o0 + PYRAMID_TILE : dst->width;
+        // Column pairs up to o1 - 1 are always inside src
+        int first = o0 > 0 ? o0 - 1 : 0;
+        const uint8_t *tap[5];
+        for (int r = 0; r < 5; r++)
+        {
+            tap[r] = rows[r] + 2 * first * ch;
+        }
+        k->pyramid_col(tap, ch, even + (first - o0) * ch, odd + (first - o0) * ch, o1 - first);
+        if (o0 == 0)
+        {
+            // Columns -2 and -1 repeat column 0
+            memcpy(even - ch, even, ch * sizeof(*even));
+            memcpy(odd - ch, even, ch * sizeof(*odd));
+        }
+        // Even column 2 * o1, past the edge of an even width src
+        uint16_t *last = even + (o1 - o0) * ch;
+        if (2 * o1 < src->width)
+        {
+            for (int c = 0; c < ch; c++)
+            {
+                int x = 2 * o1 * ch + c;
+                last[c] = rows[0][x] + 4 * rows[1][x] + 6 * rows[2][x] + 4 * rows[3][x] + rows[4][x];
+            }
+        }
+        else
+        {
+            memcpy(last, odd + (o1 - o0 - 1) * ch, ch * sizeof(*last));
+        }
+        k->pyramid_row(even, odd, ch, out + o0 * ch, (o1 - o0) * ch);
+    }
+}
+
+// One level of an image_pyramid_build_pair() job
+struct image_pyramid_job
+{
+    struct image_pyramid *pyr[2];
+    int level;
+    int band_rows;
+    int bands;
+};
+
+static void image_pyramid_band(void *arg, int index, int worker)
+{
+    struct image_pyramid_job *job = (struct image_pyramid_job *)arg;
+    struct image_pyramid *pyr = job->pyr[index / job->bands];
+    struct ppm_array *dst = &pyr->level[job->level];
+    int y_start = index % job->bands * job->band_rows;
+    int y_end = y_start + job->band_rows > dst->height ? dst->height : y_start + job->band_rows;
+    for (int j = y_start; j < y_end; j++)
+    {
+        pyramid_down_row(&pyr->level[job->level - 1], dst, j);
+    }
+}
+
+// Points level 0 of the pyramids at the images without copying them, exits if
+// they aren't the size the pyramids were made for. right and img_right may be
+// NULL.
+void image_pyramid_view(struct image_pyramid *left, struct image_pyramid *right, struct ppm_array *img_left,
+                        struct ppm_array *img_right)
+{
+    struct image_pyramid *pyr[2] = {left, right};
+    struct ppm_array *img[2] = {img_left, img_right};
+    for (int i = 0; i < (right ? 2 : 1); i++)
+    {
+        if (img[i]->width != pyr[i]->level[0].width || img[i]->height != pyr[i]->level[0].height ||
+            img[i]->channels != pyr[i]->level[0].channels || pyr[i]->levels != left->levels)
+        {
+            fprintf(stderr, "Image does not match the pyramid\n");
+            exit(1);
+        }
+        pyr[i]->level[0] = *img[i];
+        pyr[i]->level[0].buffer = NULL;
+    }
+}
+
+// Builds level l (1 or more) of a pair of pyramids from level l - 1. The rows
+// of both are split into bands run together on the pool's workers, pool may be
+// NULL to run on this thread. right may be NULL for a single pyramid.
+void image_pyramid_build_level(struct image_pyramid *left, struct image_pyramid *right, int l, struct thread_pool *pool)
+{
+    int height = left->level[l].height;
+    int bands = pool ? pool->workers * BANDS_PER_WORKER : 1;
+    int band_rows = (height + bands - 1) / bands;
+    bands = (height + band_rows - 1) / band_rows;
+    struct image_pyramid_job job = {{left, right}, l, band_rows, bands};
+    int tasks = right ? 2 * bands : bands;
+    if (pool)
+    {
+        thread_pool_run(pool, image_pyramid_band, &job, tasks);
+    }
+    else
+    {
+        for (int i = 0; i < tasks; i++)
+        {
+            image_pyramid_band(&job, i, 0);
+        }
+    }
+}
+
+// Builds the left and right pyramids of a stereo pair. right and img_right
+// may be NULL to build just one.
+void image_pyramid_build_pair(struct image_pyramid *left, struct image_pyramid *right, struct ppm_array *img_left,
+                              struct ppm_array *img_right, struct thread_pool *pool)
+{
+    image_pyramid_view(left, right, img_left, img_right);
+    for (int l = 1; l < left->levels; l++)
+    {
+        image_pyramid_build_level(left, right, l, pool);
+    }
+}
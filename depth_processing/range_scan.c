@@ -0,0 +1,212 @@
+// Range scans. A disparity map is turned into a polar scan like a planar
+// lidar's: each ray holds the distance to the nearest obstacle in a group of
+// image columns, seen within a band of rows, and the bearing of the group's
+// centre. This is the sensor input of the particle filter's calc_weights
+// (localization/particle_filter/main.c).
+//
+// Distances are in the units of the calibration baseline (mm for Middlebury).
+// Bearings are in radians from the optical axis, positive to the right, which
+// is clockwise seen from above like the particle filter's angles.
+
+// Camera calibration of a rectified pair, as in a Middlebury calib.txt
+struct stereo_calib
+{
+    // Focal length and principal point of the left camera, in pixels
+    double focal;
+    double cx;
+    double cy;
+    // Distance between the camera centres
+    double baseline;
+    // x difference of the two principal points, added to every disparity
+    double doffs;
+    // Size of the images the calibration is for
+    int width;
+    int height;
+    // Disparity search range the dataset needs
+    int ndisp;
+};
+
+// Options of disparity_to_range_scan()
+struct range_scan_options
+{
+    // Disparity map rows [y_start, y_end) searched for obstacles
+    int y_start;
+    int y_end;
+    // Height of the camera above the ground, and how close to the ground a
+    // point has to be to count as ground. 0 camera_height keeps every point.
+    // Assumes the camera looks straight ahead, level with the ground.
+    double camera_height;
+    double ground_margin;
+    // Furthest distance reported, rays with nothing closer get max_range. 0
+    // for no limit, those rays get INFINITY.
+    double max_range;
+    // Number of rays, the columns are split evenly between them. The map width
+    // gives one ray per column.
+    int rays;
+    // Pixels whose confidence from block_match_confidence() is below
+    // min_confidence count as having no disparity. NULL uses every pixel.
+    struct ppm_array *confidence;
+    int min_confidence;
+};
+
+// A range scan, rays go from left to right. range is NAN for rays with no valid
+// disparity at all.
+struct range_scan
+{
+    int count;
+    double *bearing;
+    double *range;
+    // Per column nearest disparity, and whether the column had any valid
+    // disparity
+    uint16_t *nearest;
+    uint8_t *seen;
+    double *column_range;
+    // Allocated rays and columns, only replaced when a scan needs more
+    size_t ray_capacity[2];
+    size_t column_capacity[3];
+};
+
+// Reads a Middlebury calib.txt. Exits if a field is missing.
+void read_calib(const char *filename, struct stereo_calib *calib)
+{
+    FILE *fp = fopen(filename, "r");
+    if (!fp)
+    {
+        fprintf(stderr, "Unable to open file '%s'\n", filename);
+        exit(1);
+    }
+    char line[256];
+    int found = 0;
+    memset(calib, 0, sizeof(*calib));
+    while (fgets(line, sizeof(line), fp))
+    {
+        double focal, cx, cy;
+        if (sscanf(line, "cam0=[%lf %*f %lf; %*f %*f %lf", &focal, &cx, &cy) == 3)
+        {
+            calib->focal = focal;
+            calib->cx = cx;
+            calib->cy = cy;
+            found |= 1;
+        }
+        found |= (sscanf(line, "baseline=%lf", &calib->baseline) == 1) << 1;
+        found |= (sscanf(line, "doffs=%lf", &calib->doffs) == 1) << 2;
+        found |= (sscanf(line, "width=%d", &calib->width) == 1) << 3;
+        found |= (sscanf(line, "height=%d", &calib->height) == 1) << 4;
+        found |= (sscanf(line, "ndisp=%d", &calib->ndisp) == 1) << 5;
+    }
+    fclose(fp);
+    if (found != 0x3f)
+    {
+        fprintf(stderr, "Invalid calibration file '%s'\n", filename);
+        exit(1);
+    }
+}
+
+// Frees the scan's buffers.
+void free_range_scan(struct range_scan *scan)
+{
+    free(scan->bearing);
+    free(scan->range);
+    free(scan->nearest);
+    free(scan->seen);
+    free(scan->column_range);
+    memset(scan, 0, sizeof(*scan));
+}
+
+// Builds a range scan from a disparity map of the calibrated pair, or of a
+// scaled copy of it (the map width gives the scale). scan must be zeroed before
+// the first call, later calls reuse its buffers.
+void disparity_to_range_scan(struct disparity_map *map, const struct stereo_calib *calib,
+                             const struct range_scan_options *opt, struct range_scan *scan)
+{
+    int width = map->width;
+    if (opt->confidence && (opt->confidence->width != width || opt->confidence->height != map->height))
+    {
+        fprintf(stderr, "Confidence must have the same size as the disparity map\n");
+        exit(1);
+    }
+    int rays = opt->rays < 1 ? 1 : opt->rays > width ? width : opt->rays;
+    scan->count = rays;
+    scan->bearing = (double *)buffer_reserve(scan->bearing, &scan->ray_capacity[0], rays, sizeof(double));
+    scan->range = (double *)buffer_reserve(scan->range, &scan->ray_capacity[1], rays, sizeof(double));
+    scan->nearest = (uint16_t *)buffer_reserve(scan->nearest, &scan->column_capacity[0], width, sizeof(uint16_t));
+    scan->seen = (uint8_t *)buffer_reserve(scan->seen, &scan->column_capacity[1], width, 1);
+    scan->column_range = (double *)buffer_reserve(scan->column_range, &scan->column_capacity[2], width, sizeof(double));
+
+    // Calibration at the map's resolution. Depth is baseline * focal /
+    // (disparity + doffs), and a point lies (y - cy) * depth / focal below the
+    // camera.
+    double scale = (double)width / calib->width;
+    double focal = calib->focal * scale;
+    double cx = calib->cx * scale;
+    double cy = calib->cy * scale;
+    double doffs = calib->doffs * scale;
+    int fixed_one = 1 << DISPARITY_FRAC_BITS;
+
+    // Both limits are disparity floors, so a pixel is an obstacle if its
+    // fixed-point disparity is above the larger of them. Disparity 0 is
+    // infinitely far and never one.
+    int64_t range_floor = 0;
+    if (opt->max_range > 0)
+    {
+        range_floor = (int64_t)ceil((calib->baseline * focal / opt->max_range - doffs) * fixed_one) - 1;
+    }
+    double ground_height = opt->camera_height - opt->ground_margin;
+
+    memset(scan->nearest, 0, sizeof(uint16_t) * width);
+    memset(scan->seen, 0, width);
+    int y_start = opt->y_start < 0 ? 0 : opt->y_start;
+    int y_end = opt->y_end > map->height ? map->height : opt->y_end;
+    for (int y = y_start; y < y_end; y++)
+    {
+        // Points at or below ground_height have a disparity of at most
+        // (y - cy) * baseline / ground_height - doffs
+        int64_t floor_fixed = range_floor;
+        if (opt->camera_height > 0 && y > cy)
+        {
+            int64_t ground_floor = ground_height > 0 ? (int64_t)floor(((y - cy) * calib->baseline / ground_height - doffs) * fixed_one)
+                                                     : DISPARITY_INVALID;
+            floor_fixed = ground_floor > floor_fixed ? ground_floor : floor_fixed;
+        }
+        if (floor_fixed >= DISPARITY_INVALID)
+        {
+            floor_fixed = DISPARITY_INVALID - 1;
+        }
+        uint16_t lower = floor_fixed < 0 ? 0 : (uint16_t)floor_fixed;
+
+        // Branch free, so the compiler vectorizes it
+        const uint16_t *row = disparity_map_at(map, 0, y);
+        const uint8_t *confidence = opt->confidence ? ppm_array_at(opt->confidence, 0, y) : NULL;
+        uint16_t *nearest = scan->nearest;
+        uint8_t *seen = scan->seen;
+        for (int x = 0; x < width; x++)
+        {
+            uint16_t d = confidence && confidence[x] < opt->min_confidence ? DISPARITY_INVALID : row[x];
+            uint16_t obstacle = d > lower && d < DISPARITY_INVALID ? d : 0;
+            nearest[x] = obstacle > nearest[x] ? obstacle : nearest[x];
+            seen[x] |= d < DISPARITY_INVALID;
+        }
+    }
+
+    double empty = opt->max_range > 0 ? opt->max_range : INFINITY;
+    for (int x = 0; x < width; x++)
+    {
+        double tangent = (x - cx) / focal;
+        double depth = calib->baseline * focal / ((double)scan->nearest[x] / fixed_one + doffs);
+        double range = scan->nearest[x] ? depth * sqrt(1 + tangent * tangent) : empty;
+        scan->column_range[x] = scan->seen[x] ? range : NAN;
+    }
+    for (int r = 0; r < rays; r++)
+    {
+        int x_start = (int)((int64_t)r * width / rays);
+        int x_end = (int)((int64_t)(r + 1) * width / rays);
+        // fmin ignores NAN, so the ray is only NAN if every column is
+        double range = NAN;
+        for (int x = x_start; x < x_end; x++)
+        {
+            range = fmin(range, scan->column_range[x]);
+        }
+        scan->range[r] = range;
+        scan->bearing[r] = atan(((x_start + x_end - 1) / 2.0 - cx) / focal);
+    }
+}
@@ -0,0 +1,418 @@
+// Stereo rectification. The matchers assume every row of the left image lies
+// on the same epipolar line as the same row of the right image, which a real
+// pair of cameras only approximates. Rectification warps both images so it
+// holds: each camera is undistorted and rotated to share a common orientation,
+// with the x axis along the baseline, and both are projected with the same
+// camera matrix.
+//
+// The warp is fixed for a calibration, so it is computed once into a remap
+// table holding the fixed-point source coordinates of every output pixel. Each
+// frame then only needs bilinear sampling (the remap_row kernel), and the
+// tables can be cached on disk to skip computing them on the next start.
+//
+// Calibration files use the calib.txt format, with these optional additions:
+//   dist0=[k1 k2 p1 p2 k3]   radial and tangential distortion of cam0, the
+//   dist1=[k1 k2 p1 p2 k3]   OpenCV model, in normalized image coordinates
+//   R=[r11 r12 r13; r21 r22 r23; r31 r32 r33]
+//   T=[tx ty tz]             a point X in cam0 coordinates is R * X + T in
+//                            cam1 coordinates, T in baseline units
+// Without them the cameras have no distortion and cam1 sits baseline to the
+// right of cam0, as for the already rectified Middlebury pairs.
+
+// Calibration of a stereo pair
+struct rectify_calib
+{
+    // Camera matrices and distortion of cam0 (left) and cam1 (right)
+    double K[2][9];
+    double dist[2][5];
+    // Pose of cam1 relative to cam0
+    double R[9];
+    double T[3];
+    // Size of the images
+    int width;
+    int height;
+};
+
+// Source coordinates of every pixel of a rectified image
+struct remap_table
+{
+    // Size of the rectified and the source images
+    int width;
+    int height;
+    int src_width;
+    int src_height;
+    // Per pixel, row-major: the top left source pixel as x, y pairs (x -1 for
+    // pixels that fall outside the source), and the bilinear weights of its
+    // neighbours, fx | fy << 8 in 1 << REMAP_FRAC_BITS steps
+    int16_t *xy;
+    uint16_t *frac;
+};
+
+// Magic number and version at the start of a remap table cache file
+#define REMAP_CACHE_MAGIC "RMAPTBL1"
+
+// Reads count numbers out of a "[a b c; d e f]" list, returns non-zero if all
+// of them were there.
+static int read_calib_list(const char *text, double *out, int count)
+{
+    const char *p = strchr(text, '[');
+    if (!p)
+    {
+        return 0;
+    }
+    p++;
+    for (int i = 0; i < count; i++)
+    {
+        while (*p == ' ' || *p == ';')
+        {
+            p++;
+        }
+        char *end;
+        out[i] = strtod(p, &end);
+        if (end == p)
+        {
+            return 0;
+        }
+        p = end;
+    }
+    return 1;
+}
+
+// Reads a calibration file, see the top of this file. Exits if the camera
+// matrices or the image size are missing.
+void read_rectify_calib(const char *filename, struct rectify_calib *calib)
+{
+    FILE *fp = fopen(filename, "r");
+    if (!fp)
+    {
+        fprintf(stderr, "Unable to open file '%s'\n", filename);
+        exit(1);
+    }
+    char line[512];
+    int found = 0;
+    int has_T = 0;
+    double baseline = 0;
+    memset(calib, 0, sizeof(*calib));
+    calib->R[0] = calib->R[4] = calib->R[8] = 1;
+    while (fgets(line, sizeof(line), fp))
+    {
+        if (strncmp(line, "cam0=", 5) == 0)
+        {
+            found |= read_calib_list(line, calib->K[0], 9);
+        }
+        else if (strncmp(line, "cam1=", 5) == 0)
+        {
+            found |= read_calib_list(line, calib->K[1], 9) << 1;
+        }
+        else if (strncmp(line, "dist0=", 6) == 0)
+        {
+            read_calib_list(line, calib->dist[0], 5);
+        }
+        else if (strncmp(line, "dist1=", 6) == 0)
+        {
+            read_calib_list(line, calib->dist[1], 5);
+        }
+        else if (strncmp(line, "R=", 2) == 0)
+        {
+            read_calib_list(line, calib->R, 9);
+        }
+        else if (strncmp(line, "T=", 2) == 0)
+        {
+            has_T = read_calib_list(line, calib->T, 3);
+        }
+        found |= (sscanf(line, "width=%d", &calib->width) == 1) << 2;
+        found |= (sscanf(line, "height=%d", &calib->height) == 1) << 3;
+        sscanf(line, "baseline=%lf", &baseline);
+    }
+    fclose(fp);
+    if (found != 0xf || calib->width < 2 || calib->height < 2)
+    {
+        fprintf(stderr, "Invalid calibration file '%s'\n", filename);
+        exit(1);
+    }
+    if (!has_T)
+    {
+        calib->T[0] = -baseline;
+    }
+}
+
+// Applies the 3x3 matrix m, or its transpose, to v.
+static void rectify_mul(const double *m, const double *v, double *out, int transpose)
+{
+    for (int i = 0; i < 3; i++)
+    {
+        out[i] = 0;
+        for (int j = 0; j < 3; j++)
+        {
+            out[i] += (transpose ? m[j * 3 + i] : m[i * 3 + j]) * v[j];
+        }
+    }
+}
+
+static void rectify_cross(const double *a, const double *b, double *out)
+{
+    out[0] = a[1] * b[2] - a[2] * b[1];
+    out[1] = a[2] * b[0] - a[0] * b[2];
+    out[2] = a[0] * b[1] - a[1] * b[0];
+}
+
+static void rectify_normalize(double *v)
+{
+    double length = sqrt(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+    v[0] /= length;
+    v[1] /= length;
+    v[2] /= length;
+}
+
+// Fills the rotation from cam0 coordinates to the rectified ones, row-major.
+// Its x axis points from cam0 to cam1, and its z axis is as close as it can be
+// to the average of the two optical axes.
+static void rectify_rotation(const struct rectify_calib *calib, double *rect)
+{
+    // cam1 centre is -R^T T in cam0 coordinates, its optical axis R^T z
+    double centre[3];
+    double z[3] = {0, 0, 1};
+    double axis[3];
+    rectify_mul(calib->R, calib->T, centre, 1);
+    rectify_mul(calib->R, z, axis, 1);
+    double *x = rect;
+    double *y = rect + 3;
+    double *new_z = rect + 6;
+    for (int i = 0; i < 3; i++)
+    {
+        x[i] = -centre[i];
+        axis[i] += z[i];
+    }
+    rectify_normalize(x);
+    rectify_cross(axis, x, y);
+    rectify_normalize(y);
+    rectify_cross(x, y, new_z);
+}
+
+// Computes the remap table rectifying camera 0 (left) or 1 (right). Both
+// rectified images are the calibrated size and use cam0's principal point and
+// the average focal length. table must be zeroed before the first call, later
+// calls reuse its buffers.
+void remap_table_build(const struct rectify_calib *calib, int camera, struct remap_table *table)
+{
+    int width = calib->width;
+    int height = calib->height;
+    if (width > INT16_MAX || height > INT16_MAX)
+    {
+        fprintf(stderr, "Images are too big to rectify\n");
+        exit(1);
+    }
+    size_t pixels = (size_t)width * height;
+    size_t xy_capacity = table->xy ? (size_t)table->width * table->height * 2 : 0;
+    size_t frac_capacity = table->frac ? (size_t)table->width * table->height : 0;
+    table->xy = (int16_t *)buffer_reserve(table->xy, &xy_capacity, pixels * 2, sizeof(int16_t));
+    table->frac = (uint16_t *)buffer_reserve(table->frac, &frac_capacity, pixels, sizeof(uint16_t));
+    table->width = table->src_width = width;
+    table->height = table->src_height = height;
+
+    // Rotation from rectified to camera coordinates, R_cam = R_rect^T for
+    // cam0 and R * R_rect^T for cam1
+    double rect[9];
+    double to_camera[9];
+    rectify_rotation(calib, rect);
+    for (int i = 0; i < 3; i++)
+    {
+        for (int j = 0; j < 3; j++)
+        {
+            double sum = 0;
+            for (int k = 0; k < 3; k++)
+            {
+                double r = camera ? calib->R[i * 3 + k] : (i == k);
+                sum += r * rect[j * 3 + k];
+            }
+            to_camera[i * 3 + j] = sum;
+        }
+    }
+
+    const double *K = calib->K[camera];
+    const double *dist = calib->dist[camera];
+    double focal = (calib->K[0][0] + calib->K[1][0] + calib->K[0][4] + calib->K[1][4]) / 4;
+    double cx = calib->K[0][2];
+    double cy = calib->K[0][5];
+    const int one = 1 << REMAP_FRAC_BITS;
+    for (int v = 0; v < height; v++)
+    {
+        for (int u = 0; u < width; u++)
+        {
+            int16_t *xy = table->xy + 2 * ((size_t)v * width + u);
+            uint16_t *frac = table->frac + (size_t)v * width + u;
+            double ray[3] = {(u - cx) / focal, (v - cy) / focal, 1};
+            double point[3];
+            rectify_mul(to_camera, ray, point, 0);
+            xy[0] = -1;
+            xy[1] = 0;
+            *frac = 0;
+            if (point[2] <= 0)
+            {
+                continue;
+            }
+
+            // Distort, then project with the camera's own matrix
+            double x = point[0] / point[2];
+            double y = point[1] / point[2];
+            double r2 = x * x + y * y;
+            double radial = 1 + r2 * (dist[0] + r2 * (dist[1] + r2 * dist[4]));
+            double x_d = x * radial + 2 * dist[2] * x * y + dist[3] * (r2 + 2 * x * x);
+            double y_d = y * radial + dist[2] * (r2 + 2 * y * y) + 2 * dist[3] * x * y;
+            double src_x = (K[0] * x_d + K[1] * y_d + K[2]) * one;
+            double src_y = (K[4] * y_d + K[5]) * one;
+            if (!(src_x > -0.5 && src_x < (width - 1) * one + 0.5 && src_y > -0.5 && src_y < (height - 1) * one + 0.5))
+            {
+                continue;
+            }
+
+            // The last row and column blend fully towards their neighbour
+            // before them, so the sampled 2x2 block stays inside the image
+            int fixed_x = (int)lround(src_x);
+            int fixed_y = (int)lround(src_y);
+            int x_0 = fixed_x >> REMAP_FRAC_BITS;
+            int y_0 = fixed_y >> REMAP_FRAC_BITS;
+            int f_x = fixed_x & (one - 1);
+            int f_y = fixed_y & (one - 1);
+            if (x_0 == width - 1)
+            {
+                x_0--;
+                f_x = one;
+            }
+            if (y_0 == height - 1)
+            {
+                y_0--;
+                f_y = one;
+            }
+            xy[0] = x_0;
+            xy[1] = y_0;
+            *frac = f_x | f_y << 8;
+        }
+    }
+}
+
+// Frees the table's buffers.
+void free_remap_table(struct remap_table *table)
+{
+    free(table->xy);
+    free(table->frac);
+    memset(table, 0, sizeof(*table));
+}
+
+// Returns a hash of the calibration and camera, which identifies the remap
+// table built from them in a cache file.
+uint64_t rectify_calib_key(const struct rectify_calib *calib, int camera)
+{
+    // FNV-1a, read_rectify_calib() zeroes the struct so its padding is stable
+    uint64_t hash = 0xcbf29ce484222325ull;
+    const unsigned char *bytes = (const unsigned char *)calib;
+    for (size_t i = 0; i < sizeof(*calib); i++)
+    {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+    }
+    return (hash ^ (uint64_t)camera) * 0x100000001b3ull;
+}
+
+// Writes the table to a cache file, tagged with key. Returns 0 on failure.
+int remap_table_save(struct remap_table *table, uint64_t key, const char *filename)
+{
+    FILE *fp = fopen(filename, "wb");
+    if (!fp)
+    {
+        return 0;
+    }
+    size_t pixels = (size_t)table->width * table->height;
+    int32_t size[4] = {table->width, table->height, table->src_width, table->src_height};
+    int ok = fwrite(REMAP_CACHE_MAGIC, 8, 1, fp) == 1 && fwrite(&key, sizeof(key), 1, fp) == 1 &&
+             fwrite(size, sizeof(size), 1, fp) == 1 && fwrite(table->xy, sizeof(int16_t) * 2, pixels, fp) == pixels &&
+             fwrite(table->frac, sizeof(uint16_t), pixels, fp) == pixels;
+    ok &= fclose(fp) == 0;
+    return ok;
+}
+
+// Reads a cache file written by remap_table_save(). Returns 0, leaving the
+// table unchanged, if the file is missing, damaged or tagged with another key.
+// table must be zeroed before the first call, later calls reuse its buffers.
+int remap_table_load(struct remap_table *table, uint64_t key, const char *filename)
+{
+    FILE *fp = fopen(filename, "rb");
+    if (!fp)
+    {
+        return 0;
+    }
+    char magic[8];
+    uint64_t file_key;
+    int32_t size[4];
+    if (fread(magic, 8, 1, fp) != 1 || memcmp(magic, REMAP_CACHE_MAGIC, 8) != 0 ||
+        fread(&file_key, sizeof(file_key), 1, fp) != 1 || file_key != key ||
+        fread(size, sizeof(size), 1, fp) != 1 || size[0] < 2 || size[1] < 2 || size[0] > INT16_MAX || size[1] > INT16_MAX)
+    {
+        fclose(fp);
+        return 0;
+    }
+    size_t pixels = (size_t)size[0] * size[1];
+    int16_t *xy = (int16_t *)malloc(sizeof(int16_t) * 2 * pixels);
+    uint16_t *frac = (uint16_t *)malloc(sizeof(uint16_t) * pixels);
+    if (!xy || !frac || fread(xy, sizeof(int16_t) * 2, pixels, fp) != pixels || fread(frac, sizeof(uint16_t), pixels, fp) != pixels)
+    {
+        free(xy);
+        free(frac);
+        fclose(fp);
+        return 0;
+    }
+    fclose(fp);
+    free(table->xy);
+    free(table->frac);
+    table->width = size[0];
+    table->height = size[1];
+    table->src_width = size[2];
+    table->src_height = size[3];
+    table->xy = xy;
+    table->frac = frac;
+    return 1;
+}
+
+// Loads the remap table of a camera from cache_file, or builds it and writes
+// the cache if the file is missing or was made for another calibration.
+// cache_file may be NULL to always build it.
+void remap_table_cached(const struct rectify_calib *calib, int camera, const char *cache_file, struct remap_table *table)
+{
+    uint64_t key = rectify_calib_key(calib, camera);
+    if (cache_file && remap_table_load(table, key, cache_file))
+    {
+        return;
+    }
+    remap_table_build(calib, camera, table);
+    if (cache_file && !remap_table_save(table, key, cache_file))
+    {
+        fprintf(stderr, "Unable to write remap table cache '%s'\n", cache_file);
+    }
+}
+
+// Rectifies rows [y_start, y_end) of img_out.
+void remap_image_rows(struct remap_table *table, struct ppm_array *img_in, struct ppm_array *img_out, int y_start, int y_end)
+{
+    const struct sad_kernels *kernels = sad_kernels_get();
+    const uint8_t *src = ppm_array_at(img_in, 0, 0);
+    for (int y = y_start; y < y_end; y++)
+    {
+        size_t row = (size_t)y * table->width;
+        kernels->remap_row(src, img_in->stride, img_in->channels, table->xy + 2 * row, table->frac + row,
+                           ppm_array_at(img_out, 0, y), table->width);
+    }
+}
+
+// Rectifies img_in into img_out, which has to be allocated (or wrapped) with
+// the table's size and the same channels (1 or 3). Single channel sources must
+// be allocated, as a few bytes past the end of each row are read.
+void remap_image(struct remap_table *table, struct ppm_array *img_in, struct ppm_array *img_out)
+{
+    if (img_in->width != table->src_width || img_in->height != table->src_height ||
+        img_out->width != table->width || img_out->height != table->height ||
+        img_in->channels != img_out->channels || (img_in->channels != 1 && img_in->channels != 3))
+    {
+        fprintf(stderr, "Images don't match the remap table\n");
+        exit(1);
+    }
+    remap_image_rows(table, img_in, img_out, 0, table->height);
+}
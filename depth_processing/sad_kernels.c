@@ -0,0 +1,1709 @@
+// Absolute difference kernels used by the SAD cost aggregation. Every kernel
+// has a scalar version and vectorized versions for SSE2/AVX2 on x86 and NEON on
+// ARM, the best one the running CPU supports is picked at runtime. All versions
+// give bit-identical results. The sets also carry the path step of semi-global
+// matching (sgm.c), which works on 16 bit costs, the Hamming distances of the
+// census cost (census.c), the bilinear sampling of rectification 
+// (rectify.c), the greyscale, blur and downsampling steps of image
+// preprocessing, the image pyramid filter (pyramid.c) and the median filter
+// of disparity maps (speckle.c).
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(SAD_KERNELS_NEON_MODEL)
+// The NEON set built from a C model of its intrinsics, to test it on any CPU
+#include "neon_model.h"
+#define SAD_KERNELS_NEON
+#else
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SAD_KERNELS_X86
+#endif
+
+#if defined(__ARM_NEON) || defined(__aarch64__)
+#include <arm_neon.h>
+#define SAD_KERNELS_NEON
+#endif
+#endif
+
+// Fractional bits of the source coordinates in a rectification remap table
+#define REMAP_FRAC_BITS 5
+
+// Set of kernels for one instruction set
+struct sad_kernels
+{
+    const char *name;
+    // Returns non-zero if the running CPU can execute these kernels
+    int (*supported)(void);
+    // col[i] += |a[i] - b[i]| for i in [0, n)
+    void (*col_add)(uint16_t *col, const uint8_t *a, const uint8_t *b, int n);
+    // col[i] -= |a[i] - b[i]| for i in [0, n)
+    void (*col_sub)(uint16_t *col, const uint8_t *a, const uint8_t *b, int n);
+    // col[i] += |a_in[i] - b_in[i]| - |a_out[i] - b_out[i]| for i in [0, n)
+    void (*col_update)(uint16_t *col, const uint8_t *a_in, const uint8_t *b_in,
+                       const uint8_t *a_out, const uint8_t *b_out, int n);
+    // Returns the sum of |a[i] - b[i]| for i in [0, n)
+    uint32_t (*row_sad)(const uint8_t *a, const uint8_t *b, int n);
+    // Returns the sum of row_sad() over rows rows, the rows of a and b are 
+    // a_stride and b_stride bytes apart
+    uint32_t (*block_sad)(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int n, int rows);
+    // One semi-global matching step along a path for n disparities, n being a
+    // multiple of 16:
+    //   cur[d] = cost[d] + min(prev[d], prev[d - 1] + p1, prev[d + 1] + p1,
+    //                          prev_min + p2) - prev_min
+    //   sum[d] += cur[d]
+    // with saturating additions. prev[-1] and prev[n] must be readable, 
+    // prev_min is the smallest of prev[0, n). Returns the smallest of cur.
+    uint16_t (*sgm_path)(const uint16_t *cost, const uint16_t *prev, uint16_t prev_min,
+                         uint16_t *cur, uint16_t *sum, int n, uint16_t p1, uint16_t p2);
+    // out[i] = popcount(a[i] ^ b[i]) for i in [0, n)
+    void (*hamming_row)(const uint64_t *a, const uint64_t *b, uint8_t *out, int n);
+    // Returns the sum of popcount(a[i] ^ b[i]) over n descriptors and rows 
+    // rows, the rows of a and b are a_stride and b_stride descriptors apart
+    uint32_t (*hamming_block)(const uint64_t *a, int a_stride, const uint64_t *b, int b_stride, int n, int rows);
+    // Bilinear sampling of n output pixels of channels (1 or 3) bytes. Pixel i
+    // blends source pixel (xy[2i], xy[2i + 1]) with its right, lower and lower 
+    // right neighbours by frac[i] = fx | fy << 8, in 1 << REMAP_FRAC_BITS 
+    // steps. Pixels with xy[2i] < 0 are black. Up to 3 bytes past a source 
+    // pixel's neighbours may be read.
+    void (*remap_row)(const uint8_t *src, int stride, int channels, const int16_t *xy, const uint16_t *frac,
+                      uint8_t *out, int n);
+    // out[i] = (r + g + b) / 3 of RGB pixel i, for i in [0, n)
+    void (*grey_row)(const uint8_t *rgb, uint8_t *out, int n);
+    // Vertical pass of the 1 8 1 Gaussian:
+    //   out[i] = above[i] + 8 * row[i] + below[i] for i in [0, n)
+    void (*blur_col)(const uint8_t *above, const uint8_t *row, const uint8_t *below, uint16_t *out, int n);
+    // Horizontal pass of the Gaussian over blur_col() sums, scaled back to
+    // bytes:
+    //   out[i] = (v[i - channels] + 8 * v[i] + v[i + channels]) / 100
+    // for i in [0, n), v[-channels] and v[n - 1 + channels] must be readable
+    void (*blur_row)(const uint16_t *v, int channels, uint8_t *out, int n);
+    // Average of 2x2 blocks of two rows of pixels of channels bytes, rounding
+    // down, for n output pixels
+    void (*half_row)(const uint8_t *a, const uint8_t *b, int channels, uint8_t *out, int n);
+    // Vertical pass of the 1 4 6 4 1 pyramid filter over five rows, for n
+    // pairs of pixels, split into the pixels at even and odd columns:
+    //   even[p] = sum of w[r] * rows[r][2p], odd[p] the same of [2p + 1]
+    // with pixels of channels bytes
+    void (*pyramid_col)(const uint8_t *const *rows, int channels, uint16_t *even, uint16_t *odd, int n);
+    // Horizontal pass of the pyramid filter at the even columns, rounded back
+    // to bytes:
+    //   out[i] = (even[i - channels] + 4 * odd[i - channels] + 6 * even[i] +
+    //             4 * odd[i] + even[i + channels] + 128) >> 8
+    // for i in [0, n)
+    void (*pyramid_row)(const uint16_t *even, const uint16_t *odd, int channels, uint8_t *out, int n);
+    // Median of the 3x3 block of 16 bit values around each of n pixels:
+    //   out[i] = median of above, row and below at [i - 1, i + 1]
+    // for i in [0, n), [-1] and [n] of the three rows must be readable
+    void (*median3_row)(const uint16_t *above, const uint16_t *row, const uint16_t *below, uint16_t *out, int n);
+};
+
+// The median of nine network: 19 compare-exchanges leave the median of p[0, 9)
+// in p[4]. SORT(a, b) orders the values at a and b, the smaller first.
+#define SAD_MEDIAN9(SORT, p)                                                                                           \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        SORT(&p[1], &p[2]); SORT(&p[4], &p[5]); SORT(&p[7], &p[8]);                                                    \
+        SORT(&p[0], &p[1]); SORT(&p[3], &p[4]); SORT(&p[6], &p[7]);                                                    \
+        SORT(&p[1], &p[2]); SORT(&p[4], &p[5]); SORT(&p[7], &p[8]);                                                    \
+        SORT(&p[0], &p[3]); SORT(&p[5], &p[8]); SORT(&p[4], &p[7]);                                                    \
+        SORT(&p[3], &p[6]); SORT(&p[1], &p[4]); SORT(&p[2], &p[5]);                                                    \
+        SORT(&p[4], &p[7]); SORT(&p[4], &p[2]); SORT(&p[6], &p[4]);                                                    \
+        SORT(&p[4], &p[2]);                                                                                            \
+    } while (0)
+
+// * * * * * * * * * * * * * * * * Scalar * * * * * * * * * * * * * * * * * * *
+
+static int sad_supported_scalar(void)
+{
+    return 1;
+}
+
+static inline int sad_abs_dif(int a, int b)
+{
+    return a > b ? a - b : b - a;
+}
+
+static void sad_col_add_scalar(uint16_t *col, const uint8_t *a, const uint8_t *b, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        col[i] += sad_abs_dif(a[i], b[i]);
+    }
+}
+
+static void sad_col_sub_scalar(uint16_t *col, const uint8_t *a, const uint8_t *b, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        col[i] -= sad_abs_dif(a[i], b[i]);
+    }
+}
+
+static void sad_col_update_scalar(uint16_t *col, const uint8_t *a_in, const uint8_t *b_in,
+                                  const uint8_t *a_out, const uint8_t *b_out, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        col[i] += sad_abs_dif(a_in[i], b_in[i]) - sad_abs_dif(a_out[i], b_out[i]);
+    }
+}
+
+static uint32_t sad_row_sad_scalar(const uint8_t *a, const uint8_t *b, int n)
+{
+    uint32_t sum = 0;
+    for (int i = 0; i < n; i++)
+    {
+        sum += sad_abs_dif(a[i], b[i]);
+    }
+    return sum;
+}
+
+static uint32_t sad_block_sad_scalar(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int n, int rows)
+{
+    uint32_t sum = 0;
+    for (int j = 0; j < rows; j++, a += a_stride, b += b_stride)
+    {
+        sum += sad_row_sad_scalar(a, b, n);
+    }
+    return sum;
+}
+
+static inline uint16_t sad_adds_u16(uint16_t a, uint16_t b)
+{
+    uint32_t sum = (uint32_t)a + b;
+    return sum > 0xffff ? 0xffff : sum;
+}
+
+static uint16_t sad_sgm_path_scalar(const uint16_t *cost, const uint16_t *prev, uint16_t prev_min,
+                                    uint16_t *cur, uint16_t *sum, int n, uint16_t p1, uint16_t p2)
+{
+    uint16_t jump = sad_adds_u16(prev_min, p2);
+    uint16_t cur_min = 0xffff;
+    for (int d = 0; d < n; d++)
+    {
+        uint16_t best = prev[d];
+        uint16_t step = sad_adds_u16(prev[d - 1], p1);
+        best = step < best ? step : best;
+        step = sad_adds_u16(prev[d + 1], p1);
+        best = step < best ? step : best;
+        best = jump < best ? jump : best;
+        uint16_t value = sad_adds_u16(cost[d], best) - prev_min;
+        cur[d] = value;
+        sum[d] = sad_adds_u16(sum[d], value);
+        cur_min = value < cur_min ? value : cur_min;
+    }
+    return cur_min;
+}
+
+// The compiler picks a bit trick or a popcount instruction for the target
+static void sad_hamming_row_scalar(const uint64_t *a, const uint64_t *b, uint8_t *out, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        out[i] = __builtin_popcountll(a[i] ^ b[i]);
+    }
+}
+
+static uint32_t sad_hamming_block_scalar(const uint64_t *a, int a_stride, const uint64_t *b, int b_stride, int n, int rows)
+{
+    uint32_t sum = 0;
+    for (int j = 0; j < rows; j++, a += a_stride, b += b_stride)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            sum += __builtin_popcountll(a[i] ^ b[i]);
+        }
+    }
+    return sum;
+}
+
+static void sad_remap_row_scalar(const uint8_t *src, int stride, int channels, const int16_t *xy, const uint16_t *frac,
+                                 uint8_t *out, int n)
+{
+    const int one = 1 << REMAP_FRAC_BITS;
+    for (int i = 0; i < n; i++, out += channels)
+    {
+        if (xy[2 * i] < 0)
+        {
+            memset(out, 0, channels);
+            continue;
+        }
+        const uint8_t *p = src + xy[2 * i + 1] * stride + xy[2 * i] * channels;
+        int fx = frac[i] & 0xff;
+        int fy = frac[i] >> 8;
+        for (int c = 0; c < channels; c++)
+        {
+            int top = p[c] * (one - fx) + p[c + channels] * fx;
+            int bottom = p[c + stride] * (one - fx) + p[c + stride + channels] * fx;
+            out[c] = (top * (one - fy) + bottom * fy + (1 << (2 * REMAP_FRAC_BITS - 1))) >> (2 * REMAP_FRAC_BITS);
+        }
+    }
+}
+
+// Points rows at the top and bottom row of the 2x2 source block of remap 
+// pixel i, or at zeros for a black pixel so the vectorized kernels blend it
+// like any other. Up to 6 bytes are read from either.
+static inline void sad_remap_rows(const uint8_t *src, int stride, int channels, const int16_t *xy, int i,
+                                  const uint8_t **rows)
+{
+    static const uint8_t black[8] = {0};
+    if (xy[2 * i] < 0)
+    {
+        rows[0] = rows[1] = black;
+        return;
+    }
+    rows[0] = src + xy[2 * i + 1] * stride + xy[2 * i] * channels;
+    rows[1] = rows[0] + stride;
+}
+
+static void sad_grey_row_scalar(const uint8_t *rgb, uint8_t *out, int n)
+{
+    for (int i = 0; i < n; i++, rgb += 3)
+    {
+        out[i] = (rgb[0] + rgb[1] + rgb[2]) / 3;
+    }
+}
+
+static void sad_blur_col_scalar(const uint8_t *above, const uint8_t *row, const uint8_t *below, uint16_t *out, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        out[i] = above[i] + 8 * row[i] + below[i];
+    }
+}
+
+static void sad_blur_row_scalar(const uint16_t *v, int channels, uint8_t *out, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        out[i] = (v[i - channels] + 8 * v[i] + v[i + channels]) / 100;
+    }
+}
+
+static void sad_half_row_scalar(const uint8_t *a, const uint8_t *b, int channels, uint8_t *out, int n)
+{
+    for (int i = 0; i < n; i++, a += 2 * channels, b += 2 * channels, out += channels)
+    {
+        for (int c = 0; c < channels; c++)
+        {
+            out[c] = (a[c] + a[c + channels] + b[c] + b[c + channels]) >> 2;
+        }
+    }
+}
+
+static void sad_pyramid_col_scalar(const uint8_t *const *rows, int channels, uint16_t *even, uint16_t *odd, int n)
+{
+    for (int p = 0; p < n; p++, even += channels, odd += channels)
+    {
+        for (int c = 0; c < 2 * channels; c++)
+        {
+            int x = 2 * p * channels + c;
+            uint16_t sum = rows[0][x] + 4 * rows[1][x] + 6 * rows[2][x] + 4 * rows[3][x] + rows[4][x];
+            if (c < channels)
+            {
+                even[c] = sum;
+            }
+            else
+            {
+                odd[c - channels] = sum;
+            }
+        }
+    }
+}
+
+// Splits the vertical sums of pairs of pixels of channels elements into the
+// even and odd pixels, for SIMD pyramid_col() versions summing whole rows
+static inline void sad_pyramid_split(const uint16_t *sums, int channels, uint16_t *even, uint16_t *odd, int n)
+{
+    if (channels == 3)
+    {
+        for (int p = 0; p < n; p++)
+        {
+            even[3 * p] = sums[6 * p];
+            even[3 * p + 1] = sums[6 * p + 1];
+            even[3 * p + 2] = sums[6 * p + 2];
+            odd[3 * p] = sums[6 * p + 3];
+            odd[3 * p + 1] = sums[6 * p + 4];
+            odd[3 * p + 2] = sums[6 * p + 5];
+        }
+        return;
+    }
+    for (int p = 0; p < n; p++, sums += 2 * channels, even += channels, odd += channels)
+    {
+        for (int c = 0; c < channels; c++)
+        {
+            even[c] = sums[c];
+            odd[c] = sums[channels + c];
+        }
+    }
+}
+
+static void sad_pyramid_row_scalar(const uint16_t *even, const uint16_t *odd, int channels, uint8_t *out, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        out[i] = (even[i - channels] + 4 * odd[i - channels] + 6 * even[i] + 4 * odd[i] + even[i + channels] + 128) >> 8;
+    }
+}
+
+static inline void sad_sort2_scalar(uint16_t *a, uint16_t *b)
+{
+    uint16_t lo = *a < *b ? *a : *b;
+    *b = *a < *b ? *b : *a;
+    *a = lo;
+}
+
+static void sad_median3_row_scalar(const uint16_t *above, const uint16_t *row, const uint16_t *below, uint16_t *out,
+                                   int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        uint16_t p[9] = {above[i - 1], above[i], above[i + 1],
+                         row[i - 1],   row[i],   row[i + 1],
+                         below[i - 1], below[i], below[i + 1]};
+        SAD_MEDIAN9(sad_sort2_scalar, p);
+        out[i] = p[4];
+    }
+}
+
+static const struct sad_kernels sad_kernels_scalar = {
+    "scalar",
+    sad_supported_scalar,
+    sad_col_add_scalar,
+    sad_col_sub_scalar,
+    sad_col_update_scalar,
+    sad_row_sad_scalar,
+    sad_block_sad_scalar,
+    sad_sgm_path_scalar,
+    sad_hamming_row_scalar,
+    sad_hamming_block_scalar,
+    sad_remap_row_scalar,
+    sad_grey_row_scalar,
+    sad_blur_col_scalar,
+    sad_blur_row_scalar,
+    sad_half_row_scalar,
+    sad_pyramid_col_scalar,
+    sad_pyramid_row_scalar,
+    sad_median3_row_scalar,
+};
+
+#ifdef SAD_KERNELS_X86
+// * * * * * * * * * * * * * * * * * SSE2 * * * * * * * * * * * * * * * * * * *
+
+static int sad_supported_sse2(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2");
+}
+
+// |a - b| for 16 unsigned bytes
+__attribute__((target("sse2"))) static inline __m128i sad_absdiff_sse2(__m128i a, __m128i b)
+{
+    return _mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a));
+}
+
+__attribute__((target("sse2"))) static void sad_col_add_sse2(uint16_t *col, const uint8_t *a, const uint8_t *b, int n)
+{
+    __m128i zero = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i ad = sad_absdiff_sse2(_mm_loadu_si128((const __m128i *)(a + i)),
+                                      _mm_loadu_si128((const __m128i *)(b + i)));
+        __m128i lo = _mm_loadu_si128((__m128i *)(col + i));
+        __m128i hi = _mm_loadu_si128((__m128i *)(col + i + 8));
+        lo = _mm_add_epi16(lo, _mm_unpacklo_epi8(ad, zero));
+        hi = _mm_add_epi16(hi, _mm_unpackhi_epi8(ad, zero));
+        _mm_storeu_si128((__m128i *)(col + i), lo);
+        _mm_storeu_si128((__m128i *)(col + i + 8), hi);
+    }
+    sad_col_add_scalar(col + i, a + i, b + i, n - i);
+}
+
+__attribute__((target("sse2"))) static void sad_col_sub_sse2(uint16_t *col, const uint8_t *a, const uint8_t *b, int n)
+{
+    __m128i zero = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i ad = sad_absdiff_sse2(_mm_loadu_si128((const __m128i *)(a + i)),
+                                      _mm_loadu_si128((const __m128i *)(b + i)));
+        __m128i lo = _mm_loadu_si128((__m128i *)(col + i));
+        __m128i hi = _mm_loadu_si128((__m128i *)(col + i + 8));
+        lo = _mm_sub_epi16(lo, _mm_unpacklo_epi8(ad, zero));
+        hi = _mm_sub_epi16(hi, _mm_unpackhi_epi8(ad, zero));
+        _mm_storeu_si128((__m128i *)(col + i), lo);
+        _mm_storeu_si128((__m128i *)(col + i + 8), hi);
+    }
+    sad_col_sub_scalar(col + i, a + i, b + i, n - i);
+}
+
+__attribute__((target("sse2"))) static void sad_col_update_sse2(uint16_t *col, const uint8_t *a_in, const uint8_t *b_in,
+                                                                const uint8_t *a_out, const uint8_t *b_out, int n)
+{
+    __m128i zero = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i ad_in = sad_absdiff_sse2(_mm_loadu_si128((const __m128i *)(a_in + i)),
+                                         _mm_loadu_si128((const __m128i *)(b_in + i)));
+        __m128i ad_out = sad_absdiff_sse2(_mm_loadu_si128((const __m128i *)(a_out + i)),
+                                          _mm_loadu_si128((const __m128i *)(b_out + i)));
+        __m128i lo = _mm_loadu_si128((__m128i *)(col + i));
+        __m128i hi = _mm_loadu_si128((__m128i *)(col + i + 8));
+        lo = _mm_add_epi16(lo, _mm_sub_epi16(_mm_unpacklo_epi8(ad_in, zero), _mm_unpacklo_epi8(ad_out, zero)));
+        hi = _mm_add_epi16(hi, _mm_sub_epi16(_mm_unpackhi_epi8(ad_in, zero), _mm_unpackhi_epi8(ad_out, zero)));
+        _mm_storeu_si128((__m128i *)(col + i), lo);
+        _mm_storeu_si128((__m128i *)(col + i + 8), hi);
+    }
+    sad_col_update_scalar(col + i, a_in + i, b_in + i, a_out + i, b_out + i, n - i);
+}
+
+__attribute__((target("sse2"))) static uint32_t sad_row_sad_sse2(const uint8_t *a, const uint8_t *b, int n)
+{
+    __m128i acc = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(a + i)),
+                                              _mm_loadu_si128((const __m128i *)(b + i))));
+    }
+    uint32_t sum = _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+    return sum + sad_row_sad_scalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("sse2"))) static uint32_t sad_block_sad_sse2(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int n, int rows)
+{
+    uint32_t sum = 0;
+    for (int j = 0; j < rows; j++, a += a_stride, b += b_stride)
+    {
+        sum += sad_row_sad_sse2(a, b, n);
+    }
+    return sum;
+}
+
+// Unsigned 16 bit minimum, SSE2 only has the signed one
+__attribute__((target("sse2"))) static inline __m128i sad_min_epu16_sse2(__m128i a, __m128i b)
+{
+    return _mm_sub_epi16(a, _mm_subs_epu16(a, b));
+}
+
+__attribute__((target("sse2"))) static uint16_t sad_sgm_path_sse2(const uint16_t *cost, const uint16_t *prev, uint16_t prev_min,
+                                                                  uint16_t *cur, uint16_t *sum, int n, uint16_t p1, uint16_t p2)
+{
+    __m128i penalty = _mm_set1_epi16(p1);
+    __m128i jump = _mm_set1_epi16(sad_adds_u16(prev_min, p2));
+    __m128i base = _mm_set1_epi16(prev_min);
+    __m128i cur_min = _mm_set1_epi16(-1);
+    for (int d = 0; d < n; d += 8)
+    {
+        __m128i best = _mm_loadu_si128((const __m128i *)(prev + d));
+        best = sad_min_epu16_sse2(best, _mm_adds_epu16(_mm_loadu_si128((const __m128i *)(prev + d - 1)), penalty));
+        best = sad_min_epu16_sse2(best, _mm_adds_epu16(_mm_loadu_si128((const __m128i *)(prev + d + 1)), penalty));
+        best = sad_min_epu16_sse2(best, jump);
+        __m128i value = _mm_sub_epi16(_mm_adds_epu16(_mm_loadu_si128((const __m128i *)(cost + d)), best), base);
+        _mm_storeu_si128((__m128i *)(cur + d), value);
+        _mm_storeu_si128((__m128i *)(sum + d), _mm_adds_epu16(_mm_loadu_si128((const __m128i *)(sum + d)), value));
+        cur_min = sad_min_epu16_sse2(cur_min, value);
+    }
+    cur_min = sad_min_epu16_sse2(cur_min, _mm_srli_si128(cur_min, 8));
+    cur_min = sad_min_epu16_sse2(cur_min, _mm_srli_si128(cur_min, 4));
+    cur_min = sad_min_epu16_sse2(cur_min, _mm_srli_si128(cur_min, 2));
+    return (uint16_t)_mm_cvtsi128_si32(cur_min);
+}
+
+// Blends 8 values. top and bottom hold each value's source byte in the top 
+// and bottom row followed by its right neighbour's, fx and fy its 16 bit 
+// weights. madd does the multiply-adds of both neighbours at once, the top 
+// and bottom blends are at most 255 << REMAP_FRAC_BITS so they pack back into
+// 16 bits for the vertical one.
+__attribute__((target("sse2"))) static inline __m128i sad_remap_blend_sse2(__m128i top, __m128i bottom, __m128i fx, __m128i fy)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi16(1 << REMAP_FRAC_BITS);
+    const __m128i round = _mm_set1_epi32(1 << (2 * REMAP_FRAC_BITS - 1));
+    __m128i wx_lo = _mm_unpacklo_epi16(_mm_sub_epi16(one, fx), fx);
+    __m128i wx_hi = _mm_unpackhi_epi16(_mm_sub_epi16(one, fx), fx);
+    __m128i wy_lo = _mm_unpacklo_epi16(_mm_sub_epi16(one, fy), fy);
+    __m128i wy_hi = _mm_unpackhi_epi16(_mm_sub_epi16(one, fy), fy);
+    __m128i t = _mm_packs_epi32(_mm_madd_epi16(_mm_unpacklo_epi8(top, zero), wx_lo),
+                                _mm_madd_epi16(_mm_unpackhi_epi8(top, zero), wx_hi));
+    __m128i b = _mm_packs_epi32(_mm_madd_epi16(_mm_unpacklo_epi8(bottom, zero), wx_lo),
+                                _mm_madd_epi16(_mm_unpackhi_epi8(bottom, zero), wx_hi));
+    __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi16(t, b), wy_lo);
+    __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi16(t, b), wy_hi);
+    lo = _mm_srli_epi32(_mm_add_epi32(lo, round), 2 * REMAP_FRAC_BITS);
+    hi = _mm_srli_epi32(_mm_add_epi32(hi, round), 2 * REMAP_FRAC_BITS);
+    return _mm_packs_epi32(lo, hi);
+}
+
+// SSE2 has no gather, so each pixel's 2x2 block is fetched with scalar loads
+// and the blends run 8 values at a time
+__attribute__((target("sse2"))) static void sad_remap_row_sse2(const uint8_t *src, int stride, int channels, const int16_t *xy, const uint16_t *frac,
+                                                               uint8_t *out, int n)
+{
+    const __m128i byte = _mm_set1_epi16(0xff);
+    const uint8_t *rows[2];
+    int i = 0;
+    if (channels == 1)
+    {
+        for (; i + 8 <= n; i += 8)
+        {
+            // A pixel and its right neighbour per 16 bit lane, put together
+            // in general purpose registers as going through memory would stall
+            // the vector loads on the scalar stores
+            uint32_t pairs[2][4] = {{0}};
+            for (int k = 0; k < 8; k++)
+            {
+                uint16_t top, bottom;
+                sad_remap_rows(src, stride, 1, xy, i + k, rows);
+                memcpy(&top, rows[0], 2);
+                memcpy(&bottom, rows[1], 2);
+                pairs[0][k / 2] |= (uint32_t)top << (16 * (k % 2));
+                pairs[1][k / 2] |= (uint32_t)bottom << (16 * (k % 2));
+            }
+            __m128i weights = _mm_loadu_si128((const __m128i *)(frac + i));
+            __m128i value = sad_remap_blend_sse2(_mm_setr_epi32(pairs[0][0], pairs[0][1], pairs[0][2], pairs[0][3]),
+                                                 _mm_setr_epi32(pairs[1][0], pairs[1][1], pairs[1][2], pairs[1][3]),
+                                                 _mm_and_si128(weights, byte), _mm_srli_epi16(weights, 8));
+            _mm_storel_epi64((__m128i *)(out + i), _mm_packus_epi16(value, value));
+        }
+    }
+    else
+    {
+        for (; i + 4 <= n; i += 4)
+        {
+            // A pixel's 3 channels and a spare byte per 32 bit lane, for the
+            // left and right column of the top and bottom rows. The right
+            // column is loaded from the left one's last channel and shifted
+            // down a byte (little endian), so RGB sources are never read past
+            // the block.
+            uint32_t words[4][4];
+            for (int k = 0; k < 4; k++)
+            {
+                sad_remap_rows(src, stride, 3, xy, i + k, rows);
+                memcpy(&words[0][k], rows[0], 4);
+                memcpy(&words[1][k], rows[0] + 2, 4);
+                memcpy(&words[2][k], rows[1], 4);
+                memcpy(&words[3][k], rows[1] + 2, 4);
+                words[1][k] >>= 8;
+                words[3][k] >>= 8;
+            }
+            __m128i left_top = _mm_setr_epi32(words[0][0], words[0][1], words[0][2], words[0][3]);
+            __m128i right_top = _mm_setr_epi32(words[1][0], words[1][1], words[1][2], words[1][3]);
+            __m128i left_bottom = _mm_setr_epi32(words[2][0], words[2][1], words[2][2], words[2][3]);
+            __m128i right_bottom = _mm_setr_epi32(words[3][0], words[3][1], words[3][2], words[3][3]);
+            // Each pixel's weights repeated over its 4 bytes
+            __m128i weights = _mm_loadl_epi64((const __m128i *)(frac + i));
+            weights = _mm_unpacklo_epi16(weights, weights);
+            __m128i weights_lo = _mm_unpacklo_epi32(weights, weights);
+            __m128i weights_hi = _mm_unpackhi_epi32(weights, weights);
+            __m128i lo = sad_remap_blend_sse2(_mm_unpacklo_epi8(left_top, right_top), _mm_unpacklo_epi8(left_bottom, right_bottom),
+                                              _mm_and_si128(weights_lo, byte), _mm_srli_epi16(weights_lo, 8));
+            __m128i hi = sad_remap_blend_sse2(_mm_unpackhi_epi8(left_top, right_top), _mm_unpackhi_epi8(left_bottom, right_bottom),
+                                              _mm_and_si128(weights_hi, byte), _mm_srli_epi16(weights_hi, 8));
+            uint8_t pixels[16];
+            _mm_storeu_si128((__m128i *)pixels, _mm_packus_epi16(lo, hi));
+            for (int k = 0; k < 4; k++)
+            {
+                memcpy(out + 3 * (i + k), pixels + 4 * k, 3);
+            }
+        }
+    }
+    sad_remap_row_scalar(src, stride, channels, xy + 2 * i, frac + i, out + i * channels, n - i);
+}
+
+// x / 100 for the 16 bit lanes of x, exact up to 43698
+__attribute__((target("sse2"))) static inline __m128i sad_div100_sse2(__m128i x)
+{
+    return _mm_srli_epi16(_mm_mulhi_epu16(x, _mm_set1_epi16(5243)), 3);
+}
+
+__attribute__((target("sse2"))) static void sad_blur_col_sse2(const uint8_t *above, const uint8_t *row, const uint8_t *below,
+                                                              uint16_t *out, int n)
+{
+    __m128i zero = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(above + i));
+        __m128i r = _mm_loadu_si128((const __m128i *)(row + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(below + i));
+        __m128i lo = _mm_add_epi16(_mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero)),
+                                   _mm_slli_epi16(_mm_unpacklo_epi8(r, zero), 3));
+        __m128i hi = _mm_add_epi16(_mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero)),
+                                   _mm_slli_epi16(_mm_unpackhi_epi8(r, zero), 3));
+        _mm_storeu_si128((__m128i *)(out + i), lo);
+        _mm_storeu_si128((__m128i *)(out + i + 8), hi);
+    }
+    sad_blur_col_scalar(above + i, row + i, below + i, out + i, n - i);
+}
+
+__attribute__((target("sse2"))) static void sad_blur_row_sse2(const uint16_t *v, int channels, uint8_t *out, int n)
+{
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i sums[2];
+        for (int k = 0; k < 2; k++)
+        {
+            const uint16_t *p = v + i + 8 * k;
+            __m128i side = _mm_add_epi16(_mm_loadu_si128((const __m128i *)(p - channels)),
+                                         _mm_loadu_si128((const __m128i *)(p + channels)));
+            sums[k] = sad_div100_sse2(_mm_add_epi16(side, _mm_slli_epi16(_mm_loadu_si128((const __m128i *)p), 3)));
+        }
+        _mm_storeu_si128((__m128i *)(out + i), _mm_packus_epi16(sums[0], sums[1]));
+    }
+    sad_blur_row_scalar(v + i, channels, out + i, n - i);
+}
+
+__attribute__((target("sse2"))) static void sad_half_row_sse2(const uint8_t *a, const uint8_t *b, int channels, uint8_t *out, int n)
+{
+    int i = 0;
+    if (channels == 1)
+    {
+        // The even bytes of each 16 bit lane are the left pixels of the blocks
+        __m128i even = _mm_set1_epi16(0xff);
+        for (; i + 16 <= n; i += 16)
+        {
+            __m128i sums[2];
+            for (int k = 0; k < 2; k++)
+            {
+                __m128i va = _mm_loadu_si128((const __m128i *)(a + 2 * i + 16 * k));
+                __m128i vb = _mm_loadu_si128((const __m128i *)(b + 2 * i + 16 * k));
+                __m128i sum = _mm_add_epi16(_mm_add_epi16(_mm_and_si128(va, even), _mm_srli_epi16(va, 8)),
+                                            _mm_add_epi16(_mm_and_si128(vb, even), _mm_srli_epi16(vb, 8)));
+                sums[k] = _mm_srli_epi16(sum, 2);
+            }
+            _mm_storeu_si128((__m128i *)(out + i), _mm_packus_epi16(sums[0], sums[1]));
+        }
+    }
+    sad_half_row_scalar(a + 2 * i * channels, b + 2 * i * channels, channels, out + i * channels, n - i);
+}
+
+// 1 4 6 4 1 sum of five vectors of 16 bit lanes
+__attribute__((target("sse2"))) static inline __m128i sad_pyramid_sum_sse2(__m128i a, __m128i b, __m128i c, __m128i d, __m128i e)
+{
+    __m128i outer = _mm_add_epi16(a, e);
+    __m128i inner = _mm_slli_epi16(_mm_add_epi16(b, d), 2);
+    __m128i center = _mm_add_epi16(_mm_slli_epi16(c, 2), _mm_slli_epi16(c, 1));
+    return _mm_add_epi16(_mm_add_epi16(outer, inner), center);
+}
+
+__attribute__((target("sse2"))) static void sad_pyramid_col_sse2(const uint8_t *const *rows, int channels, uint16_t *even,
+                                                                 uint16_t *odd, int n)
+{
+    int i = 0;
+    if (channels == 1)
+    {
+        // The even bytes of each 16 bit lane are the even columns
+        __m128i low = _mm_set1_epi16(0xff);
+        for (; i + 8 <= n; i += 8)
+        {
+            __m128i v[5];
+            for (int r = 0; r < 5; r++)
+            {
+                v[r] = _mm_loadu_si128((const __m128i *)(rows[r] + 2 * i));
+            }
+            __m128i e = sad_pyramid_sum_sse2(_mm_and_si128(v[0], low), _mm_and_si128(v[1], low), _mm_and_si128(v[2], low),
+                                             _mm_and_si128(v[3], low), _mm_and_si128(v[4], low));
+            __m128i o = sad_pyramid_sum_sse2(_mm_srli_epi16(v[0], 8), _mm_srli_epi16(v[1], 8), _mm_srli_epi16(v[2], 8),
+                                             _mm_srli_epi16(v[3], 8), _mm_srli_epi16(v[4], 8));
+            _mm_storeu_si128((__m128i *)(even + i), e);
+            _mm_storeu_si128((__m128i *)(odd + i), o);
+        }
+    }
+    else if (channels <= 3)
+    {
+        // Sum 16 pairs at a time in order, then split them
+        __m128i zero = _mm_setzero_si128();
+        uint16_t sums[2 * 16 * 3];
+        for (; i + 16 <= n; i += 16)
+        {
+            for (int b = 0; b < 2 * channels; b++)
+            {
+                __m128i lo[5], hi[5];
+                for (int r = 0; r < 5; r++)
+                {
+                    __m128i v = _mm_loadu_si128((const __m128i *)(rows[r] + 2 * i * channels + 16 * b));
+                    lo[r] = _mm_unpacklo_epi8(v, zero);
+                    hi[r] = _mm_unpackhi_epi8(v, zero);
+                }
+                _mm_storeu_si128((__m128i *)(sums + 16 * b), sad_pyramid_sum_sse2(lo[0], lo[1], lo[2], lo[3], lo[4]));
+                _mm_storeu_si128((__m128i *)(sums + 16 * b + 8), sad_pyramid_sum_sse2(hi[0], hi[1], hi[2], hi[3], hi[4]));
+            }
+            sad_pyramid_split(sums, channels, even + i * channels, odd + i * channels, 16);
+        }
+    }
+    const uint8_t *rest[5];
+    for (int r = 0; r < 5; r++)
+    {
+        rest[r] = rows[r] + 2 * i * channels;
+    }
+    sad_pyramid_col_scalar(rest, channels, even + i * channels, odd + i * channels, n - i);
+}
+
+__attribute__((target("sse2"))) static void sad_pyramid_row_sse2(const uint16_t *even, const uint16_t *odd, int channels,
+                                                                 uint8_t *out, int n)
+{
+    __m128i round = _mm_set1_epi16(128);
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i sums[2];
+        for (int k = 0; k < 2; k++)
+        {
+            const uint16_t *e = even + i + 8 * k;
+            const uint16_t *o = odd + i + 8 * k;
+            __m128i sum = sad_pyramid_sum_sse2(_mm_loadu_si128((const __m128i *)(e - channels)),
+                                               _mm_loadu_si128((const __m128i *)(o - channels)),
+                                               _mm_loadu_si128((const __m128i *)e), _mm_loadu_si128((const __m128i *)o),
+                                               _mm_loadu_si128((const __m128i *)(e + channels)));
+            sums[k] = _mm_srli_epi16(_mm_add_epi16(sum, round), 8);
+        }
+        _mm_storeu_si128((__m128i *)(out + i), _mm_packus_epi16(sums[0], sums[1]));
+    }
+    sad_pyramid_row_scalar(even + i, odd + i, channels, out + i, n - i);
+}
+
+// Orders unsigned 16 bit lanes without SSE4.1's min and max: with the
+// saturated a - b as d, a - d is the smaller and b + d the larger
+__attribute__((target("sse2"))) static inline void sad_sort2_sse2(__m128i *a, __m128i *b)
+{
+    __m128i d = _mm_subs_epu16(*a, *b);
+    *a = _mm_sub_epi16(*a, d);
+    *b = _mm_add_epi16(*b, d);
+}
+
+__attribute__((target("sse2"))) static void sad_median3_row_sse2(const uint16_t *above, const uint16_t *row,
+                                                                 const uint16_t *below, uint16_t *out, int n)
+{
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        const uint16_t *rows[3] = {above + i, row + i, below + i};
+        __m128i p[9];
+        for (int r = 0; r < 3; r++)
+        {
+            p[3 * r] = _mm_loadu_si128((const __m128i *)(rows[r] - 1));
+            p[3 * r + 1] = _mm_loadu_si128((const __m128i *)rows[r]);
+            p[3 * r + 2] = _mm_loadu_si128((const __m128i *)(rows[r] + 1));
+        }
+        SAD_MEDIAN9(sad_sort2_sse2, p);
+        _mm_storeu_si128((__m128i *)(out + i), p[4]);
+    }
+    sad_median3_row_scalar(above + i, row + i, below + i, out + i, n - i);
+}
+
+static const struct sad_kernels sad_kernels_sse2 = {
+    "sse2",
+    sad_supported_sse2,
+    sad_col_add_sse2,
+    sad_col_sub_sse2,
+    sad_col_update_sse2,
+    sad_row_sad_sse2,
+    sad_block_sad_sse2,
+    sad_sgm_path_sse2,
+    // SSE2 has no popcount, and not every SSE2 CPU has POPCNT
+    sad_hamming_row_scalar,
+    sad_hamming_block_scalar,
+    sad_remap_row_sse2,
+    // Nor a byte shuffle to split the RGB channels, which the remap kernel 
+    // avoids by loading whole pixels
+    sad_grey_row_scalar,
+    sad_blur_col_sse2,
+    sad_blur_row_sse2,
+    sad_half_row_sse2,
+    sad_pyramid_col_sse2,
+    sad_pyramid_row_sse2,
+    sad_median3_row_sse2,
+};
+
+// * * * * * * * * * * * * * * * * * AVX2 * * * * * * * * * * * * * * * * * * *
+
+static int sad_supported_avx2(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+}
+
+// |a - b| for 32 unsigned bytes
+__attribute__((target("avx2"))) static inline __m256i sad_absdiff_avx2(__m256i a, __m256i b)
+{
+    return _mm256_or_si256(_mm256_subs_epu8(a, b), _mm256_subs_epu8(b, a));
+}
+
+__attribute__((target("avx2"))) static void sad_col_add_avx2(uint16_t *col, const uint8_t *a, const uint8_t *b, int n)
+{
+    int i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i ad = sad_absdiff_avx2(_mm256_loadu_si256((const __m256i *)(a + i)),
+                                      _mm256_loadu_si256((const __m256i *)(b + i)));
+        __m256i lo = _mm256_loadu_si256((__m256i *)(col + i));
+        __m256i hi = _mm256_loadu_si256((__m256i *)(col + i + 16));
+        lo = _mm256_add_epi16(lo, _mm256_cvtepu8_epi16(_mm256_castsi256_si128(ad)));
+        hi = _mm256_add_epi16(hi, _mm256_cvtepu8_epi16(_mm256_extracti128_si256(ad, 1)));
+        _mm256_storeu_si256((__m256i *)(col + i), lo);
+        _mm256_storeu_si256((__m256i *)(col + i + 16), hi);
+    }
+    sad_col_add_sse2(col + i, a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void sad_col_sub_avx2(uint16_t *col, const uint8_t *a, const uint8_t *b, int n)
+{
+    int i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i ad = sad_absdiff_avx2(_mm256_loadu_si256((const __m256i *)(a + i)),
+                                      _mm256_loadu_si256((const __m256i *)(b + i)));
+        __m256i lo = _mm256_loadu_si256((__m256i *)(col + i));
+        __m256i hi = _mm256_loadu_si256((__m256i *)(col + i + 16));
+        lo = _mm256_sub_epi16(lo, _mm256_cvtepu8_epi16(_mm256_castsi256_si128(ad)));
+        hi = _mm256_sub_epi16(hi, _mm256_cvtepu8_epi16(_mm256_extracti128_si256(ad, 1)));
+        _mm256_storeu_si256((__m256i *)(col + i), lo);
+        _mm256_storeu_si256((__m256i *)(col + i + 16), hi);
+    }
+    sad_col_sub_sse2(col + i, a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void sad_col_update_avx2(uint16_t *col, const uint8_t *a_in, const uint8_t *b_in,
+                                                                const uint8_t *a_out, const uint8_t *b_out, int n)
+{
+    int i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i ad_in = sad_absdiff_avx2(_mm256_loadu_si256((const __m256i *)(a_in + i)),
+                                         _mm256_loadu_si256((const __m256i *)(b_in + i)));
+        __m256i ad_out = sad_absdiff_avx2(_mm256_loadu_si256((const __m256i *)(a_out + i)),
+                                          _mm256_loadu_si256((const __m256i *)(b_out + i)));
+        __m256i lo = _mm256_loadu_si256((__m256i *)(col + i));
+        __m256i hi = _mm256_loadu_si256((__m256i *)(col + i + 16));
+        lo = _mm256_add_epi16(lo, _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm256_castsi256_si128(ad_in)),
+                                                   _mm256_cvtepu8_epi16(_mm256_castsi256_si128(ad_out))));
+        hi = _mm256_add_epi16(hi, _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm256_extracti128_si256(ad_in, 1)),
+                                                   _mm256_cvtepu8_epi16(_mm256_extracti128_si256(ad_out, 1))));
+        _mm256_storeu_si256((__m256i *)(col + i), lo);
+        _mm256_storeu_si256((__m256i *)(col + i + 16), hi);
+    }
+    sad_col_update_sse2(col + i, a_in + i, b_in + i, a_out + i, b_out + i, n - i);
+}
+
+__attribute__((target("avx2"))) static uint32_t sad_row_sad_avx2(const uint8_t *a, const uint8_t *b, int n)
+{
+    __m256i acc = _mm256_setzero_si256();
+    int i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i *)(a + i)),
+                                                    _mm256_loadu_si256((const __m256i *)(b + i))));
+    }
+    __m128i acc_128 = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    uint32_t sum = _mm_cvtsi128_si32(acc_128) + _mm_cvtsi128_si32(_mm_srli_si128(acc_128, 8));
+    return sum + sad_row_sad_sse2(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2"))) static uint32_t sad_block_sad_avx2(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int n, int rows)
+{
+    uint32_t sum = 0;
+    for (int j = 0; j < rows; j++, a += a_stride, b += b_stride)
+    {
+        sum += sad_row_sad_avx2(a, b, n);
+    }
+    return sum;
+}
+
+__attribute__((target("avx2"))) static uint16_t sad_sgm_path_avx2(const uint16_t *cost, const uint16_t *prev, uint16_t prev_min,
+                                                                  uint16_t *cur, uint16_t *sum, int n, uint16_t p1, uint16_t p2)
+{
+    __m256i penalty = _mm256_set1_epi16(p1);
+    __m256i jump = _mm256_set1_epi16(sad_adds_u16(prev_min, p2));
+    __m256i base = _mm256_set1_epi16(prev_min);
+    __m256i cur_min = _mm256_set1_epi16(-1);
+    for (int d = 0; d < n; d += 16)
+    {
+        __m256i best = _mm256_loadu_si256((const __m256i *)(prev + d));
+        best = _mm256_min_epu16(best, _mm256_adds_epu16(_mm256_loadu_si256((const __m256i *)(prev + d - 1)), penalty));
+        best = _mm256_min_epu16(best, _mm256_adds_epu16(_mm256_loadu_si256((const __m256i *)(prev + d + 1)), penalty));
+        best = _mm256_min_epu16(best, jump);
+        __m256i value = _mm256_sub_epi16(_mm256_adds_epu16(_mm256_loadu_si256((const __m256i *)(cost + d)), best), base);
+        _mm256_storeu_si256((__m256i *)(cur + d), value);
+        _mm256_storeu_si256((__m256i *)(sum + d), _mm256_adds_epu16(_mm256_loadu_si256((const __m256i *)(sum + d)), value));
+        cur_min = _mm256_min_epu16(cur_min, value);
+    }
+    __m128i min = _mm_min_epu16(_mm256_castsi256_si128(cur_min), _mm256_extracti128_si256(cur_min, 1));
+    return (uint16_t)_mm_cvtsi128_si32(_mm_minpos_epu16(min));
+}
+
+// Hardware POPCNT, which every AVX2 CPU has. A byte shuffle popcount would need
+// a horizontal add per 64 bit descriptor, which costs more than it saves.
+__attribute__((target("avx2,popcnt"))) static void sad_hamming_row_avx2(const uint64_t *a, const uint64_t *b, uint8_t *out, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        out[i] = __builtin_popcountll(a[i] ^ b[i]);
+    }
+}
+
+__attribute__((target("avx2,popcnt"))) static uint32_t sad_hamming_block_avx2(const uint64_t *a, int a_stride, const uint64_t *b, int b_stride, int n, int rows)
+{
+    uint32_t sum = 0;
+    for (int j = 0; j < rows; j++, a += a_stride, b += b_stride)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            sum += __builtin_popcountll(a[i] ^ b[i]);
+        }
+    }
+    return sum;
+}
+
+// Blends 8 pixels of one channel. The gathers load 4 bytes starting at each
+// pixel's channel, in the top and bottom source rows, of which byte 0 is the
+// pixel and byte channels is its right neighbour.
+__attribute__((target("avx2"))) static inline __m256i sad_remap_blend_avx2(const uint8_t *src, __m256i offset, __m256i stride, __m256i valid,
+                                                                          __m256i fx, __m256i fy, int channels)
+{
+    const __m256i one = _mm256_set1_epi32(1 << REMAP_FRAC_BITS);
+    const __m256i byte = _mm256_set1_epi32(0xff);
+    __m256i zero = _mm256_setzero_si256();
+    __m256i top = _mm256_mask_i32gather_epi32(zero, (const int *)src, offset, valid, 1);
+    __m256i bottom = _mm256_mask_i32gather_epi32(zero, (const int *)src, _mm256_add_epi32(offset, stride), valid, 1);
+    __m128i shift = _mm_cvtsi32_si128(8 * channels);
+    __m256i top_mix = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_and_si256(top, byte), _mm256_sub_epi32(one, fx)),
+                                       _mm256_mullo_epi32(_mm256_and_si256(_mm256_srl_epi32(top, shift), byte), fx));
+    __m256i bottom_mix = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_and_si256(bottom, byte), _mm256_sub_epi32(one, fx)),
+                                          _mm256_mullo_epi32(_mm256_and_si256(_mm256_srl_epi32(bottom, shift), byte), fx));
+    __m256i sum = _mm256_add_epi32(_mm256_mullo_epi32(top_mix, _mm256_sub_epi32(one, fy)), _mm256_mullo_epi32(bottom_mix, fy));
+    sum = _mm256_add_epi32(sum, _mm256_set1_epi32(1 << (2 * REMAP_FRAC_BITS - 1)));
+    return _mm256_srli_epi32(sum, 2 * REMAP_FRAC_BITS);
+}
+
+// Packs 8 values below 256 into the low 8 bytes.
+__attribute__((target("avx2"))) static inline __m128i sad_remap_pack_avx2(__m256i v)
+{
+    __m128i words = _mm_packus_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    return _mm_packus_epi16(words, words);
+}
+
+__attribute__((target("avx2"))) static void sad_remap_row_avx2(const uint8_t *src, int stride, int channels, const int16_t *xy, const uint16_t *frac,
+                                                               uint8_t *out, int n)
+{
+    __m256i stride_v = _mm256_set1_epi32(stride);
+    __m256i channels_v = _mm256_set1_epi32(channels);
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256i coords = _mm256_loadu_si256((const __m256i *)(xy + 2 * i));
+        __m256i x = _mm256_srai_epi32(_mm256_slli_epi32(coords, 16), 16);
+        __m256i y = _mm256_srai_epi32(coords, 16);
+        __m256i valid = _mm256_cmpgt_epi32(x, _mm256_set1_epi32(-1));
+        __m256i offset = _mm256_add_epi32(_mm256_mullo_epi32(y, stride_v), _mm256_mullo_epi32(x, channels_v));
+        offset = _mm256_and_si256(offset, valid);
+        __m256i weights = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(frac + i)));
+        __m256i fx = _mm256_and_si256(weights, _mm256_set1_epi32(0xff));
+        __m256i fy = _mm256_srli_epi32(weights, 8);
+        if (channels == 1)
+        {
+            __m128i value = sad_remap_pack_avx2(sad_remap_blend_avx2(src, offset, stride_v, valid, fx, fy, 1));
+            _mm_storel_epi64((__m128i *)(out + i), value);
+        }
+        else
+        {
+            // Interleave the three channel vectors back into pixels
+            uint8_t planes[3][16];
+            for (int c = 0; c < 3; c++)
+            {
+                __m256i channel_offset = _mm256_add_epi32(offset, _mm256_set1_epi32(c));
+                _mm_storeu_si128((__m128i *)planes[c], sad_remap_pack_avx2(sad_remap_blend_avx2(src, channel_offset, stride_v, valid, fx, fy, 3)));
+            }
+            for (int k = 0; k < 8; k++)
+            {
+                out[3 * (i + k)] = planes[0][k];
+                out[3 * (i + k) + 1] = planes[1][k];
+                out[3 * (i + k) + 2] = planes[2][k];
+            }
+        }
+    }
+    sad_remap_row_scalar(src, stride, channels, xy + 2 * i, frac + i, out + i * channels, n - i);
+}
+
+// Splits 8 RGB pixels, 24 bytes from lo (bytes 0-15) and hi (bytes 8-23),
+// into their 16 bit r + g + b sums
+__attribute__((target("avx2"))) static inline __m128i sad_rgb_sum_avx2(__m128i lo, __m128i hi)
+{
+    // Pixels 0-4 are in lo, pixels 5-7 at bytes 7-15 of hi
+    __m128i sum = _mm_setzero_si128();
+    for (int c = 0; c < 3; c++)
+    {
+        __m128i lo_mask = _mm_setr_epi8(c, -1, 3 + c, -1, 6 + c, -1, 9 + c, -1, 12 + c, -1, -1, -1, -1, -1, -1, -1);
+        __m128i hi_mask = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 7 + c, -1, 10 + c, -1, 13 + c, -1);
+        sum = _mm_add_epi16(sum, _mm_or_si128(_mm_shuffle_epi8(lo, lo_mask), _mm_shuffle_epi8(hi, hi_mask)));
+    }
+    return sum;
+}
+
+__attribute__((target("avx2"))) static void sad_grey_row_avx2(const uint8_t *rgb, uint8_t *out, int n)
+{
+    // x / 3 is (x * 21846) >> 16 for x up to 765
+    __m128i third = _mm_set1_epi16(21846);
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        const uint8_t *p = rgb + 3 * i;
+        __m128i first = sad_rgb_sum_avx2(_mm_loadu_si128((const __m128i *)p), _mm_loadu_si128((const __m128i *)(p + 8)));
+        __m128i second = sad_rgb_sum_avx2(_mm_loadu_si128((const __m128i *)(p + 24)), _mm_loadu_si128((const __m128i *)(p + 32)));
+        _mm_storeu_si128((__m128i *)(out + i), _mm_packus_epi16(_mm_mulhi_epu16(first, third), _mm_mulhi_epu16(second, third)));
+    }
+    sad_grey_row_scalar(rgb + 3 * i, out + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void sad_blur_col_avx2(const uint8_t *above, const uint8_t *row, const uint8_t *below,
+                                                              uint16_t *out, int n)
+{
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m256i a = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(above + i)));
+        __m256i r = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(row + i)));
+        __m256i b = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(below + i)));
+        _mm256_storeu_si256((__m256i *)(out + i), _mm256_add_epi16(_mm256_add_epi16(a, b), _mm256_slli_epi16(r, 3)));
+    }
+    sad_blur_col_scalar(above + i, row + i, below + i, out + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void sad_blur_row_avx2(const uint16_t *v, int channels, uint8_t *out, int n)
+{
+    __m256i factor = _mm256_set1_epi16(5243);
+    int i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i sums[2];
+        for (int k = 0; k < 2; k++)
+        {
+            const uint16_t *p = v + i + 16 * k;
+            __m256i side = _mm256_add_epi16(_mm256_loadu_si256((const __m256i *)(p - channels)),
+                                            _mm256_loadu_si256((const __m256i *)(p + channels)));
+            __m256i sum = _mm256_add_epi16(side, _mm256_slli_epi16(_mm256_loadu_si256((const __m256i *)p), 3));
+            sums[k] = _mm256_srli_epi16(_mm256_mulhi_epu16(sum, factor), 3);
+        }
+        // packus works within 128 bit lanes, put the lanes back in order
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(sums[0], sums[1]), 0xd8);
+        _mm256_storeu_si256((__m256i *)(out + i), packed);
+    }
+    _mm256_zeroupper();
+    sad_blur_row_sse2(v + i, channels, out + i, n - i);
+}
+
+// 1 4 6 4 1 sum of five vectors of 16 bit lanes
+__attribute__((target("avx2"))) static inline __m256i sad_pyramid_sum_avx2(__m256i a, __m256i b, __m256i c, __m256i d, __m256i e)
+{
+    __m256i outer = _mm256_add_epi16(a, e);
+    __m256i inner = _mm256_slli_epi16(_mm256_add_epi16(b, d), 2);
+    __m256i center = _mm256_add_epi16(_mm256_slli_epi16(c, 2), _mm256_slli_epi16(c, 1));
+    return _mm256_add_epi16(_mm256_add_epi16(outer, inner), center);
+}
+
+__attribute__((target("avx2"))) static void sad_pyramid_col_avx2(const uint8_t *const *rows, int channels, uint16_t *even,
+                                                                 uint16_t *odd, int n)
+{
+    int i = 0;
+    if (channels == 1)
+    {
+        __m256i low = _mm256_set1_epi16(0xff);
+        for (; i + 16 <= n; i += 16)
+        {
+            __m256i v[5];
+            for (int r = 0; r < 5; r++)
+            {
+                v[r] = _mm256_loadu_si256((const __m256i *)(rows[r] + 2 * i));
+            }
+            __m256i e = sad_pyramid_sum_avx2(_mm256_and_si256(v[0], low), _mm256_and_si256(v[1], low),
+                                             _mm256_and_si256(v[2], low), _mm256_and_si256(v[3], low),
+                                             _mm256_and_si256(v[4], low));
+            __m256i o = sad_pyramid_sum_avx2(_mm256_srli_epi16(v[0], 8), _mm256_srli_epi16(v[1], 8),
+                                             _mm256_srli_epi16(v[2], 8), _mm256_srli_epi16(v[3], 8),
+                                             _mm256_srli_epi16(v[4], 8));
+            _mm256_storeu_si256((__m256i *)(even + i), e);
+            _mm256_storeu_si256((__m256i *)(odd + i), o);
+        }
+    }
+    else if (channels <= 3)
+    {
+        // Sum 16 pairs at a time in order, then split them
+        uint16_t sums[2 * 16 * 3];
+        for (; i + 16 <= n; i += 16)
+        {
+            for (int b = 0; b < 2 * channels; b++)
+            {
+                __m256i v[5];
+                for (int r = 0; r < 5; r++)
+                {
+                    v[r] = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(rows[r] + 2 * i * channels + 16 * b)));
+                }
+                _mm256_storeu_si256((__m256i *)(sums + 16 * b), sad_pyramid_sum_avx2(v[0], v[1], v[2], v[3], v[4]));
+            }
+            sad_pyramid_split(sums, channels, even + i * channels, odd + i * channels, 16);
+        }
+    }
+    const uint8_t *rest[5];
+    for (int r = 0; r < 5; r++)
+    {
+        rest[r] = rows[r] + 2 * i * channels;
+    }
+    _mm256_zeroupper();
+    sad_pyramid_col_sse2(rest, channels, even + i * channels, odd + i * channels, n - i);
+}
+
+__attribute__((target("avx2"))) static void sad_pyramid_row_avx2(const uint16_t *even, const uint16_t *odd, int channels,
+                                                                 uint8_t *out, int n)
+{
+    __m256i round = _mm256_set1_epi16(128);
+    int i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i sums[2];
+        for (int k = 0; k < 2; k++)
+        {
+            const uint16_t *e = even + i + 16 * k;
+            const uint16_t *o = odd + i + 16 * k;
+            __m256i sum = sad_pyramid_sum_avx2(_mm256_loadu_si256((const __m256i *)(e - channels)),
+                                               _mm256_loadu_si256((const __m256i *)(o - channels)),
+                                               _mm256_loadu_si256((const __m256i *)e),
+                                               _mm256_loadu_si256((const __m256i *)o),
+                                               _mm256_loadu_si256((const __m256i *)(e + channels)));
+            sums[k] = _mm256_srli_epi16(_mm256_add_epi16(sum, round), 8);
+        }
+        // packus works within 128 bit lanes, put the lanes back in order
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(sums[0], sums[1]), 0xd8);
+        _mm256_storeu_si256((__m256i *)(out + i), packed);
+    }
+    _mm256_zeroupper();
+    sad_pyramid_row_sse2(even + i, odd + i, channels, out + i, n - i);
+}
+
+__attribute__((target("avx2"))) static inline void sad_sort2_avx2(__m256i *a, __m256i *b)
+{
+    __m256i lo = _mm256_min_epu16(*a, *b);
+    *b = _mm256_max_epu16(*a, *b);
+    *a = lo;
+}
+
+__attribute__((target("avx2"))) static void sad_median3_row_avx2(const uint16_t *above, const uint16_t *row,
+                                                                 const uint16_t *below, uint16_t *out, int n)
+{
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        const uint16_t *rows[3] = {above + i, row + i, below + i};
+        __m256i p[9];
+        for (int r = 0; r < 3; r++)
+        {
+            p[3 * r] = _mm256_loadu_si256((const __m256i *)(rows[r] - 1));
+            p[3 * r + 1] = _mm256_loadu_si256((const __m256i *)rows[r]);
+            p[3 * r + 2] = _mm256_loadu_si256((const __m256i *)(rows[r] + 1));
+        }
+        SAD_MEDIAN9(sad_sort2_avx2, p);
+        _mm256_storeu_si256((__m256i *)(out + i), p[4]);
+    }
+    _mm256_zeroupper();
+    sad_median3_row_sse2(above + i, row + i, below + i, out + i, n - i);
+}
+
+static const struct sad_kernels sad_kernels_avx2 = {
+    "avx2",
+    sad_supported_avx2,
+    sad_col_add_avx2,
+    sad_col_sub_avx2,
+    sad_col_update_avx2,
+    sad_row_sad_avx2,
+    sad_block_sad_avx2,
+    sad_sgm_path_avx2,
+    sad_hamming_row_avx2,
+    sad_hamming_block_avx2,
+    sad_remap_row_avx2,
+    sad_grey_row_avx2,
+    sad_blur_col_avx2,
+    sad_blur_row_avx2,
+    // Memory bound, SSE2 keeps up
+    sad_half_row_sse2,
+    sad_pyramid_col_avx2,
+    sad_pyramid_row_avx2,
+    sad_median3_row_avx2,
+};
+#endif
+
+#ifdef SAD_KERNELS_NEON
+// * * * * * * * * * * * * * * * * * NEON * * * * * * * * * * * * * * * * * * *
+
+// NEON is only compiled in when the target guarantees it (always on aarch64,
+// -mfpu=neon on 32 bit ARM), at which point the compiler may use it anywhere.
+static int sad_supported_neon(void)
+{
+    return 1;
+}
+
+static void sad_col_add_neon(uint16_t *col, const uint8_t *a, const uint8_t *b, int n)
+{
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        uint8x16_t ad = vabdq_u8(vld1q_u8(a + i), vld1q_u8(b + i));
+        vst1q_u16(col + i, vaddw_u8(vld1q_u16(col + i), vget_low_u8(ad)));
+        vst1q_u16(col + i + 8, vaddw_u8(vld1q_u16(col + i + 8), vget_high_u8(ad)));
+    }
+    sad_col_add_scalar(col + i, a + i, b + i, n - i);
+}
+
+static void sad_col_sub_neon(uint16_t *col, const uint8_t *a, const uint8_t *b, int n)
+{
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        uint8x16_t ad = vabdq_u8(vld1q_u8(a + i), vld1q_u8(b + i));
+        vst1q_u16(col + i, vsubw_u8(vld1q_u16(col + i), vget_low_u8(ad)));
+        vst1q_u16(col + i + 8, vsubw_u8(vld1q_u16(col + i + 8), vget_high_u8(ad)));
+    }
+    sad_col_sub_scalar(col + i, a + i, b + i, n - i);
+}
+
+static void sad_col_update_neon(uint16_t *col, const uint8_t *a_in, const uint8_t *b_in,
+                                const uint8_t *a_out, const uint8_t *b_out, int n)
+{
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        uint8x16_t ad_in = vabdq_u8(vld1q_u8(a_in + i), vld1q_u8(b_in + i));
+        uint8x16_t ad_out = vabdq_u8(vld1q_u8(a_out + i), vld1q_u8(b_out + i));
+        uint16x8_t lo = vaddw_u8(vld1q_u16(col + i), vget_low_u8(ad_in));
+        uint16x8_t hi = vaddw_u8(vld1q_u16(col + i + 8), vget_high_u8(ad_in));
+        vst1q_u16(col + i, vsubw_u8(lo, vget_low_u8(ad_out)));
+        vst1q_u16(col + i + 8, vsubw_u8(hi, vget_high_u8(ad_out)));
+    }
+    sad_col_update_scalar(col + i, a_in + i, b_in + i, a_out + i, b_out + i, n - i);
+}
+
+static uint32_t sad_row_sad_neon(const uint8_t *a, const uint8_t *b, int n)
+{
+    uint32x4_t acc = vdupq_n_u32(0);
+    int i = 0;
+    while (i + 16 <= n)
+    {
+        // Each pass adds at most 2 * 255 to a 16 bit lane, so flush to the 32
+        // bit accumulator well before it can overflow
+        uint16x8_t acc_16 = vdupq_n_u16(0);
+        for (int pass = 0; pass < 64 && i + 16 <= n; pass++, i += 16)
+        {
+            acc_16 = vpadalq_u8(acc_16, vabdq_u8(vld1q_u8(a + i), vld1q_u8(b + i)));
+        }
+        acc = vpadalq_u16(acc, acc_16);
+    }
+    uint32_t sum = vgetq_lane_u32(acc, 0) + vgetq_lane_u32(acc, 1) + vgetq_lane_u32(acc, 2) + vgetq_lane_u32(acc, 3);
+    return sum + sad_row_sad_scalar(a + i, b + i, n - i);
+}
+
+static uint32_t sad_block_sad_neon(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int n, int rows)
+{
+    uint32_t sum = 0;
+    for (int j = 0; j < rows; j++, a += a_stride, b += b_stride)
+    {
+        sum += sad_row_sad_neon(a, b, n);
+    }
+    return sum;
+}
+
+static uint16_t sad_sgm_path_neon(const uint16_t *cost, const uint16_t *prev, uint16_t prev_min,
+                                  uint16_t *cur, uint16_t *sum, int n, uint16_t p1, uint16_t p2)
+{
+    uint16x8_t penalty = vdupq_n_u16(p1);
+    uint16x8_t jump = vdupq_n_u16(sad_adds_u16(prev_min, p2));
+    uint16x8_t base = vdupq_n_u16(prev_min);
+    uint16x8_t cur_min = vdupq_n_u16(0xffff);
+    for (int d = 0; d < n; d += 8)
+    {
+        uint16x8_t best = vld1q_u16(prev + d);
+        best = vminq_u16(best, vqaddq_u16(vld1q_u16(prev + d - 1), penalty));
+        best = vminq_u16(best, vqaddq_u16(vld1q_u16(prev + d + 1), penalty));
+        best = vminq_u16(best, jump);
+        uint16x8_t value = vsubq_u16(vqaddq_u16(vld1q_u16(cost + d), best), base);
+        vst1q_u16(cur + d, value);
+        vst1q_u16(sum + d, vqaddq_u16(vld1q_u16(sum + d), value));
+        cur_min = vminq_u16(cur_min, value);
+    }
+#ifdef __aarch64__
+    return vminvq_u16(cur_min);
+#else
+    uint16x4_t min = vpmin_u16(vget_low_u16(cur_min), vget_high_u16(cur_min));
+    min = vpmin_u16(min, min);
+    min = vpmin_u16(min, min);
+    return vget_lane_u16(min, 0);
+#endif
+}
+
+// vcnt counts the bits of every byte, pairwise adds widen them to one count
+// per 64 bit descriptor
+static void sad_hamming_row_neon(const uint64_t *a, const uint64_t *b, uint8_t *out, int n)
+{
+    int i = 0;
+    for (; i + 2 <= n; i += 2)
+    {
+        uint8x16_t bits = vcntq_u8(veorq_u8(vreinterpretq_u8_u64(vld1q_u64(a + i)), vreinterpretq_u8_u64(vld1q_u64(b + i))));
+        uint64x2_t count = vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(bits)));
+        out[i] = vgetq_lane_u64(count, 0);
+        out[i + 1] = vgetq_lane_u64(count, 1);
+    }
+    sad_hamming_row_scalar(a + i, b + i, out + i, n - i);
+}
+
+static uint32_t sad_hamming_block_neon(const uint64_t *a, int a_stride, const uint64_t *b, int b_stride, int n, int rows)
+{
+    uint32_t sum = 0;
+    for (int j = 0; j < rows; j++, a += a_stride, b += b_stride)
+    {
+        uint16x8_t acc = vdupq_n_u16(0);
+        int i = 0;
+        for (; i + 2 <= n; i += 2)
+        {
+            acc = vpadalq_u8(acc, vcntq_u8(veorq_u8(vreinterpretq_u8_u64(vld1q_u64(a + i)), vreinterpretq_u8_u64(vld1q_u64(b + i)))));
+        }
+        uint64x2_t total = vpaddlq_u32(vpaddlq_u16(acc));
+        sum += vgetq_lane_u64(total, 0) + vgetq_lane_u64(total, 1);
+        sum += sad_hamming_block_scalar(a + i, 0, b + i, 0, n - i, 1);
+    }
+    return sum;
+}
+
+// Blends 8 values from their source bytes in the left and right column of the
+// top and bottom rows, by their 8 bit weights fx and fy. The vertical blend 
+// needs 32 bits, vrshrn rounds like the scalar kernel.
+static inline uint8x8_t sad_remap_blend_neon(uint8x8_t left_top, uint8x8_t right_top, uint8x8_t left_bottom,
+                                             uint8x8_t right_bottom, uint8x8_t fx, uint8x8_t fy)
+{
+    uint8x8_t one = vdup_n_u8(1 << REMAP_FRAC_BITS);
+    uint16x8_t top = vmlal_u8(vmull_u8(left_top, vsub_u8(one, fx)), right_top, fx);
+    uint16x8_t bottom = vmlal_u8(vmull_u8(left_bottom, vsub_u8(one, fx)), right_bottom, fx);
+    uint16x8_t wy = vmovl_u8(fy);
+    uint16x8_t wy_inv = vmovl_u8(vsub_u8(one, fy));
+    uint32x4_t lo = vmlal_u16(vmull_u16(vget_low_u16(top), vget_low_u16(wy_inv)), vget_low_u16(bottom), vget_low_u16(wy));
+    uint32x4_t hi = vmlal_u16(vmull_u16(vget_high_u16(top), vget_high_u16(wy_inv)), vget_high_u16(bottom), vget_high_u16(wy));
+    return vmovn_u16(vcombine_u16(vrshrn_n_u32(lo, 2 * REMAP_FRAC_BITS), vrshrn_n_u32(hi, 2 * REMAP_FRAC_BITS)));
+}
+
+// Vector of 4 words put together in general purpose registers, as storing
+// them and loading the vector would stall on the stores
+static inline uint8x16_t sad_remap_lanes_neon(const uint32_t *words)
+{
+    uint32x4_t v = vdupq_n_u32(words[0]);
+    v = vsetq_lane_u32(words[1], v, 1);
+    v = vsetq_lane_u32(words[2], v, 2);
+    v = vsetq_lane_u32(words[3], v, 3);
+    return vreinterpretq_u8_u32(v);
+}
+
+// Each pixel's 2x2 block is fetched with scalar loads, the blends run 8 
+// values at a time
+static void sad_remap_row_neon(const uint8_t *src, int stride, int channels, const int16_t *xy, const uint16_t *frac,
+                               uint8_t *out, int n)
+{
+    const uint8_t *rows[2];
+    int i = 0;
+    if (channels == 1)
+    {
+        for (; i + 8 <= n; i += 8)
+        {
+            // A pixel in the low byte and its right neighbour in the high byte
+            // of each 16 bit lane
+            uint32_t pairs[2][4] = {{0}};
+            for (int k = 0; k < 8; k++)
+            {
+                uint16_t top, bottom;
+                sad_remap_rows(src, stride, 1, xy, i + k, rows);
+                memcpy(&top, rows[0], 2);
+                memcpy(&bottom, rows[1], 2);
+                pairs[0][k / 2] |= (uint32_t)top << (16 * (k % 2));
+                pairs[1][k / 2] |= (uint32_t)bottom << (16 * (k % 2));
+            }
+            uint16x8_t top = vreinterpretq_u16_u8(sad_remap_lanes_neon(pairs[0]));
+            uint16x8_t bottom = vreinterpretq_u16_u8(sad_remap_lanes_neon(pairs[1]));
+            uint16x8_t weights = vld1q_u16(frac + i);
+            vst1_u8(out + i, sad_remap_blend_neon(vmovn_u16(top), vshrn_n_u16(top, 8), vmovn_u16(bottom),
+                                                  vshrn_n_u16(bottom, 8), vmovn_u16(weights), vshrn_n_u16(weights, 8)));
+        }
+    }
+    else
+    {
+        for (; i + 4 <= n; i += 4)
+        {
+            // A pixel's 3 channels and a spare byte per 32 bit lane, for the
+            // left and right column of the top and bottom rows. The right
+            // column is loaded from the left one's last channel and shifted
+            // down a byte (little endian), so RGB sources are never read past
+            // the block.
+            uint32_t words[4][4];
+            for (int k = 0; k < 4; k++)
+            {
+                sad_remap_rows(src, stride, 3, xy, i + k, rows);
+                memcpy(&words[0][k], rows[0], 4);
+                memcpy(&words[1][k], rows[0] + 2, 4);
+                memcpy(&words[2][k], rows[1], 4);
+                memcpy(&words[3][k], rows[1] + 2, 4);
+                words[1][k] >>= 8;
+                words[3][k] >>= 8;
+            }
+            uint8x16_t left_top = sad_remap_lanes_neon(words[0]);
+            uint8x16_t right_top = sad_remap_lanes_neon(words[1]);
+            uint8x16_t left_bottom = sad_remap_lanes_neon(words[2]);
+            uint8x16_t right_bottom = sad_remap_lanes_neon(words[3]);
+            // Each pixel's weights repeated over its 4 bytes
+            uint16x4_t weights = vld1_u16(frac + i);
+            uint8x16_t fx = vreinterpretq_u8_u32(vmulq_n_u32(vmovl_u16(vand_u16(weights, vdup_n_u16(0xff))), 0x01010101));
+            uint8x16_t fy = vreinterpretq_u8_u32(vmulq_n_u32(vmovl_u16(vshr_n_u16(weights, 8)), 0x01010101));
+            uint8x8_t lo = sad_remap_blend_neon(vget_low_u8(left_top), vget_low_u8(right_top), vget_low_u8(left_bottom),
+                                                vget_low_u8(right_bottom), vget_low_u8(fx), vget_low_u8(fy));
+            uint8x8_t hi = sad_remap_blend_neon(vget_high_u8(left_top), vget_high_u8(right_top), vget_high_u8(left_bottom),
+                                                vget_high_u8(right_bottom), vget_high_u8(fx), vget_high_u8(fy));
+            uint8_t pixels[16];
+            vst1q_u8(pixels, vcombine_u8(lo, hi));
+            for (int k = 0; k < 4; k++)
+            {
+                memcpy(out + 3 * (i + k), pixels + 4 * k, 3);
+            }
+        }
+    }
+    sad_remap_row_scalar(src, stride, channels, xy + 2 * i, frac + i, out + i * channels, n - i);
+}
+
+static void sad_grey_row_neon(const uint8_t *rgb, uint8_t *out, int n)
+{
+    // x / 3 is (x * 21846) >> 16 for x up to 765
+    uint16x4_t third = vdup_n_u16(21846);
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        uint8x16x3_t px = vld3q_u8(rgb + 3 * i);
+        uint16x8_t lo = vaddw_u8(vaddl_u8(vget_low_u8(px.val[0]), vget_low_u8(px.val[1])), vget_low_u8(px.val[2]));
+        uint16x8_t hi = vaddw_u8(vaddl_u8(vget_high_u8(px.val[0]), vget_high_u8(px.val[1])), vget_high_u8(px.val[2]));
+        uint16x8_t lo_third = vcombine_u16(vshrn_n_u32(vmull_u16(vget_low_u16(lo), third), 16),
+                                           vshrn_n_u32(vmull_u16(vget_high_u16(lo), third), 16));
+        uint16x8_t hi_third = vcombine_u16(vshrn_n_u32(vmull_u16(vget_low_u16(hi), third), 16),
+                                           vshrn_n_u32(vmull_u16(vget_high_u16(hi), third), 16));
+        vst1q_u8(out + i, vcombine_u8(vmovn_u16(lo_third), vmovn_u16(hi_third)));
+    }
+    sad_grey_row_scalar(rgb + 3 * i, out + i, n - i);
+}
+
+static void sad_blur_col_neon(const uint8_t *above, const uint8_t *row, const uint8_t *below, uint16_t *out, int n)
+{
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        uint8x16_t a = vld1q_u8(above + i);
+        uint8x16_t r = vld1q_u8(row + i);
+        uint8x16_t b = vld1q_u8(below + i);
+        uint16x8_t lo = vaddq_u16(vaddl_u8(vget_low_u8(a), vget_low_u8(b)), vshll_n_u8(vget_low_u8(r), 3));
+        uint16x8_t hi = vaddq_u16(vaddl_u8(vget_high_u8(a), vget_high_u8(b)), vshll_n_u8(vget_high_u8(r), 3));
+        vst1q_u16(out + i, lo);
+        vst1q_u16(out + i + 8, hi);
+    }
+    sad_blur_col_scalar(above + i, row + i, below + i, out + i, n - i);
+}
+
+static void sad_blur_row_neon(const uint16_t *v, int channels, uint8_t *out, int n)
+{
+    // x / 100 is (x * 5243) >> 19 up to 43698
+    uint16x4_t factor = vdup_n_u16(5243);
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        const uint16_t *p = v + i;
+        uint16x8_t sum = vaddq_u16(vaddq_u16(vld1q_u16(p - channels), vld1q_u16(p + channels)), vshlq_n_u16(vld1q_u16(p), 3));
+        uint16x8_t scaled = vcombine_u16(vshrn_n_u32(vmull_u16(vget_low_u16(sum), factor), 16),
+                                         vshrn_n_u32(vmull_u16(vget_high_u16(sum), factor), 16));
+        vst1_u8(out + i, vmovn_u16(vshrq_n_u16(scaled, 3)));
+    }
+    sad_blur_row_scalar(v + i, channels, out + i, n - i);
+}
+
+static void sad_half_row_neon(const uint8_t *a, const uint8_t *b, int channels, uint8_t *out, int n)
+{
+    int i = 0;
+    if (channels == 1)
+    {
+        // vld2 splits the left and right pixels of the blocks
+        for (; i + 16 <= n; i += 16)
+        {
+            uint8x16x2_t va = vld2q_u8(a + 2 * i);
+            uint8x16x2_t vb = vld2q_u8(b + 2 * i);
+            uint16x8_t lo = vaddq_u16(vaddl_u8(vget_low_u8(va.val[0]), vget_low_u8(va.val[1])),
+                                      vaddl_u8(vget_low_u8(vb.val[0]), vget_low_u8(vb.val[1])));
+            uint16x8_t hi = vaddq_u16(vaddl_u8(vget_high_u8(va.val[0]), vget_high_u8(va.val[1])),
+                                      vaddl_u8(vget_high_u8(vb.val[0]), vget_high_u8(vb.val[1])));
+            vst1q_u8(out + i, vcombine_u8(vshrn_n_u16(lo, 2), vshrn_n_u16(hi, 2)));
+        }
+    }
+    sad_half_row_scalar(a + 2 * i * channels, b + 2 * i * channels, channels, out + i * channels, n - i);
+}
+
+static void sad_pyramid_col_neon(const uint8_t *const *rows, int channels, uint16_t *even, uint16_t *odd, int n)
+{
+    int i = 0;
+    if (channels == 1)
+    {
+        // vld2 splits the even and odd columns
+        for (; i + 16 <= n; i += 16)
+        {
+            uint16x8_t sum[2][2];
+            for (int r = 0; r < 5; r++)
+            {
+                static const uint8_t weight[5] = {1, 4, 6, 4, 1};
+                uint8x8_t w = vdup_n_u8(weight[r]);
+                uint8x16x2_t v = vld2q_u8(rows[r] + 2 * i);
+                for (int k = 0; k < 2; k++)
+                {
+                    if (r == 0)
+                    {
+                        sum[k][0] = vmovl_u8(vget_low_u8(v.val[k]));
+                        sum[k][1] = vmovl_u8(vget_high_u8(v.val[k]));
+                    }
+                    else
+                    {
+                        sum[k][0] = vmlal_u8(sum[k][0], vget_low_u8(v.val[k]), w);
+                        sum[k][1] = vmlal_u8(sum[k][1], vget_high_u8(v.val[k]), w);
+                    }
+                }
+            }
+            vst1q_u16(even + i, sum[0][0]);
+            vst1q_u16(even + i + 8, sum[0][1]);
+            vst1q_u16(odd + i, sum[1][0]);
+            vst1q_u16(odd + i + 8, sum[1][1]);
+        }
+    }
+    const uint8_t *rest[5];
+    for (int r = 0; r < 5; r++)
+    {
+        rest[r] = rows[r] + 2 * i * channels;
+    }
+    sad_pyramid_col_scalar(rest, channels, even + i * channels, odd + i * channels, n - i);
+}
+
+static void sad_pyramid_row_neon(const uint16_t *even, const uint16_t *odd, int channels, uint8_t *out, int n)
+{
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        const uint16_t *e = even + i;
+        const uint16_t *o = odd + i;
+        uint16x8_t sum = vaddq_u16(vld1q_u16(e - channels), vld1q_u16(e + channels));
+        sum = vaddq_u16(sum, vshlq_n_u16(vaddq_u16(vld1q_u16(o - channels), vld1q_u16(o)), 2));
+        sum = vmlaq_n_u16(sum, vld1q_u16(e), 6);
+        // Rounding narrow, (sum + 128) >> 8 without overflowing
+        vst1_u8(out + i, vrshrn_n_u16(sum, 8));
+    }
+    sad_pyramid_row_scalar(even + i, odd + i, channels, out + i, n - i);
+}
+
+static inline void sad_sort2_neon(uint16x8_t *a, uint16x8_t *b)
+{
+    uint16x8_t lo = vminq_u16(*a, *b);
+    *b = vmaxq_u16(*a, *b);
+    *a = lo;
+}
+
+static void sad_median3_row_neon(const uint16_t *above, const uint16_t *row, const uint16_t *below, uint16_t *out,
+                                 int n)
+{
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        const uint16_t *rows[3] = {above + i, row + i, below + i};
+        uint16x8_t p[9];
+        for (int r = 0; r < 3; r++)
+        {
+            p[3 * r] = vld1q_u16(rows[r] - 1);
+            p[3 * r + 1] = vld1q_u16(rows[r]);
+            p[3 * r + 2] = vld1q_u16(rows[r] + 1);
+        }
+        SAD_MEDIAN9(sad_sort2_neon, p);
+        vst1q_u16(out + i, p[4]);
+    }
+    sad_median3_row_scalar(above + i, row + i, below + i, out + i, n - i);
+}
+
+static const struct sad_kernels sad_kernels_neon = {
+    "neon",
+    sad_supported_neon,
+    sad_col_add_neon,
+    sad_col_sub_neon,
+    sad_col_update_neon,
+    sad_row_sad_neon,
+    sad_block_sad_neon,
+    sad_sgm_path_neon,
+    sad_hamming_row_neon,
+    sad_hamming_block_neon,
+    sad_remap_row_neon,
+    sad_grey_row_neon,
+    sad_blur_col_neon,
+    sad_blur_row_neon,
+    sad_half_row_neon,
+    sad_pyramid_col_neon,
+    sad_pyramid_row_neon,
+    sad_median3_row_neon,
+};
+#endif
+
+// Every kernel set compiled in, fastest first
+static const struct sad_kernels *sad_kernels_all[] = {
+#ifdef SAD_KERNELS_X86
+    &sad_kernels_avx2,
+    &sad_kernels_sse2,
+#endif
+#ifdef SAD_KERNELS_NEON
+    &sad_kernels_neon,
+#endif
+    &sad_kernels_scalar,
+    NULL,
+};
+
+// Kernels currently used for matching, NULL until first use
+static const struct sad_kernels *sad_kernels_active = NULL;
+
+// Returns the active kernels, picking the fastest supported set on first use.
+static const struct sad_kernels *sad_kernels_get(void)
+{
+    if (!sad_kernels_active)
+    {
+        for (int i = 0; sad_kernels_all[i]; i++)
+        {
+            if (sad_kernels_all[i]->supported())
+            {
+                sad_kernels_active = sad_kernels_all[i];
+                break;
+            }
+        }
+    }
+    return sad_kernels_active;
+}
+
+// Forces the kernel set with the given name, NULL picks the fastest supported
+// set again. Returns 0 if the set isn't compiled in or isn't supported by
+// this CPU.
+int sad_kernels_use(const char *name)
+{
+    if (!name)
+    {
+        sad_kernels_active = NULL;
+        sad_kernels_get();
+        return 1;
+    }
+    for (int i = 0; sad_kernels_all[i]; i++)
+    {
+        if (strcmp(sad_kernels_all[i]->name, name) == 0 && sad_kernels_all[i]->supported())
+        {
+            sad_kernels_active = sad_kernels_all[i];
+            return 1;
+        }
+    }
+    return 0;
+}
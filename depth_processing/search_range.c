@@ -0,0 +1,283 @@
+// Tile-adaptive search ranges. block_match() tests every disparity up to
+// search_len at every pixel, although a scene only spans part of that range and
+// any one region of it far less. A pre-pass block matches the images at a
+// quarter of the resolution over the whole range, which costs a few percent of
+// the full match, and each tile of the full resolution image then only searches
+// the disparities found in and around it there, with a margin for the coarse
+// matches' error.
+//
+// Pixels whose best match falls outside their tile's range get the best one
+// inside it instead, so a too narrow range costs accuracy. The ranges span
+// the coarse disparities of a halo around each tile as well, so objects
+// crossing into the tile are covered.
+
+// Width and height of the tiles in full resolution pixels
+#define SEARCH_RANGE_TILE 64
+// Pyramid level the pre-pass matches, 2 is a quarter of the resolution
+#define SEARCH_RANGE_LEVEL 2
+// Coarse pixels around a tile whose disparities its range covers
+#define SEARCH_RANGE_HALO 2
+// Coarse disparities added to either end of a tile's range
+#define SEARCH_RANGE_MARGIN 1
+
+struct search_ranges
+{
+    int width;
+    int height;
+    int search_len;
+    int tiles_x;
+    int tiles_y;
+    // Disparity range of each tile, in row-major order
+    uint16_t *d_min;
+    uint16_t *d_max;
+    // Pre-pass images and disparity map
+    struct image_pyramid left;
+    struct image_pyramid right;
+    struct disparity_map coarse;
+};
+
+// Sets up the ranges of images of the given size and channels, searched up to
+// search_len. Every tile starts with the whole range.
+void search_ranges_init(struct search_ranges *sr, int width, int height, int channels, int search_len)
+{
+    sr->width = width;
+    sr->height = height;
+    sr->search_len = search_len;
+    sr->tiles_x = (width + SEARCH_RANGE_TILE - 1) / SEARCH_RANGE_TILE;
+    sr->tiles_y = (height + SEARCH_RANGE_TILE - 1) / SEARCH_RANGE_TILE;
+    size_t tiles = (size_t)sr->tiles_x * sr->tiles_y;
+    sr->d_min = (uint16_t *)calloc(tiles, sizeof(uint16_t));
+    sr->d_max = (uint16_t *)malloc(tiles * sizeof(uint16_t));
+    if (!sr->d_min || !sr->d_max)
+    {
+        fprintf(stderr, "Unable to allocate memory\n");
+        exit(1);
+    }
+    for (size_t t = 0; t < tiles; t++)
+    {
+        sr->d_max[t] = search_len;
+    }
+    image_pyramid_init(&sr->left, width, height, channels, SEARCH_RANGE_LEVEL + 1);
+    image_pyramid_init(&sr->right, width, height, channels, SEARCH_RANGE_LEVEL + 1);
+    sr->coarse.width = sr->left.level[sr->left.levels - 1].width;
+    sr->coarse.height = sr->left.level[sr->left.levels - 1].height;
+    allocate_disparity_map(&sr->coarse);
+}
+
+void search_ranges_free(struct search_ranges *sr)
+{
+    free(sr->d_min);
+    free(sr->d_max);
+    image_pyramid_free(&sr->left);
+    image_pyramid_free(&sr->right);
+    free_disparity_map(&sr->coarse);
+}
+
+// Estimates the range of every tile from a block match of the plain greyscale
+// or RGB images at the pre-pass level. pool may be NULL to run on this thread.
+void search_ranges_estimate(struct search_ranges *sr, struct ppm_array *img_left, struct ppm_array *img_right,
+                            struct thread_pool *pool)
+{
+    image_pyramid_build_pair(&sr->left, &sr->right, img_left, img_right, pool);
+    int level = sr->left.levels - 1;
+    int scale = 1 << level;
+    int coarse_search = (sr->search_len + scale - 1) >> level;
+    if (pool)
+    {
+        block_match_parallel(&sr->left.level[level], &sr->right.level[level], &sr->coarse, coarse_search, pool);
+    }
+    else
+    {
+        block_match(&sr->left.level[level], &sr->right.level[level], &sr->coarse, coarse_search);
+    }
+
+    for (int ty = 0; ty < sr->tiles_y; ty++)
+    {
+        // Coarse pixels under the tile and its halo
+        int y0 = ty * SEARCH_RANGE_TILE / scale - SEARCH_RANGE_HALO;
+        int y1 = ((ty + 1) * SEARCH_RANGE_TILE - 1) / scale + SEARCH_RANGE_HALO;
+        y0 = y0 < 0 ? 0 : y0;
+        y1 = y1 >= sr->coarse.height ? sr->coarse.height - 1 : y1;
+        for (int tx = 0; tx < sr->tiles_x; tx++)
+        {
+            int x0 = tx * SEARCH_RANGE_TILE / scale - SEARCH_RANGE_HALO;
+            int x1 = ((tx + 1) * SEARCH_RANGE_TILE - 1) / scale + SEARCH_RANGE_HALO;
+            x0 = x0 < 0 ? 0 : x0;
+            x1 = x1 >= sr->coarse.width ? sr->coarse.width - 1 : x1;
+            uint16_t lo = UINT16_MAX;
+            uint16_t hi = 0;
+            for (int y = y0; y <= y1; y++)
+            {
+                uint16_t *row = disparity_map_at(&sr->coarse, 0, y);
+                for (int x = x0; x <= x1; x++)
+                {
+                    lo = row[x] < lo ? row[x] : lo;
+                    hi = row[x] > hi ? row[x] : hi;
+                }
+            }
+            // Disparities are fixed point, scale them up and widen to whole
+            // pixels
+            int d_min = (lo >> DISPARITY_FRAC_BITS) * scale - SEARCH_RANGE_MARGIN * scale;
+            int d_max = ((hi + (1 << DISPARITY_FRAC_BITS) - 1) >> DISPARITY_FRAC_BITS) * scale + SEARCH_RANGE_MARGIN * scale;
+            int t = ty * sr->tiles_x + tx;
+            sr->d_min[t] = d_min < 0 ? 0 : d_min;
+            sr->d_max[t] = d_max > sr->search_len ? sr->search_len : d_max;
+        }
+    }
+}
+
+// Returns the fraction of a full block match's cost volume, the disparities
+// every pixel tests, that matching with the ranges skips.
+double search_ranges_skipped(struct search_ranges *sr)
+{
+    double full = 0;
+    double searched = 0;
+    for (int x = 0; x < sr->width; x++)
+    {
+        // Pixels test disparities up to the first whose kernel is off the
+        // right image, as in sad_engine_tested()
+        int tested = x + KERNEL_EDGE_SIZE < sr->search_len + 1 ? x + KERNEL_EDGE_SIZE : sr->search_len + 1;
+        for (int ty = 0; ty < sr->tiles_y; ty++)
+        {
+            int rows = ty == sr->tiles_y - 1 ? sr->height - ty * SEARCH_RANGE_TILE : SEARCH_RANGE_TILE;
+            int t = ty * sr->tiles_x + x / SEARCH_RANGE_TILE;
+            int hi = sr->d_max[t] < tested - 1 ? sr->d_max[t] : tested - 1;
+            full += (double)rows * tested;
+            searched += hi >= sr->d_min[t] ? (double)rows * (hi - sr->d_min[t] + 1) : 0;
+        }
+    }
+    return 1 - searched / full;
+}
+
+// Picks the disparity of pixel x in the engine's current row from its window
+// of disparities, like select_disparity() does over the whole range: the
+// lowest cost, refined with its neighbours unless it's at an end of the range.
+static double search_ranges_select(struct sad_engine *eng, int x)
+{
+    int width = eng->img_left->width;
+    int tested = sad_engine_tested(eng, x);
+    int hi = eng->d_max < tested - 1 ? eng->d_max : tested - 1;
+    uint32_t min_cost = UINT32_MAX;
+    uint32_t before = 0;
+    uint32_t after = 0;
+    uint32_t previous = 0;
+    int disparity = eng->d_min;
+    for (int d = eng->d_min; d <= hi; d++)
+    {
+        uint32_t cost = cost_normalize(eng->cost[d * width + x], eng->norm, sad_engine_pixels(eng, x, d));
+        if (cost < min_cost)
+        {
+            min_cost = cost;
+            disparity = d;
+            before = previous;
+            // Untested disparities cost 0, as in select_disparity()
+            after = 0;
+        }
+        else if (d == disparity + 1)
+        {
+            after = cost;
+        }
+        previous = cost;
+    }
+    if (disparity > eng->d_min && disparity < eng->d_max)
+    {
+        return parabolic_approximation(before, min_cost, after, disparity);
+    }
+    return disparity;
+}
+
+// One block_match_ranges() job
+struct block_match_ranges_job
+{
+    struct ppm_array *img_left;
+    struct ppm_array *img_right;
+    struct disparity_map *img_out;
+    struct search_ranges *sr;
+};
+
+// Matches one column of tiles, top to bottom. Going from a tile to the one
+// below it, the column sums of the disparities both search carry on
+// incrementally and only the disparities new to the lower tile are summed
+// over its first window from scratch.
+static void block_match_ranges_column(void *arg, int tx, int worker)
+{
+    struct block_match_ranges_job *job = (struct block_match_ranges_job *)arg;
+    struct search_ranges *sr = job->sr;
+    struct match_scratch *scratch = match_scratch_get(sr->search_len + 1);
+    struct sad_engine *eng = &scratch->eng;
+    sad_engine_init(eng, job->img_left, job->img_right, sr->search_len, KERNEL_EDGE_SIZE);
+    int x_start = tx * SEARCH_RANGE_TILE;
+    int x_end = x_start + SEARCH_RANGE_TILE < sr->width ? x_start + SEARCH_RANGE_TILE : sr->width;
+    // Disparities whose column sums are at the engine's row
+    int lo = 0, hi = -1;
+    for (int ty = 0; ty < sr->tiles_y; ty++)
+    {
+        int t = ty * sr->tiles_x + tx;
+        int d_min = sr->d_min[t], d_max = sr->d_max[t];
+        int y_start = ty * SEARCH_RANGE_TILE;
+        int y_end = y_start + SEARCH_RANGE_TILE < sr->height ? y_start + SEARCH_RANGE_TILE : sr->height;
+        int keep_lo = lo > d_min ? lo : d_min;
+        int keep_hi = hi < d_max ? hi : d_max;
+        if (keep_lo <= keep_hi)
+        {
+            sad_engine_window(eng, x_start, x_end, keep_lo, keep_hi);
+            sad_engine_seek_columns(eng, y_start);
+            if (d_min < keep_lo)
+            {
+                sad_engine_window(eng, x_start, x_end, d_min, keep_lo - 1);
+                sad_engine_build_columns(eng);
+            }
+            if (d_max > keep_hi)
+            {
+                sad_engine_window(eng, x_start, x_end, keep_hi + 1, d_max);
+                sad_engine_build_columns(eng);
+            }
+            sad_engine_window(eng, x_start, x_end, d_min, d_max);
+        }
+        else
+        {
+            sad_engine_window(eng, x_start, x_end, d_min, d_max);
+            eng->row = -1;
+            sad_engine_seek_columns(eng, y_start);
+        }
+        lo = d_min;
+        hi = d_max;
+
+        for (int j = y_start; j < y_end; j++)
+        {
+            sad_engine_seek(eng, j);
+            for (int i = x_start; i < x_end; i++)
+            {
+                *disparity_map_at(job->img_out, i, j) = disparity_to_fixed(search_ranges_select(eng, i));
+            }
+        }
+    }
+}
+
+// Block matches the images, which may be census images, searching each tile
+// only over its range from search_ranges_estimate(). Columns of tiles run on
+// the pool's workers, pool may be NULL to run on this thread. Where a tile's
+// range is the whole search range its pixels get the same disparities as
+// block_match().
+void block_match_ranges(struct ppm_array *img_left, struct ppm_array *img_right, struct disparity_map *img_out,
+                        struct search_ranges *sr, struct thread_pool *pool)
+{
+    if (img_out->width != img_left->width || img_out->height != img_left->height || img_left->width != sr->width ||
+        img_left->height != sr->height)
+    {
+        fprintf(stderr, "Disparity map must have the same size as the images\n");
+        exit(1);
+    }
+    struct block_match_ranges_job job = {img_left, img_right, img_out, sr};
+    if (pool)
+    {
+        thread_pool_run(pool, block_match_ranges_column, &job, sr->tiles_x);
+    }
+    else
+    {
+        for (int tx = 0; tx < sr->tiles_x; tx++)
+        {
+            block_match_ranges_column(&job, tx, 0);
+        }
+    }
+}
@@ -0,0 +1,315 @@
+// Semi-global matching. Every pixel gets a 16 bit matching cost per disparity
+// from a small SAD kernel, then the costs are smoothed along straight paths
+// through the image: a path's cost at a pixel is its matching cost plus the
+// cheapest way to get there from the previous pixel on the path, paying p1 for
+// a disparity step of one and p2 for any larger jump. The disparity with the
+// lowest sum over all paths wins. This keeps textureless regions consistent
+// with their edges, so the kernel can be much smaller than block_match's.
+//
+// 4 paths (left to right and the three coming from the row above) are
+// computed in a single pass down the image and only keep two rows of costs,
+// so memory is O(width * search_len). 8 paths add the four paths from the
+// other side in a second pass up the image, which needs the sums of the first
+// pass for every pixel: height * width * search_len * 2 bytes, about 1.2 GB for
+// a 1920x1080 image with 290 disparities. Use 4 paths for large images on the
+// Pi.
+
+// Pixels above/below/left/right of a pixel in its matching cost kernel
+#define SGM_KERNEL_EDGE_SIZE 2
+// Penalties per image channel for a disparity step of one between neighbours
+// and for any larger jump
+#define SGM_P1 4
+#define SGM_P2 48
+// Disparities are processed in multiples of this many
+#define SGM_LANES 16
+// Cost of disparities a pixel can't test
+#define SGM_INFINITY 0xffff
+
+struct sgm_state
+{
+    struct sad_engine eng;
+    int width;
+    int height;
+    // Disparities per pixel rounded up to SGM_LANES, and the distance between
+    // the cost vectors of neighbouring pixels in the path buffers, which have
+    // an SGM_INFINITY entry before and after every vector
+    int lanes;
+    int stride;
+    uint16_t p1;
+    uint16_t p2;
+    // Matching costs of the current row, width vectors of lanes entries
+    uint16_t *cost;
+    // Path costs of the previous and current row, and their minimums, for the
+    // three paths coming from the previous row (from x - 1, x and x + 1)
+    uint16_t *prev_row;
+    uint16_t *cur_row;
+    uint16_t *prev_row_min;
+    uint16_t *cur_row_min;
+    // Path costs of the previous and current pixel along the row
+    uint16_t *line;
+    // Zero vector used where a path starts
+    uint16_t *zero;
+    // 2^16 / n for the possible kernel pixel counts n
+    uint32_t *reciprocal;
+};
+
+static uint16_t *sgm_alloc(size_t count, uint16_t value)
+{
+    uint16_t *buffer = (uint16_t *)malloc(sizeof(uint16_t) * count);
+    if (!buffer)
+    {
+        fprintf(stderr, "Unable to allocate memory\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        buffer[i] = value;
+    }
+    return buffer;
+}
+
+// Allocates the state for images of the given size and channels
+// (CENSUS_CHANNELS for census images).
+static void sgm_state_init(struct sgm_state *s, int width, int height, int channels, int search_len)
+{
+    memset(&s->eng, 0, sizeof(s->eng));
+    sad_engine_reserve(&s->eng, width, channels == CENSUS_CHANNELS ? 1 : channels, search_len, SGM_KERNEL_EDGE_SIZE);
+    s->width = width;
+    s->height = height;
+    s->lanes = (search_len + SGM_LANES) / SGM_LANES * SGM_LANES;
+    s->stride = s->lanes + 2;
+    s->cost = sgm_alloc((size_t)s->width * s->lanes, SGM_INFINITY);
+    // Sentinels are never written, so filling once keeps them infinite
+    s->prev_row = sgm_alloc((size_t)3 * s->width * s->stride, SGM_INFINITY);
+    s->cur_row = sgm_alloc((size_t)3 * s->width * s->stride, SGM_INFINITY);
+    s->prev_row_min = sgm_alloc((size_t)3 * s->width, 0);
+    s->cur_row_min = sgm_alloc((size_t)3 * s->width, 0);
+    s->line = sgm_alloc((size_t)2 * s->stride, SGM_INFINITY);
+    s->zero = sgm_alloc(s->stride, 0);
+
+    int max_pixels = (2 * SGM_KERNEL_EDGE_SIZE + 1) * (2 * SGM_KERNEL_EDGE_SIZE + 1);
+    s->reciprocal = (uint32_t *)malloc(sizeof(uint32_t) * (max_pixels + 1));
+    if (!s->reciprocal)
+    {
+        fprintf(stderr, "Unable to allocate memory\n");
+        exit(1);
+    }
+    s->reciprocal[0] = 0;
+    for (int n = 1; n <= max_pixels; n++)
+    {
+        s->reciprocal[n] = (65536 + n / 2) / n;
+    }
+}
+
+// Sets the state up for an image pair of the size it was made for. The
+// sentinels of the path buffers keep their fill from sgm_state_init().
+static void sgm_state_bind(struct sgm_state *s, struct ppm_array *img_left, struct ppm_array *img_right, int search_len)
+{
+    if (img_left->width != s->width || img_left->height != s->height)
+    {
+        fprintf(stderr, "Images must have the size the semi-global matching buffers were made for\n");
+        exit(1);
+    }
+    sad_engine_init(&s->eng, img_left, img_right, search_len, SGM_KERNEL_EDGE_SIZE);
+    s->p1 = SGM_P1 * s->eng.channels;
+    s->p2 = SGM_P2 * s->eng.channels;
+}
+
+static void sgm_state_free(struct sgm_state *s)
+{
+    sad_engine_free(&s->eng);
+    free(s->cost);
+    free(s->prev_row);
+    free(s->cur_row);
+    free(s->prev_row_min);
+    free(s->cur_row_min);
+    free(s->line);
+    free(s->zero);
+    free(s->reciprocal);
+}
+
+// Fills s->cost with the matching costs of row y: the average absolute
+// difference over the kernel pixels that have a match, rounded. Disparities a
+// pixel can't test, and the padding up to lanes, cost SGM_INFINITY.
+static void sgm_row_costs(struct sgm_state *s, int y)
+{
+    struct sad_engine *eng = &s->eng;
+    sad_engine_seek(eng, y);
+    for (int x = 0; x < s->width; x++)
+    {
+        uint16_t *cost = s->cost + (size_t)x * s->lanes;
+        int count = sad_engine_tested(eng, x);
+        for (int d = 0; d < count; d++)
+        {
+            uint64_t sum = eng->cost[d * s->width + x];
+            cost[d] = (uint16_t)((sum * s->reciprocal[sad_engine_pixels(eng, x, d)] + 32768) >> 16);
+        }
+        for (int d = count; d < s->lanes; d++)
+        {
+            cost[d] = SGM_INFINITY;
+        }
+    }
+}
+
+// Runs the four paths entering row y: along the row in direction dx (1 for
+// left to right, -1 for right to left) and from the three neighbours in the
+// previously processed row. Their costs are added to sum, one vector of lanes
+// entries per pixel. first is set for the first row of a pass, where the paths
+// from the previous row start.
+static void sgm_row_paths(struct sgm_state *s, int y, int dx, int first, uint16_t *sum)
+{
+    const struct sad_kernels *kernels = sad_kernels_get();
+    int width = s->width;
+    int stride = s->stride;
+    sgm_row_costs(s, y);
+
+    // Along the row, alternating between the two line buffers
+    uint16_t *prev = s->zero + 1;
+    uint16_t prev_min = 0;
+    for (int i = 0; i < width; i++)
+    {
+        int x = dx > 0 ? i : width - 1 - i;
+        uint16_t *cur = s->line + (i & 1) * stride + 1;
+        prev_min = kernels->sgm_path(s->cost + (size_t)x * s->lanes, prev, prev_min, cur,
+                                     sum + (size_t)x * s->lanes, s->lanes, s->p1, s->p2);
+        prev = cur;
+    }
+
+    // From the previous row, x - 1, x and x + 1
+    for (int k = 0; k < 3; k++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            int from = x + k - 1;
+            const uint16_t *path_prev = s->zero + 1;
+            uint16_t path_prev_min = 0;
+            if (!first && from >= 0 && from < width)
+            {
+                path_prev = s->prev_row + ((size_t)k * width + from) * stride + 1;
+                path_prev_min = s->prev_row_min[k * width + from];
+            }
+            s->cur_row_min[k * width + x] = kernels->sgm_path(s->cost + (size_t)x * s->lanes, path_prev, path_prev_min,
+                                                              s->cur_row + ((size_t)k * width + x) * stride + 1,
+                                                              sum + (size_t)x * s->lanes, s->lanes, s->p1, s->p2);
+        }
+    }
+
+    uint16_t *swap = s->prev_row;
+    s->prev_row = s->cur_row;
+    s->cur_row = swap;
+    swap = s->prev_row_min;
+    s->prev_row_min = s->cur_row_min;
+    s->cur_row_min = swap;
+}
+
+// Picks the disparity with the lowest path sum for every pixel of row y, then
+// refines it to sub-pixel accuracy like select_disparity.
+static void sgm_row_select(struct sgm_state *s, int y, const uint16_t *sum, struct disparity_map *img_out, int search_len)
+{
+    for (int x = 0; x < s->width; x++)
+    {
+        const uint16_t *costs = sum + (size_t)x * s->lanes;
+        int count = sad_engine_tested(&s->eng, x);
+        int disparity = 0;
+        for (int d = 1; d < count; d++)
+        {
+            if (costs[d] < costs[disparity])
+            {
+                disparity = d;
+            }
+        }
+        double result = disparity;
+        if (disparity > 0 && disparity < search_len && disparity + 1 < count)
+        {
+            double c_1 = costs[disparity - 1];
+            double c_2 = costs[disparity];
+            double c_3 = costs[disparity + 1];
+            // Flat costs have no vertex
+            if (c_1 - 2 * c_2 + c_3 > 0)
+            {
+                result = parabolic_approximation(c_1, c_2, c_3, disparity);
+            }
+        }
+        *disparity_map_at(img_out, x, y) = disparity_to_fixed(result);
+    }
+}
+
+// Buffers of sgm_match_buffers() for images of one size, search range and
+// number of paths, so matching frame after frame allocates nothing.
+struct sgm_buffers
+{
+    struct sgm_state state;
+    int search_len;
+    int paths;
+    // Path cost sums, of one row for 4 paths and of every row for 8
+    uint16_t *sums;
+};
+
+// Sizes the buffers for images of the given size and channels
+// (CENSUS_CHANNELS for census images).
+void sgm_buffers_init(struct sgm_buffers *buffers, int width, int height, int channels, int search_len, int paths)
+{
+    if (paths != 4 && paths != 8)
+    {
+        fprintf(stderr, "Semi-global matching supports 4 or 8 paths, not %d\n", paths);
+        exit(1);
+    }
+    sgm_state_init(&buffers->state, width, height, channels, search_len);
+    buffers->search_len = search_len;
+    buffers->paths = paths;
+    size_t row_len = (size_t)width * buffers->state.lanes;
+    buffers->sums = sgm_alloc(paths == 4 ? row_len : row_len * height, 0);
+}
+
+void sgm_buffers_free(struct sgm_buffers *buffers)
+{
+    sgm_state_free(&buffers->state);
+    free(buffers->sums);
+}
+
+// Semi-global matching of a whole image pair with the buffers' search range
+// and paths, see sgm_match().
+void sgm_match_buffers(struct ppm_array *img_left, struct ppm_array *img_right, struct disparity_map *img_out,
+                       struct sgm_buffers *buffers)
+{
+    struct sgm_state *s = &buffers->state;
+    int search_len = buffers->search_len;
+    sgm_state_bind(s, img_left, img_right, search_len);
+    size_t row_len = (size_t)s->width * s->lanes;
+
+    if (buffers->paths == 4)
+    {
+        uint16_t *sum = buffers->sums;
+        for (int y = 0; y < s->height; y++)
+        {
+            memset(sum, 0, sizeof(uint16_t) * row_len);
+            sgm_row_paths(s, y, 1, y == 0, sum);
+            sgm_row_select(s, y, sum, img_out, search_len);
+        }
+    }
+    else
+    {
+        // The pass down the image leaves its sums for the pass back up
+        uint16_t *volume = buffers->sums;
+        memset(volume, 0, sizeof(uint16_t) * row_len * s->height);
+        for (int y = 0; y < s->height; y++)
+        {
+            sgm_row_paths(s, y, 1, y == 0, volume + row_len * y);
+        }
+        for (int y = s->height - 1; y >= 0; y--)
+        {
+            sgm_row_paths(s, y, -1, y == s->height - 1, volume + row_len * y);
+            sgm_row_select(s, y, volume + row_len * y, img_out, search_len);
+        }
+    }
+}
+
+// Semi-global matching of a whole image pair along 4 or 8 paths, writing the
+// same disparity_map as block_match. The images must have the same size.
+void sgm_match(struct ppm_array *img_left, struct ppm_array *img_right, struct disparity_map *img_out, int search_len, int paths)
+{
+    struct sgm_buffers buffers;
+    sgm_buffers_init(&buffers, img_left->width, img_left->height, img_left->channels, search_len, paths);
+    sgm_match_buffers(img_left, img_right, img_out, &buffers);
+    sgm_buffers_free(&buffers);
+}
@@ -0,0 +1,225 @@
+// Disparity post-filters. Block matching leaves small islands of disparities
+// that differ from everything around them where a window matched noise, a
+// repeated texture or an occluded edge, and a range scan of the map reports
+// each of them as an obstacle. The speckle filter invalidates connected
+// regions of fewer than a given number of pixels, the pixels above, below and
+// beside one another being connected when their disparities are within
+// max_diff. The optional median filter before it smooths single pixel
+// outliers that are connected to a larger region.
+//
+// Regions are labelled by runs: one pass over the map splits each row into
+// runs of connected pixels and joins each run with the runs of the row above
+// it touches in a union-find, so labelling is linear in the pixels and only
+// keeps the labels of two rows. A second pass finds the same runs again and
+// invalidates the ones whose region is too small. Every buffer is allocated by
+// speckle_filter_init(), filtering a frame allocates nothing.
+
+// Largest disparity difference within a region, in fixed point: one pixel
+#define SPECKLE_MAX_DIFF (1 << DISPARITY_FRAC_BITS)
+// Regions of less than this fraction of the map's pixels are speckles, so a
+// scene has the same speckles at any resolution: 368 pixels for tsukuba
+#define SPECKLE_REGION_DIVISOR 300
+
+struct speckle_filter
+{
+    int width;
+    int height;
+    // Run of every pixel of the previous and the current row, -1 where the
+    // pixel is invalid
+    int32_t *labels[2];
+    // Union-find parent of every run, which is always a run before it, so the
+    // root of a region is its first run
+    int32_t *parent;
+    // Pixels of every run, and after labelling of every region at its root
+    int32_t *size;
+};
+
+// Sets up the filter for maps of the given size.
+void speckle_filter_init(struct speckle_filter *filter, int width, int height)
+{
+    filter->width = width;
+    filter->height = height;
+    // Every pixel is a run of its own at worst
+    size_t runs = (size_t)width * height;
+    filter->labels[0] = (int32_t *)malloc(sizeof(int32_t) * width);
+    filter->labels[1] = (int32_t *)malloc(sizeof(int32_t) * width);
+    filter->parent = (int32_t *)malloc(sizeof(int32_t) * runs);
+    filter->size = (int32_t *)malloc(sizeof(int32_t) * runs);
+    if (!filter->labels[0] || !filter->labels[1] || !filter->parent || !filter->size)
+    {
+        fprintf(stderr, "Unable to allocate memory\n");
+        exit(1);
+    }
+}
+
+void speckle_filter_free(struct speckle_filter *filter)
+{
+    free(filter->labels[0]);
+    free(filter->labels[1]);
+    free(filter->parent);
+    free(filter->size);
+}
+
+// Default region size of speckle_filter_apply() for maps of the given size.
+static inline int speckle_max_region(int width, int height)
+{
+    return (int)((size_t)width * height / SPECKLE_REGION_DIVISOR);
+}
+
+// Returns the root of run r, halving the path to it on the way.
+static inline int32_t speckle_find(int32_t *parent, int32_t r)
+{
+    while (parent[r] != r)
+    {
+        parent[r] = parent[parent[r]];
+        r = parent[r];
+    }
+    return r;
+}
+
+// Whether pixel x of row starts a new run, rather than continuing the one of
+// the pixel before it
+static inline int speckle_run_start(const uint16_t *row, int x, int max_diff)
+{
+    return x == 0 || row[x - 1] == DISPARITY_INVALID || abs((int)row[x] - (int)row[x - 1]) > max_diff;
+}
+
+// Invalidates the regions of map of fewer than max_region pixels whose
+// neighbouring disparities differ by at most max_diff, in fixed point.
+// Returns the number of pixels invalidated.
+int speckle_filter_apply(struct speckle_filter *filter, struct disparity_map *map, int max_region, int max_diff)
+{
+    if (map->width != filter->width || map->height != filter->height)
+    {
+        fprintf(stderr, "Disparity map must have the size the speckle filter was made for\n");
+        exit(1);
+    }
+    int32_t *parent = filter->parent;
+    int32_t *size = filter->size;
+    int32_t runs = 0;
+    for (int y = 0; y < map->height; y++)
+    {
+        const uint16_t *row = disparity_map_at(map, 0, y);
+        const uint16_t *above = y ? disparity_map_at(map, 0, y - 1) : NULL;
+        int32_t *label = filter->labels[y & 1];
+        int32_t *label_above = filter->labels[(y & 1) ^ 1];
+        // The last pair of runs joined, a run along a run above it only needs
+        // joining once
+        int32_t joined = -1, joined_above = -1;
+        for (int x = 0; x < map->width; x++)
+        {
+            if (row[x] == DISPARITY_INVALID)
+            {
+                label[x] = -1;
+                continue;
+            }
+            if (speckle_run_start(row, x, max_diff))
+            {
+                parent[runs] = runs;
+                size[runs] = 0;
+                runs++;
+            }
+            int32_t run = runs - 1;
+            label[x] = run;
+            size[run]++;
+            if (above && label_above[x] >= 0 && abs((int)row[x] - (int)above[x]) <= max_diff &&
+                (run != joined || label_above[x] != joined_above))
+            {
+                joined = run;
+                joined_above = label_above[x];
+                int32_t a = speckle_find(parent, run);
+                int32_t b = speckle_find(parent, label_above[x]);
+                if (a != b)
+                {
+                    parent[a > b ? a : b] = a < b ? a : b;
+                }
+            }
+        }
+    }
+
+    // Parents come before their runs, so in order every parent is already a
+    // root when its run is reached
+    for (int32_t r = 0; r < runs; r++)
+    {
+        parent[r] = parent[parent[r]];
+        if (parent[r] != r)
+        {
+            size[parent[r]] += size[r];
+        }
+    }
+
+    // The same runs again, the pixel before each is read before it's changed
+    int removed = 0;
+    runs = 0;
+    for (int y = 0; y < map->height; y++)
+    {
+        uint16_t *row = disparity_map_at(map, 0, y);
+        uint16_t before = DISPARITY_INVALID;
+        int small = 0;
+        for (int x = 0; x < map->width; x++)
+        {
+            uint16_t value = row[x];
+            if (value == DISPARITY_INVALID)
+            {
+                before = value;
+                continue;
+            }
+            if (before == DISPARITY_INVALID || abs((int)value - (int)before) > max_diff)
+            {
+                small = size[parent[runs++]] < max_region;
+            }
+            before = value;
+            if (small)
+            {
+                row[x] = DISPARITY_INVALID;
+                removed++;
+            }
+        }
+    }
+    return removed;
+}
+
+// Median of the 3x3 block around pixel (x, y) of map, repeating the edge
+// pixels past the edges
+static uint16_t disparity_median_at(struct disparity_map *map, int x, int y)
+{
+    uint16_t p[9];
+    for (int j = -1; j <= 1; j++)
+    {
+        int v = y + j < 0 ? 0 : y + j >= map->height ? map->height - 1 : y + j;
+        for (int i = -1; i <= 1; i++)
+        {
+            int u = x + i < 0 ? 0 : x + i >= map->width ? map->width - 1 : x + i;
+            p[3 * (j + 1) + i + 1] = *disparity_map_at(map, u, v);
+        }
+    }
+    SAD_MEDIAN9(sad_sort2_scalar, p);
+    return p[4];
+}
+
+// Writes the 3x3 median of map_in to map_out, which must be another map of the
+// same size. Invalid pixels are the largest disparity to the median, so a
+// pixel becomes invalid when most of its block is.
+void disparity_median3(struct disparity_map *map_in, struct disparity_map *map_out)
+{
+    if (map_out->width != map_in->width || map_out->height != map_in->height || map_out->data == map_in->data)
+    {
+        fprintf(stderr, "Median filter needs a separate output map of the same size\n");
+        exit(1);
+    }
+    const struct sad_kernels *k = sad_kernels_get();
+    int width = map_in->width;
+    for (int y = 0; y < map_in->height; y++)
+    {
+        uint16_t *out = disparity_map_at(map_out, 0, y);
+        if (width >= 3)
+        {
+            const uint16_t *above = disparity_map_at(map_in, 0, y ? y - 1 : 0);
+            const uint16_t *row = disparity_map_at(map_in, 0, y);
+            const uint16_t *below = disparity_map_at(map_in, 0, y + 1 < map_in->height ? y + 1 : y);
+            k->median3_row(above + 1, row + 1, below + 1, out + 1, width - 2);
+        }
+        out[0] = disparity_median_at(map_in, 0, y);
+        out[width - 1] = disparity_median_at(map_in, width - 1, y);
+    }
+}
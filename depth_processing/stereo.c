@@ -0,0 +1,2300 @@
+// Needed for pinning worker threads to CPUs
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <float.h>
+#include <time.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "sad_kernels.c"
+#include "window_kernels.c"
+#include "thread_pool.c"
+
+// How many pixels above/below/left/right of given pixel to SAD for disparity
+// metric. Default 5, block_match_edge() takes others at runtime
+#define KERNEL_EDGE_SIZE 5
+// Largest kernel edge size block_match_edge() takes. A column of 2 * edge + 1
+// differences of up to 255 has to fit the engine's 16 bit column sums.
+#define KERNEL_EDGE_MAX 128
+// How many pixels left of given to check for disparity metric. Default 50
+#define BLOCK_SIZE 20
+// Used for exporting the ppm file
+#define RGB_COMPONENT_COLOR 255
+// Most levels pyramid_block_match() can use
+#define PYRAMID_MAX_LEVELS 8
+// Disparities either side of the coarse estimate searched on each finer level
+#define PYRAMID_SEARCH_RADIUS 2
+// Row bands handed out per worker by block_match_parallel(). More bands than
+// workers evens out the load when a core is busy with something else.
+#define BANDS_PER_WORKER 4
+// Default tile size of block_match_tiled() when a tile's whole search range
+// doesn't fit in L2, tiles searched in one pass are at least MATCH_TILE_MIN 
+// wide
+#define MATCH_TILE_WIDTH 128
+#define MATCH_TILE_HEIGHT 64
+#define MATCH_TILE_MIN 32
+// L1 data and L2 cache sizes assumed when the system doesn't report them, the
+// Raspberry Pi 4's
+#define MATCH_L1_DEFAULT (32L << 10)
+#define MATCH_L2_DEFAULT (1L << 20)
+// Rows match_tiling_tune() times each tiling on, keeping the best of a few
+// runs
+#define MATCH_TUNE_ROWS 64
+#define MATCH_TUNE_REPEATS 2
+// Number of zeroed border pixels allocated on every side of a ppm_array, so
+// filters can read a little past the edge of the image.
+#define IMAGE_PAD 16
+// Fractional bits of the fixed-point factors that scale kernel sums clipped by
+// the image edge up to a full kernel
+#define COST_NORM_SHIFT 16
+// Curvature of the cost curve at the best disparity, as a fraction of the mean
+// cost, above which it stops lowering the confidence
+#define CONFIDENCE_CURVATURE_GAIN 16
+// Fractional bits of the disparities stored in a disparity_map
+#define DISPARITY_FRAC_BITS 4
+// Stored for pixels without a valid disparity
+#define DISPARITY_INVALID 0xffff
+
+// An RGB pixel for storing image values
+struct ppm_pixel
+{
+    unsigned char red, green, blue;
+};
+
+// An HSV pixel for easier color calculations
+struct hsv_pixel
+{
+    double hue, saturation, value;
+};
+
+// Struct used to read and write ppm images from filesystem
+struct ppm_image
+{
+    int x, y;
+    struct ppm_pixel *data;
+};
+
+// Contiguous, row-major image used for processing. Holds either planar
+// greyscale (1 channel), packed RGB (3 channels) pixels or census descriptors
+// (CENSUS_CHANNELS bytes, see census.c). data points at pixel
+// (0, 0) and rows are stride bytes apart. Arrays allocated with
+// ppm_array_allocate() have IMAGE_PAD zeroed pixels around the image, arrays
+// wrapping a ppm_image have no padding and don't own their pixels.
+struct ppm_array
+{
+    int height;
+    int width;
+    int channels;
+    int stride;
+    int pad;
+    unsigned char *data;
+    // Start of the allocation, NULL if the pixels belong to someone else
+    unsigned char *buffer;
+};
+
+// Special disparity map structure, used for even faster processing of
+// disparity maps. Disparities are unsigned Q12.4 fixed point (a 16th of a 
+// pixel, up to 4095.875), stored row-major in a single allocation, with 
+// DISPARITY_INVALID for pixels that have none.
+struct disparity_map
+{
+    int height;
+    int width;
+    uint16_t *data;
+};
+
+// The disparity map layout used before the fixed-point one, an array of 
+// columns of doubles, with NAN for invalid pixels. Kept for comparisons.
+struct disparity_map_double
+{
+    int height;
+    int width;
+    double **arr;
+};
+
+// Scale the input value between given output values, clamping if over/under
+// max input.
+double clamp_and_scale(double in_bottom, double in_top, double out_top, double input)
+{
+    double out_bottom = 0;
+    double output;
+    if (input >= in_top)
+    {
+        output = out_top;
+    }
+    else if (input <= out_bottom)
+    {
+        output = out_bottom;
+    }
+    else
+    {
+        input -= in_bottom;
+        input /= in_top - in_bottom;
+        input *= out_top - out_bottom;
+        input += out_bottom;
+        output = input;
+    }
+    return output;
+}
+
+// Convert an HSV pixel value to RGB
+// Source: https://stackoverflow.com/questions/3018313/algorithm-to-convert-rgb-to-hsv-and-hsv-to-rgb-in-range-0-255-for-both
+struct ppm_pixel hsv_to_rgb(struct hsv_pixel in)
+{
+    double hh, p, q, t, ff, v;
+    long i;
+    struct ppm_pixel out;
+
+    v = clamp_and_scale(0, 1, 255, in.value);
+
+    // If saturation is zero, RGB is just value
+    if (in.saturation <= 0.0)
+    {
+        out.red = v;
+        out.green = v;
+        out.blue = v;
+        return out;
+    }
+    hh = in.hue;
+    if (hh >= 360.0)
+        hh = 0.0;
+    hh /= 60.0;
+    i = (long)hh;
+    ff = hh - i;
+    p = clamp_and_scale(0, 1, 255, in.value * (1.0 - in.saturation));
+    q = clamp_and_scale(0, 1, 255, in.value * (1.0 - (in.saturation * ff)));
+    t = clamp_and_scale(0, 1, 255, in.value * (1.0 - (in.saturation * (1.0 - ff))));
+
+    // Many cases for proper conversion
+    switch (i)
+    {
+    case 0:
+        out.red = in.value;
+        out.green = t;
+        out.blue = p;
+        break;
+    case 1:
+        out.red = q;
+        out.green = in.value;
+        out.blue = p;
+        break;
+    case 2:
+        out.red = p;
+        out.green = in.value;
+        out.blue = t;
+        break;
+
+    case 3:
+        out.red = p;
+        out.green = q;
+        out.blue = in.value;
+        break;
+    case 4:
+        out.red = t;
+        out.green = p;
+        out.blue = in.value;
+        break;
+    case 5:
+    default:
+        out.red = in.value;
+        out.green = p;
+        out.blue = q;
+        break;
+    }
+    return out;
+}
+
+// Allocates space for the ppm_array, assumes that the height, width and 
+// channels members have been set and are correct. The image and its border are 
+// zeroed.
+void ppm_array_allocate(struct ppm_array *obj)
+{
+    (*obj).pad = IMAGE_PAD;
+    (*obj).stride = ((*obj).width + 2 * IMAGE_PAD) * (*obj).channels;
+    (*obj).buffer = (unsigned char *)calloc((size_t)(*obj).stride * ((*obj).height + 2 * IMAGE_PAD), 1);
+    if (!(*obj).buffer)
+    {
+        fprintf(stderr, "Unable to allocate memory\n");
+        exit(1);
+    }
+    (*obj).data = (*obj).buffer + IMAGE_PAD * (*obj).stride + IMAGE_PAD * (*obj).channels;
+}
+
+// Returns a pointer to the first channel of the pixel at x, y.
+static inline unsigned char *ppm_array_at(struct ppm_array *obj, int x, int y)
+{
+    return obj->data + y * obj->stride + x * obj->channels;
+}
+
+// Returns a pointer to the disparity of the pixel at x, y.
+static inline uint16_t *disparity_map_at(struct disparity_map *obj, int x, int y)
+{
+    return obj->data + (size_t)y * obj->width + x;
+}
+
+// Converts a disparity in pixels to the fixed-point format, rounding to the
+// nearest step. Negative sub-pixel estimates become 0, anything that isn't a
+// representable number becomes DISPARITY_INVALID.
+static inline uint16_t disparity_to_fixed(double disparity)
+{
+    double fixed = disparity * (1 << DISPARITY_FRAC_BITS) + 0.5;
+    if (!(fixed < DISPARITY_INVALID))
+    {
+        return DISPARITY_INVALID;
+    }
+    return fixed < 0 ? 0 : (uint16_t)fixed;
+}
+
+// Converts a fixed-point disparity back to pixels, NAN if it is invalid.
+static inline double disparity_from_fixed(uint16_t fixed)
+{
+    return fixed == DISPARITY_INVALID ? NAN : (double)fixed / (1 << DISPARITY_FRAC_BITS);
+}
+
+// Allocates space for the disparity map, assumes that the height and width 
+// members have been set and are correct.
+void allocate_disparity_map(struct disparity_map *obj)
+{
+    (*obj).data = (uint16_t *)malloc(sizeof(uint16_t) * (*obj).width * (*obj).height);
+    if (!(*obj).data)
+    {
+        fprintf(stderr, "Unable to allocate memory\n");
+        exit(1);
+    }
+}
+
+// Allocates space for a legacy disparity map, assumes that the height and 
+// width members have been set and are correct.
+void allocate_disparity_map_double(struct disparity_map_double *obj)
+{
+    (*obj).arr = (double **)malloc(sizeof(double *) * (*obj).width);
+    for (int x = 0; x < (*obj).width; x++)
+    {
+        (*obj).arr[x] = (double *)malloc(sizeof(double) * (*obj).height);
+    }
+}
+
+// Frees the ppm_array object. Wrapped arrays leave their pixels to the owner.
+void free_ppm_array(struct ppm_array *obj)
+{
+    free((*obj).buffer);
+    (*obj).buffer = NULL;
+    (*obj).data = NULL;
+}
+
+// Frees the disparity_map object.
+void free_disparity_map(struct disparity_map *obj)
+{
+    free((*obj).data);
+    (*obj).data = NULL;
+}
+
+// Frees the legacy disparity map object.
+void free_disparity_map_double(struct disparity_map_double *obj)
+{
+    for (int x = 0; x < (*obj).width; x++)
+    {
+        free((*obj).arr[x]);
+    }
+    free((*obj).arr);
+}
+
+// Converts the disparity map to the legacy layout. Assumes that out HAS been 
+// allocated with the same size as the map.
+void disparity_map_to_double(struct disparity_map *obj, struct disparity_map_double *out)
+{
+    for (int y = 0; y < obj->height; y++)
+    {
+        uint16_t *row = disparity_map_at(obj, 0, y);
+        for (int x = 0; x < obj->width; x++)
+        {
+            out->arr[x][y] = disparity_from_fixed(row[x]);
+        }
+    }
+}
+
+// Wraps the loaded image buffer in an array without copying it. The image must 
+// outlive the array, and writes through the array modify the image.
+void ppm_array_wrap(struct ppm_image *img, struct ppm_array *obj)
+{
+    (*obj).height = img->y;
+    (*obj).width = img->x;
+    (*obj).channels = 3;
+    (*obj).stride = 3 * img->x;
+    (*obj).pad = 0;
+    (*obj).data = (unsigned char *)img->data;
+    (*obj).buffer = NULL;
+}
+
+// Converts the array back into an image. Assumes the image HAS been malloced.
+// Greyscale arrays are expanded to RGB.
+// TODO no protection for writing a bigger file than is malloced.
+void arr_to_img(struct ppm_array *obj, struct ppm_image *img)
+{
+    img->x = obj->width;
+    img->y = obj->height;
+    for (int y = 0; y < obj->height; y++)
+    {
+        struct ppm_pixel *out = img->data + y * img->x;
+        for (int x = 0; x < obj->width; x++)
+        {
+            unsigned char *pix = ppm_array_at(obj, x, y);
+            out[x].red = pix[0];
+            out[x].green = pix[obj->channels == 3 ? 1 : 0];
+            out[x].blue = pix[obj->channels == 3 ? 2 : 0];
+        }
+    }
+}
+
+// Returns the largest valid disparity in the map, in fixed point.
+static uint16_t get_max_disparity_fixed(struct disparity_map *obj)
+{
+    uint16_t max = 0;
+    size_t count = (size_t)obj->width * obj->height;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (obj->data[i] > max && obj->data[i] != DISPARITY_INVALID)
+        {
+            max = obj->data[i];
+        }
+    }
+    return max;
+}
+
+// Returns the maximum disparity value from a disparity map.
+double get_max_disparity(struct disparity_map *obj)
+{
+    return disparity_from_fixed(get_max_disparity_fixed(obj));
+}
+
+// Converts the disparity map into an array, for viewing. Assumes that the 
+// array HAS been allocated (or wrapped) with the same size as the map. Invalid
+// pixels are black.
+void disparity_map_to_img(struct disparity_map *obj, struct ppm_array *img)
+{
+    uint32_t max_disparity = get_max_disparity_fixed(obj);
+    for (int y = 0; y < obj->height; y++)
+    {
+        unsigned char *out = ppm_array_at(img, 0, y);
+        uint16_t *row = disparity_map_at(obj, 0, y);
+        for (int x = 0; x < obj->width; x++)
+        {
+            int newval = 0;
+            if (row[x] != DISPARITY_INVALID && max_disparity > 0)
+            {
+                newval = row[x] >= max_disparity ? 255 : row[x] * 255 / max_disparity;
+            }
+            for (int c = 0; c < img->channels; c++)
+            {
+                *out++ = newval;
+            }
+        }
+    }
+}
+
+// Memory mapped image files
+#include "image_io.c"
+
+// Reads a PPM file into a newly allocated image object. 16 bit files are 
+// scaled to 8 bits.
+struct ppm_image *readPPM(const char *filename)
+{
+    struct mapped_image file;
+    mapped_image_open(filename, &file);
+    if (file.channels != 3)
+    {
+        fprintf(stderr, "Invalid image format (must be 'P6')\n");
+        exit(1);
+    }
+    struct ppm_image *img = (struct ppm_image *)malloc(sizeof(struct ppm_image));
+    if (!img)
+    {
+        fprintf(stderr, "Unable to allocate memory\n");
+        exit(1);
+    }
+    img->x = file.width;
+    img->y = file.height;
+    img->data = (struct ppm_pixel *)malloc((size_t)img->x * img->y * sizeof(struct ppm_pixel));
+    if (!img->data)
+    {
+        fprintf(stderr, "Unable to allocate memory\n");
+        exit(1);
+    }
+    mapped_image_copy(&file, (unsigned char *)img->data, 3 * img->x);
+    mapped_image_close(&file);
+    return img;
+}
+
+// Reads a binary PGM file (P5), such as a ground truth disparity map, into a 
+// newly allocated single channel array. 16 bit files are scaled to 8 bits.
+void readPGM(const char *filename, struct ppm_array *obj)
+{
+    struct mapped_image file;
+    mapped_image_open(filename, &file);
+    if (file.channels != 1)
+    {
+        fprintf(stderr, "Invalid image format (must be 'P5')\n");
+        exit(1);
+    }
+    obj->width = file.width;
+    obj->height = file.height;
+    obj->channels = 1;
+    ppm_array_allocate(obj);
+    mapped_image_copy(&file, obj->data, obj->stride);
+    mapped_image_close(&file);
+}
+
+// Prints the image to the cmd line, 1 pixel at a time. For debugging.
+void print_img(struct ppm_image *img)
+{
+    printf("x,y : %d,%d\n", img->x, img->y);
+    int i;
+    for (i = 0; i < img->x * img->y; i++)
+    {
+        int x = i % img->x;
+        int y = i / img->y;
+        printf("x: %d, y: %d,  r: %d,  g: %d,  b: %d\n", x, y, img->data[i].red, img->data[i].green, img->data[i].blue);
+    }
+}
+
+// Prints the array image to the command line, 1 pixel at a time. For debugging.
+void print_arr(struct ppm_array obj)
+{
+    printf("width,height : %d,%d\n", obj.width, obj.height);
+    for (int y = 0; y < obj.height; y++)
+    {
+        for (int x = 0; x < obj.width; x++)
+        {
+            unsigned char *pix = ppm_array_at(&obj, x, y);
+            if (obj.channels == 3)
+            {
+                printf("x: %d, y: %d,  r: %d,  g: %d,  b: %d\n", x, y, pix[0], pix[1], pix[2]);
+            }
+            else
+            {
+                printf("x: %d, y: %d,  v: %d\n", x, y, pix[0]);
+            }
+        }
+    }
+}
+
+// Writes the ppm_image object to the filesystem as a .ppm image.
+void writePPM(const char *filename, struct ppm_image *img)
+{
+    write_netpbm(filename, (const unsigned char *)img->data, img->x, img->y, 3, 3 * img->x);
+}
+
+// Writes a greyscale or RGB array to the filesystem as a .pgm or .ppm image.
+void write_array(const char *filename, struct ppm_array *obj)
+{
+    if (obj->channels != 1 && obj->channels != 3)
+    {
+        fprintf(stderr, "Only greyscale and RGB arrays can be written\n");
+        exit(1);
+    }
+    write_netpbm(filename, obj->data, obj->width, obj->height, obj->channels, obj->stride);
+}
+
+// Convert each pixel value in the RGB image to grey, in place.
+void to_greyscale(struct ppm_array *obj)
+{
+    for (int y = 0; y < (*obj).height; y++)
+    {
+        unsigned char *pix = ppm_array_at(obj, 0, y);
+        for (int x = 0; x < (*obj).width; x++, pix += 3)
+        {
+            int greyscale = (pix[0] + pix[1] + pix[2]) / 3;
+            pix[0] = pix[1] = pix[2] = greyscale;
+        }
+    }
+}
+
+// Convert the RGB image to grey in img_out, an allocated single channel array
+// of the same size.
+void to_greyscale_plane_into(struct ppm_array *img_in, struct ppm_array *img_out)
+{
+    if (img_out->width != img_in->width || img_out->height != img_in->height || img_out->channels != 1)
+    {
+        fprintf(stderr, "Greyscale plane must be a single channel array of the image's size\n");
+        exit(1);
+    }
+    const struct sad_kernels *k = sad_kernels_get();
+    for (int y = 0; y < img_in->height; y++)
+    {
+        k->grey_row(ppm_array_at(img_in, 0, y), ppm_array_at(img_out, 0, y), img_in->width);
+    }
+}
+
+// Convert the RGB image to a single channel greyscale array. Allocates img_out.
+void to_greyscale_plane(struct ppm_array *img_in, struct ppm_array *img_out)
+{
+    img_out->height = img_in->height;
+    img_out->width = img_in->width;
+    img_out->channels = 1;
+    ppm_array_allocate(img_out);
+    to_greyscale_plane_into(img_in, img_out);
+}
+
+// Census transform, the alternative matching cost to SAD
+#include "census.c"
+
+// Return the absolute value of the input
+int abs(int in)
+{
+    if (in < 0)
+    {
+        return -in;
+    }
+    return in;
+}
+
+// Get a sum of the difference in pixel values between two image pixels.
+int pixel_dif_abs(int x_1, int y_1, int x_2, int y_2, struct ppm_array *img_left, struct ppm_array *img_right)
+{
+    // Return -1 if out of bounds, so that we can process out of bounds differently
+    if (x_1 < 0 || x_2 < 0 || y_1 < 0 || y_2 < 0 ||
+        x_1 >= img_left->width || x_2 >= img_right->width || y_1 >= img_left->height || y_2 >= img_right->height)
+    {
+        return -1;
+    }
+    unsigned char *pix_1 = ppm_array_at(img_left, x_1, y_1);
+    unsigned char *pix_2 = ppm_array_at(img_right, x_2, y_2);
+    int dif = 0;
+    for (int c = 0; c < img_left->channels; c++)
+    {
+        dif += abs(pix_1[c] - pix_2[c]);
+    }
+    return dif;
+}
+
+// Fills norm[pixels] for pixels in [1, (2 * edge + 1)^2] with the fixed-point
+// factor that scales a sum over that many kernel pixels up to a full kernel.
+void cost_norm_fill(uint32_t *norm, int edge)
+{
+    uint64_t full = (uint64_t)(2 * edge + 1) * (2 * edge + 1);
+    norm[0] = 0;
+    for (uint64_t pixels = 1; pixels <= full; pixels++)
+    {
+        norm[pixels] = (uint32_t)(((full << COST_NORM_SHIFT) + pixels / 2) / pixels);
+    }
+}
+
+// Scales a sum over the given number of kernel pixels up to a full kernel, 
+// rounding to the nearest integer. Sums over full kernels are unchanged.
+static inline uint32_t cost_normalize(uint32_t sum, const uint32_t *norm, int pixels)
+{
+    return (uint32_t)(((uint64_t)sum * norm[pixels] + (1u << (COST_NORM_SHIFT - 1))) >> COST_NORM_SHIFT);
+}
+
+// Get the sum absolute difference between kernels of edge pixels either side
+// in 2 images, over the kernel pixels that exist in both images and scaled up
+// to a full kernel with norm from cost_norm_fill(edge). For census images this
+// is the sum of Hamming distances instead.
+uint32_t get_sum_absolute_difference(int x_1, int y_1, int x_2, int y_2, struct ppm_array *img_left, struct ppm_array *img_right, const uint32_t *norm, int edge)
+{
+    // Clip the kernel to the pixels that exist in both images, as the
+    // remaining pixels are contiguous each kernel row is a single run of bytes
+    int i_min = -edge;
+    int i_max = edge;
+    int j_min = -edge;
+    int j_max = edge;
+    i_min = -x_1 > i_min ? -x_1 : i_min;
+    i_min = -x_2 > i_min ? -x_2 : i_min;
+    i_max = img_left->width - 1 - x_1 < i_max ? img_left->width - 1 - x_1 : i_max;
+    i_max = img_right->width - 1 - x_2 < i_max ? img_right->width - 1 - x_2 : i_max;
+    j_min = -y_1 > j_min ? -y_1 : j_min;
+    j_min = -y_2 > j_min ? -y_2 : j_min;
+    j_max = img_left->height - 1 - y_1 < j_max ? img_left->height - 1 - y_1 : j_max;
+    j_max = img_right->height - 1 - y_2 < j_max ? img_right->height - 1 - y_2 : j_max;
+
+    uint32_t SAD = 0;
+    int pixels = 0;
+    if (i_min <= i_max && j_min <= j_max)
+    {
+        const struct sad_kernels *kernels = sad_kernels_get();
+        if (ppm_array_is_census(img_left))
+        {
+            SAD = kernels->hamming_block(census_at(img_left, x_1 + i_min, y_1 + j_min), img_left->stride / CENSUS_CHANNELS,
+                                         census_at(img_right, x_2 + i_min, y_2 + j_min), img_right->stride / CENSUS_CHANNELS,
+                                         i_max - i_min + 1, j_max - j_min + 1);
+        }
+        else if (i_max - i_min == 2 * edge && j_max - j_min == 2 * edge)
+        {
+            // Whole kernels, most pixels, have a kernel specialized for the size
+            SAD = window_kernels_get(edge)->sad[img_left->channels == 3](
+                ppm_array_at(img_left, x_1 + i_min, y_1 + j_min), img_left->stride,
+                ppm_array_at(img_right, x_2 + i_min, y_2 + j_min), img_right->stride, edge);
+        }
+        else
+        {
+            int len = (i_max - i_min + 1) * img_left->channels;
+            SAD = kernels->block_sad(ppm_array_at(img_left, x_1 + i_min, y_1 + j_min), img_left->stride,
+                                     ppm_array_at(img_right, x_2 + i_min, y_2 + j_min), img_right->stride,
+                                     len, j_max - j_min + 1);
+        }
+        pixels = (i_max - i_min + 1) * (j_max - j_min + 1);
+    }
+
+    // Scale by the number of valid pixels, to get comparable matches. This 
+    // solves edge cases when pixels don't exist (such as on the edge of an 
+    // image).
+    if (pixels == 0)
+    {
+        return UINT32_MAX;
+    }
+    return cost_normalize(SAD, norm, pixels);
+}
+
+// Calculate a parabolic approximation, allows us to provide sub-pixel accuracy 
+// in the disparity map.
+// Source: http://mccormickml.com/2014/01/10/stereo-vision-tutorial-part-i/
+double parabolic_approximation(double C_1, double C_2, double C_3, double d_2)
+{
+    return d_2 - ((C_3 - C_1) / (C_1 - 2 * C_2 + C_3)) / 2;
+}
+
+// Pick the disparity with the lowest cost, then refine it to sub-pixel accuracy
+// using its neighbours. costs holds search_len + 1 entries, of which only the 
+// first count have been computed (the rest must be zero).
+double select_disparity(const uint32_t *costs, int count, int search_len, int offset)
+{
+    uint32_t min_SAD = UINT32_MAX;
+    int disparity = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (costs[i] < min_SAD)
+        {
+            min_SAD = costs[i];
+            disparity = i + offset;
+        }
+    }
+
+    // Sub-pixel approximation
+    if (disparity > 0 && disparity < search_len)
+    {
+        return parabolic_approximation(costs[disparity - 1 - offset], costs[disparity - offset], costs[disparity + 1 - offset], disparity + offset);
+    }
+    return disparity;
+}
+
+// Picks the disparity like select_disparity(), and sets *confidence to how far 
+// to trust it, from 0 to 255, in the same pass over the costs. That's the 
+// product of three measures between 0 and 1:
+// - the peak ratio (c2 - c1) / c2 of the best cost c1 and the best cost c2 that
+//   isn't its neighbour, low where another disparity matches nearly as well
+// - texture, (mean - c1) / mean, low for the flat cost curves of patches with
+//   no texture
+// - the curvature parabolic_approximation() fits at the best cost, over the 
+//   mean, times CONFIDENCE_CURVATURE_GAIN and capped at 1. This only matters 
+//   for flat bottomed minima, which don't pin the disparity down.
+// Pixels with no disparity to compare beyond the best and its neighbours, at
+// the left edge, get 0.
+double select_disparity_confidence(const uint32_t *costs, int count, int search_len, int offset, uint8_t *confidence)
+{
+    uint32_t min_SAD = UINT32_MAX;
+    int best = 0;
+    uint64_t sum = 0;
+    // Lowest cost up to two before the current one, and the lowest costs 
+    // before and after the best one that aren't its neighbours
+    uint32_t lowest = UINT32_MAX;
+    uint32_t runner_before = UINT32_MAX;
+    uint32_t runner_after = UINT32_MAX;
+    for (int i = 0; i < count; i++)
+    {
+        if (i >= 2 && costs[i - 2] < lowest)
+        {
+            lowest = costs[i - 2];
+        }
+        if (costs[i] < min_SAD)
+        {
+            min_SAD = costs[i];
+            best = i;
+            runner_before = lowest;
+            runner_after = UINT32_MAX;
+        }
+        else if (i >= best + 2 && costs[i] < runner_after)
+        {
+            runner_after = costs[i];
+        }
+        sum += costs[i];
+    }
+
+    uint32_t runner_up = runner_before < runner_after ? runner_before : runner_after;
+    double mean = (double)sum / count;
+    if (runner_up == UINT32_MAX || runner_up == 0 || mean == 0)
+    {
+        *confidence = 0;
+    }
+    else
+    {
+        double c1 = min_SAD;
+        double ratio = (runner_up - c1) / runner_up;
+        double texture = (mean - c1) / mean;
+        // A missing neighbour mirrors the other one
+        double before = best > 0 ? costs[best - 1] : costs[best + 1];
+        double after = best + 1 < count ? costs[best + 1] : before;
+        double curvature = CONFIDENCE_CURVATURE_GAIN * (before + after - 2 * c1) / mean;
+        curvature = curvature < 1 ? curvature : 1;
+        *confidence = (uint8_t)(255 * ratio * texture * curvature + 0.5);
+    }
+
+    // Sub-pixel approximation, as in select_disparity()
+    int disparity = best + offset;
+    if (disparity > 0 && disparity < search_len)
+    {
+        return parabolic_approximation(costs[disparity - 1 - offset], costs[disparity - offset], costs[disparity + 1 - offset], disparity + offset);
+    }
+    return disparity;
+}
+
+// Makes sure buffer holds at least count elements of size bytes, replacing it
+// with a zeroed one if it's too small. capacity holds the current number of 
+// elements. Returns the buffer.
+static void *buffer_reserve(void *buffer, size_t *capacity, size_t count, size_t size)
+{
+    if (*capacity >= count && buffer)
+    {
+        return buffer;
+    }
+    free(buffer);
+    buffer = calloc(count, size);
+    if (!buffer)
+    {
+        fprintf(stderr, "Unable to allocate memory\n");
+        exit(1);
+    }
+    *capacity = count;
+    return buffer;
+}
+
+// Running cost aggregation for block matching a whole image pair. For every 
+// candidate disparity it keeps the per-column sums of absolute differences over
+// the rows inside the kernel window. Moving up or down a row adds the entering 
+// row and removes the leaving one, and the window sums along a row are a 
+// running sum over those columns, so a pixel's SAD costs the same for any 
+// kernel size. Census images are summed the same way, with one Hamming 
+// distance per pixel in place of the channel differences.
+struct sad_engine
+{
+    struct ppm_array *img_left;
+    struct ppm_array *img_right;
+    int search_len;
+    // Column sums per pixel, the image channels or 1 for census images
+    int channels;
+    // Pixels above/below/left/right of a pixel in its kernel window
+    int edge;
+    // Disparities [d_min, d_max] of pixels [x_start, x_end) of each row are
+    // matched, the whole search range and row unless sad_engine_window()
+    // narrows them. Column sums outside are left as they were.
+    int d_min;
+    int d_max;
+    int x_start;
+    int x_end;
+    // Row whose window sums are in cost, and the image rows summed into col
+    int row;
+    int top;
+    int bottom;
+    // Number of rows the images hold as a ring buffer, image row y being row
+    // y % ring of the array. 0 for whole images.
+    int ring;
+    // (search_len + 1) rows of width * channels column sums, one per disparity
+    uint16_t *col;
+    // (search_len + 1) rows of width window sums for the current row
+    uint32_t *cost;
+    // Per-pixel column sums for one disparity
+    uint32_t *col_pixel;
+    // Census only, Hamming distances of the rows entering and leaving the
+    // window and a row of zeros to difference them against
+    uint8_t *hamming_in;
+    uint8_t *hamming_out;
+    uint8_t *zero;
+    // cost_norm_fill() for edge
+    uint32_t *norm;
+    // Allocated elements of the buffers, which are only replaced when an image
+    // pair needs more
+    size_t col_capacity;
+    size_t cost_capacity;
+    size_t row_capacity[4];
+    size_t norm_capacity;
+};
+
+// Makes sure the engine's buffers are big enough for images of the given width
+// and cost channels (1 for census), search range and kernel edge size. eng 
+// must be zeroed before the first call.
+void sad_engine_reserve(struct sad_engine *eng, int width, int channels, int search_len, int edge)
+{
+    size_t row_len = (size_t)width * channels;
+    eng->col = (uint16_t *)buffer_reserve(eng->col, &eng->col_capacity, row_len * (search_len + 1), sizeof(uint16_t));
+    eng->cost = (uint32_t *)buffer_reserve(eng->cost, &eng->cost_capacity, (size_t)width * (search_len + 1), sizeof(uint32_t));
+    eng->col_pixel = (uint32_t *)buffer_reserve(eng->col_pixel, &eng->row_capacity[0], width, sizeof(uint32_t));
+    eng->hamming_in = (uint8_t *)buffer_reserve(eng->hamming_in, &eng->row_capacity[1], width, 1);
+    eng->hamming_out = (uint8_t *)buffer_reserve(eng->hamming_out, &eng->row_capacity[2], width, 1);
+    // Never written, so it stays zeroed
+    eng->zero = (uint8_t *)buffer_reserve(eng->zero, &eng->row_capacity[3], width, 1);
+    size_t full = (size_t)(2 * edge + 1) * (2 * edge + 1);
+    eng->norm = (uint32_t *)buffer_reserve(eng->norm, &eng->norm_capacity, full + 1, sizeof(uint32_t));
+}
+
+// Sets the engine up for the given image pair and kernel edge size. eng must be
+// zeroed before the first call, later calls reuse its buffers and only 
+// allocate if the images or search range got bigger.
+void sad_engine_init(struct sad_engine *eng, struct ppm_array *img_left, struct ppm_array *img_right, int search_len, int edge)
+{
+    if (img_left->width != img_right->width || img_left->height != img_right->height ||
+        img_left->channels != img_right->channels)
+    {
+        fprintf(stderr, "Left and right images must have the same size\n");
+        exit(1);
+    }
+    eng->img_left = img_left;
+    eng->img_right = img_right;
+    eng->search_len = search_len;
+    eng->channels = ppm_array_is_census(img_left) ? 1 : img_left->channels;
+    eng->edge = edge;
+    eng->row = -1;
+    eng->ring = 0;
+    eng->d_min = 0;
+    eng->d_max = search_len;
+    eng->x_start = 0;
+    eng->x_end = img_left->width;
+    sad_engine_reserve(eng, img_left->width, eng->channels, search_len, edge);
+    cost_norm_fill(eng->norm, edge);
+}
+
+// Frees the engine's buffers.
+void sad_engine_free(struct sad_engine *eng)
+{
+    free(eng->col);
+    free(eng->cost);
+    free(eng->col_pixel);
+    free(eng->hamming_in);
+    free(eng->hamming_out);
+    free(eng->zero);
+    free(eng->norm);
+    memset(eng, 0, sizeof(*eng));
+}
+
+// Returns y, or the first row after [top, bottom] if y is inside of it.
+static int sad_engine_next_row(int y, int top, int bottom)
+{
+    if (y >= top && y <= bottom)
+    {
+        y = bottom + 1;
+    }
+    return y;
+}
+
+// Narrows the engine to disparities [d_min, d_max] of pixels [x_start, x_end)
+// of each row. Seeking then only keeps the column sums those pixels' windows
+// need at those disparities, the rest keep their old values.
+void sad_engine_window(struct sad_engine *eng, int x_start, int x_end, int d_min, int d_max)
+{
+    eng->x_start = x_start;
+    eng->x_end = x_end;
+    eng->d_min = d_min;
+    eng->d_max = d_max;
+}
+
+// Sets [*start, *end) to the columns whose sums the window needs at disparity
+// d, those with a match in the right image that are inside a window pixel's
+// kernel.
+static inline void sad_engine_columns(struct sad_engine *eng, int d, int *start, int *end)
+{
+    *start = eng->x_start - eng->edge > d ? eng->x_start - eng->edge : d;
+    *end = eng->x_end + eng->edge < eng->img_left->width ? eng->x_end + eng->edge : eng->img_left->width;
+}
+
+// Returns the left and right image rows y from column x at disparity d, as the
+// bytes the column sums difference. Census rows are turned into the Hamming 
+// distances of n pixels in out, and are differenced against zeros.
+static inline void sad_engine_rows(struct sad_engine *eng, int d, int x, int y, int n, uint8_t *out, const uint8_t **a,
+                                   const uint8_t **b)
+{
+    if (eng->ring)
+    {
+        y %= eng->ring;
+    }
+    if (ppm_array_is_census(eng->img_left))
+    {
+        sad_kernels_get()->hamming_row(census_at(eng->img_left, x, y), census_at(eng->img_right, x - d, y), out, n);
+        *a = out;
+        *b = eng->zero;
+    }
+    else
+    {
+        *a = ppm_array_at(eng->img_left, x, y);
+        *b = ppm_array_at(eng->img_right, x - d, y);
+    }
+}
+
+// Updates the column sums of every disparity for the kernel window moving from
+// rows [top, bottom] to rows [new_top, new_bottom]. Pixels with no match in the
+// right image contribute nothing.
+void sad_engine_move(struct sad_engine *eng, int top, int bottom, int new_top, int new_bottom)
+{
+    const struct sad_kernels *kernels = sad_kernels_get();
+    int channels = eng->channels;
+    int row_len = eng->img_left->width * channels;
+    const uint8_t *a_in, *b_in, *a_out, *b_out;
+    for (int d = eng->d_min; d <= eng->d_max && d < eng->img_left->width; d++)
+    {
+        int start, end;
+        sad_engine_columns(eng, d, &start, &end);
+        if (start >= end)
+        {
+            continue;
+        }
+        uint16_t *col = eng->col + d * row_len + start * channels;
+        int pixels = end - start;
+        int n = pixels * channels;
+        int y_in = sad_engine_next_row(new_top, top, bottom);
+        int y_out = sad_engine_next_row(top, new_top, new_bottom);
+
+        // Swap a leaving row for an entering one in a single pass where we can
+        while (y_in <= new_bottom && y_out <= bottom)
+        {
+            sad_engine_rows(eng, d, start, y_in, pixels, eng->hamming_in, &a_in, &b_in);
+            sad_engine_rows(eng, d, start, y_out, pixels, eng->hamming_out, &a_out, &b_out);
+            kernels->col_update(col, a_in, b_in, a_out, b_out, n);
+            y_in = sad_engine_next_row(y_in + 1, top, bottom);
+            y_out = sad_engine_next_row(y_out + 1, new_top, new_bottom);
+        }
+        for (; y_in <= new_bottom; y_in = sad_engine_next_row(y_in + 1, top, bottom))
+        {
+            sad_engine_rows(eng, d, start, y_in, pixels, eng->hamming_in, &a_in, &b_in);
+            kernels->col_add(col, a_in, b_in, n);
+        }
+        for (; y_out <= bottom; y_out = sad_engine_next_row(y_out + 1, new_top, new_bottom))
+        {
+            sad_engine_rows(eng, d, start, y_out, pixels, eng->hamming_out, &a_out, &b_out);
+            kernels->col_sub(col, a_out, b_out, n);
+        }
+    }
+}
+
+// Sums the column sums of each disparity along the current row into the 
+// window sums in cost.
+void sad_engine_aggregate(struct sad_engine *eng)
+{
+    int width = eng->img_left->width;
+    int channels = eng->channels;
+    int row_len = width * channels;
+    int edge = eng->edge;
+    const struct window_kernels *windows = window_kernels_get(edge);
+    for (int d = eng->d_min; d <= eng->d_max && d < width; d++)
+    {
+        // Columns outside [start, end) have no match or are outside every
+        // window, and count as 0
+        int start, end;
+        sad_engine_columns(eng, d, &start, &end);
+        // Pixels left of d - edge + 1 never test this disparity
+        int x = d - edge + 1 < eng->x_start ? eng->x_start : d - edge + 1;
+        if (x >= eng->x_end)
+        {
+            continue;
+        }
+        windows->aggregate[channels == 3](eng->col + d * row_len, eng->col_pixel, eng->cost + d * width, edge, start,
+                                          end, x, eng->x_end);
+    }
+}
+
+// Rebuilds the column sums of the engine's window over rows [top, bottom] from
+// scratch, e.g. for disparities just added to the window.
+void sad_engine_build_columns(struct sad_engine *eng)
+{
+    int row_len = eng->img_left->width * eng->channels;
+    for (int d = eng->d_min; d <= eng->d_max && d < eng->img_left->width; d++)
+    {
+        int start, end;
+        sad_engine_columns(eng, d, &start, &end);
+        if (start < end)
+        {
+            memset(eng->col + d * row_len + start * eng->channels, 0, sizeof(uint16_t) * (end - start) * eng->channels);
+        }
+    }
+    sad_engine_move(eng, eng->top, eng->top - 1, eng->top, eng->bottom);
+}
+
+// Moves the engine's column sums to row y without computing the window sums.
+// Moving to a neighbouring row is incremental, any other row rebuilds them.
+void sad_engine_seek_columns(struct sad_engine *eng, int y)
+{
+    int height = eng->img_left->height;
+    int top = y - eng->edge < 0 ? 0 : y - eng->edge;
+    int bottom = y + eng->edge >= height ? height - 1 : y + eng->edge;
+    if (eng->row >= 0 && (y == eng->row + 1 || y == eng->row - 1))
+    {
+        sad_engine_move(eng, eng->top, eng->bottom, top, bottom);
+        eng->row = y;
+        eng->top = top;
+        eng->bottom = bottom;
+    }
+    else
+    {
+        eng->row = y;
+        eng->top = top;
+        eng->bottom = bottom;
+        sad_engine_build_columns(eng);
+    }
+}
+
+// Moves the engine to row y and computes that row's window sums.
+void sad_engine_seek(struct sad_engine *eng, int y)
+{
+    sad_engine_seek_columns(eng, y);
+    sad_engine_aggregate(eng);
+}
+
+// Returns how many disparities, starting from 0, pixel x tests. Like 
+// get_disparity, the kernel has to overlap the right image.
+static inline int sad_engine_tested(struct sad_engine *eng, int x)
+{
+    return x + eng->edge < eng->search_len + 1 ? x + eng->edge : eng->search_len + 1;
+}
+
+// Returns how many kernel pixels of pixel x in the current row have a match in
+// the right image at disparity d, which are the pixels summed in cost.
+static inline int sad_engine_pixels(struct sad_engine *eng, int x, int d)
+{
+    int width = eng->img_left->width;
+    int right = x + eng->edge >= width ? width - 1 : x + eng->edge;
+    int left = x - eng->edge < d ? d : x - eng->edge;
+    return (right - left + 1) * (eng->bottom - eng->top + 1);
+}
+
+// Fills costs with the absolute difference of every disparity tested at pixel 
+// x of the current row, scaled to a full kernel like 
+// get_sum_absolute_difference. Returns how many disparities were tested, the 
+// remaining entries up to search_len are zeroed.
+int sad_engine_costs(struct sad_engine *eng, int x, uint32_t *costs)
+{
+    int width = eng->img_left->width;
+    int count = sad_engine_tested(eng, x);
+    for (int d = 0; d < count; d++)
+    {
+        costs[d] = cost_normalize(eng->cost[d * width + x], eng->norm, sad_engine_pixels(eng, x, d));
+    }
+    for (int d = count; d <= eng->search_len; d++)
+    {
+        costs[d] = 0;
+    }
+    return count;
+}
+
+// Buffers for the disparity search, one set per thread. They are kept between
+// calls and only grow when a bigger image or search range comes along, so once
+// every thread has matched a frame the search no longer touches the heap. 
+// Pool workers free theirs when they exit, any other thread can free its own 
+// with match_scratch_release().
+struct match_scratch
+{
+    struct sad_engine eng;
+    // Candidate costs of one pixel
+    uint32_t *costs;
+    size_t costs_capacity;
+    // Best disparities so far of a block_match_tiled() tile
+    struct disparity_choice *choices;
+    size_t choices_capacity;
+    // cost_norm_fill() for norm_edge, 0 before the first fill
+    uint32_t *norm;
+    size_t norm_capacity;
+    int norm_edge;
+};
+
+static pthread_key_t match_scratch_key;
+static pthread_once_t match_scratch_once = PTHREAD_ONCE_INIT;
+
+static void match_scratch_free(void *arg)
+{
+    struct match_scratch *scratch = (struct match_scratch *)arg;
+    sad_engine_free(&scratch->eng);
+    free(scratch->costs);
+    free(scratch->choices);
+    free(scratch->norm);
+    free(scratch);
+}
+
+static void match_scratch_create_key(void)
+{
+    pthread_key_create(&match_scratch_key, match_scratch_free);
+}
+
+// Returns the calling thread's scratch, with room for count candidate costs.
+struct match_scratch *match_scratch_get(int count)
+{
+    pthread_once(&match_scratch_once, match_scratch_create_key);
+    struct match_scratch *scratch = (struct match_scratch *)pthread_getspecific(match_scratch_key);
+    if (!scratch)
+    {
+        scratch = (struct match_scratch *)calloc(1, sizeof(struct match_scratch));
+        if (!scratch)
+        {
+            fprintf(stderr, "Unable to allocate memory\n");
+            exit(1);
+        }
+        pthread_setspecific(match_scratch_key, scratch);
+    }
+    scratch->costs = (uint32_t *)buffer_reserve(scratch->costs, &scratch->costs_capacity, count, sizeof(uint32_t));
+    return scratch;
+}
+
+// Returns the scratch's cost_norm_fill() for the given kernel edge size, only
+// refilled when the edge size changes.
+static const uint32_t *match_scratch_norm(struct match_scratch *scratch, int edge)
+{
+    if (scratch->norm_edge != edge)
+    {
+        size_t full = (size_t)(2 * edge + 1) * (2 * edge + 1);
+        scratch->norm = (uint32_t *)buffer_reserve(scratch->norm, &scratch->norm_capacity, full + 1, sizeof(uint32_t));
+        cost_norm_fill(scratch->norm, edge);
+        scratch->norm_edge = edge;
+    }
+    return scratch->norm;
+}
+
+// Size of the images matched by match_scratch_reserve()
+struct match_scratch_size
+{
+    int width;
+    int channels;
+    int search_len;
+    int edge;
+};
+
+static void match_scratch_reserve_worker(void *arg, int worker)
+{
+    struct match_scratch_size *size = (struct match_scratch_size *)arg;
+    struct match_scratch *scratch = match_scratch_get(size->search_len + 1);
+    int channels = size->channels == CENSUS_CHANNELS ? 1 : size->channels;
+    sad_engine_reserve(&scratch->eng, size->width, channels, size->search_len, size->edge);
+    match_scratch_norm(scratch, size->edge);
+}
+
+// Sizes the scratch of every worker of pool, or of the calling thread if pool
+// is NULL, for block matching images of the given width and channels
+// (CENSUS_CHANNELS for census images) over search_len disparities with a
+// kernel of edge pixels either side. Matching images up to that size then
+// makes no allocations, even on the first frame.
+void match_scratch_reserve(struct thread_pool *pool, int width, int channels, int search_len, int edge)
+{
+    struct match_scratch_size size = {width, channels, search_len, edge};
+    if (pool)
+    {
+        thread_pool_run_each(pool, match_scratch_reserve_worker, &size);
+    }
+    else
+    {
+        match_scratch_reserve_worker(&size, 0);
+    }
+}
+
+// Frees the calling thread's scratch, e.g. before the main thread exits.
+void match_scratch_release(void)
+{
+    pthread_once(&match_scratch_once, match_scratch_create_key);
+    struct match_scratch *scratch = (struct match_scratch *)pthread_getspecific(match_scratch_key);
+    if (scratch)
+    {
+        match_scratch_free(scratch);
+        pthread_setspecific(match_scratch_key, NULL);
+    }
+}
+
+// Calculate the disparity for a given pixel with a kernel of edge pixels either
+// side, and its confidence as in select_disparity_confidence() if confidence 
+// isn't NULL.
+double get_disparity_edge(struct ppm_array *img_left, struct ppm_array *img_right, int x, int y, int search_len, int offset, int edge, uint8_t *confidence)
+{
+    int count = 0;
+    struct match_scratch *scratch = match_scratch_get(search_len + 1);
+    const uint32_t *norm = match_scratch_norm(scratch, edge);
+    uint32_t *costs = scratch->costs;
+    for (int i = 0; -i <= search_len && i + x + edge - offset > 0; i--)
+    {
+        costs[-i] = get_sum_absolute_difference(x, y, x + i - offset, y, img_left, img_right, norm, edge);
+        count++;
+    }
+    for (int i = count; i <= search_len; i++)
+    {
+        costs[i] = 0;
+    }
+    if (confidence)
+    {
+        return select_disparity_confidence(costs, count, search_len, offset, confidence);
+    }
+    return select_disparity(costs, count, search_len, offset);
+}
+
+// Calculate the disparity for a given pixel, and its confidence as in 
+// select_disparity_confidence() if confidence isn't NULL.
+double get_disparity_confidence(struct ppm_array *img_left, struct ppm_array *img_right, int x, int y, int search_len, int offset, uint8_t *confidence)
+{
+    return get_disparity_edge(img_left, img_right, x, y, search_len, offset, KERNEL_EDGE_SIZE, confidence);
+}
+
+// Calculate the disparity for a given pixel.
+double get_disparity(struct ppm_array *img_left, struct ppm_array *img_right, int x, int y, int search_len, int offset)
+{
+    return get_disparity_confidence(img_left, img_right, x, y, search_len, offset, NULL);
+}
+
+// Perform block matching for rows [y_start, y_end) of the disparity map, with
+// a kernel of edge pixels either side. Only the image rows within edge of the
+// band are read. confidence, a single channel array the size of the map, gets 
+// each pixel's confidence from select_disparity_confidence() unless it is NULL.
+void block_match_rows(struct ppm_array *img_left, struct ppm_array *img_right, struct disparity_map *img_out, struct ppm_array *confidence, int search_len, int edge, int y_start, int y_end)
+{
+    struct match_scratch *scratch = match_scratch_get(search_len + 1);
+    struct sad_engine *eng = &scratch->eng;
+    sad_engine_init(eng, img_left, img_right, search_len, edge);
+    for (int j = y_start; j < y_end; j++)
+    {
+        sad_engine_seek(eng, j);
+        uint8_t *confidence_row = confidence ? ppm_array_at(confidence, 0, j) : NULL;
+        for (int i = 0; i < img_out->width; i++)
+        {
+            int count = sad_engine_costs(eng, i, scratch->costs);
+            double disparity = confidence_row ? select_disparity_confidence(scratch->costs, count, search_len, 0, &confidence_row[i])
+                                              : select_disparity(scratch->costs, count, search_len, 0);
+            *disparity_map_at(img_out, i, j) = disparity_to_fixed(disparity);
+        }
+    }
+}
+
+// Perform block matching to generate a disparity map
+void block_match(struct ppm_array *img_left, struct ppm_array *img_right, struct disparity_map *img_out, int search_len)
+{
+    if (img_out->width != img_left->width || img_out->height != img_left->height)
+    {
+        fprintf(stderr, "Disparity map must have the same size as the images\n");
+        exit(1);
+    }
+    block_match_rows(img_left, img_right, img_out, NULL, search_len, KERNEL_EDGE_SIZE, 0, img_out->height);
+}
+
+// A rectangle of disparity map pixels, columns [x_start, x_end) of rows
+// [y_start, y_end). A band of rows spans the full width, a sample point is a
+// 1x1 rectangle.
+struct disparity_roi
+{
+    int x_start;
+    int x_end;
+    int y_start;
+    int y_end;
+};
+
+// Perform block matching for only the pixels inside the given rectangles,
+// leaving the rest of img_out untouched. Each pixel gets exactly the disparity
+// block_match() would give it. Wide rectangles run the column sums over their
+// rows, which costs whole image rows plus a kernel of halo rows per
+// rectangle; narrow ones and points search each pixel on its own. The kernel
+// has edge pixels either side, and each pixel gets the disparity 
+// block_match_edge() would give it with the same edge.
+void block_match_roi_edge(struct ppm_array *img_left, struct ppm_array *img_right, struct disparity_map *img_out, int search_len,
+                          const struct disparity_roi *rois, int count, int edge)
+{
+    if (img_out->width != img_left->width || img_out->height != img_left->height)
+    {
+        fprintf(stderr, "Disparity map must have the same size as the images\n");
+        exit(1);
+    }
+    if (edge < 1 || edge > KERNEL_EDGE_MAX)
+    {
+        fprintf(stderr, "Block matching needs a kernel edge size from 1 to %d\n", KERNEL_EDGE_MAX);
+        exit(1);
+    }
+    struct match_scratch *scratch = match_scratch_get(search_len + 1);
+    struct sad_engine *eng = &scratch->eng;
+    sad_engine_init(eng, img_left, img_right, search_len, edge);
+    int channels = eng->channels;
+    int kernel = 2 * edge + 1;
+    for (int r = 0; r < count; r++)
+    {
+        int x_start = rois[r].x_start < 0 ? 0 : rois[r].x_start;
+        int x_end = rois[r].x_end > img_out->width ? img_out->width : rois[r].x_end;
+        int y_start = rois[r].y_start < 0 ? 0 : rois[r].y_start;
+        int y_end = rois[r].y_end > img_out->height ? img_out->height : rois[r].y_end;
+        if (x_start >= x_end || y_start >= y_end)
+        {
+            continue;
+        }
+
+        // Rough work per disparity: the column sums add and remove a row per
+        // pixel, plus the halo rows, and sum the channels along each row,
+        // against a whole kernel per pixel searched on its own
+        int rows = y_end - y_start;
+        int64_t engine_work = (int64_t)img_out->width * ((kernel + rows) * 2 * channels + rows * (channels + 2));
+        int64_t pixel_work = (int64_t)(x_end - x_start) * rows * kernel * kernel * channels;
+        for (int j = y_start; j < y_end; j++)
+        {
+            if (engine_work < pixel_work)
+            {
+                sad_engine_seek(eng, j);
+            }
+            for (int i = x_start; i < x_end; i++)
+            {
+                double disparity;
+                if (engine_work < pixel_work)
+                {
+                    int tested = sad_engine_costs(eng, i, scratch->costs);
+                    disparity = select_disparity(scratch->costs, tested, search_len, 0);
+                }
+                else
+                {
+                    disparity = get_disparity_edge(img_left, img_right, i, j, search_len, 0, edge, NULL);
+                }
+                *disparity_map_at(img_out, i, j) = disparity_to_fixed(disparity);
+            }
+        }
+    }
+}
+
+// Perform block matching for only the pixels inside the given rectangles, as
+// block_match_roi_edge() with a kernel of KERNEL_EDGE_SIZE.
+void block_match_roi(struct ppm_array *img_left, struct ppm_array *img_right, struct disparity_map *img_out, int search_len,
+                     const struct disparity_roi *rois, int count)
+{
+    block_match_roi_edge(img_left, img_right, img_out, search_len, rois, count, KERNEL_EDGE_SIZE);
+}
+
+// One block_match_parallel() job
+struct block_match_job
+{
+    struct ppm_array *img_left;
+    struct ppm_array *img_right;
+    struct disparity_map *img_out;
+    struct ppm_array *confidence;
+    int search_len;
+    int edge;
+    int band_rows;
+};
+
+static void block_match_band(void *arg, int index, int worker)
+{
+    struct block_match_job *job = (struct block_match_job *)arg;
+    int y_start = index * job->band_rows;
+    int y_end = y_start + job->band_rows > job->img_out->height ? job->img_out->height : y_start + job->band_rows;
+    block_match_rows(job->img_left, job->img_right, job->img_out, job->confidence, job->search_len, job->edge, y_start,
+                     y_end);
+}
+
+// Perform block matching like block_match(), with a kernel of edge pixels 
+// above, below, left and right of each pixel in place of KERNEL_EDGE_SIZE. 
+// Windows up to WINDOW_KERNELS_MAX_EDGE match with kernels specialized for 
+// their size, bigger ones up to KERNEL_EDGE_MAX with the generic loops.
+// confidence, a single channel array the size of the map, gets each pixel's
+// confidence from select_disparity_confidence() unless it is NULL. Runs in
+// bands of rows on the pool's workers, pool may be NULL to run on this thread.
+void block_match_edge(struct ppm_array *img_left, struct ppm_array *img_right, struct disparity_map *img_out, struct ppm_array *confidence, int search_len, int edge, struct thread_pool *pool)
+{
+    if (img_out->width != img_left->width || img_out->height != img_left->height ||
+        (confidence && (confidence->width != img_out->width || confidence->height != img_out->height ||
+                        confidence->channels != 1)))
+    {
+        fprintf(stderr, "Disparity map and confidence must have the same size as the images\n");
+        exit(1);
+    }
+    if (edge < 1 || edge > KERNEL_EDGE_MAX)
+    {
+        fprintf(stderr, "Block matching needs a kernel edge size from 1 to %d\n", KERNEL_EDGE_MAX);
+        exit(1);
+    }
+    if (!pool)
+    {
+        block_match_rows(img_left, img_right, img_out, confidence, search_len, edge, 0, img_out->height);
+        return;
+    }
+    // Each band rebuilds the column sums over its top halo, so don't let 
+    // bands get much smaller than the kernel
+    int bands = pool->workers * BANDS_PER_WORKER;
+    int band_rows = (img_out->height + bands - 1) / bands;
+    if (band_rows < 2 * edge + 1)
+    {
+        band_rows = 2 * edge + 1;
+    }
+    struct block_match_job job = {img_left, img_right, img_out, confidence, search_len, edge, band_rows};
+    thread_pool_run(pool, block_match_band, &job, (img_out->height + band_rows - 1) / band_rows);
+}
+
+// Perform block matching on the pool's workers, split into bands of rows. 
+// Every pixel is computed the same way as by block_match(), so the result is 
+// identical to it.
+void block_match_parallel(struct ppm_array *img_left, struct ppm_array *img_right, struct disparity_map *img_out, int search_len, struct thread_pool *pool)
+{
+    block_match_edge(img_left, img_right, img_out, NULL, search_len, KERNEL_EDGE_SIZE, pool);
+}
+
+// Perform block matching like block_match(), and fill confidence, a single 
+// channel array the size of the map, with each pixel's confidence from
+// select_disparity_confidence(). It comes from the costs the disparity is picked 
+// from, so there is no separate pass over the images. Runs in bands of rows 
+// on the pool's workers, pool may be NULL to run on this thread.
+void block_match_confidence(struct ppm_array *img_left, struct ppm_array *img_right, struct disparity_map *img_out, struct ppm_array *confidence, int search_len, struct thread_pool *pool)
+{
+    block_match_edge(img_left, img_right, img_out, confidence, search_len, KERNEL_EDGE_SIZE, pool);
+}
+
+// Returns a monotonic time in seconds, for timing.
+double seconds_now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * 
+//                        CACHE-BLOCKED BLOCK MATCHING
+// 
+// block_match() moves the column sums of every disparity down a row before it
+// goes on to the next row, so on a wide image with a big search range the 
+// sums of a disparity have left the cache by the time the next row needs 
+// them. The tiled matcher splits the image into tiles and the search range 
+// into blocks of disparities, and moves one block's sums down all the rows of
+// a tile before the next block, keeping each pixel's best disparity so far in
+// between. Tile and block sizes come from the cache sizes, or from timing a 
+// few of them on the images. The disparities are the same as block_match()'s.
+//
+// * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * 
+
+// Tile and disparity block sizes of block_match_tiled()
+struct match_tiling
+{
+    int tile_width;
+    int tile_height;
+    // Disparities searched per pass over a tile, search_len + 1 searches them
+    // all in one pass
+    int disparity_block;
+};
+
+// A pixel's best disparity over the blocks searched so far, in increasing 
+// order of disparity. Holds what select_disparity() needs of the costs.
+struct disparity_choice
+{
+    uint32_t min_cost;
+    // Costs of the disparities either side of the best, and of the last 
+    // disparity searched
+    uint32_t before;
+    uint32_t after;
+    uint32_t previous;
+    int disparity;
+};
+
+// Returns a cache size from sysconf(), or fallback if the system doesn't 
+// report it.
+static long match_cache_size(int name, long fallback)
+{
+    long size = sysconf(name);
+    return size > 0 ? size : fallback;
+}
+
+// Sizes the tiles from the cache sizes, for matching images of the given width
+// and channels (CENSUS_CHANNELS for census images) over search_len 
+// disparities. A block's column and window sums fill half of L1, and if the 
+// whole search range of a tile fits in half of L2 it's searched in one pass, 
+// which saves rebuilding the column sums at the top of the tile per block.
+void match_tiling_auto(struct match_tiling *tiling, int width, int channels, int search_len)
+{
+    long l1 = match_cache_size(_SC_LEVEL1_DCACHE_SIZE, MATCH_L1_DEFAULT);
+    long l2 = match_cache_size(_SC_LEVEL2_CACHE_SIZE, MATCH_L2_DEFAULT);
+    // Column and window sum bytes per pixel and disparity
+    long pixel = (channels == CENSUS_CHANNELS ? 1 : channels) * sizeof(uint16_t) + sizeof(uint32_t);
+    long edges = 2 * KERNEL_EDGE_SIZE;
+    long tile_width = l2 / 2 / ((search_len + 1) * pixel) - edges;
+    if (tile_width >= MATCH_TILE_MIN)
+    {
+        tiling->tile_width = tile_width / MATCH_TILE_MIN * MATCH_TILE_MIN;
+        tiling->disparity_block = search_len + 1;
+    }
+    else
+    {
+        tiling->tile_width = MATCH_TILE_WIDTH;
+        long block = l1 / 2 / ((MATCH_TILE_WIDTH + edges) * pixel);
+        tiling->disparity_block = block < 1 ? 1 : block;
+    }
+    if (tiling->tile_width > width)
+    {
+        tiling->tile_width = width;
+    }
+    tiling->tile_height = MATCH_TILE_HEIGHT;
+}
+
+// Searches one block of disparities, the engine's window, for every pixel of
+// the row the engine is at from x_start on, updating their choices.
+static void disparity_choice_update(struct disparity_choice *choices, struct sad_engine *eng)
+{
+    int width = eng->img_left->width;
+    for (int x = eng->x_start; x < eng->x_end; x++)
+    {
+        struct disparity_choice c = choices[x - eng->x_start];
+        int tested = sad_engine_tested(eng, x);
+        int d_max = eng->d_max < tested - 1 ? eng->d_max : tested - 1;
+        for (int d = eng->d_min; d <= d_max; d++)
+        {
+            uint32_t cost = cost_normalize(eng->cost[d * width + x], eng->norm, sad_engine_pixels(eng, x, d));
+            if (cost < c.min_cost)
+            {
+                c.min_cost = cost;
+                c.disparity = d;
+                c.before = c.previous;
+                // Untested disparities cost 0, as in select_disparity()
+                c.after = 0;
+            }
+            else if (d == c.disparity + 1)
+            {
+                c.after = cost;
+            }
+            c.previous = cost;
+        }
+        choices[x - eng->x_start] = c;
+    }
+}
+
+// One block_match_tiled() job
+struct block_match_tiled_job
+{
+    struct ppm_array *img_left;
+    struct ppm_array *img_right;
+    struct disparity_map *img_out;
+    int search_len;
+    struct match_tiling tiling;
+    int tiles_x;
+};
+
+static void block_match_tile(void *arg, int index, int worker)
+{
+    struct block_match_tiled_job *job = (struct block_match_tiled_job *)arg;
+    const struct match_tiling *tiling = &job->tiling;
+    int width = job->img_out->width;
+    int height = job->img_out->height;
+    int x_start = index % job->tiles_x * tiling->tile_width;
+    int x_end = x_start + tiling->tile_width < width ? x_start + tiling->tile_width : width;
+    int y_start = index / job->tiles_x * tiling->tile_height;
+    int y_end = y_start + tiling->tile_height < height ? y_start + tiling->tile_height : height;
+    int tile_width = x_end - x_start;
+
+    struct match_scratch *scratch = match_scratch_get(job->search_len + 1);
+    size_t pixels = (size_t)tile_width * (y_end - y_start);
+    struct disparity_choice *choices = (struct disparity_choice *)buffer_reserve(
+        scratch->choices, &scratch->choices_capacity, pixels, sizeof(struct disparity_choice));
+    scratch->choices = choices;
+    for (size_t p = 0; p < pixels; p++)
+    {
+        choices[p].min_cost = UINT32_MAX;
+        choices[p].before = choices[p].after = choices[p].previous = 0;
+        choices[p].disparity = 0;
+    }
+
+    struct sad_engine *eng = &scratch->eng;
+    sad_engine_init(eng, job->img_left, job->img_right, job->search_len, KERNEL_EDGE_SIZE);
+    // Pixels test disparities up to x + edge - 1, so blocks past the tile's 
+    // last pixel are skipped
+    for (int d_min = 0; d_min <= job->search_len && d_min < x_end + KERNEL_EDGE_SIZE - 1;
+         d_min += tiling->disparity_block)
+    {
+        int d_max = d_min + tiling->disparity_block - 1;
+        sad_engine_window(eng, x_start, x_end, d_min, d_max < job->search_len ? d_max : job->search_len);
+        // Rebuild the column sums of the new block at the top of the tile
+        eng->row = -1;
+        for (int j = y_start; j < y_end; j++)
+        {
+            sad_engine_seek(eng, j);
+            disparity_choice_update(choices + (size_t)(j - y_start) * tile_width, eng);
+        }
+    }
+
+    for (int j = y_start; j < y_end; j++)
+    {
+        for (int i = x_start; i < x_end; i++)
+        {
+            struct disparity_choice *c = &choices[(size_t)(j - y_start) * tile_width + i - x_start];
+            double disparity = c->disparity;
+            if (c->disparity > 0 && c->disparity < job->search_len)
+            {
+                disparity = parabolic_approximation(c->before, c->min_cost, c->after, c->disparity);
+            }
+            *disparity_map_at(job->img_out, i, j) = disparity_to_fixed(disparity);
+        }
+    }
+}
+
+// Perform block matching a tile at a time, searching blocks of disparities per
+// pass over a tile as given by tiling. The tiles run on the pool's workers, 
+// pool may be NULL to run on this thread. The result is identical to 
+// block_match().
+void block_match_tiled(struct ppm_array *img_left, struct ppm_array *img_right, struct disparity_map *img_out,
+                       int search_len, const struct match_tiling *tiling, struct thread_pool *pool)
+{
+    if (img_out->width != img_left->width || img_out->height != img_left->height)
+    {
+        fprintf(stderr, "Disparity map must have the same size as the images\n");
+        exit(1);
+    }
+    if (tiling->tile_width < 1 || tiling->tile_height < 1 || tiling->disparity_block < 1)
+    {
+        fprintf(stderr, "Tile and disparity block sizes must be positive\n");
+        exit(1);
+    }
+    struct block_match_tiled_job job = {img_left, img_right, img_out, search_len, *tiling,
+                                        (img_out->width + tiling->tile_width - 1) / tiling->tile_width};
+    int tiles = job.tiles_x * ((img_out->height + tiling->tile_height - 1) / tiling->tile_height);
+    if (pool)
+    {
+        thread_pool_run(pool, block_match_tile, &job, tiles);
+    }
+    else
+    {
+        for (int t = 0; t < tiles; t++)
+        {
+            block_match_tile(&job, t, 0);
+        }
+    }
+}
+
+// Picks the fastest of a few tilings around match_tiling_auto()'s by timing 
+// each on a band of rows from the middle of the images, and stores it in 
+// tiling. Meant to be run once at startup on a first frame, on a tall image it
+// takes about as long as matching the frame.
+void match_tiling_tune(struct ppm_array *img_left, struct ppm_array *img_right, int search_len,
+                       struct thread_pool *pool, struct match_tiling *tiling)
+{
+    match_tiling_auto(tiling, img_left->width, img_left->channels, search_len);
+    int rows = MATCH_TUNE_ROWS < img_left->height ? MATCH_TUNE_ROWS : img_left->height;
+    struct ppm_array band[2] = {*img_left, *img_right};
+    for (int i = 0; i < 2; i++)
+    {
+        band[i].data = ppm_array_at(i ? img_right : img_left, 0, (img_left->height - rows) / 2);
+        band[i].height = rows;
+        band[i].buffer = NULL;
+    }
+    struct disparity_map map;
+    map.width = img_left->width;
+    map.height = rows;
+    allocate_disparity_map(&map);
+
+    struct match_tiling candidates[] = {
+        *tiling,
+        {MATCH_TILE_WIDTH, MATCH_TILE_HEIGHT, search_len + 1},
+        {2 * MATCH_TILE_WIDTH, MATCH_TILE_HEIGHT, search_len + 1},
+        {MATCH_TILE_WIDTH, MATCH_TILE_HEIGHT, tiling->disparity_block * 2},
+        {MATCH_TILE_WIDTH / 2, MATCH_TILE_HEIGHT, tiling->disparity_block * 2},
+        {img_left->width, MATCH_TILE_HEIGHT, search_len + 1},
+    };
+    double best = DBL_MAX;
+    for (size_t c = 0; c < sizeof(candidates) / sizeof(candidates[0]); c++)
+    {
+        if (candidates[c].tile_width > img_left->width)
+        {
+            candidates[c].tile_width = img_left->width;
+        }
+        if (candidates[c].disparity_block > search_len + 1)
+        {
+            candidates[c].disparity_block = search_len + 1;
+        }
+        for (int r = 0; r < MATCH_TUNE_REPEATS; r++)
+        {
+            double start = seconds_now();
+            block_match_tiled(&band[0], &band[1], &map, search_len, &candidates[c], pool);
+            double seconds = seconds_now() - start;
+            if (seconds < best)
+            {
+                best = seconds;
+                *tiling = candidates[c];
+            }
+        }
+    }
+    free_disparity_map(&map);
+}
+
+// * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * 
+//                        STREAMING BLOCK MATCHING
+// 
+// Block matching one image row at a time, as the rows come off the cameras. 
+// Only the 2 * KERNEL_EDGE_SIZE + 1 rows of the kernel window are kept, in 
+// ring buffers, and disparity row j is emitted as soon as image row 
+// j + KERNEL_EDGE_SIZE has arrived. The column sums are the same integers 
+// block_match() computes, so the output is identical to it.
+//
+// * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * 
+
+// Rows kept by a stereo_stream
+#define STREAM_ROWS (2 * KERNEL_EDGE_SIZE + 1)
+
+struct stereo_stream
+{
+    int width;
+    int height;
+    int channels;
+    int search_len;
+    // Image rows received and disparity rows emitted so far
+    int rows_in;
+    int rows_out;
+    // STREAM_ROWS row ring buffers, image row y is in row y % STREAM_ROWS
+    struct ppm_array left;
+    struct ppm_array right;
+    struct sad_engine eng;
+    uint32_t *costs;
+    // Disparity row being emitted, in the disparity_map format
+    uint16_t *row;
+    // Called with every disparity row, in order
+    void (*emit)(void *arg, int y, const uint16_t *row);
+    void *arg;
+};
+
+// Starts a new frame, dropping any rows of the current one.
+void stereo_stream_reset(struct stereo_stream *st)
+{
+    st->rows_in = 0;
+    st->rows_out = 0;
+    st->eng.row = -1;
+    st->eng.top = 0;
+    st->eng.bottom = -1;
+    memset(st->eng.col, 0, sizeof(uint16_t) * st->width * st->eng.channels * (st->search_len + 1));
+}
+
+// Sets up a stream for images of the given size and channels (1 or 3). emit is
+// called with arg for every disparity row, row holds width fixed-point 
+// disparities like a disparity_map row and is only valid during the call.
+void stereo_stream_init(struct stereo_stream *st, int width, int height, int channels, int search_len,
+                        void (*emit)(void *arg, int y, const uint16_t *row), void *arg)
+{
+    st->width = width;
+    st->height = height;
+    st->channels = channels;
+    st->search_len = search_len;
+    st->emit = emit;
+    st->arg = arg;
+    st->left.height = st->right.height = STREAM_ROWS;
+    st->left.width = st->right.width = width;
+    st->left.channels = st->right.channels = channels;
+    ppm_array_allocate(&st->left);
+    ppm_array_allocate(&st->right);
+    memset(&st->eng, 0, sizeof(st->eng));
+    sad_engine_init(&st->eng, &st->left, &st->right, search_len, KERNEL_EDGE_SIZE);
+    st->eng.ring = STREAM_ROWS;
+    st->costs = (uint32_t *)malloc(sizeof(uint32_t) * (search_len + 1));
+    st->row = (uint16_t *)malloc(sizeof(uint16_t) * width);
+    if (!st->costs || !st->row)
+    {
+        fprintf(stderr, "Unable to allocate memory\n");
+        exit(1);
+    }
+    stereo_stream_reset(st);
+}
+
+// Frees the stream's buffers.
+void stereo_stream_free(struct stereo_stream *st)
+{
+    free_ppm_array(&st->left);
+    free_ppm_array(&st->right);
+    sad_engine_free(&st->eng);
+    free(st->costs);
+    free(st->row);
+}
+
+// Moves the window to the one of the next disparity row and emits that row.
+static void stereo_stream_emit(struct stereo_stream *st)
+{
+    struct sad_engine *eng = &st->eng;
+    int y = st->rows_out;
+    int top = y - KERNEL_EDGE_SIZE < 0 ? 0 : y - KERNEL_EDGE_SIZE;
+    int bottom = y + KERNEL_EDGE_SIZE >= st->height ? st->height - 1 : y + KERNEL_EDGE_SIZE;
+    sad_engine_move(eng, eng->top, eng->bottom, top, bottom);
+    eng->row = y;
+    eng->top = top;
+    eng->bottom = bottom;
+    sad_engine_aggregate(eng);
+    for (int x = 0; x < st->width; x++)
+    {
+        int count = sad_engine_costs(eng, x, st->costs);
+        st->row[x] = disparity_to_fixed(select_disparity(st->costs, count, st->search_len, 0));
+    }
+    st->emit(st->arg, y, st->row);
+    st->rows_out++;
+}
+
+// Feeds the next row of both images, width * channels bytes each. Emits every
+// disparity row that no longer needs further image rows, which is the row 
+// KERNEL_EDGE_SIZE above this one, or all remaining rows after the last one.
+void stereo_stream_push(struct stereo_stream *st, const unsigned char *left_row, const unsigned char *right_row)
+{
+    struct sad_engine *eng = &st->eng;
+    int y = st->rows_in;
+    if (y >= st->height)
+    {
+        fprintf(stderr, "Stream already received all %d rows\n", st->height);
+        exit(1);
+    }
+
+    // The row leaving the window shares its slot with the new one, so take it
+    // out of the column sums first
+    if (eng->top <= y - STREAM_ROWS)
+    {
+        sad_engine_move(eng, eng->top, eng->bottom, y - STREAM_ROWS + 1, eng->bottom);
+        eng->top = y - STREAM_ROWS + 1;
+    }
+    int slot = y % STREAM_ROWS;
+    memcpy(ppm_array_at(&st->left, 0, slot), left_row, (size_t)st->width * st->channels);
+    memcpy(ppm_array_at(&st->right, 0, slot), right_row, (size_t)st->width * st->channels);
+    st->rows_in++;
+
+    if (y == st->height - 1)
+    {
+        while (st->rows_out < st->height)
+        {
+            stereo_stream_emit(st);
+        }
+    }
+    else if (y - KERNEL_EDGE_SIZE >= 0)
+    {
+        stereo_stream_emit(st);
+    }
+}
+
+// * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * 
+//                        PYRAMID BLOCK MATCHING
+// 
+// Coarse to fine matching. The images are repeatedly halved, the coarsest level
+// is block matched over the whole (scaled down) search range, and every finer 
+// level only searches a few disparities around twice the disparity found on 
+// the level below it.
+//
+// * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * 
+
+// Calculate the disparity for a given pixel with a kernel of edge pixels 
+// either side, only testing disparities in [d_min, d_max].
+double get_disparity_window_edge(struct ppm_array *img_left, struct ppm_array *img_right, int x, int y, int d_min, int d_max, int edge)
+{
+    // Same candidates as get_disparity_edge, the kernel has to overlap the 
+    // right image
+    if (d_max > x + edge - 1)
+    {
+        d_max = x + edge - 1;
+    }
+    if (d_min > d_max)
+    {
+        d_min = d_max;
+    }
+    if (d_min < 0)
+    {
+        d_min = 0;
+    }
+
+    struct match_scratch *scratch = match_scratch_get(d_max - d_min + 1);
+    const uint32_t *norm = match_scratch_norm(scratch, edge);
+    uint32_t *costs = scratch->costs;
+    uint32_t min_SAD = UINT32_MAX;
+    int disparity = d_min;
+    for (int d = d_min; d <= d_max; d++)
+    {
+        costs[d - d_min] = get_sum_absolute_difference(x, y, x - d, y, img_left, img_right, norm, edge);
+        if (costs[d - d_min] < min_SAD)
+        {
+            min_SAD = costs[d - d_min];
+            disparity = d;
+        }
+    }
+
+    // Sub-pixel approximation, if both neighbours were tested
+    if (disparity > d_min && disparity < d_max)
+    {
+        return parabolic_approximation(costs[disparity - 1 - d_min], costs[disparity - d_min], costs[disparity + 1 - d_min], disparity);
+    }
+    return disparity;
+}
+
+// Calculate the disparity for a given pixel, only testing disparities in 
+// [d_min, d_max].
+double get_disparity_window(struct ppm_array *img_left, struct ppm_array *img_right, int x, int y, int d_min, int d_max)
+{
+    return get_disparity_window_edge(img_left, img_right, x, y, d_min, d_max, KERNEL_EDGE_SIZE);
+}
+
+// Refine rows [y_start, y_end) of img_out from a disparity map of half the 
+// resolution, searching radius disparities either side of the scaled up coarse
+// disparity.
+void block_match_informed_rows(struct ppm_array *img_left, struct ppm_array *img_right, struct disparity_map *coarse, struct disparity_map *img_out, int search_len, int radius, int y_start, int y_end)
+{
+    for (int j = y_start; j < y_end; j++)
+    {
+        // Odd sizes leave the last row/column without a coarse pixel
+        int coarse_y = j / 2 < coarse->height ? j / 2 : coarse->height - 1;
+        for (int i = 0; i < img_out->width; i++)
+        {
+            int coarse_x = i / 2 < coarse->width ? i / 2 : coarse->width - 1;
+            double prior = 2 * disparity_from_fixed(*disparity_map_at(coarse, coarse_x, coarse_y));
+            if (!(prior >= 0))
+            {
+                prior = 0;
+            }
+            if (prior > search_len)
+            {
+                prior = search_len;
+            }
+            int center = (int)(prior + 0.5);
+            int d_max = center + radius > search_len ? search_len : center + radius;
+            *disparity_map_at(img_out, i, j) = disparity_to_fixed(get_disparity_window(img_left, img_right, i, j, center - radius, d_max));
+        }
+    }
+}
+
+// Refine a disparity map from one of half the resolution.
+void block_match_informed(struct ppm_array *img_left, struct ppm_array *img_right, struct disparity_map *coarse, struct disparity_map *img_out, int search_len, int radius)
+{
+    block_match_informed_rows(img_left, img_right, coarse, img_out, search_len, radius, 0, img_out->height);
+}
+
+// One block_match_informed_parallel() job
+struct block_match_informed_job
+{
+    struct ppm_array *img_left;
+    struct ppm_array *img_right;
+    struct disparity_map *coarse;
+    struct disparity_map *img_out;
+    int search_len;
+    int radius;
+    int band_rows;
+};
+
+static void block_match_informed_band(void *arg, int index, int worker)
+{
+    struct block_match_informed_job *job = (struct block_match_informed_job *)arg;
+    int y_start = index * job->band_rows;
+    int y_end = y_start + job->band_rows > job->img_out->height ? job->img_out->height : y_start + job->band_rows;
+    block_match_informed_rows(job->img_left, job->img_right, job->coarse, job->img_out, job->search_len, job->radius, y_start, y_end);
+}
+
+// block_match_informed() on the pool's workers. Pixels are independent, so the
+// bands need no halo.
+void block_match_informed_parallel(struct ppm_array *img_left, struct ppm_array *img_right, struct disparity_map *coarse, struct disparity_map *img_out, int search_len, int radius, struct thread_pool *pool)
+{
+    int bands = pool->workers * BANDS_PER_WORKER;
+    int band_rows = (img_out->height + bands - 1) / bands;
+    struct block_match_informed_job job = {img_left, img_right, coarse, img_out, search_len, radius, band_rows};
+    thread_pool_run(pool, block_match_informed_band, &job, (img_out->height + band_rows - 1) / band_rows);
+}
+
+// Output pixels per column tile of the half resolution preprocessing, its
+// buffers live on the stack
+#define PREPROCESS_TILE 128
+
+// Builds row j of the half resolution image of src: the 2x2 block average
+// (rounding down) of src blurred with the separable 1 8 1 Gaussian, 
+// floor(sum / 100) of the 3x3 weights 1, 8 and 64. Pixels outside src count as
+// black. Reads rows 2j - 1 to 2j + 2 of src, in column tiles so the blurred 
+// rows stay in cache.
+static void preprocess_half_row(struct ppm_array *src, int j, uint8_t *out, int out_width)
+{
+    const struct sad_kernels *k = sad_kernels_get();
+    int ch = src->channels;
+    static const uint8_t zero[(2 * PREPROCESS_TILE + 2) * 3];
+    // Blurred rows 2j and 2j + 1 of the tile, and their vertical sums with a
+    // pixel of margin either side
+    uint8_t blurred[2][2 * PREPROCESS_TILE * 3];
+    uint16_t sums[(2 * PREPROCESS_TILE + 2) * 3];
+    const uint8_t *rows[4];
+    for (int r = 0; r < 4; r++)
+    {
+        int y = 2 * j - 1 + r;
+        rows[r] = y >= 0 && y < src->height ? ppm_array_at(src, 0, y) : NULL;
+    }
+
+    for (int o0 = 0; o0 < out_width; o0 += PREPROCESS_TILE)
+    {
+        int o1 = o0 + PREPROCESS_TILE < out_width ? o0 + PREPROCESS_TILE : out_width;
+        // Source columns x0 - 1 to x1 inclusive, the ends may be outside src
+        int x0 = 2 * o0, x1 = 2 * o1;
+        int first = x0 > 0 ? x0 - 1 : 0;
+        int last = x1 < src->width ? x1 : src->width - 1;
+        uint16_t *v = sums + ch;
+        for (int b = 0; b < 2; b++)
+        {
+            const uint8_t *tap[3];
+            for (int r = 0; r < 3; r++)
+            {
+                tap[r] = rows[b + r] ? rows[b + r] + first * ch : zero;
+            }
+            k->blur_col(tap[0], tap[1], tap[2], v + (first - x0) * ch, (last - first + 1) * ch);
+            if (first == x0)
+            {
+                memset(v - ch, 0, ch * sizeof(*v));
+            }
+            if (last < x1)
+            {
+                memset(v + (x1 - x0) * ch, 0, ch * sizeof(*v));
+            }
+            k->blur_row(v, ch, blurred[b], (x1 - x0) * ch);
+        }
+        k->half_row(blurred[0], blurred[1], ch, out + o0 * ch, o1 - o0);
+    }
+}
+
+// Blur and halve the image, see preprocess_half_row(). Allocates img_out.
+void resize_down_half(struct ppm_array *img_in, struct ppm_array *img_out)
+{
+    img_out->height = img_in->height / 2;
+    img_out->width = img_in->width / 2;
+    img_out->channels = img_in->channels;
+    ppm_array_allocate(img_out);
+    for (int j = 0; j < img_out->height; j++)
+    {
+        preprocess_half_row(img_in, j, ppm_array_at(img_out, 0, j), img_out->width);
+    }
+}
+
+// Converts an RGB or greyscale image to greyscale and its half resolution
+// blurred copy in one pass, the same as to_greyscale_plane() followed by
+// resize_down_half() but without allocating: grey and half must already be
+// single channel arrays of the full and half size. Each grey row is converted
+// just before the half rows that need it, while it is still in cache.
+void preprocess_grey_half(struct ppm_array *img_in, struct ppm_array *grey, struct ppm_array *half)
+{
+    if ((img_in->channels != 1 && img_in->channels != 3) || grey->channels != 1 || half->channels != 1 ||
+        grey->width != img_in->width || grey->height != img_in->height || half->width != img_in->width / 2 ||
+        half->height != img_in->height / 2)
+    {
+        fprintf(stderr, "Preprocessing arrays do not match the image\n");
+        exit(1);
+    }
+    const struct sad_kernels *k = sad_kernels_get();
+    int converted = 0;
+    for (int j = 0; j <= half->height; j++)
+    {
+        // Half row j reads grey rows up to 2j + 2, the last pass only
+        // converts the rows left over
+        int needed = j < half->height ? 2 * j + 3 : img_in->height;
+        for (; converted < needed && converted < img_in->height; converted++)
+        {
+            uint8_t *out = ppm_array_at(grey, 0, converted);
+            if (img_in->channels == 3)
+            {
+                k->grey_row(ppm_array_at(img_in, 0, converted), out, img_in->width);
+            }
+            else
+            {
+                memcpy(out, ppm_array_at(img_in, 0, converted), img_in->width);
+            }
+        }
+        if (j < half->height)
+        {
+            preprocess_half_row(grey, j, ppm_array_at(half, 0, j), half->width);
+        }
+    }
+}
+
+// Gaussian image pyramids, built without allocating
+#include "pyramid.c"
+
+// Time spent on each level by pyramid_block_match(), level 0 is the full 
+// resolution image. Resizing includes preparing the level for the matching
+// cost.
+struct pyramid_timing
+{
+    int levels;
+    double resize_seconds[PYRAMID_MAX_LEVELS];
+    double match_seconds[PYRAMID_MAX_LEVELS];
+};
+
+// Buffers of pyramid_block_match_pyramids() for a pair of pyramids: the
+// matching cost buffers of both images and the disparity map of every level
+// but the finest, which is the output.
+struct pyramid_match_buffers
+{
+    int levels;
+    enum match_cost cost;
+    struct match_cost_buffers images[2][PYRAMID_MAX_LEVELS];
+    struct disparity_map maps[PYRAMID_MAX_LEVELS];
+};
+
+// Sizes the buffers for pyramids like pyr from image_pyramid_init(), matched
+// with the given cost.
+void pyramid_match_buffers_init(struct pyramid_match_buffers *buffers, struct image_pyramid *pyr, enum match_cost cost)
+{
+    buffers->levels = pyr->levels;
+    buffers->cost = cost;
+    buffers->maps[0].data = NULL;
+    for (int l = 0; l < pyr->levels; l++)
+    {
+        match_cost_buffers_init(&buffers->images[0][l], pyr->level[l].width, pyr->level[l].height, cost);
+        match_cost_buffers_init(&buffers->images[1][l], pyr->level[l].width, pyr->level[l].height, cost);
+        if (l > 0)
+        {
+            buffers->maps[l].height = pyr->level[l].height;
+            buffers->maps[l].width = pyr->level[l].width;
+            allocate_disparity_map(&buffers->maps[l]);
+        }
+    }
+}
+
+void pyramid_match_buffers_free(struct pyramid_match_buffers *buffers)
+{
+    for (int l = 0; l < buffers->levels; l++)
+    {
+        match_cost_buffers_free(&buffers->images[0][l]);
+        match_cost_buffers_free(&buffers->images[1][l]);
+        if (l > 0)
+        {
+            free_disparity_map(&buffers->maps[l]);
+        }
+    }
+}
+
+// Perform coarse to fine block matching with a pair of pyramids from
+// image_pyramid_init(), which are rebuilt from the images, so matching frame
+// after frame reuses their buffers. The images are plain greyscale or RGB, 
+// every level is prepared for the given matching cost after building it. 
+// buffers from pyramid_match_buffers_init() make matching allocation free, or
+// may be NULL to allocate them for the call. pool may be NULL to run on this
+// thread, timing may be NULL if not needed.
+void pyramid_block_match_pyramids(struct image_pyramid *left, struct image_pyramid *right, struct ppm_array *img_left, struct ppm_array *img_right, struct disparity_map *disparity_map, int search_len, enum match_cost cost, struct pyramid_match_buffers *buffers, struct thread_pool *pool, struct pyramid_timing *timing)
+{
+    // The levels as matched, which share the pixels of the pyramids for SAD
+    struct ppm_array match_left[PYRAMID_MAX_LEVELS];
+    struct ppm_array match_right[PYRAMID_MAX_LEVELS];
+    struct disparity_map maps[PYRAMID_MAX_LEVELS];
+    struct pyramid_match_buffers own;
+    struct pyramid_timing unused;
+    if (!timing)
+    {
+        timing = &unused;
+    }
+    int levels = left->levels;
+    timing->levels = levels;
+    if (!buffers)
+    {
+        pyramid_match_buffers_init(&own, left, cost);
+    }
+    else if (buffers->levels != levels || buffers->cost != cost)
+    {
+        fprintf(stderr, "Pyramid match buffers must have the pyramids' levels and cost\n");
+        exit(1);
+    }
+    struct pyramid_match_buffers *use = buffers ? buffers : &own;
+
+    // Build the image pyramids a level at a time, level 0 is the input itself
+    image_pyramid_view(left, right, img_left, img_right);
+    maps[0] = *disparity_map;
+    for (int l = 0; l < levels; l++)
+    {
+        double start = seconds_now();
+        if (l > 0)
+        {
+            image_pyramid_build_level(left, right, l, pool);
+            maps[l] = use->maps[l];
+        }
+        match_cost_prepare_into(&left->level[l], &match_left[l], &use->images[0][l]);
+        match_cost_prepare_into(&right->level[l], &match_right[l], &use->images[1][l]);
+        timing->resize_seconds[l] = seconds_now() - start;
+    }
+
+    // Full search on the coarsest level, rounding the range up
+    int coarsest = levels - 1;
+    int coarse_search = (search_len + (1 << coarsest) - 1) >> coarsest;
+    double start = seconds_now();
+    if (pool)
+    {
+        block_match_parallel(&match_left[coarsest], &match_right[coarsest], &maps[coarsest], coarse_search, pool);
+    }
+    else
+    {
+        block_match(&match_left[coarsest], &match_right[coarsest], &maps[coarsest], coarse_search);
+    }
+    timing->match_seconds[coarsest] = seconds_now() - start;
+
+    // Narrow search around the level below on every finer level
+    for (int l = coarsest - 1; l >= 0; l--)
+    {
+        int level_search = (search_len + (1 << l) - 1) >> l;
+        start = seconds_now();
+        if (pool)
+        {
+            block_match_informed_parallel(&match_left[l], &match_right[l], &maps[l + 1], &maps[l], level_search, PYRAMID_SEARCH_RADIUS, pool);
+        }
+        else
+        {
+            block_match_informed(&match_left[l], &match_right[l], &maps[l + 1], &maps[l], level_search, PYRAMID_SEARCH_RADIUS);
+        }
+        timing->match_seconds[l] = seconds_now() - start;
+    }
+
+    if (!buffers)
+    {
+        pyramid_match_buffers_free(&own);
+    }
+}
+
+// Perform coarse to fine block matching over the given number of pyramid 
+// levels (1 is plain block matching), see pyramid_block_match_pyramids().
+// Levels are dropped if the coarsest image would be smaller than the kernel.
+void pyramid_block_match(struct ppm_array *img_left, struct ppm_array *img_right, struct disparity_map *disparity_map, int search_len, int levels, enum match_cost cost, struct thread_pool *pool, struct pyramid_timing *timing)
+{
+    struct image_pyramid left;
+    struct image_pyramid right;
+    image_pyramid_init(&left, img_left->width, img_left->height, img_left->channels, levels);
+    image_pyramid_init(&right, img_right->width, img_right->height, img_right->channels, levels);
+    pyramid_block_match_pyramids(&left, &right, img_left, img_right, disparity_map, search_len, cost, NULL, pool, timing);
+    image_pyramid_free(&left);
+    image_pyramid_free(&right);
+}
+
+// Compares a disparity map with a ground truth greyscale map storing 
+// disparity * scale, where 0 marks an unknown disparity. Returns the mean 
+// absolute error over the known pixels and sets bad to the fraction of them 
+// that are off by more than threshold.
+double disparity_error(struct disparity_map *map, struct ppm_array *truth, double scale, double threshold, double *bad)
+{
+    double error = 0;
+    int known = 0;
+    int wrong = 0;
+    for (int y = 0; y < map->height && y < truth->height; y++)
+    {
+        for (int x = 0; x < map->width && x < truth->width; x++)
+        {
+            int value = *ppm_array_at(truth, x, y);
+            if (value == 0)
+            {
+                continue;
+            }
+            double dif = fabs(disparity_from_fixed(*disparity_map_at(map, x, y)) - value / scale);
+            // Treat broken sub-pixel estimates as fully wrong
+            if (!(dif <= threshold))
+            {
+                wrong++;
+            }
+            error += isfinite(dif) ? dif : value / scale;
+            known++;
+        }
+    }
+    if (bad)
+    {
+        *bad = known ? (double)wrong / known : 0;
+    }
+    return known ? error / known : 0;
+}
+
+// Semi-global matching, built on the SAD engine above
+#include "sgm.c"
+
+// Range scans for the particle filter, from a disparity map and calib.txt
+#include "range_scan.c"
+
+// Rectification of the camera images before matching
+#include "rectify.c"
+
+// Memory mapped dataset cache files
+#include "dataset.c"
+
+// Block matching of video frames around the previous frame's disparities
+#include "temporal.c"
+
+// Block matching over per-tile disparity ranges from a coarse pre-pass
+#include "search_range.c"
+
+// Speckle and median filtering of disparity maps
+#include "speckle.c"
+
+// A matching configuration that owns its buffers, for camera loops
+#include "stereo_context.c"
@@ -0,0 +1,287 @@
+// Stereo context: one matching configuration and every buffer it needs, sized
+// once for the camera resolution by stereo_create(). stereo_process() then
+// matches frame after frame without allocating, so a camera loop runs at a
+// steady latency from the first frame on:
+//
+//     struct stereo_config config;
+//     stereo_config_default(&config, width, height, 3);
+//     config.cost = MATCH_COST_CENSUS;
+//     struct stereo_context *ctx = stereo_create(&config);
+//     while (capture(&left, &right))
+//     {
+//         struct stereo_result result;
+//         stereo_process(ctx, &left, &right, &result);
+//         use(result.disparity);
+//     }
+//     stereo_destroy(ctx);
+//
+// The matching runs on the context's own pool, whose workers hold the matching
+// scratch: stereo_create() sizes it and stereo_destroy() frees it with the
+// pool. Any thread may call stereo_process(), one call at a time per context.
+
+// Default number of block matching threads
+#define STEREO_THREADS 3
+
+struct stereo_config
+{
+    // Size and channels (1 or 3) of the camera images
+    int width;
+    int height;
+    int channels;
+    int search_len;
+    // Pixels above/below/left/right of a pixel in its kernel window. Plain
+    // block matching takes 1 to KERNEL_EDGE_MAX, pyramids keep
+    // KERNEL_EDGE_SIZE and semi-global matching SGM_KERNEL_EDGE_SIZE.
+    int edge;
+    enum match_cost cost;
+    // Match greyscale planes of RGB images
+    int grey;
+    // Pyramid levels, 1 for plain block matching
+    int levels;
+    // Semi-global matching paths, 4 or 8, 0 for block matching
+    int paths;
+    // Fill a confidence plane, plain block matching only
+    int confidence;
+    // Post-filter with disparity_median3(), then speckle_filter_apply()
+    int median;
+    int speckle;
+    // Block matching threads, and the CPUs they may run on as for
+    // thread_pool_create()
+    int threads;
+    unsigned long cpu_mask;
+};
+
+// Output of stereo_process(), the maps belong to the context and are
+// overwritten by the next frame
+struct stereo_result
+{
+    struct disparity_map *disparity;
+    // NULL unless the configuration asks for it
+    struct ppm_array *confidence;
+    // Wall time of the frame, and of each level with pyramids (levels.levels
+    // is 0 without)
+    double seconds;
+    struct pyramid_timing levels;
+};
+
+struct stereo_context
+{
+    struct stereo_config config;
+    struct thread_pool pool;
+    // Greyscale planes of RGB images
+    struct ppm_array grey[2];
+    // Matching cost images of plain block matching and semi-global matching
+    struct match_cost_buffers images[2];
+    struct image_pyramid pyramid[2];
+    struct pyramid_match_buffers levels;
+    struct sgm_buffers sgm;
+    struct disparity_map disparity;
+    // The match before the median filter
+    struct disparity_map unfiltered;
+    struct ppm_array confidence;
+    struct speckle_filter speckle;
+};
+
+// Fills config with plain SAD block matching of images of the given size and
+// channels over BLOCK_SIZE disparities and a KERNEL_EDGE_SIZE kernel, on
+// STEREO_THREADS threads.
+void stereo_config_default(struct stereo_config *config, int width, int height, int channels)
+{
+    memset(config, 0, sizeof(*config));
+    config->width = width;
+    config->height = height;
+    config->channels = channels;
+    config->search_len = BLOCK_SIZE;
+    config->edge = KERNEL_EDGE_SIZE;
+    config->cost = MATCH_COST_SAD;
+    config->levels = 1;
+    config->threads = STEREO_THREADS;
+}
+
+// Makes a context for the configuration, allocating all of its buffers.
+struct stereo_context *stereo_create(const struct stereo_config *config)
+{
+    if (config->width <= 0 || config->height <= 0 || (config->channels != 1 && config->channels != 3))
+    {
+        fprintf(stderr, "Stereo images must be greyscale or RGB with a size\n");
+        exit(1);
+    }
+    if (config->levels < 1 || config->levels > PYRAMID_MAX_LEVELS || (config->paths && config->levels > 1))
+    {
+        fprintf(stderr, "Stereo matching needs 1 to %d pyramid levels, and 1 with semi-global matching\n",
+                PYRAMID_MAX_LEVELS);
+        exit(1);
+    }
+    if (config->confidence && (config->paths || config->levels > 1))
+    {
+        fprintf(stderr, "Only plain block matching gives a confidence\n");
+        exit(1);
+    }
+    if (config->edge < 1 || config->edge > KERNEL_EDGE_MAX)
+    {
+        fprintf(stderr, "Block matching needs a kernel edge size from 1 to %d\n", KERNEL_EDGE_MAX);
+        exit(1);
+    }
+    if (config->edge != KERNEL_EDGE_SIZE && (config->paths || config->levels > 1))
+    {
+        fprintf(stderr, "Only plain block matching takes a kernel edge size other than %d\n", KERNEL_EDGE_SIZE);
+        exit(1);
+    }
+    struct stereo_context *ctx = (struct stereo_context *)calloc(1, sizeof(struct stereo_context));
+    if (!ctx)
+    {
+        fprintf(stderr, "Unable to allocate memory\n");
+        exit(1);
+    }
+    ctx->config = *config;
+    int width = config->width;
+    int height = config->height;
+    int channels = config->channels;
+    if (config->grey && channels == 3)
+    {
+        for (int i = 0; i < 2; i++)
+        {
+            ctx->grey[i].width = width;
+            ctx->grey[i].height = height;
+            ctx->grey[i].channels = 1;
+            ppm_array_allocate(&ctx->grey[i]);
+        }
+        channels = 1;
+    }
+
+    thread_pool_create(&ctx->pool, config->threads, config->cpu_mask);
+    int match_channels = config->cost == MATCH_COST_CENSUS ? CENSUS_CHANNELS : channels;
+    if (config->levels > 1)
+    {
+        image_pyramid_init(&ctx->pyramid[0], width, height, channels, config->levels);
+        image_pyramid_init(&ctx->pyramid[1], width, height, channels, config->levels);
+        pyramid_match_buffers_init(&ctx->levels, &ctx->pyramid[0], config->cost);
+    }
+    else
+    {
+        match_cost_buffers_init(&ctx->images[0], width, height, config->cost);
+        match_cost_buffers_init(&ctx->images[1], width, height, config->cost);
+    }
+    if (config->paths)
+    {
+        sgm_buffers_init(&ctx->sgm, width, height, match_channels, config->search_len, config->paths);
+    }
+    else
+    {
+        match_scratch_reserve(&ctx->pool, width, match_channels, config->search_len, config->edge);
+    }
+
+    ctx->disparity.width = ctx->unfiltered.width = width;
+    ctx->disparity.height = ctx->unfiltered.height = height;
+    allocate_disparity_map(&ctx->disparity);
+    if (config->median)
+    {
+        allocate_disparity_map(&ctx->unfiltered);
+    }
+    if (config->confidence)
+    {
+        ctx->confidence.width = width;
+        ctx->confidence.height = height;
+        ctx->confidence.channels = 1;
+        ppm_array_allocate(&ctx->confidence);
+    }
+    if (config->speckle)
+    {
+        speckle_filter_init(&ctx->speckle, width, height);
+    }
+    return ctx;
+}
+
+// Matches a rectified image pair of the configured size and channels. The
+// result points to the context's maps.
+void stereo_process(struct stereo_context *ctx, struct ppm_array *img_left, struct ppm_array *img_right,
+                    struct stereo_result *result)
+{
+    const struct stereo_config *config = &ctx->config;
+    if (img_left->width != config->width || img_left->height != config->height ||
+        img_left->channels != config->channels || img_right->width != config->width ||
+        img_right->height != config->height || img_right->channels != config->channels)
+    {
+        fprintf(stderr, "Images must have the size and channels the stereo context was made for\n");
+        exit(1);
+    }
+    double start = seconds_now();
+    struct ppm_array *left = img_left;
+    struct ppm_array *right = img_right;
+    if (ctx->grey[0].data)
+    {
+        to_greyscale_plane_into(img_left, &ctx->grey[0]);
+        to_greyscale_plane_into(img_right, &ctx->grey[1]);
+        left = &ctx->grey[0];
+        right = &ctx->grey[1];
+    }
+
+    struct disparity_map *matched = config->median ? &ctx->unfiltered : &ctx->disparity;
+    result->levels.levels = 0;
+    if (config->levels > 1)
+    {
+        pyramid_block_match_pyramids(&ctx->pyramid[0], &ctx->pyramid[1], left, right, matched, config->search_len,
+                                     config->cost, &ctx->levels, &ctx->pool, &result->levels);
+    }
+    else
+    {
+        struct ppm_array match_left;
+        struct ppm_array match_right;
+        match_cost_prepare_into(left, &match_left, &ctx->images[0]);
+        match_cost_prepare_into(right, &match_right, &ctx->images[1]);
+        if (config->paths)
+        {
+            sgm_match_buffers(&match_left, &match_right, matched, &ctx->sgm);
+        }
+        else
+        {
+            block_match_edge(&match_left, &match_right, matched, config->confidence ? &ctx->confidence : NULL,
+                             config->search_len, config->edge, &ctx->pool);
+        }
+    }
+
+    if (config->median)
+    {
+        disparity_median3(&ctx->unfiltered, &ctx->disparity);
+    }
+    if (config->speckle)
+    {
+        speckle_filter_apply(&ctx->speckle, &ctx->disparity, speckle_max_region(config->width, config->height),
+                             SPECKLE_MAX_DIFF);
+    }
+    result->disparity = &ctx->disparity;
+    result->confidence = config->confidence ? &ctx->confidence : NULL;
+    result->seconds = seconds_now() - start;
+}
+
+// Frees the context, all of its buffers and its pool.
+void stereo_destroy(struct stereo_context *ctx)
+{
+    const struct stereo_config *config = &ctx->config;
+    thread_pool_destroy(&ctx->pool);
+    free_ppm_array(&ctx->grey[0]);
+    free_ppm_array(&ctx->grey[1]);
+    if (config->levels > 1)
+    {
+        pyramid_match_buffers_free(&ctx->levels);
+        image_pyramid_free(&ctx->pyramid[0]);
+        image_pyramid_free(&ctx->pyramid[1]);
+    }
+    else
+    {
+        match_cost_buffers_free(&ctx->images[0]);
+        match_cost_buffers_free(&ctx->images[1]);
+    }
+    if (config->paths)
+    {
+        sgm_buffers_free(&ctx->sgm);
+    }
+    free_disparity_map(&ctx->disparity);
+    free_disparity_map(&ctx->unfiltered);
+    free_ppm_array(&ctx->confidence);
+    if (config->speckle)
+    {
+        speckle_filter_free(&ctx->speckle);
+    }
+    free(ctx);
+}
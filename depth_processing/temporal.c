@@ -0,0 +1,499 @@
+// Temporal block matching, for video. Consecutive frames see nearly the same
+// depth, so each pixel only searches a few disparities either side of the
+// previous frame's disparity there, instead of the whole range. With the
+// camera's motion since the previous frame (from odometry) the previous
+// disparity map is first warped into the new view.
+//
+// A pixel searches the whole range instead when it has no prior (the warp
+// uncovered it), when its tile of the image changed while the camera stood
+// still, or when its best cost lies on an edge of its window, where the real
+// minimum may be outside it. The first frame and every refresh frames after it
+// are searched in full with block_match.
+//
+// The column sums are the sad_engine's, updated for every disparity as the rows
+// slide down, which is a small part of block_match's time. The window sums
+// along the row and the choice of disparity are only done for each pixel's
+// window, as running sums from the pixel to its left. They are the same
+// integers block_match uses, so a pixel whose minimum is inside its window
+// gets exactly block_match's disparity.
+
+// Disparities searched either side of the prior
+#define TEMPORAL_RADIUS 2
+// Size of the tiles the image change test is done on
+#define TEMPORAL_TILE 16
+// Mean absolute difference of a tile's bytes from the previous frame above
+// which it counts as changed
+#define TEMPORAL_CHANGE_THRESHOLD 6
+// Frames between full searches
+#define TEMPORAL_REFRESH 30
+
+// Motion of the camera between two frames, in the earlier camera's
+// coordinates: x right, y down and z forward, in the units of the calibration
+// baseline. yaw is the turn about the vertical axis in radians, positive to the
+// right. Odometry gives x and z (forward) and the yaw.
+struct camera_motion
+{
+    double x;
+    double y;
+    double z;
+    double yaw;
+};
+
+// State kept between the frames of one camera pair
+struct temporal_match
+{
+    int width;
+    int height;
+    int search_len;
+    // Disparities searched either side of the prior
+    int radius;
+    // Frames between full searches, 0 for only the first frame
+    int refresh;
+    // Frames since the last full search, -1 before the first frame
+    int age;
+    // Disparities of the last frame, and the prior of the current one
+    struct disparity_map previous;
+    struct disparity_map prior;
+    // The last frame's left image, and whether each tile of the current one
+    // differs from it
+    struct ppm_array previous_left;
+    uint8_t *changed;
+    int tiles_x;
+    int tiles_y;
+    // Pixels of the last frame searched in a window and over the whole range
+    long window_pixels;
+    long full_pixels;
+};
+
+// Sets up temporal matching of frames of the given size.
+void temporal_match_init(struct temporal_match *tm, int width, int height, int search_len)
+{
+    memset(tm, 0, sizeof(*tm));
+    tm->width = width;
+    tm->height = height;
+    tm->search_len = search_len;
+    tm->radius = TEMPORAL_RADIUS;
+    tm->refresh = TEMPORAL_REFRESH;
+    tm->age = -1;
+    tm->previous.width = width;
+    tm->previous.height = height;
+    allocate_disparity_map(&tm->previous);
+    tm->prior.width = width;
+    tm->prior.height = height;
+    allocate_disparity_map(&tm->prior);
+    tm->tiles_x = (width + TEMPORAL_TILE - 1) / TEMPORAL_TILE;
+    tm->tiles_y = (height + TEMPORAL_TILE - 1) / TEMPORAL_TILE;
+    tm->changed = (uint8_t *)calloc((size_t)tm->tiles_x * tm->tiles_y, 1);
+    if (!tm->changed)
+    {
+        fprintf(stderr, "Unable to allocate memory\n");
+        exit(1);
+    }
+}
+
+// Forgets the previous frame, e.g. after the cameras were covered, so the next
+// frame is searched in full.
+void temporal_match_reset(struct temporal_match *tm)
+{
+    tm->age = -1;
+}
+
+void temporal_match_free(struct temporal_match *tm)
+{
+    free_disparity_map(&tm->previous);
+    free_disparity_map(&tm->prior);
+    if (tm->previous_left.buffer)
+    {
+        free_ppm_array(&tm->previous_left);
+    }
+    free(tm->changed);
+    memset(tm, 0, sizeof(*tm));
+}
+
+// Warps a disparity map into the view of a camera that moved by motion, for a
+// pair with the given calibration (or a scaled copy of it, the map width gives
+// the scale). Each pixel is moved to where its point is seen from the new
+// position, the nearest point winning where several land on one pixel. Pixels
+// no point lands on are DISPARITY_INVALID, apart from single pixel gaps, which
+// get the further of their neighbours.
+void temporal_warp(struct disparity_map *map, const struct stereo_calib *calib, const struct camera_motion *motion,
+                   struct disparity_map *out)
+{
+    int width = map->width;
+    int height = map->height;
+    double scale = (double)width / calib->width;
+    double focal = calib->focal * scale;
+    double cx = calib->cx * scale;
+    double cy = calib->cy * scale;
+    double doffs = calib->doffs * scale;
+    double bf = calib->baseline * focal;
+    double c = cos(motion->yaw);
+    double s = sin(motion->yaw);
+
+    // A point is worked on divided by its depth z, which only needs its
+    // disparity: q = 1 / z = (disparity + doffs) / bf. The new position is
+    // then a ratio, and the new disparity bf * q / nz - doffs.
+    memset(out->data, 0xff, sizeof(uint16_t) * width * height);
+    double fixed_scale = 1.0 / (1 << DISPARITY_FRAC_BITS) / bf;
+    for (int y = 0; y < height; y++)
+    {
+        const uint16_t *row = disparity_map_at(map, 0, y);
+        double py_base = (y - cy) / focal;
+        for (int x = 0; x < width; x++)
+        {
+            if (row[x] == DISPARITY_INVALID)
+            {
+                continue;
+            }
+            double q = row[x] * fixed_scale + doffs / bf;
+            // Points at infinity have no depth to move by
+            if (q <= 0)
+            {
+                continue;
+            }
+            double px = (x - cx) / focal - motion->x * q;
+            double py = py_base - motion->y * q;
+            double pz = 1 - motion->z * q;
+            double nx = c * px - s * pz;
+            double nz = s * px + c * pz;
+            // Behind the camera
+            if (nz <= 0)
+            {
+                continue;
+            }
+            double inverse = 1 / nz;
+            double u = cx + focal * nx * inverse + 0.5;
+            double v = cy + focal * py * inverse + 0.5;
+            if (!(u >= 0 && u < width && v >= 0 && v < height))
+            {
+                continue;
+            }
+            uint16_t fixed = disparity_to_fixed(bf * q * inverse - doffs);
+            uint16_t *target = disparity_map_at(out, (int)u, (int)v);
+            if (*target == DISPARITY_INVALID || fixed > *target)
+            {
+                *target = fixed;
+            }
+        }
+    }
+
+    // Rounding leaves single pixel gaps where a surface stretches, fill them
+    // from the further side, which is what an uncovered pixel usually shows
+    for (int y = 0; y < height; y++)
+    {
+        uint16_t *row = disparity_map_at(out, 0, y);
+        for (int x = 1; x + 1 < width; x++)
+        {
+            if (row[x] == DISPARITY_INVALID && row[x - 1] != DISPARITY_INVALID && row[x + 1] != DISPARITY_INVALID)
+            {
+                row[x] = row[x - 1] < row[x + 1] ? row[x - 1] : row[x + 1];
+            }
+        }
+    }
+}
+
+// Sum of the column sums of one pixel over its channels.
+static inline uint32_t temporal_column(const uint16_t *col, int channels)
+{
+    switch (channels)
+    {
+    case 1:
+        return col[0];
+    case 3:
+        return col[0] + col[1] + col[2];
+    default:
+    {
+        uint32_t sum = 0;
+        for (int c = 0; c < channels; c++)
+        {
+            sum += col[c];
+        }
+        return sum;
+    }
+    }
+}
+
+// Makes sums[d] the window sum of pixel x in the current row for every d in
+// [lo, hi]. [*have_lo, *have_hi] are the disparities sums holds for pixel
+// *have_x, which are reused as they are or moved along by one pixel.
+static void temporal_sums(struct sad_engine *eng, int x, int lo, int hi, uint32_t *sums, int *have_x, int *have_lo,
+                          int *have_hi)
+{
+    int width = eng->img_left->width;
+    int channels = eng->channels;
+    size_t row_len = (size_t)width * channels;
+    int edge = eng->edge;
+    // Columns entering and leaving the window when moving from x - 1. The 
+    // engine only keeps the columns of disparity d from d on, the ones before
+    // hold whatever the scratch was last used for and count as 0.
+    int in = x + edge < width ? x + edge : -1;
+    int out = x - edge - 1;
+    int first = x - edge < 0 ? 0 : x - edge;
+    int last = x + edge >= width ? width - 1 : x + edge;
+    int moved_lo = *have_x == x - 1 ? *have_lo : hi + 1;
+    int moved_hi = *have_x == x - 1 ? *have_hi : lo - 1;
+    int kept_lo = *have_x == x ? *have_lo : hi + 1;
+    int kept_hi = *have_x == x ? *have_hi : lo - 1;
+    const uint16_t *col = eng->col + (size_t)lo * row_len;
+    for (int d = lo; d <= hi; d++, col += row_len)
+    {
+        if (d >= kept_lo && d <= kept_hi)
+        {
+            continue;
+        }
+        if (d >= moved_lo && d <= moved_hi)
+        {
+            uint32_t sum = sums[d];
+            if (in >= d)
+            {
+                sum += temporal_column(col + in * channels, channels);
+            }
+            if (out >= d)
+            {
+                sum -= temporal_column(col + out * channels, channels);
+            }
+            sums[d] = sum;
+            continue;
+        }
+        uint32_t sum = 0;
+        for (int i = first > d ? first : d; i <= last; i++)
+        {
+            sum += temporal_column(col + i * channels, channels);
+        }
+        sums[d] = sum;
+    }
+    *have_x = x;
+    *have_lo = lo;
+    *have_hi = hi;
+}
+
+// Cost of disparity d at pixel x from its window sum, scaled to a full kernel
+// like sad_engine_costs(). Only pixels near the image edges need scaling.
+static inline uint32_t temporal_cost(struct sad_engine *eng, int x, int d, uint32_t sum, int interior)
+{
+    return interior && x - eng->edge >= d ? sum : cost_normalize(sum, eng->norm, sad_engine_pixels(eng, x, d));
+}
+
+// Returns the disparity in [lo, hi] with the lowest cost at pixel x, the first
+// one on ties like select_disparity().
+static int temporal_best(struct sad_engine *eng, int x, int lo, int hi, const uint32_t *sums, int interior)
+{
+    uint32_t min_cost = UINT32_MAX;
+    int best = lo;
+    for (int d = lo; d <= hi; d++)
+    {
+        uint32_t cost = temporal_cost(eng, x, d, sums[d], interior);
+        if (cost < min_cost)
+        {
+            min_cost = cost;
+            best = d;
+        }
+    }
+    return best;
+}
+
+// Temporal matching of rows [y_start, y_end) around tm->prior. Adds the pixels
+// searched in a window and in full to the counts.
+static void temporal_match_rows(struct temporal_match *tm, struct ppm_array *img_left, struct ppm_array *img_right,
+                                struct disparity_map *img_out, int y_start, int y_end, long *window_pixels,
+                                long *full_pixels)
+{
+    int search_len = tm->search_len;
+    struct match_scratch *scratch = match_scratch_get(search_len + 1);
+    struct sad_engine *eng = &scratch->eng;
+    uint32_t *sums = scratch->costs;
+    sad_engine_init(eng, img_left, img_right, search_len, KERNEL_EDGE_SIZE);
+    int half = 1 << (DISPARITY_FRAC_BITS - 1);
+    for (int y = y_start; y < y_end; y++)
+    {
+        sad_engine_seek_columns(eng, y);
+        const uint16_t *prior = disparity_map_at(&tm->prior, 0, y);
+        const uint8_t *changed = tm->changed + (y / TEMPORAL_TILE) * tm->tiles_x;
+        // Rows whose kernel window is whole, where a pixel's window sums only
+        // need scaling near the left and right edges
+        int full_rows = eng->bottom - eng->top == 2 * eng->edge;
+        int have_x = -1, have_lo = 0, have_hi = -1;
+        for (int x = 0; x < tm->width; x++)
+        {
+            int tested = sad_engine_tested(eng, x);
+            int interior = full_rows && x + eng->edge < tm->width;
+            int lo = 0;
+            int hi = tested - 1;
+            int windowed = prior[x] != DISPARITY_INVALID && !changed[x / TEMPORAL_TILE];
+            if (windowed)
+            {
+                int center = (prior[x] + half) >> DISPARITY_FRAC_BITS;
+                lo = center - tm->radius < 0 ? 0 : center - tm->radius;
+                hi = center + tm->radius > tested - 1 ? tested - 1 : center + tm->radius;
+                windowed = lo <= hi;
+            }
+            if (!windowed)
+            {
+                lo = 0;
+                hi = tested - 1;
+            }
+            temporal_sums(eng, x, lo, hi, sums, &have_x, &have_lo, &have_hi);
+            int best = temporal_best(eng, x, lo, hi, sums, interior);
+
+            // A minimum on an edge of the window may continue outside of it
+            if (windowed && ((best == lo && lo > 0) || (best == hi && hi < tested - 1)))
+            {
+                windowed = 0;
+                lo = 0;
+                hi = tested - 1;
+                temporal_sums(eng, x, lo, hi, sums, &have_x, &have_lo, &have_hi);
+                best = temporal_best(eng, x, lo, hi, sums, interior);
+            }
+            windowed ? (*window_pixels)++ : (*full_pixels)++;
+
+            // Sub-pixel approximation as in select_disparity(), which has
+            // zero costs for untested disparities
+            double disparity = best;
+            if (best > 0 && best < search_len)
+            {
+                uint32_t below = temporal_cost(eng, x, best - 1, sums[best - 1], interior);
+                uint32_t at = temporal_cost(eng, x, best, sums[best], interior);
+                uint32_t above = best + 1 < tested ? temporal_cost(eng, x, best + 1, sums[best + 1], interior) : 0;
+                disparity = parabolic_approximation(below, at, above, best);
+            }
+            *disparity_map_at(img_out, x, y) = disparity_to_fixed(disparity);
+        }
+    }
+}
+
+// One temporal_match_frame() job
+struct temporal_match_job
+{
+    struct temporal_match *tm;
+    struct ppm_array *img_left;
+    struct ppm_array *img_right;
+    struct disparity_map *img_out;
+    int band_rows;
+};
+
+static void temporal_match_band(void *arg, int index, int worker)
+{
+    struct temporal_match_job *job = (struct temporal_match_job *)arg;
+    int y_start = index * job->band_rows;
+    int y_end = y_start + job->band_rows > job->img_out->height ? job->img_out->height : y_start + job->band_rows;
+    long window_pixels = 0;
+    long full_pixels = 0;
+    temporal_match_rows(job->tm, job->img_left, job->img_right, job->img_out, y_start, y_end, &window_pixels,
+                        &full_pixels);
+    __atomic_add_fetch(&job->tm->window_pixels, window_pixels, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&job->tm->full_pixels, full_pixels, __ATOMIC_RELAXED);
+}
+
+// Marks the tiles of img_left that differ from the previous frame's.
+static void temporal_find_changes(struct temporal_match *tm, struct ppm_array *img_left)
+{
+    int channels = img_left->channels;
+    for (int ty = 0; ty < tm->tiles_y; ty++)
+    {
+        int y_end = (ty + 1) * TEMPORAL_TILE > tm->height ? tm->height : (ty + 1) * TEMPORAL_TILE;
+        for (int tx = 0; tx < tm->tiles_x; tx++)
+        {
+            int x_start = tx * TEMPORAL_TILE;
+            int x_end = x_start + TEMPORAL_TILE > tm->width ? tm->width : x_start + TEMPORAL_TILE;
+            int len = (x_end - x_start) * channels;
+            uint32_t dif = 0;
+            for (int y = ty * TEMPORAL_TILE; y < y_end; y++)
+            {
+                const unsigned char *a = ppm_array_at(img_left, x_start, y);
+                const unsigned char *b = ppm_array_at(&tm->previous_left, x_start, y);
+                for (int i = 0; i < len; i++)
+                {
+                    dif += a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+                }
+            }
+            uint32_t bytes = (uint32_t)len * (y_end - ty * TEMPORAL_TILE);
+            tm->changed[ty * tm->tiles_x + tx] = dif > TEMPORAL_CHANGE_THRESHOLD * bytes;
+        }
+    }
+}
+
+// Matches the next frame of the pair into img_out, like block_match but
+// searching around the previous frame's disparities. motion is the camera's
+// motion since the previous frame and calib the pair's calibration, both may
+// be NULL if the camera didn't move (the image change test is only done then).
+// pool may be NULL to run on this thread.
+void temporal_match_frame(struct temporal_match *tm, struct ppm_array *img_left, struct ppm_array *img_right,
+                          struct disparity_map *img_out, const struct stereo_calib *calib,
+                          const struct camera_motion *motion, struct thread_pool *pool)
+{
+    if (img_left->width != tm->width || img_left->height != tm->height || img_out->width != tm->width ||
+        img_out->height != tm->height)
+    {
+        fprintf(stderr, "Frames must have the size temporal matching was set up for\n");
+        exit(1);
+    }
+    if (tm->previous_left.buffer && tm->previous_left.channels != img_left->channels)
+    {
+        free_ppm_array(&tm->previous_left);
+        tm->age = -1;
+    }
+    if (!tm->previous_left.buffer)
+    {
+        tm->previous_left.width = tm->width;
+        tm->previous_left.height = tm->height;
+        tm->previous_left.channels = img_left->channels;
+        ppm_array_allocate(&tm->previous_left);
+    }
+
+    if (tm->age < 0 || (tm->refresh > 0 && tm->age >= tm->refresh))
+    {
+        if (pool)
+        {
+            block_match_parallel(img_left, img_right, img_out, tm->search_len, pool);
+        }
+        else
+        {
+            block_match(img_left, img_right, img_out, tm->search_len);
+        }
+        tm->window_pixels = 0;
+        tm->full_pixels = (long)tm->width * tm->height;
+        tm->age = 0;
+    }
+    else
+    {
+        if (motion && calib)
+        {
+            temporal_warp(&tm->previous, calib, motion, &tm->prior);
+            memset(tm->changed, 0, (size_t)tm->tiles_x * tm->tiles_y);
+        }
+        else
+        {
+            memcpy(tm->prior.data, tm->previous.data, sizeof(uint16_t) * tm->width * tm->height);
+            temporal_find_changes(tm, img_left);
+        }
+
+        tm->window_pixels = 0;
+        tm->full_pixels = 0;
+        int bands = pool ? pool->workers * BANDS_PER_WORKER : 1;
+        int band_rows = (tm->height + bands - 1) / bands;
+        if (band_rows < 2 * KERNEL_EDGE_SIZE + 1)
+        {
+            band_rows = 2 * KERNEL_EDGE_SIZE + 1;
+        }
+        struct temporal_match_job job = {tm, img_left, img_right, img_out, band_rows};
+        int tasks = (tm->height + band_rows - 1) / band_rows;
+        if (pool)
+        {
+            thread_pool_run(pool, temporal_match_band, &job, tasks);
+        }
+        else
+        {
+            for (int i = 0; i < tasks; i++)
+            {
+                temporal_match_band(&job, i, 0);
+            }
+        }
+        tm->age++;
+    }
+
+    memcpy(tm->previous.data, img_out->data, sizeof(uint16_t) * tm->width * tm->height);
+    for (int y = 0; y < tm->height; y++)
+    {
+        memcpy(ppm_array_at(&tm->previous_left, 0, y), ppm_array_at(img_left, 0, y), (size_t)tm->width * img_left->channels);
+    }
+}
@@ -0,0 +1,2355 @@
+// gcc test.c -o test.o -O3 -lpthread -lm
+
+// stereo.c needs this before any system header is included
+#define _GNU_SOURCE
+#include <stdlib.h>
+
+// Heap allocations made by the code under test, counted by routing its malloc
+// and calloc calls through these wrappers
+static int allocations = 0;
+
+static void *counted_malloc(size_t size)
+{
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    return malloc(size);
+}
+
+static void *counted_calloc(size_t count, size_t size)
+{
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    return calloc(count, size);
+}
+
+#define malloc(size) counted_malloc(size)
+#define calloc(count, size) counted_calloc(count, size)
+
+#include "stereo.c"
+
+// Original block matcher, one full kernel of pixel_dif_abs calls per pixel and
+// disparity, with the costs scaled to a full kernel in fixed point. Every 
+// optimized path must reproduce its output exactly.
+double reference_disparity_edge(struct ppm_array *img_left, struct ppm_array *img_right, int x, int y, int search_len,
+                                int edge)
+{
+    uint32_t min_SAD = UINT32_MAX;
+    int disparity = 0;
+    uint32_t *costs = calloc(search_len + 1, sizeof(uint32_t));
+    uint32_t *norm = calloc((2 * edge + 1) * (2 * edge + 1) + 1, sizeof(uint32_t));
+    cost_norm_fill(norm, edge);
+    for (int i = 0; -i <= search_len && i + x + edge > 0; i--)
+    {
+        uint32_t SAD = 0;
+        int pixels = 0;
+        for (int k = -edge; k <= edge; k++)
+        {
+            for (int j = -edge; j <= edge; j++)
+            {
+                int diff = pixel_dif_abs(x + k, y + j, x + i + k, y + j, img_left, img_right);
+                if (diff != -1)
+                {
+                    pixels++;
+                    SAD += diff;
+                }
+            }
+        }
+        SAD = cost_normalize(SAD, norm, pixels);
+        if (SAD < min_SAD)
+        {
+            min_SAD = SAD;
+            disparity = -i;
+        }
+        costs[-i] = SAD;
+    }
+    double result = disparity;
+    if (disparity > 0 && disparity < search_len)
+    {
+        result = parabolic_approximation(costs[disparity - 1], costs[disparity], costs[disparity + 1], disparity);
+    }
+    free(costs);
+    free(norm);
+    return result;
+}
+
+void reference_block_match_edge(struct ppm_array *img_left, struct ppm_array *img_right, struct disparity_map *img_out,
+                                int search_len, int edge)
+{
+    for (int j = 0; j < img_out->height; j++)
+    {
+        for (int i = 0; i < img_out->width; i++)
+        {
+            *disparity_map_at(img_out, i, j) = disparity_to_fixed(reference_disparity_edge(img_left, img_right, i, j, search_len, edge));
+        }
+    }
+}
+
+void reference_block_match(struct ppm_array *img_left, struct ppm_array *img_right, struct disparity_map *img_out, int search_len)
+{
+    reference_block_match_edge(img_left, img_right, img_out, search_len, KERNEL_EDGE_SIZE);
+}
+
+// Returns the number of entries that differ.
+int disparity_map_mismatches(struct disparity_map *a, struct disparity_map *b)
+{
+    int mismatches = 0;
+    size_t count = (size_t)a->width * a->height;
+    for (size_t i = 0; i < count; i++)
+    {
+        mismatches += a->data[i] != b->data[i];
+    }
+    return mismatches;
+}
+
+// Checks block_match and get_disparity with every kernel set this CPU supports
+// against the reference matcher.
+int test_kernels_on(const char *name, struct ppm_array *img_left, struct ppm_array *img_right, int search_len)
+{
+    int failures = 0;
+    struct disparity_map expected;
+    struct disparity_map actual;
+    expected.height = actual.height = img_left->height;
+    expected.width = actual.width = img_left->width;
+    allocate_disparity_map(&expected);
+    allocate_disparity_map(&actual);
+    reference_block_match(img_left, img_right, &expected, search_len);
+
+    for (int k = 0; sad_kernels_all[k]; k++)
+    {
+        if (!sad_kernels_use(sad_kernels_all[k]->name))
+        {
+            printf("\tTest %s %s: not supported, skipped\n", name, sad_kernels_all[k]->name);
+            continue;
+        }
+
+        printf("\tTest %s %s block_match", name, sad_kernels_all[k]->name);
+        block_match(img_left, img_right, &actual, search_len);
+        int mismatches = disparity_map_mismatches(&expected, &actual);
+        printf(mismatches == 0 ? " PASS" : " FAIL (%d pixels)", mismatches);
+        failures += mismatches != 0;
+
+        printf(", get_disparity");
+        for (int j = 0; j < actual.height; j++)
+        {
+            for (int i = 0; i < actual.width; i++)
+            {
+                *disparity_map_at(&actual, i, j) = disparity_to_fixed(get_disparity(img_left, img_right, i, j, search_len, 0));
+            }
+        }
+        mismatches = disparity_map_mismatches(&expected, &actual);
+        printf(mismatches == 0 ? " PASS" : " FAIL (%d pixels)", mismatches);
+        failures += mismatches != 0;
+        printf("\n");
+    }
+    sad_kernels_use(NULL);
+
+    free_disparity_map(&expected);
+    free_disparity_map(&actual);
+    return failures;
+}
+
+// Dataset cache the cones pair is mapped from (see dataset_convert.c), the
+// cones tests are skipped when it hasn't been built
+#define TEST_CONES_CACHE "cache/cones.stc"
+
+// Maps the cones pair from its dataset cache, returning 0 if there is none.
+int test_open_cones(struct dataset *set, struct ppm_array pair[2])
+{
+    if (access(TEST_CONES_CACHE, R_OK) != 0)
+    {
+        printf("\tSkipping cones, no %s\n", TEST_CONES_CACHE);
+        return 0;
+    }
+    dataset_open(TEST_CONES_CACHE, set);
+    pair[0] = set->plane[DATASET_LEFT_RGB];
+    pair[1] = set->plane[DATASET_RIGHT_RGB];
+    return 1;
+}
+
+// The pairs the kernel and stream tests run on: tsukuba from its PPMs, then
+// cones from its cache if there is one
+struct test_pair
+{
+    const char *name;
+    struct ppm_array img[2];
+    struct ppm_image *ppm[2];
+    struct dataset set;
+};
+
+#define TEST_PAIRS 2
+
+// Opens pair p for a loop over the test pairs, returning 0 if it's missing.
+int test_pair_open(int p, struct test_pair *pair)
+{
+    memset(pair, 0, sizeof(*pair));
+    if (p == 0)
+    {
+        pair->name = "tsukuba";
+        pair->ppm[0] = readPPM("tsukuba/scene1.row3.col1.ppm");
+        pair->ppm[1] = readPPM("tsukuba/scene1.row3.col2.ppm");
+        ppm_array_wrap(pair->ppm[0], &pair->img[0]);
+        ppm_array_wrap(pair->ppm[1], &pair->img[1]);
+        return 1;
+    }
+    pair->name = "cones";
+    return test_open_cones(&pair->set, pair->img);
+}
+
+void test_pair_close(struct test_pair *pair)
+{
+    for (int i = 0; i < 2; i++)
+    {
+        if (pair->ppm[i])
+        {
+            free(pair->ppm[i]->data);
+            free(pair->ppm[i]);
+        }
+    }
+    if (pair->set.map)
+    {
+        dataset_close(&pair->set);
+    }
+}
+
+int test_block_match_kernels()
+{
+    printf("block_match kernels\n");
+    int failures = 0;
+    for (int p = 0; p < TEST_PAIRS; p++)
+    {
+        struct test_pair pair;
+        if (!test_pair_open(p, &pair))
+        {
+            continue;
+        }
+        failures += test_kernels_on(pair.name, &pair.img[0], &pair.img[1], BLOCK_SIZE);
+
+        // Single channel planes take the same paths with a different stride
+        struct ppm_array grey_left;
+        struct ppm_array grey_right;
+        char name[64];
+        snprintf(name, sizeof(name), "%s grey", pair.name);
+        to_greyscale_plane(&pair.img[0], &grey_left);
+        to_greyscale_plane(&pair.img[1], &grey_right);
+        failures += test_kernels_on(name, &grey_left, &grey_right, BLOCK_SIZE);
+
+        free_ppm_array(&grey_left);
+        free_ppm_array(&grey_right);
+        test_pair_close(&pair);
+    }
+    return failures;
+}
+
+int test_block_match_parallel()
+{
+    printf("block_match_parallel\n");
+    int failures = 0;
+    struct ppm_image *left = readPPM("tsukuba/scene1.row3.col1.ppm");
+    struct ppm_image *right = readPPM("tsukuba/scene1.row3.col2.ppm");
+    struct ppm_array img_left;
+    struct ppm_array img_right;
+    struct disparity_map expected;
+    struct disparity_map actual;
+    ppm_array_wrap(left, &img_left);
+    ppm_array_wrap(right, &img_right);
+    expected.height = actual.height = img_left.height;
+    expected.width = actual.width = img_left.width;
+    allocate_disparity_map(&expected);
+    allocate_disparity_map(&actual);
+    block_match(&img_left, &img_right, &expected, BLOCK_SIZE);
+
+    // Pinned and unpinned pools, up to more workers than there are bands
+    int workers[] = {1, 2, 3, 4, 7, 40};
+    unsigned long masks[] = {0, 0x7};
+    for (int m = 0; m < 2; m++)
+    {
+        for (int w = 0; w < 6; w++)
+        {
+            struct thread_pool pool;
+            thread_pool_create(&pool, workers[w], masks[m]);
+            printf("\tTest %d workers, cpu mask 0x%lx", workers[w], masks[m]);
+            // Run twice to check the pool can be reused
+            for (int run = 0; run < 2; run++)
+            {
+                memset(actual.data, 0, sizeof(uint16_t) * actual.width * actual.height);
+                block_match_parallel(&img_left, &img_right, &actual, BLOCK_SIZE, &pool);
+                int mismatches = disparity_map_mismatches(&expected, &actual);
+                printf(mismatches == 0 ? " PASS" : " FAIL (%d pixels)", mismatches);
+                failures += mismatches != 0;
+            }
+            printf("\n");
+            thread_pool_destroy(&pool);
+        }
+    }
+
+    free_disparity_map(&expected);
+    free_disparity_map(&actual);
+    free(left->data);
+    free(left);
+    free(right->data);
+    free(right);
+    return failures;
+}
+
+// Checks that tiled matching gives block_match's disparities for tiles and
+// disparity blocks that do and don't divide the image and search range, for
+// SAD and census costs, on one thread and on a pool.
+int test_block_match_tiled()
+{
+    printf("block_match_tiled\n");
+    int failures = 0;
+    struct ppm_image *left = readPPM("tsukuba/scene1.row3.col1.ppm");
+    struct ppm_image *right = readPPM("tsukuba/scene1.row3.col2.ppm");
+    struct ppm_array img[2];
+    struct ppm_array census[2];
+    ppm_array_wrap(left, &img[0]);
+    ppm_array_wrap(right, &img[1]);
+    match_cost_prepare(&img[0], &census[0], MATCH_COST_CENSUS);
+    match_cost_prepare(&img[1], &census[1], MATCH_COST_CENSUS);
+    struct disparity_map expected;
+    struct disparity_map actual;
+    expected.height = actual.height = img[0].height;
+    expected.width = actual.width = img[0].width;
+    allocate_disparity_map(&expected);
+    allocate_disparity_map(&actual);
+    struct thread_pool pool;
+    thread_pool_create(&pool, 3, 0);
+
+    int search_len = 48;
+    struct match_tiling tilings[] = {{64, 64, search_len + 1}, {100, 37, 16}, {384, 288, 7}, {1, 5, 1}, {0, 0, 0}};
+    match_tiling_auto(&tilings[4], img[0].width, img[0].channels, search_len);
+    for (int c = 0; c < 2; c++)
+    {
+        struct ppm_array *pair = c ? census : img;
+        block_match(&pair[0], &pair[1], &expected, search_len);
+        for (int t = 0; t < 5; t++)
+        {
+            printf("\tTest %s %dx%d tiles, %d disparities a pass", c ? "census" : "SAD", tilings[t].tile_width,
+                   tilings[t].tile_height, tilings[t].disparity_block);
+            for (int p = 0; p < 2; p++)
+            {
+                memset(actual.data, 0, sizeof(uint16_t) * actual.width * actual.height);
+                block_match_tiled(&pair[0], &pair[1], &actual, search_len, &tilings[t], p ? &pool : NULL);
+                int mismatches = disparity_map_mismatches(&expected, &actual);
+                printf(mismatches == 0 ? " PASS" : " FAIL (%d pixels)", mismatches);
+                failures += mismatches != 0;
+            }
+            printf("\n");
+        }
+    }
+
+    // Tuning picks a usable tiling
+    struct match_tiling tuned;
+    match_tiling_tune(&img[0], &img[1], search_len, &pool, &tuned);
+    block_match(&img[0], &img[1], &expected, search_len);
+    block_match_tiled(&img[0], &img[1], &actual, search_len, &tuned, &pool);
+    int tune = disparity_map_mismatches(&expected, &actual) == 0;
+    printf("\tTest tuned %dx%d tiles, %d disparities a pass %s\n", tuned.tile_width, tuned.tile_height,
+           tuned.disparity_block, tune ? "PASS" : "FAIL");
+    failures += !tune;
+
+    thread_pool_destroy(&pool);
+    free_disparity_map(&expected);
+    free_disparity_map(&actual);
+    free_ppm_array(&census[0]);
+    free_ppm_array(&census[1]);
+    free(left->data);
+    free(left);
+    free(right->data);
+    free(right);
+    return failures;
+}
+
+// Returns the number of bytes that differ between two arrays of the same size.
+int ppm_array_mismatches(struct ppm_array *a, struct ppm_array *b)
+{
+    int mismatches = 0;
+    for (int y = 0; y < a->height; y++)
+    {
+        unsigned char *row_a = ppm_array_at(a, 0, y);
+        unsigned char *row_b = ppm_array_at(b, 0, y);
+        for (int x = 0; x < a->width * a->channels; x++)
+        {
+            mismatches += row_a[x] != row_b[x];
+        }
+    }
+    return mismatches;
+}
+
+// Integer reference of a pyramid level: the even pixels of src filtered with
+// the 1 4 6 4 1 kernel in both directions, edges repeated, rounded.
+void reference_pyramid_down(struct ppm_array *src, struct ppm_array *dst)
+{
+    int weight[5] = {1, 4, 6, 4, 1};
+    for (int j = 0; j < dst->height; j++)
+    {
+        for (int i = 0; i < dst->width; i++)
+        {
+            for (int c = 0; c < src->channels; c++)
+            {
+                int sum = 0;
+                for (int dy = -2; dy <= 2; dy++)
+                {
+                    for (int dx = -2; dx <= 2; dx++)
+                    {
+                        int x = 2 * i + dx, y = 2 * j + dy;
+                        x = x < 0 ? 0 : x >= src->width ? src->width - 1 : x;
+                        y = y < 0 ? 0 : y >= src->height ? src->height - 1 : y;
+                        sum += weight[dx + 2] * weight[dy + 2] * ppm_array_at(src, x, y)[c];
+                    }
+                }
+                ppm_array_at(dst, i, j)[c] = (sum + 128) >> 8;
+            }
+        }
+    }
+}
+
+// Checks that every kernel set builds the levels of RGB and greyscale 
+// pyramids of awkward sizes exactly like the reference, that building a pair
+// on a pool gives the same levels, and that rebuilding neither allocates nor
+// copies the input.
+int test_image_pyramid()
+{
+    int failures = 0;
+    printf("image_pyramid\n");
+    struct ppm_image *image = readPPM("tsukuba/scene1.row3.col3.ppm");
+    struct ppm_array tsukuba[2];
+    ppm_array_wrap(image, &tsukuba[0]);
+    to_greyscale_plane(&tsukuba[0], &tsukuba[1]);
+    struct thread_pool pool;
+    thread_pool_create(&pool, 3, 0);
+
+    // Tsukuba, then random images of odd sizes around the tile width
+    int sizes[][3] = {{0, 0, 3}, {0, 0, 1}, {301, 77, 3}, {517, 90, 1}, {258, 47, 1}};
+    srand(19);
+    for (int s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++)
+    {
+        struct ppm_array img = tsukuba[sizes[s][2] == 1];
+        if (sizes[s][0])
+        {
+            img.width = sizes[s][0];
+            img.height = sizes[s][1];
+            img.channels = sizes[s][2];
+            ppm_array_allocate(&img);
+            for (int y = 0; y < img.height; y++)
+            {
+                for (int x = 0; x < img.width * img.channels; x++)
+                {
+                    ppm_array_at(&img, 0, y)[x] = rand() & 0xff;
+                }
+            }
+        }
+
+        struct image_pyramid expected, left, right;
+        image_pyramid_init(&expected, img.width, img.height, img.channels, 4);
+        image_pyramid_init(&left, img.width, img.height, img.channels, 4);
+        image_pyramid_init(&right, img.width, img.height, img.channels, 4);
+        expected.level[0] = img;
+        for (int l = 1; l < expected.levels; l++)
+        {
+            reference_pyramid_down(&expected.level[l - 1], &expected.level[l]);
+        }
+
+        for (int k = 0; sad_kernels_all[k]; k++)
+        {
+            if (!sad_kernels_use(sad_kernels_all[k]->name))
+            {
+                printf("\tTest %dx%dx%d %s: not supported, skipped\n", img.width, img.height, img.channels,
+                       sad_kernels_all[k]->name);
+                continue;
+            }
+            printf("\tTest %dx%dx%d %s, %d levels", img.width, img.height, img.channels, sad_kernels_all[k]->name,
+                   expected.levels);
+            image_pyramid_build_pair(&left, NULL, &img, NULL, NULL);
+            int mismatches = 0;
+            for (int l = 1; l < expected.levels; l++)
+            {
+                mismatches += ppm_array_mismatches(&expected.level[l], &left.level[l]);
+            }
+            printf(", single %s", mismatches ? "FAIL" : "PASS");
+            failures += mismatches != 0;
+
+            // Again as a pair on the pool, over the stale levels
+            int before = allocations;
+            image_pyramid_build_pair(&left, &right, &img, &img, &pool);
+            int allocated = allocations - before;
+            mismatches = left.level[0].data != img.data || right.level[0].data != img.data;
+            for (int l = 1; l < expected.levels; l++)
+            {
+                mismatches += ppm_array_mismatches(&expected.level[l], &left.level[l]);
+                mismatches += ppm_array_mismatches(&expected.level[l], &right.level[l]);
+            }
+            printf(", pair %s", mismatches ? "FAIL" : "PASS");
+            printf(", %d allocations %s\n", allocated, allocated ? "FAIL" : "PASS");
+            failures += (mismatches != 0) + (allocated != 0);
+        }
+        sad_kernels_use(NULL);
+
+        image_pyramid_free(&expected);
+        image_pyramid_free(&left);
+        image_pyramid_free(&right);
+        if (sizes[s][0])
+        {
+            free_ppm_array(&img);
+        }
+    }
+    thread_pool_destroy(&pool);
+    free_ppm_array(&tsukuba[1]);
+    free(image->data);
+    free(image);
+    return failures;
+}
+
+int test_pyramid_block_match()
+{
+    printf("pyramid_block_match\n");
+    int failures = 0;
+    struct ppm_image *left = readPPM("tsukuba/scene1.row3.col3.ppm");
+    struct ppm_image *right = readPPM("tsukuba/scene1.row3.col4.ppm");
+    struct ppm_array img_left;
+    struct ppm_array img_right;
+    struct ppm_array truth;
+    struct disparity_map expected;
+    struct disparity_map actual;
+    struct thread_pool pool;
+    ppm_array_wrap(left, &img_left);
+    ppm_array_wrap(right, &img_right);
+    readPGM("tsukuba/truedisp.row3.col3.pgm", &truth);
+    expected.height = actual.height = img_left.height;
+    expected.width = actual.width = img_left.width;
+    allocate_disparity_map(&expected);
+    allocate_disparity_map(&actual);
+    thread_pool_create(&pool, 3, 0);
+
+    printf("\tTest 1 level matches block_match");
+    block_match(&img_left, &img_right, &expected, BLOCK_SIZE);
+    pyramid_block_match(&img_left, &img_right, &actual, BLOCK_SIZE, 1, MATCH_COST_SAD, NULL, NULL);
+    int mismatches = disparity_map_mismatches(&expected, &actual);
+    printf(mismatches == 0 ? " PASS\n" : " FAIL (%d pixels)\n", mismatches);
+    failures += mismatches != 0;
+
+    for (int levels = 2; levels <= 4; levels++)
+    {
+        struct pyramid_timing timing;
+        double bad;
+        printf("\tTest %d levels", levels);
+        pyramid_block_match(&img_left, &img_right, &expected, BLOCK_SIZE, levels, MATCH_COST_SAD, NULL, &timing);
+        pyramid_block_match(&img_left, &img_right, &actual, BLOCK_SIZE, levels, MATCH_COST_SAD, &pool, NULL);
+        mismatches = disparity_map_mismatches(&expected, &actual);
+        printf(mismatches == 0 ? " parallel PASS" : " parallel FAIL (%d pixels)", mismatches);
+        failures += mismatches != 0;
+
+        // Plain block matching gets about 13% bad pixels on this pair
+        double error = disparity_error(&expected, &truth, 16, 1.0, &bad);
+        int accurate = timing.levels == levels && bad < 0.16;
+        printf(accurate ? ", accuracy PASS" : ", accuracy FAIL (%.2f%% bad, %f px)", 100 * bad, error);
+        failures += !accurate;
+        printf("\n");
+    }
+
+    thread_pool_destroy(&pool);
+    free_disparity_map(&expected);
+    free_disparity_map(&actual);
+    free_ppm_array(&truth);
+    free(left->data);
+    free(left);
+    free(right->data);
+    free(right);
+    return failures;
+}
+
+int test_sgm_match()
+{
+    printf("sgm_match\n");
+    int failures = 0;
+    struct ppm_image *left = readPPM("tsukuba/scene1.row3.col3.ppm");
+    struct ppm_image *right = readPPM("tsukuba/scene1.row3.col4.ppm");
+    struct ppm_array img_left;
+    struct ppm_array img_right;
+    struct ppm_array truth;
+    struct disparity_map expected;
+    struct disparity_map actual;
+    ppm_array_wrap(left, &img_left);
+    ppm_array_wrap(right, &img_right);
+    readPGM("tsukuba/truedisp.row3.col3.pgm", &truth);
+    expected.height = actual.height = img_left.height;
+    expected.width = actual.width = img_left.width;
+    allocate_disparity_map(&expected);
+    allocate_disparity_map(&actual);
+
+    // Block matching gets about 13% bad pixels on this pair
+    double max_bad[] = {0.125, 0.11};
+    for (int p = 0; p < 2; p++)
+    {
+        int paths = 4 + 4 * p;
+        double bad;
+        printf("\tTest %d paths", paths);
+        sad_kernels_use("scalar");
+        sgm_match(&img_left, &img_right, &expected, BLOCK_SIZE, paths);
+        double error = disparity_error(&expected, &truth, 16, 1.0, &bad);
+        int accurate = bad < max_bad[p];
+        printf(accurate ? " accuracy PASS" : " accuracy FAIL (%.2f%% bad, %f px)", 100 * bad, error);
+        failures += !accurate;
+
+        // Every kernel set must give the scalar result
+        for (int k = 0; sad_kernels_all[k]; k++)
+        {
+            if (!sad_kernels_use(sad_kernels_all[k]->name))
+            {
+                continue;
+            }
+            sgm_match(&img_left, &img_right, &actual, BLOCK_SIZE, paths);
+            int mismatches = disparity_map_mismatches(&expected, &actual);
+            printf(mismatches == 0 ? ", %s PASS" : ", %s FAIL (%d pixels)", sad_kernels_all[k]->name, mismatches);
+            failures += mismatches != 0;
+        }
+        sad_kernels_use(NULL);
+        printf("\n");
+    }
+
+    free_disparity_map(&expected);
+    free_disparity_map(&actual);
+    free_ppm_array(&truth);
+    free(left->data);
+    free(left);
+    free(right->data);
+    free(right);
+    return failures;
+}
+
+int test_census_match()
+{
+    printf("census cost\n");
+    int failures = 0;
+    struct ppm_image *left = readPPM("tsukuba/scene1.row3.col3.ppm");
+    struct ppm_image *right = readPPM("tsukuba/scene1.row3.col4.ppm");
+    struct ppm_array img_left;
+    struct ppm_array img_right;
+    struct ppm_array census_left;
+    struct ppm_array census_right;
+    struct ppm_array truth;
+    struct disparity_map expected;
+    struct disparity_map actual;
+    ppm_array_wrap(left, &img_left);
+    ppm_array_wrap(right, &img_right);
+    census_transform(&img_left, &census_left);
+    census_transform(&img_right, &census_right);
+    readPGM("tsukuba/truedisp.row3.col3.pgm", &truth);
+    expected.height = actual.height = img_left.height;
+    expected.width = actual.width = img_left.width;
+    allocate_disparity_map(&expected);
+    allocate_disparity_map(&actual);
+
+    // The running sums must give the per-pixel Hamming sums exactly
+    for (int j = 0; j < expected.height; j++)
+    {
+        for (int i = 0; i < expected.width; i++)
+        {
+            *disparity_map_at(&expected, i, j) = disparity_to_fixed(get_disparity(&census_left, &census_right, i, j, BLOCK_SIZE, 0));
+        }
+    }
+    for (int k = 0; sad_kernels_all[k]; k++)
+    {
+        if (!sad_kernels_use(sad_kernels_all[k]->name))
+        {
+            continue;
+        }
+        printf("\tTest %s block_match", sad_kernels_all[k]->name);
+        block_match(&census_left, &census_right, &actual, BLOCK_SIZE);
+        int mismatches = disparity_map_mismatches(&expected, &actual);
+        printf(mismatches == 0 ? " PASS\n" : " FAIL (%d pixels)\n", mismatches);
+        failures += mismatches != 0;
+    }
+    sad_kernels_use(NULL);
+
+    // SAD block matching gets about 13% bad pixels on this pair
+    double bad;
+    printf("\tTest block_match accuracy");
+    double error = disparity_error(&expected, &truth, 16, 1.0, &bad);
+    printf(bad < 0.12 ? " PASS\n" : " FAIL (%.2f%% bad, %f px)\n", 100 * bad, error);
+    failures += !(bad < 0.12);
+
+    printf("\tTest pyramid_block_match accuracy");
+    pyramid_block_match(&img_left, &img_right, &actual, BLOCK_SIZE, 3, MATCH_COST_CENSUS, NULL, NULL);
+    error = disparity_error(&actual, &truth, 16, 1.0, &bad);
+    printf(bad < 0.11 ? " PASS\n" : " FAIL (%.2f%% bad, %f px)\n", 100 * bad, error);
+    failures += !(bad < 0.11);
+
+    printf("\tTest sgm_match accuracy");
+    sgm_match(&census_left, &census_right, &actual, BLOCK_SIZE, 8);
+    error = disparity_error(&actual, &truth, 16, 1.0, &bad);
+    printf(bad < 0.095 ? " PASS\n" : " FAIL (%.2f%% bad, %f px)\n", 100 * bad, error);
+    failures += !(bad < 0.095);
+
+    // Brighten the right image, as if its camera exposed for longer. Only the
+    // pixels that saturate change order, so census barely notices.
+    printf("\tTest exposure difference");
+    struct ppm_array bright;
+    bright.height = img_right.height;
+    bright.width = img_right.width;
+    bright.channels = img_right.channels;
+    ppm_array_allocate(&bright);
+    for (int y = 0; y < bright.height; y++)
+    {
+        for (int x = 0; x < bright.width * bright.channels; x++)
+        {
+            int value = ppm_array_at(&img_right, 0, y)[x] + 40;
+            ppm_array_at(&bright, 0, y)[x] = value > 255 ? 255 : value;
+        }
+    }
+    free_ppm_array(&census_right);
+    census_transform(&bright, &census_right);
+    block_match(&census_left, &census_right, &actual, BLOCK_SIZE);
+    double census_bad;
+    disparity_error(&actual, &truth, 16, 1.0, &census_bad);
+    block_match(&img_left, &bright, &actual, BLOCK_SIZE);
+    disparity_error(&actual, &truth, 16, 1.0, &bad);
+    int robust = census_bad < 0.125 && census_bad < bad;
+    printf(robust ? " PASS\n" : " FAIL (census %.2f%% bad, SAD %.2f%% bad)\n", 100 * census_bad, 100 * bad);
+    failures += !robust;
+
+    free_ppm_array(&bright);
+    free_ppm_array(&census_left);
+    free_ppm_array(&census_right);
+    free_disparity_map(&expected);
+    free_disparity_map(&actual);
+    free_ppm_array(&truth);
+    free(left->data);
+    free(left);
+    free(right->data);
+    free(right);
+    return failures;
+}
+
+int test_allocation_free()
+{
+    printf("allocation free search\n");
+    int failures = 0;
+    struct ppm_image *left = readPPM("tsukuba/scene1.row3.col3.ppm");
+    struct ppm_image *right = readPPM("tsukuba/scene1.row3.col4.ppm");
+    struct ppm_array img_left;
+    struct ppm_array img_right;
+    struct disparity_map coarse;
+    struct disparity_map map;
+    struct thread_pool pool;
+    ppm_array_wrap(left, &img_left);
+    ppm_array_wrap(right, &img_right);
+    map.height = img_left.height;
+    map.width = img_left.width;
+    allocate_disparity_map(&map);
+    coarse.height = img_left.height / 2;
+    coarse.width = img_left.width / 2;
+    allocate_disparity_map(&coarse);
+    for (int x = 0; x < coarse.width; x++)
+    {
+        for (int y = 0; y < coarse.height; y++)
+        {
+            *disparity_map_at(&coarse, x, y) = disparity_to_fixed(BLOCK_SIZE / 4);
+        }
+    }
+    thread_pool_create(&pool, 3, 0);
+
+    // Once the scratch is sized no frame may allocate, including the first
+    match_scratch_reserve(NULL, img_left.width, img_left.channels, BLOCK_SIZE, KERNEL_EDGE_SIZE);
+    match_scratch_reserve(&pool, img_left.width, img_left.channels, BLOCK_SIZE, KERNEL_EDGE_SIZE);
+    for (int frame = 0; frame < 2; frame++)
+    {
+        int before = allocations;
+        block_match(&img_left, &img_right, &map, BLOCK_SIZE);
+        for (int i = 0; i < map.width; i++)
+        {
+            *disparity_map_at(&map, i, map.height / 2) = disparity_to_fixed(get_disparity(&img_left, &img_right, i, map.height / 2, BLOCK_SIZE, 0));
+        }
+        block_match_informed(&img_left, &img_right, &coarse, &map, BLOCK_SIZE, PYRAMID_SEARCH_RADIUS);
+        int serial = allocations - before;
+
+        before = allocations;
+        block_match_parallel(&img_left, &img_right, &map, BLOCK_SIZE, &pool);
+        block_match_informed_parallel(&img_left, &img_right, &coarse, &map, BLOCK_SIZE, PYRAMID_SEARCH_RADIUS, &pool);
+        int parallel = allocations - before;
+        printf("\tTest frame %d serial %s", frame, serial == 0 ? "PASS" : "FAIL");
+        printf(serial == 0 ? "" : " (%d allocations)", serial);
+        printf(", parallel %s", parallel == 0 ? "PASS" : "FAIL");
+        printf(parallel == 0 ? "\n" : " (%d allocations)\n", parallel);
+        failures += serial != 0;
+        failures += parallel != 0;
+    }
+
+    thread_pool_destroy(&pool);
+    match_scratch_release();
+    free_disparity_map(&map);
+    free_disparity_map(&coarse);
+    free(left->data);
+    free(left);
+    free(right->data);
+    free(right);
+    return failures;
+}
+
+// Collects the rows emitted by a stereo_stream
+struct stream_capture
+{
+    struct stereo_stream *st;
+    struct disparity_map *map;
+    // Rows emitted before enough image rows had arrived, or out of order
+    int early;
+    int next;
+};
+
+void stream_capture_row(void *arg, int y, const uint16_t *row)
+{
+    struct stream_capture *capture = (struct stream_capture *)arg;
+    int needed = y + KERNEL_EDGE_SIZE + 1 < capture->map->height ? y + KERNEL_EDGE_SIZE + 1 : capture->map->height;
+    capture->early += capture->st->rows_in < needed || y != capture->next;
+    capture->next = y + 1;
+    memcpy(disparity_map_at(capture->map, 0, y), row, sizeof(uint16_t) * capture->map->width);
+}
+
+int test_stream_on(const char *name, struct ppm_array *img_left, struct ppm_array *img_right)
+{
+    int failures = 0;
+    struct disparity_map expected;
+    struct disparity_map actual;
+    struct stereo_stream st;
+    expected.height = actual.height = img_left->height;
+    expected.width = actual.width = img_left->width;
+    allocate_disparity_map(&expected);
+    allocate_disparity_map(&actual);
+    block_match(img_left, img_right, &expected, BLOCK_SIZE);
+
+    struct stream_capture capture = {&st, &actual, 0, 0};
+    stereo_stream_init(&st, img_left->width, img_left->height, img_left->channels, BLOCK_SIZE, stream_capture_row, &capture);
+    printf("\tTest %s", name);
+    // Two frames, to check the stream can be reused
+    for (int frame = 0; frame < 2; frame++)
+    {
+        memset(actual.data, 0, sizeof(uint16_t) * actual.width * actual.height);
+        capture.early = capture.next = 0;
+        int before = allocations;
+        stereo_stream_reset(&st);
+        for (int y = 0; y < img_left->height; y++)
+        {
+            stereo_stream_push(&st, ppm_array_at(img_left, 0, y), ppm_array_at(img_right, 0, y));
+        }
+        int allocated = allocations - before;
+        int mismatches = disparity_map_mismatches(&expected, &actual);
+        int pass = mismatches == 0 && capture.early == 0 && capture.next == actual.height && allocated == 0;
+        printf(pass ? " PASS" : " FAIL (%d pixels, %d rows early, %d rows, %d allocations)",
+               mismatches, capture.early, capture.next, allocated);
+        failures += !pass;
+    }
+    printf("\n");
+
+    stereo_stream_free(&st);
+    free_disparity_map(&expected);
+    free_disparity_map(&actual);
+    return failures;
+}
+
+int test_stereo_stream()
+{
+    printf("stereo_stream\n");
+    int failures = 0;
+    for (int p = 0; p < TEST_PAIRS; p++)
+    {
+        struct test_pair pair;
+        if (!test_pair_open(p, &pair))
+        {
+            continue;
+        }
+        struct ppm_array grey_left;
+        struct ppm_array grey_right;
+        char name[64];
+        failures += test_stream_on(pair.name, &pair.img[0], &pair.img[1]);
+
+        snprintf(name, sizeof(name), "%s grey", pair.name);
+        to_greyscale_plane(&pair.img[0], &grey_left);
+        to_greyscale_plane(&pair.img[1], &grey_right);
+        failures += test_stream_on(name, &grey_left, &grey_right);
+
+        free_ppm_array(&grey_left);
+        free_ppm_array(&grey_right);
+        test_pair_close(&pair);
+    }
+    return failures;
+}
+
+// Checks that block_match_roi() gives the block_match() disparity inside every
+// rectangle and leaves the rest of the map alone, for bands, column ranges,
+// points and rectangles sticking out of the image.
+int test_block_match_roi()
+{
+    printf("block_match_roi\n");
+    struct ppm_image *left = readPPM("tsukuba/scene1.row3.col1.ppm");
+    struct ppm_image *right = readPPM("tsukuba/scene1.row3.col2.ppm");
+    struct ppm_array img[2][2];
+    ppm_array_wrap(left, &img[0][0]);
+    ppm_array_wrap(right, &img[0][1]);
+    census_transform(&img[0][0], &img[1][0]);
+    census_transform(&img[0][1], &img[1][1]);
+    const char *names[] = {"sad", "census"};
+    struct disparity_roi rois[] = {{0, 384, 40, 41}, {0, 384, 90, 91}, {0, 384, 140, 143}, {0, 384, 190, 191},
+                                   {0, 384, 240, 241}, {100, 104, 0, 288}, {7, 8, 3, 4}, {383, 384, 287, 288},
+                                   {-5, 3, 280, 300}, {50, 200, 60, 80}};
+    int roi_count = sizeof(rois) / sizeof(rois[0]);
+
+    int failures = 0;
+    for (int c = 0; c < 2; c++)
+    {
+        struct disparity_map expected;
+        struct disparity_map actual;
+        expected.height = actual.height = img[c][0].height;
+        expected.width = actual.width = img[c][0].width;
+        allocate_disparity_map(&expected);
+        allocate_disparity_map(&actual);
+        block_match(&img[c][0], &img[c][1], &expected, BLOCK_SIZE);
+        memset(actual.data, 0xab, sizeof(uint16_t) * actual.width * actual.height);
+        block_match_roi(&img[c][0], &img[c][1], &actual, BLOCK_SIZE, rois, roi_count);
+
+        int wrong = 0;
+        int touched = 0;
+        for (int y = 0; y < actual.height; y++)
+        {
+            for (int x = 0; x < actual.width; x++)
+            {
+                int inside = 0;
+                for (int r = 0; r < roi_count; r++)
+                {
+                    inside |= x >= rois[r].x_start && x < rois[r].x_end && y >= rois[r].y_start && y < rois[r].y_end;
+                }
+                uint16_t value = *disparity_map_at(&actual, x, y);
+                wrong += inside && value != *disparity_map_at(&expected, x, y);
+                touched += !inside && value != 0xabab;
+            }
+        }
+        printf("\tTest %s regions %s, rest untouched %s\n", names[c], wrong ? "FAIL" : "PASS", touched ? "FAIL" : "PASS");
+        failures += wrong != 0;
+        failures += touched != 0;
+        free_disparity_map(&expected);
+        free_disparity_map(&actual);
+    }
+
+    free_ppm_array(&img[1][0]);
+    free_ppm_array(&img[1][1]);
+    free(left->data);
+    free(left);
+    free(right->data);
+    free(right);
+    return failures;
+}
+
+// Checks that block_match_confidence matches block_match, gives the same
+// confidence as get_disparity_confidence, and that confident pixels are more
+// often right.
+int test_confidence()
+{
+    printf("block_match_confidence\n");
+    struct ppm_image *left = readPPM("tsukuba/scene1.row3.col3.ppm");
+    struct ppm_image *right = readPPM("tsukuba/scene1.row3.col4.ppm");
+    struct ppm_array img_left;
+    struct ppm_array img_right;
+    struct ppm_array truth;
+    ppm_array_wrap(left, &img_left);
+    ppm_array_wrap(right, &img_right);
+    readPGM("tsukuba/truedisp.row3.col3.pgm", &truth);
+    struct disparity_map expected;
+    struct disparity_map actual;
+    struct ppm_array confidence[2];
+    expected.height = actual.height = img_left.height;
+    expected.width = actual.width = img_left.width;
+    allocate_disparity_map(&expected);
+    allocate_disparity_map(&actual);
+    for (int i = 0; i < 2; i++)
+    {
+        confidence[i].width = img_left.width;
+        confidence[i].height = img_left.height;
+        confidence[i].channels = 1;
+        ppm_array_allocate(&confidence[i]);
+    }
+    struct thread_pool pool;
+    thread_pool_create(&pool, 3, 0);
+
+    // Same disparities as block_match, and the same confidence on the pool
+    block_match(&img_left, &img_right, &expected, BLOCK_SIZE);
+    block_match_confidence(&img_left, &img_right, &actual, &confidence[0], BLOCK_SIZE, NULL);
+    int same = disparity_map_mismatches(&expected, &actual) == 0;
+    block_match_confidence(&img_left, &img_right, &actual, &confidence[1], BLOCK_SIZE, &pool);
+    same &= disparity_map_mismatches(&expected, &actual) == 0 && ppm_array_mismatches(&confidence[0], &confidence[1]) == 0;
+
+    // Per pixel matching gives the same confidence
+    int y = img_left.height / 2;
+    for (int x = 0; x < img_left.width; x++)
+    {
+        uint8_t value;
+        double disparity = get_disparity_confidence(&img_left, &img_right, x, y, BLOCK_SIZE, 0, &value);
+        same &= value == *ppm_array_at(&confidence[0], x, y) &&
+                disparity_to_fixed(disparity) == *disparity_map_at(&expected, x, y);
+    }
+    printf("\tTest matches block_match %s", same ? "PASS" : "FAIL");
+
+    // The most confident half of the pixels is wrong far less often than the
+    // rest
+    int known[2] = {0, 0};
+    int wrong[2] = {0, 0};
+    for (int j = 0; j < truth.height; j++)
+    {
+        for (int i = 0; i < truth.width; i++)
+        {
+            int value = *ppm_array_at(&truth, i, j);
+            if (value == 0)
+            {
+                continue;
+            }
+            int confident = *ppm_array_at(&confidence[0], i, j) >= 64;
+            known[confident]++;
+            wrong[confident] += !(fabs(disparity_from_fixed(*disparity_map_at(&expected, i, j)) - value / 16.0) <= 1.0);
+        }
+    }
+    double coverage = (double)known[1] / (known[0] + known[1]);
+    double bad_confident = (double)wrong[1] / known[1];
+    double bad_rest = (double)wrong[0] / known[0];
+    int reliable = coverage > 0.4 && bad_confident < bad_rest / 4;
+    printf(reliable ? ", reliable PASS (%.0f%% confident, %.2f%% bad against %.2f%%)\n"
+                    : ", reliable FAIL (%.0f%% confident, %.2f%% bad against %.2f%%)\n",
+           100 * coverage, 100 * bad_confident, 100 * bad_rest);
+
+    thread_pool_destroy(&pool);
+    free_ppm_array(&confidence[0]);
+    free_ppm_array(&confidence[1]);
+    free_disparity_map(&expected);
+    free_disparity_map(&actual);
+    free_ppm_array(&truth);
+    free(left->data);
+    free(left);
+    free(right->data);
+    free(right);
+    return !same + !reliable;
+}
+
+// Checks calib.txt parsing and the range scan of a synthetic scene: a wall on
+// the left half above a ground plane that fills the rest, with one group of 
+// columns that has no disparity at all.
+int test_range_scan()
+{
+    int failures = 0;
+    printf("range scan\n");
+    struct stereo_calib calib;
+    read_calib("all/data/chess1/calib.txt", &calib);
+    int parsed = calib.focal == 1758.23 && calib.cx == 953.34 && calib.cy == 552.29 && calib.baseline == 111.53 &&
+                 calib.doffs == 0 && calib.width == 1920 && calib.height == 1080 && calib.ndisp == 290;
+    printf("\tTest calib.txt %s", parsed ? "PASS" : "FAIL");
+    failures += !parsed;
+
+    // A tenth of the calibrated resolution
+    struct disparity_map map = {108, 192};
+    allocate_disparity_map(&map);
+    double focal = calib.focal / 10, cx = calib.cx / 10, cy = calib.cy / 10;
+    double wall = 2000, camera_height = 300;
+    for (int y = 0; y < map.height; y++)
+    {
+        for (int x = 0; x < map.width; x++)
+        {
+            double disparity = NAN;
+            if (x < 96 && y < 70)
+            {
+                disparity = calib.baseline * focal / wall;
+            }
+            else if (y > cy + 1)
+            {
+                disparity = (y - cy) * calib.baseline / camera_height;
+            }
+            *disparity_map_at(&map, x, y) = x >= 160 && x < 176 ? DISPARITY_INVALID : disparity_to_fixed(disparity);
+        }
+    }
+
+    struct range_scan scan;
+    memset(&scan, 0, sizeof(scan));
+    struct range_scan_options opt = {20, 100, camera_height, 50, 10000, map.width};
+    disparity_to_range_scan(&map, &calib, &opt, &scan);
+    int columns = scan.count == map.width;
+    for (int x = 0; x < map.width && columns; x++)
+    {
+        double tangent = (x - cx) / focal;
+        double expected = x < 96 ? wall * sqrt(1 + tangent * tangent) : x >= 160 && x < 176 ? NAN : opt.max_range;
+        columns = isnan(expected) ? isnan(scan.range[x]) : fabs(scan.range[x] - expected) < expected * 0.01;
+        columns &= fabs(scan.bearing[x] - atan(tangent)) < 1e-9;
+    }
+    printf(", columns %s", columns ? "PASS" : "FAIL");
+    failures += !columns;
+
+    // Rays of 16 columns, the invalid group is ray 10
+    opt.rays = 12;
+    disparity_to_range_scan(&map, &calib, &opt, &scan);
+    int rays = scan.count == 12 && isnan(scan.range[10]) && scan.range[9] == opt.max_range && scan.range[11] == opt.max_range;
+    for (int r = 0; r < 6; r++)
+    {
+        double tangent = (r * 16 + 7.5 - cx) / focal;
+        rays &= fabs(scan.bearing[r] - atan(tangent)) < 1e-9;
+        // Nearest column of the ray is the one closest to the optical axis
+        double nearest = (r * 16 + 15 - cx) / focal;
+        rays &= fabs(scan.range[r] - wall * sqrt(1 + nearest * nearest)) < wall * 0.01;
+    }
+    printf(", rays %s", rays ? "PASS" : "FAIL");
+    failures += !rays;
+
+    // Leaving out low confidence wall pixels leaves the ground there, which is
+    // rejected
+    struct ppm_array confidence;
+    confidence.width = map.width;
+    confidence.height = map.height;
+    confidence.channels = 1;
+    ppm_array_allocate(&confidence);
+    for (int y = 0; y < map.height; y++)
+    {
+        memset(ppm_array_at(&confidence, 0, y), y < 70 ? 10 : 200, map.width);
+    }
+    opt.confidence = &confidence;
+    opt.min_confidence = 100;
+    disparity_to_range_scan(&map, &calib, &opt, &scan);
+    int confident = scan.range[0] == opt.max_range && scan.range[5] == opt.max_range && isnan(scan.range[10]);
+    opt.min_confidence = 10;
+    disparity_to_range_scan(&map, &calib, &opt, &scan);
+    confident &= scan.range[0] < opt.max_range;
+    printf(", confidence %s", confident ? "PASS" : "FAIL");
+    failures += !confident;
+    opt.confidence = NULL;
+    free_ppm_array(&confidence);
+
+    // Without ground rejection the ground is the nearest thing on the right
+    opt.camera_height = 0;
+    disparity_to_range_scan(&map, &calib, &opt, &scan);
+    int ground = scan.range[8] < opt.max_range && scan.range[11] < opt.max_range;
+    printf(", ground kept %s\n", ground ? "PASS" : "FAIL");
+    failures += !ground;
+
+    free_range_scan(&scan);
+    free_disparity_map(&map);
+    return failures;
+}
+
+// Checks calibration parsing, that rectifying with a calibration that needs no
+// correction copies the image, that a principal point offset shifts it, that
+// every kernel set samples a rotated and distorted pair and random rows
+// identically, and the remap table cache.
+int test_rectify()
+{
+    int failures = 0;
+    printf("rectify\n");
+    struct rectify_calib calib;
+    read_rectify_calib("all/data/chess1/calib.txt", &calib);
+    int parsed = calib.K[0][0] == 1758.23 && calib.K[1][2] == 953.34 && calib.K[1][8] == 1 && calib.R[0] == 1 &&
+                 calib.R[1] == 0 && calib.R[8] == 1 && calib.T[0] == -111.53 && calib.dist[1][0] == 0 &&
+                 calib.width == 1920 && calib.height == 1080;
+    printf("\tTest calib.txt %s\n", parsed ? "PASS" : "FAIL");
+    failures += !parsed;
+
+    struct ppm_image *image = readPPM("tsukuba/scene1.row3.col1.ppm");
+    struct ppm_array img[2];
+    struct ppm_array out[2];
+    ppm_array_wrap(image, &img[0]);
+    to_greyscale_plane(&img[0], &img[1]);
+    for (int i = 0; i < 2; i++)
+    {
+        out[i].height = img[i].height;
+        out[i].width = img[i].width;
+        out[i].channels = img[i].channels;
+        ppm_array_allocate(&out[i]);
+    }
+
+    // Tsukuba sized pair needing no correction, then with cam1's principal 
+    // point 10 pixels to the right
+    memset(&calib, 0, sizeof(calib));
+    calib.width = img[0].width;
+    calib.height = img[0].height;
+    for (int c = 0; c < 2; c++)
+    {
+        double K[9] = {400, 0, 190.5, 0, 400, 140.25, 0, 0, 1};
+        memcpy(calib.K[c], K, sizeof(K));
+    }
+    calib.R[0] = calib.R[4] = calib.R[8] = 1;
+    calib.T[0] = -100;
+    struct remap_table table;
+    memset(&table, 0, sizeof(table));
+    remap_table_build(&calib, 1, &table);
+    calib.K[1][2] += 10;
+    struct remap_table shifted;
+    memset(&shifted, 0, sizeof(shifted));
+    remap_table_build(&calib, 1, &shifted);
+
+    // A rotated, distorted pair
+    double angle = 0.02;
+    double R[9] = {cos(angle), 0, sin(angle), 0, 1, 0, -sin(angle), 0, cos(angle)};
+    double dist[5] = {-0.2, 0.05, 0.001, -0.002, 0.01};
+    memcpy(calib.R, R, sizeof(R));
+    memcpy(calib.dist[1], dist, sizeof(dist));
+    calib.T[1] = 3;
+    struct remap_table warped;
+    memset(&warped, 0, sizeof(warped));
+    remap_table_build(&calib, 1, &warped);
+
+    const char *names[] = {"rgb", "grey"};
+    for (int i = 0; i < 2; i++)
+    {
+        struct ppm_array expected;
+        expected.height = img[i].height;
+        expected.width = img[i].width;
+        expected.channels = img[i].channels;
+        ppm_array_allocate(&expected);
+        sad_kernels_use("scalar");
+        remap_image(&warped, &img[i], &expected);
+        for (int k = 0; sad_kernels_all[k]; k++)
+        {
+            if (!sad_kernels_use(sad_kernels_all[k]->name))
+            {
+                printf("\tTest %s %s: not supported, skipped\n", names[i], sad_kernels_all[k]->name);
+                continue;
+            }
+            printf("\tTest %s %s", names[i], sad_kernels_all[k]->name);
+            remap_image(&table, &img[i], &out[i]);
+            int mismatches = ppm_array_mismatches(&img[i], &out[i]);
+            printf(", identity %s", mismatches ? "FAIL" : "PASS");
+            failures += mismatches != 0;
+
+            remap_image(&shifted, &img[i], &out[i]);
+            mismatches = 0;
+            for (int y = 0; y < img[i].height; y++)
+            {
+                for (int x = 0; x < img[i].width; x++)
+                {
+                    for (int c = 0; c < img[i].channels; c++)
+                    {
+                        int value = x + 10 < img[i].width ? ppm_array_at(&img[i], x + 10, y)[c] : 0;
+                        mismatches += ppm_array_at(&out[i], x, y)[c] != value;
+                    }
+                }
+            }
+            printf(", shift %s", mismatches ? "FAIL" : "PASS");
+            failures += mismatches != 0;
+
+            remap_image(&warped, &img[i], &out[i]);
+            mismatches = ppm_array_mismatches(&expected, &out[i]);
+            printf(", warp %s", mismatches ? "FAIL" : "PASS");
+            failures += mismatches != 0;
+
+            // Random rows of every length up to a few vectors, with black 
+            // pixels and full weights towards the right and lower neighbours
+            srand(13);
+            mismatches = 0;
+            for (int n = 0; n <= 27; n++)
+            {
+                int16_t xy[2 * 27];
+                uint16_t frac[27];
+                uint8_t row[3 * 27], row_scalar[3 * 27];
+                for (int k = 0; k < n; k++)
+                {
+                    xy[2 * k] = rand() % 8 ? rand() % (img[i].width - 1) : -1;
+                    xy[2 * k + 1] = rand() % (img[i].height - 1);
+                    int fx = rand() % 4 ? rand() % (1 << REMAP_FRAC_BITS) : 1 << REMAP_FRAC_BITS;
+                    int fy = rand() % 4 ? rand() % (1 << REMAP_FRAC_BITS) : 1 << REMAP_FRAC_BITS;
+                    frac[k] = fx | fy << 8;
+                }
+                sad_kernels_get()->remap_row(img[i].data, img[i].stride, img[i].channels, xy, frac, row, n);
+                sad_kernels_scalar.remap_row(img[i].data, img[i].stride, img[i].channels, xy, frac, row_scalar, n);
+                mismatches += memcmp(row, row_scalar, n * img[i].channels) != 0;
+            }
+            printf(", rows %s\n", mismatches ? "FAIL" : "PASS");
+            failures += mismatches != 0;
+        }
+        sad_kernels_use(NULL);
+        free_ppm_array(&expected);
+    }
+
+    // A cache made for the calibration is used, one for another isn't
+    const char *cache = "remap_test.cache";
+    remove(cache);
+    struct remap_table cached;
+    memset(&cached, 0, sizeof(cached));
+    remap_table_cached(&calib, 1, cache, &cached);
+    int written = remap_table_load(&table, rectify_calib_key(&calib, 1), cache);
+    size_t pixels = (size_t)warped.width * warped.height;
+    int same = written && table.width == warped.width && table.height == warped.height &&
+               memcmp(table.xy, warped.xy, sizeof(int16_t) * 2 * pixels) == 0 &&
+               memcmp(table.frac, warped.frac, sizeof(uint16_t) * pixels) == 0;
+    int other = remap_table_load(&table, rectify_calib_key(&calib, 0), cache);
+    printf("\tTest cache written %s, loaded %s, other calibration %s\n", written ? "PASS" : "FAIL",
+           same ? "PASS" : "FAIL", other ? "FAIL" : "PASS");
+    failures += !written;
+    failures += !same;
+    failures += other != 0;
+    remove(cache);
+
+    free_remap_table(&table);
+    free_remap_table(&shifted);
+    free_remap_table(&warped);
+    free_remap_table(&cached);
+    for (int i = 0; i < 2; i++)
+    {
+        free_ppm_array(&out[i]);
+    }
+    free_ppm_array(&img[1]);
+    free(image->data);
+    free(image);
+    return failures;
+}
+
+// Checks that mapped images are views of the file's pixels, that arrays 
+// written with write_array() read back the same, and 16 bit PGM files with
+// header comments.
+int test_image_io()
+{
+    int failures = 0;
+    printf("image io\n");
+    struct ppm_image *image = readPPM("tsukuba/scene1.row3.col1.ppm");
+    struct mapped_image file;
+    struct ppm_array view;
+    mapped_image_open("tsukuba/scene1.row3.col1.ppm", &file);
+    mapped_image_view(&file, &view);
+    int in_place = view.data > (unsigned char *)file.map && view.data < (unsigned char *)file.map + file.map_len;
+    int same = view.width == image->x && view.height == image->y && view.channels == 3 &&
+               memcmp(view.data, image->data, 3 * image->x * image->y) == 0;
+    printf("\tTest view in place %s, matches readPPM %s", in_place ? "PASS" : "FAIL", same ? "PASS" : "FAIL");
+    failures += !in_place;
+    failures += !same;
+
+    // A padded plane and the contiguous view, written and read back
+    const char *path = "image_io_test.pgm";
+    struct ppm_array grey;
+    to_greyscale_plane(&view, &grey);
+    struct ppm_array *arrays[] = {&grey, &view};
+    for (int i = 0; i < 2; i++)
+    {
+        write_array(path, arrays[i]);
+        struct mapped_image written;
+        struct ppm_array read_back;
+        mapped_image_open(path, &written);
+        mapped_image_view(&written, &read_back);
+        int mismatches = read_back.channels == arrays[i]->channels ? ppm_array_mismatches(arrays[i], &read_back) : 1;
+        printf(", write %s %s", i ? "rgb" : "grey", mismatches ? "FAIL" : "PASS");
+        failures += mismatches != 0;
+        mapped_image_close(&written);
+    }
+    free_ppm_array(&grey);
+    mapped_image_close(&file);
+
+    // 16 bit samples are big-endian
+    FILE *fp = fopen(path, "wb");
+    const unsigned char pixels[] = {0x00, 0x00, 0x12, 0x34, 0x80, 0x00, 0xff, 0xff, 0x01, 0x00, 0x00, 0x7f};
+    fprintf(fp, "P5\n# a comment\n3 # another\n2\n65535\n");
+    fwrite(pixels, sizeof(pixels), 1, fp);
+    fclose(fp);
+    mapped_image_open(path, &file);
+    int wide = file.sample_bytes == 2 && file.width == 3 && file.height == 2 && mapped_image_sample(&file, 1, 0, 0) == 0x1234 &&
+               mapped_image_sample(&file, 0, 1, 0) == 0xffff && mapped_image_sample(&file, 2, 1, 0) == 0x7f;
+    mapped_image_close(&file);
+    struct ppm_array scaled;
+    readPGM(path, &scaled);
+    wide &= *ppm_array_at(&scaled, 1, 0) == 18 && *ppm_array_at(&scaled, 2, 0) == 128 && *ppm_array_at(&scaled, 0, 1) == 255;
+    printf(", 16 bit %s\n", wide ? "PASS" : "FAIL");
+    failures += !wide;
+    free_ppm_array(&scaled);
+    remove(path);
+    free(image->data);
+    free(image);
+    return failures;
+}
+
+// Checks that a dataset cache maps back to the pair, greyscale planes, ground
+// truth and calibration it was written from, as page aligned padded arrays.
+int test_dataset()
+{
+    printf("dataset cache\n");
+    struct ppm_image *left = readPPM("tsukuba/scene1.row3.col3.ppm");
+    struct ppm_image *right = readPPM("tsukuba/scene1.row3.col4.ppm");
+    struct ppm_array img[2];
+    struct ppm_array truth;
+    struct stereo_calib calib;
+    ppm_array_wrap(left, &img[0]);
+    ppm_array_wrap(right, &img[1]);
+    readPGM("tsukuba/truedisp.row3.col3.pgm", &truth);
+    read_calib("all/data/chess1/calib.txt", &calib);
+
+    const char *path = "dataset_test.stc";
+    dataset_write(path, &img[0], &img[1], &truth, 16, &calib);
+    struct dataset set;
+    dataset_open(path, &set);
+    int header = set.header->width == img[0].width && set.header->height == img[0].height &&
+                 set.header->truth_scale == 16 && set.header->has_calib && set.header->calib.focal == calib.focal &&
+                 set.header->calib.ndisp == calib.ndisp;
+    int planes = 1;
+    int aligned = 1;
+    for (int p = 0; p < DATASET_PLANES; p++)
+    {
+        struct ppm_array expected;
+        if (p == DATASET_TRUTH)
+        {
+            expected = truth;
+        }
+        else if (p >= DATASET_LEFT_GREY)
+        {
+            to_greyscale_plane(&img[p - DATASET_LEFT_GREY], &expected);
+        }
+        else
+        {
+            expected = img[p];
+        }
+        struct ppm_array *plane = &set.plane[p];
+        planes &= plane->channels == expected.channels && plane->pad == IMAGE_PAD &&
+                  ppm_array_mismatches(&expected, plane) == 0;
+        // The border is zeroed like an allocated array's
+        planes &= *ppm_array_at(plane, -1, -1) == 0 && *ppm_array_at(plane, plane->width, plane->height - 1) == 0;
+        aligned &= (plane->data - plane->pad * plane->stride - plane->pad * plane->channels - (unsigned char *)set.map) % DATASET_PAGE == 0;
+        if (p == DATASET_LEFT_GREY || p == DATASET_RIGHT_GREY)
+        {
+            free_ppm_array(&expected);
+        }
+    }
+    dataset_close(&set);
+
+    // Without ground truth or calibration
+    dataset_write(path, &img[0], &img[1], NULL, 0, NULL);
+    dataset_open(path, &set);
+    int optional = !set.header->has_calib && !set.header->truth_scale && !set.plane[DATASET_TRUTH].data &&
+                   set.plane[DATASET_RIGHT_GREY].data;
+    dataset_close(&set);
+    remove(path);
+    printf("\tTest header %s, planes %s, page aligned %s, optional planes %s\n", header ? "PASS" : "FAIL",
+           planes ? "PASS" : "FAIL", aligned ? "PASS" : "FAIL", optional ? "PASS" : "FAIL");
+
+    free_ppm_array(&truth);
+    free(left->data);
+    free(left);
+    free(right->data);
+    free(right);
+    return !header + !planes + !aligned + !optional;
+}
+
+// Checks temporal matching: the first frame and an unchanged repeat match
+// block_match exactly, a changed tile is searched in full, the warp moves a
+// flat scene, and odometry keeps a moving pair as accurate as block_match.
+int test_temporal_match()
+{
+    printf("temporal matching\n");
+    struct ppm_image *views[4];
+    struct ppm_array img[4];
+    char filename[64];
+    for (int i = 0; i < 4; i++)
+    {
+        snprintf(filename, sizeof(filename), "tsukuba/scene1.row3.col%d.ppm", i + 2);
+        views[i] = readPPM(filename);
+        ppm_array_wrap(views[i], &img[i]);
+    }
+    struct ppm_array truth;
+    readPGM("tsukuba/truedisp.row3.col3.pgm", &truth);
+    int width = img[0].width;
+    int height = img[0].height;
+    struct disparity_map expected;
+    struct disparity_map actual;
+    expected.width = actual.width = width;
+    expected.height = actual.height = height;
+    allocate_disparity_map(&expected);
+    allocate_disparity_map(&actual);
+    size_t map_bytes = sizeof(uint16_t) * width * height;
+    struct thread_pool pool;
+    thread_pool_create(&pool, 3, 0);
+    struct temporal_match tm;
+    temporal_match_init(&tm, width, height, BLOCK_SIZE);
+
+    // col3/col4 twice, on the pool the second time
+    block_match(&img[1], &img[2], &expected, BLOCK_SIZE);
+    temporal_match_frame(&tm, &img[1], &img[2], &actual, NULL, NULL, NULL);
+    int first = memcmp(expected.data, actual.data, map_bytes) == 0;
+    temporal_match_frame(&tm, &img[1], &img[2], &actual, NULL, NULL, &pool);
+    int repeat = memcmp(expected.data, actual.data, map_bytes) == 0 && tm.window_pixels == (long)width * height;
+    printf("\tTest first frame %s, unchanged frame %s\n", first ? "PASS" : "FAIL", repeat ? "PASS" : "FAIL");
+
+    // Paint over one tile, its pixels must get block_match's disparities
+    struct ppm_array painted;
+    painted.width = width;
+    painted.height = height;
+    painted.channels = 3;
+    ppm_array_allocate(&painted);
+    for (int y = 0; y < height; y++)
+    {
+        memcpy(ppm_array_at(&painted, 0, y), ppm_array_at(&img[1], 0, y), width * 3);
+    }
+    for (int y = 4 * TEMPORAL_TILE; y < 5 * TEMPORAL_TILE; y++)
+    {
+        for (int x = 6 * TEMPORAL_TILE; x < 7 * TEMPORAL_TILE; x++)
+        {
+            memset(ppm_array_at(&painted, x, y), (x * 7 + y * 13) & 0xff, 3);
+        }
+    }
+    block_match(&painted, &img[2], &expected, BLOCK_SIZE);
+    temporal_match_frame(&tm, &painted, &img[2], &actual, NULL, NULL, NULL);
+    int tile = tm.full_pixels >= TEMPORAL_TILE * TEMPORAL_TILE;
+    for (int y = 4 * TEMPORAL_TILE; y < 5 * TEMPORAL_TILE; y++)
+    {
+        for (int x = 6 * TEMPORAL_TILE; x < 7 * TEMPORAL_TILE; x++)
+        {
+            tile &= *disparity_map_at(&actual, x, y) == *disparity_map_at(&expected, x, y);
+        }
+    }
+    printf("\tTest changed tile %s", tile ? "PASS" : "FAIL");
+    free_ppm_array(&painted);
+
+    // A flat scene at disparity 8 seen after moving one baseline right moves 8
+    // pixels left, uncovering the right edge
+    struct stereo_calib calib = {400, width / 2.0, height / 2.0, 1, 0, width, height, BLOCK_SIZE};
+    struct camera_motion right_step = {1, 0, 0, 0};
+    for (int i = 0; i < width * height; i++)
+    {
+        expected.data[i] = disparity_to_fixed(8);
+    }
+    temporal_warp(&expected, &calib, &right_step, &actual);
+    int warp = 1;
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            uint16_t want = x < width - 8 ? disparity_to_fixed(8) : DISPARITY_INVALID;
+            warp &= *disparity_map_at(&actual, x, y) == want;
+        }
+    }
+    printf(", warp %s", warp ? "PASS" : "FAIL");
+
+    // col2/col3 then col3/col4 with the move, scored on col3
+    double bad_full;
+    double bad_temporal;
+    block_match(&img[1], &img[2], &expected, BLOCK_SIZE);
+    disparity_error(&expected, &truth, 16, 1.0, &bad_full);
+    temporal_match_reset(&tm);
+    temporal_match_frame(&tm, &img[0], &img[1], &actual, &calib, NULL, &pool);
+    temporal_match_frame(&tm, &img[1], &img[2], &actual, &calib, &right_step, &pool);
+    disparity_error(&actual, &truth, 16, 1.0, &bad_temporal);
+    int odometry = fabs(bad_temporal - bad_full) < 0.005 && tm.window_pixels > 0.7 * width * height;
+    printf(", odometry %s (%.2f%% bad, %.2f%% for block_match)\n", odometry ? "PASS" : "FAIL", 100 * bad_temporal,
+           100 * bad_full);
+
+    // Column sums left in the scratch by a wider image over a bigger range
+    // must not leak into the windows
+    struct dataset cones_set;
+    struct ppm_array cones[2];
+    int dirty = 1;
+    if (test_open_cones(&cones_set, cones))
+    {
+        struct disparity_map cones_map;
+        cones_map.width = cones[0].width;
+        cones_map.height = cones[0].height;
+        allocate_disparity_map(&cones_map);
+        block_match(&img[1], &img[2], &expected, BLOCK_SIZE);
+        temporal_match_reset(&tm);
+        temporal_match_frame(&tm, &img[1], &img[2], &actual, NULL, NULL, NULL);
+        block_match(&cones[0], &cones[1], &cones_map, 60);
+        temporal_match_frame(&tm, &img[1], &img[2], &actual, NULL, NULL, NULL);
+        dirty = memcmp(expected.data, actual.data, map_bytes) == 0 && tm.window_pixels == (long)width * height;
+        printf("\tTest reused scratch %s\n", dirty ? "PASS" : "FAIL");
+        free_disparity_map(&cones_map);
+        dataset_close(&cones_set);
+    }
+
+    temporal_match_free(&tm);
+    thread_pool_destroy(&pool);
+    free_disparity_map(&expected);
+    free_disparity_map(&actual);
+    free_ppm_array(&truth);
+    for (int i = 0; i < 4; i++)
+    {
+        free(views[i]->data);
+        free(views[i]);
+    }
+    return !first + !repeat + !tile + !warp + !odometry + !dirty;
+}
+
+// Checks tile-adaptive search ranges: whole ranges match block_match exactly,
+// narrowed ranges match a per-pixel search of the same disparities, and the
+// estimated ranges skip part of the search without costing accuracy.
+int test_search_ranges()
+{
+    printf("search ranges\n");
+    struct ppm_image *left = readPPM("tsukuba/scene1.row3.col3.ppm");
+    struct ppm_image *right = readPPM("tsukuba/scene1.row3.col4.ppm");
+    struct ppm_array img_left;
+    struct ppm_array img_right;
+    struct ppm_array truth;
+    ppm_array_wrap(left, &img_left);
+    ppm_array_wrap(right, &img_right);
+    readPGM("tsukuba/truedisp.row3.col3.pgm", &truth);
+    int width = img_left.width;
+    int height = img_left.height;
+    struct disparity_map expected;
+    struct disparity_map actual;
+    expected.width = actual.width = width;
+    expected.height = actual.height = height;
+    allocate_disparity_map(&expected);
+    allocate_disparity_map(&actual);
+    struct thread_pool pool;
+    thread_pool_create(&pool, 3, 0);
+    struct search_ranges sr;
+    search_ranges_init(&sr, width, height, img_left.channels, BLOCK_SIZE);
+
+    // Before estimating, every tile searches the whole range
+    block_match(&img_left, &img_right, &expected, BLOCK_SIZE);
+    block_match_ranges(&img_left, &img_right, &actual, &sr, NULL);
+    int whole = disparity_map_mismatches(&expected, &actual) == 0 && search_ranges_skipped(&sr) == 0;
+    block_match_ranges(&img_left, &img_right, &actual, &sr, &pool);
+    whole &= disparity_map_mismatches(&expected, &actual) == 0;
+
+    // Ranges that overlap, contain or miss the ones of the tiles above them
+    for (int t = 0; t < sr.tiles_x * sr.tiles_y; t++)
+    {
+        sr.d_min[t] = t * 7 % 11;
+        sr.d_max[t] = sr.d_min[t] + 1 + t * 5 % 9;
+    }
+    block_match_ranges(&img_left, &img_right, &actual, &sr, NULL);
+    int narrow = 1;
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            int t = y / SEARCH_RANGE_TILE * sr.tiles_x + x / SEARCH_RANGE_TILE;
+            // Near the left edge get_disparity_window narrows the range further
+            if (x + KERNEL_EDGE_SIZE - 1 < sr.d_max[t])
+            {
+                continue;
+            }
+            double disparity = get_disparity_window(&img_left, &img_right, x, y, sr.d_min[t], sr.d_max[t]);
+            narrow &= *disparity_map_at(&actual, x, y) == disparity_to_fixed(disparity);
+        }
+    }
+    printf("\tTest whole ranges %s, narrowed ranges %s\n", whole ? "PASS" : "FAIL", narrow ? "PASS" : "FAIL");
+
+    // Estimated ranges
+    double bad_expected;
+    double bad;
+    disparity_error(&expected, &truth, 16, 1.0, &bad_expected);
+    search_ranges_estimate(&sr, &img_left, &img_right, &pool);
+    block_match_ranges(&img_left, &img_right, &actual, &sr, &pool);
+    disparity_error(&actual, &truth, 16, 1.0, &bad);
+    double skipped = search_ranges_skipped(&sr);
+    int estimated = skipped > 0.2 && bad < bad_expected + 0.005;
+    printf(estimated ? "\tTest estimated ranges PASS (%.1f%% skipped, %.2f%% bad)\n"
+                     : "\tTest estimated ranges FAIL (%.1f%% skipped, %.2f%% bad)\n",
+           100 * skipped, 100 * bad);
+
+    search_ranges_free(&sr);
+    thread_pool_destroy(&pool);
+    free_disparity_map(&expected);
+    free_disparity_map(&actual);
+    free_ppm_array(&truth);
+    free(left->data);
+    free(left);
+    free(right->data);
+    free(right);
+    return !whole + !narrow + !estimated;
+}
+
+// Reference speckle filter: flood fills every region from a stack of pixels
+// and invalidates the ones smaller than max_region.
+void reference_speckle_filter(struct disparity_map *map, int max_region, int max_diff)
+{
+    int count = map->width * map->height;
+    int *region = malloc(sizeof(int) * count);
+    int *stack = malloc(sizeof(int) * count);
+    for (int i = 0; i < count; i++)
+    {
+        region[i] = -1;
+    }
+    for (int start = 0; start < count; start++)
+    {
+        if (region[start] >= 0 || map->data[start] == DISPARITY_INVALID)
+        {
+            continue;
+        }
+        int pixels = 0;
+        int top = 0;
+        stack[top++] = start;
+        region[start] = start;
+        while (top)
+        {
+            int p = stack[--top];
+            pixels++;
+            int x = p % map->width, y = p / map->width;
+            int neighbours[4][2] = {{x - 1, y}, {x + 1, y}, {x, y - 1}, {x, y + 1}};
+            for (int n = 0; n < 4; n++)
+            {
+                int u = neighbours[n][0], v = neighbours[n][1];
+                if (u < 0 || v < 0 || u >= map->width || v >= map->height)
+                {
+                    continue;
+                }
+                int q = v * map->width + u;
+                if (region[q] < 0 && map->data[q] != DISPARITY_INVALID && abs(map->data[q] - map->data[p]) <= max_diff)
+                {
+                    region[q] = start;
+                    stack[top++] = q;
+                }
+            }
+        }
+        // The first pixel of a region keeps its size instead
+        region[start] = -2 - pixels;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        if (map->data[i] == DISPARITY_INVALID)
+        {
+            continue;
+        }
+        int first = region[i] < -1 ? i : region[i];
+        if (-2 - region[first] < max_region)
+        {
+            map->data[i] = DISPARITY_INVALID;
+        }
+    }
+    free(region);
+    free(stack);
+}
+
+// Reference 3x3 median, sorting the block with the edges repeated.
+static int compare_uint16(const void *a, const void *b)
+{
+    return *(const uint16_t *)a - *(const uint16_t *)b;
+}
+
+void reference_median3(struct disparity_map *map_in, struct disparity_map *map_out)
+{
+    for (int y = 0; y < map_in->height; y++)
+    {
+        for (int x = 0; x < map_in->width; x++)
+        {
+            uint16_t p[9];
+            int n = 0;
+            for (int j = y - 1; j <= y + 1; j++)
+            {
+                for (int i = x - 1; i <= x + 1; i++)
+                {
+                    int u = i < 0 ? 0 : i >= map_in->width ? map_in->width - 1 : i;
+                    int v = j < 0 ? 0 : j >= map_in->height ? map_in->height - 1 : j;
+                    p[n++] = *disparity_map_at(map_in, u, v);
+                }
+            }
+            qsort(p, 9, sizeof(uint16_t), compare_uint16);
+            *disparity_map_at(map_out, x, y) = p[4];
+        }
+    }
+}
+
+// Checks the speckle filter and the median filter with every kernel set
+// against the references, and that the speckles the filter removes from a
+// real map are mostly wrong.
+int test_speckle_filter()
+{
+    printf("speckle filter\n");
+    int failures = 0;
+    srand(23);
+    int sizes[][2] = {{1, 1}, {2, 5}, {3, 3}, {37, 19}, {128, 64}};
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        struct disparity_map map, expected, actual;
+        map.width = expected.width = actual.width = sizes[s][0];
+        map.height = expected.height = actual.height = sizes[s][1];
+        allocate_disparity_map(&map);
+        allocate_disparity_map(&expected);
+        allocate_disparity_map(&actual);
+        // Patches of a few disparities with noise on them, so regions of every
+        // size and shape, and holes of invalid pixels
+        int count = map.width * map.height;
+        for (int i = 0; i < count; i++)
+        {
+            int x = i % map.width, y = i / map.width;
+            int patch = ((x / 5) * 7 + (y / 4) * 3) % 4;
+            map.data[i] = rand() % 10 == 0 ? DISPARITY_INVALID : patch * 40 + rand() % 24;
+        }
+
+        struct speckle_filter filter;
+        speckle_filter_init(&filter, map.width, map.height);
+        int mismatches = 0;
+        int allocated = 0;
+        for (int max_region = 1; max_region <= 64; max_region *= 4)
+        {
+            memcpy(expected.data, map.data, sizeof(uint16_t) * count);
+            memcpy(actual.data, map.data, sizeof(uint16_t) * count);
+            reference_speckle_filter(&expected, max_region, SPECKLE_MAX_DIFF);
+            int before = allocations;
+            int removed = speckle_filter_apply(&filter, &actual, max_region, SPECKLE_MAX_DIFF);
+            allocated += allocations - before;
+            int invalid[2] = {0, 0};
+            for (int i = 0; i < count; i++)
+            {
+                invalid[0] += map.data[i] == DISPARITY_INVALID;
+                invalid[1] += actual.data[i] == DISPARITY_INVALID;
+            }
+            mismatches += disparity_map_mismatches(&expected, &actual) + (removed != invalid[1] - invalid[0]);
+        }
+        speckle_filter_free(&filter);
+        printf("\tTest %dx%d speckles %s, %d allocations %s", map.width, map.height, mismatches ? "FAIL" : "PASS",
+               allocated, allocated ? "FAIL" : "PASS");
+        failures += (mismatches != 0) + (allocated != 0);
+
+        reference_median3(&map, &expected);
+        for (int k = 0; sad_kernels_all[k]; k++)
+        {
+            if (!sad_kernels_use(sad_kernels_all[k]->name))
+            {
+                printf(", median %s not supported", sad_kernels_all[k]->name);
+                continue;
+            }
+            disparity_median3(&map, &actual);
+            mismatches = disparity_map_mismatches(&expected, &actual);
+            printf(", median %s %s", sad_kernels_all[k]->name, mismatches ? "FAIL" : "PASS");
+            failures += mismatches != 0;
+        }
+        sad_kernels_use(NULL);
+        printf("\n");
+        free_disparity_map(&map);
+        free_disparity_map(&expected);
+        free_disparity_map(&actual);
+    }
+
+    // On tsukuba most of what the filter removes is wrong
+    struct ppm_image *left = readPPM("tsukuba/scene1.row3.col3.ppm");
+    struct ppm_image *right = readPPM("tsukuba/scene1.row3.col4.ppm");
+    struct ppm_array img_left;
+    struct ppm_array img_right;
+    struct ppm_array truth;
+    ppm_array_wrap(left, &img_left);
+    ppm_array_wrap(right, &img_right);
+    readPGM("tsukuba/truedisp.row3.col3.pgm", &truth);
+    struct disparity_map matched, filtered;
+    matched.width = filtered.width = img_left.width;
+    matched.height = filtered.height = img_left.height;
+    allocate_disparity_map(&matched);
+    allocate_disparity_map(&filtered);
+    block_match(&img_left, &img_right, &matched, BLOCK_SIZE);
+    struct speckle_filter filter;
+    speckle_filter_init(&filter, matched.width, matched.height);
+    disparity_median3(&matched, &filtered);
+    speckle_filter_apply(&filter, &filtered, speckle_max_region(filtered.width, filtered.height), SPECKLE_MAX_DIFF);
+    int known[2] = {0, 0};
+    int wrong[2] = {0, 0};
+    for (int y = 0; y < truth.height; y++)
+    {
+        for (int x = 0; x < truth.width; x++)
+        {
+            int value = *ppm_array_at(&truth, x, y);
+            if (value == 0)
+            {
+                continue;
+            }
+            int removed = *disparity_map_at(&filtered, x, y) == DISPARITY_INVALID;
+            known[removed]++;
+            wrong[removed] += !(fabs(disparity_from_fixed(*disparity_map_at(&matched, x, y)) - value / 16.0) <= 1.0);
+        }
+    }
+    double coverage = (double)known[1] / (known[0] + known[1]);
+    double bad_removed = known[1] ? (double)wrong[1] / known[1] : 0;
+    double bad_kept = (double)wrong[0] / known[0];
+    int useful = coverage > 0.005 && bad_removed > 0.5 && bad_removed > 4 * bad_kept;
+    printf(useful ? "\tTest tsukuba PASS (%.1f%% removed, %.1f%% of them bad against %.2f%% kept)\n"
+                  : "\tTest tsukuba FAIL (%.1f%% removed, %.1f%% of them bad against %.2f%% kept)\n",
+           100 * coverage, 100 * bad_removed, 100 * bad_kept);
+    failures += !useful;
+
+    speckle_filter_free(&filter);
+    free_disparity_map(&matched);
+    free_disparity_map(&filtered);
+    free_ppm_array(&truth);
+    free(left->data);
+    free(left);
+    free(right->data);
+    free(right);
+    return failures;
+}
+
+// Checks that a stereo context gives what its configuration's functions give
+// on their own, frame after frame, without allocating.
+int test_stereo_context()
+{
+    printf("stereo context\n");
+    int failures = 0;
+    const char *files[] = {"tsukuba/scene1.row3.col2.ppm", "tsukuba/scene1.row3.col3.ppm",
+                           "tsukuba/scene1.row3.col4.ppm"};
+    struct ppm_image *images[3];
+    struct ppm_array views[3];
+    for (int i = 0; i < 3; i++)
+    {
+        images[i] = readPPM(files[i]);
+        ppm_array_wrap(images[i], &views[i]);
+    }
+    int width = views[0].width;
+    int height = views[0].height;
+
+    struct
+    {
+        const char *name;
+        enum match_cost cost;
+        int grey, levels, paths, confidence, median, speckle, edge;
+    } configs[] = {
+        {"sad", MATCH_COST_SAD, 0, 1, 0, 0, 0, 0, KERNEL_EDGE_SIZE},
+        {"census grey confidence", MATCH_COST_CENSUS, 1, 1, 0, 1, 0, 0, KERNEL_EDGE_SIZE},
+        {"sad pyramid3 median speckle", MATCH_COST_SAD, 0, 3, 0, 0, 1, 1, KERNEL_EDGE_SIZE},
+        {"census grey pyramid2 speckle", MATCH_COST_CENSUS, 1, 2, 0, 0, 0, 1, KERNEL_EDGE_SIZE},
+        {"sgm4 sad", MATCH_COST_SAD, 0, 1, 4, 0, 0, 0, KERNEL_EDGE_SIZE},
+        {"sgm8 census median", MATCH_COST_CENSUS, 0, 1, 8, 0, 1, 0, KERNEL_EDGE_SIZE},
+        {"sad 7x7", MATCH_COST_SAD, 0, 1, 0, 0, 0, 0, 3},
+        {"census grey confidence 15x15", MATCH_COST_CENSUS, 1, 1, 0, 1, 0, 0, 7},
+    };
+    struct disparity_map expected, filtered;
+    struct ppm_array confidence;
+    expected.width = filtered.width = confidence.width = width;
+    expected.height = filtered.height = confidence.height = height;
+    confidence.channels = 1;
+    allocate_disparity_map(&expected);
+    allocate_disparity_map(&filtered);
+    ppm_array_allocate(&confidence);
+    struct speckle_filter filter;
+    speckle_filter_init(&filter, width, height);
+
+    for (size_t c = 0; c < sizeof(configs) / sizeof(configs[0]); c++)
+    {
+        struct stereo_config config;
+        stereo_config_default(&config, width, height, 3);
+        config.cost = configs[c].cost;
+        config.grey = configs[c].grey;
+        config.levels = configs[c].levels;
+        config.paths = configs[c].paths;
+        config.confidence = configs[c].confidence;
+        config.median = configs[c].median;
+        config.speckle = configs[c].speckle;
+        config.edge = configs[c].edge;
+        struct stereo_context *ctx = stereo_create(&config);
+        int mismatches = 0;
+        int allocated = 0;
+        // The two neighbouring pairs in turn, as a camera's frames
+        for (int frame = 0; frame < 3; frame++)
+        {
+            struct ppm_array *left = &views[1 - frame % 2];
+            struct ppm_array *right = &views[2 - frame % 2];
+            struct stereo_result result;
+            // The context's scratch lives on its pool's workers, so the
+            // calling thread may have none
+            match_scratch_release();
+            int before = allocations;
+            stereo_process(ctx, left, right, &result);
+            allocated += allocations - before;
+
+            // The same steps one function at a time
+            struct ppm_array grey[2], match_left, match_right;
+            if (config.grey)
+            {
+                to_greyscale_plane(left, &grey[0]);
+                to_greyscale_plane(right, &grey[1]);
+                left = &grey[0];
+                right = &grey[1];
+            }
+            struct disparity_map *matched = config.median ? &filtered : &expected;
+            if (config.levels > 1)
+            {
+                pyramid_block_match(left, right, matched, config.search_len, config.levels, config.cost, NULL, NULL);
+            }
+            else
+            {
+                match_cost_prepare(left, &match_left, config.cost);
+                match_cost_prepare(right, &match_right, config.cost);
+                if (config.paths)
+                {
+                    sgm_match(&match_left, &match_right, matched, config.search_len, config.paths);
+                }
+                else if (config.confidence)
+                {
+                    block_match_edge(&match_left, &match_right, matched, &confidence, config.search_len, config.edge,
+                                     NULL);
+                    mismatches += ppm_array_mismatches(&confidence, result.confidence);
+                }
+                else
+                {
+                    block_match_edge(&match_left, &match_right, matched, NULL, config.search_len, config.edge, NULL);
+                }
+                free_ppm_array(&match_left);
+                free_ppm_array(&match_right);
+            }
+            if (config.median)
+            {
+                disparity_median3(&filtered, &expected);
+            }
+            if (config.speckle)
+            {
+                speckle_filter_apply(&filter, &expected, speckle_max_region(width, height), SPECKLE_MAX_DIFF);
+            }
+            if (config.grey)
+            {
+                free_ppm_array(&grey[0]);
+                free_ppm_array(&grey[1]);
+            }
+            mismatches += disparity_map_mismatches(&expected, result.disparity);
+            mismatches += (result.confidence != NULL) != (config.confidence != 0);
+        }
+        stereo_destroy(ctx);
+        printf("\tTest %s %s, %d allocations %s\n", configs[c].name, mismatches ? "FAIL" : "PASS", allocated,
+               allocated ? "FAIL" : "PASS");
+        failures += (mismatches != 0) + (allocated != 0);
+    }
+
+    speckle_filter_free(&filter);
+    free_disparity_map(&expected);
+    free_disparity_map(&filtered);
+    free_ppm_array(&confidence);
+    for (int i = 0; i < 3; i++)
+    {
+        free(images[i]->data);
+        free(images[i]);
+    }
+    return failures;
+}
+
+// Checks the window kernels of every size against the generic block SAD, and
+// block matching with other kernel sizes, specialized or not, against the
+// reference.
+int test_window_kernels()
+{
+    printf("window kernels\n");
+    int failures = 0;
+    struct ppm_image *left = readPPM("tsukuba/scene1.row3.col3.ppm");
+    struct ppm_image *right = readPPM("tsukuba/scene1.row3.col4.ppm");
+    struct ppm_array rgb[2], grey[2];
+    ppm_array_wrap(left, &rgb[0]);
+    ppm_array_wrap(right, &rgb[1]);
+    to_greyscale_plane(&rgb[0], &grey[0]);
+    to_greyscale_plane(&rgb[1], &grey[1]);
+
+    // Whole windows at random places, with every kernel set
+    srand(29);
+    for (int k = 0; sad_kernels_all[k]; k++)
+    {
+        if (!sad_kernels_use(sad_kernels_all[k]->name))
+        {
+            continue;
+        }
+        int mismatches = 0;
+        for (int edge = 1; edge <= WINDOW_KERNELS_MAX_EDGE; edge++)
+        {
+            const struct window_kernels *windows = window_kernels_get(edge);
+            mismatches += windows->edge != edge;
+            for (int c = 0; c < 2; c++)
+            {
+                struct ppm_array *img = c ? rgb : grey;
+                int n = (2 * edge + 1) * img->channels;
+                for (int i = 0; i < 200; i++)
+                {
+                    int x = rand() % (img->width - 2 * edge);
+                    int y = rand() % (img->height - 2 * edge);
+                    int d = rand() % (x + 1);
+                    const uint8_t *a = ppm_array_at(&img[0], x, y);
+                    const uint8_t *b = ppm_array_at(&img[1], x - d, y);
+                    mismatches += windows->sad[c](a, img[0].stride, b, img[1].stride, edge) !=
+                                  sad_kernels_scalar.block_sad(a, img[0].stride, b, img[1].stride, n, 2 * edge + 1);
+                }
+            }
+        }
+        printf("\tTest %s window SAD %s\n", sad_kernels_all[k]->name, mismatches ? "FAIL" : "PASS");
+        failures += mismatches != 0;
+    }
+    sad_kernels_use(NULL);
+
+    // Other kernel sizes on a corner of the images, specialized and generic,
+    // on one thread and on a pool. Census has no reference, its specialized
+    // windows must match the generic ones.
+    struct ppm_array crop[3][2], census[2];
+    for (int i = 0; i < 2; i++)
+    {
+        crop[0][i] = rgb[i];
+        crop[1][i] = grey[i];
+        crop[0][i].width = crop[1][i].width = 96;
+        crop[0][i].height = crop[1][i].height = 72;
+        census_transform(&crop[1][i], &census[i]);
+        crop[2][i] = census[i];
+    }
+    const char *names[] = {"rgb", "grey", "census"};
+    struct disparity_map expected, actual;
+    expected.width = actual.width = crop[0][0].width;
+    expected.height = actual.height = crop[0][0].height;
+    allocate_disparity_map(&expected);
+    allocate_disparity_map(&actual);
+    struct thread_pool pool;
+    thread_pool_create(&pool, 3, 0);
+    int edges[] = {1, 2, 4, WINDOW_KERNELS_MAX_EDGE, WINDOW_KERNELS_MAX_EDGE + 2};
+    for (int c = 0; c < 3; c++)
+    {
+        for (int e = 0; e < 5; e++)
+        {
+            if (c < 2)
+            {
+                reference_block_match_edge(&crop[c][0], &crop[c][1], &expected, BLOCK_SIZE, edges[e]);
+            }
+            else
+            {
+                window_kernels_use_specialized(0);
+                block_match_edge(&crop[c][0], &crop[c][1], &expected, NULL, BLOCK_SIZE, edges[e], NULL);
+                window_kernels_use_specialized(1);
+            }
+            printf("\tTest %s %dx%d", names[c], 2 * edges[e] + 1, 2 * edges[e] + 1);
+            for (int specialized = 1; specialized >= 0; specialized--)
+            {
+                window_kernels_use_specialized(specialized);
+                block_match_edge(&crop[c][0], &crop[c][1], &actual, NULL, BLOCK_SIZE, edges[e], NULL);
+                int mismatches = disparity_map_mismatches(&expected, &actual);
+                memset(actual.data, 0, sizeof(uint16_t) * actual.width * actual.height);
+                block_match_edge(&crop[c][0], &crop[c][1], &actual, NULL, BLOCK_SIZE, edges[e], &pool);
+                mismatches += disparity_map_mismatches(&expected, &actual);
+                printf(", %s %s", specialized ? "specialized" : "generic", mismatches ? "FAIL" : "PASS");
+                failures += mismatches != 0;
+            }
+
+            // A band goes through the column sums, narrow columns and points
+            // search each pixel on its own
+            memset(actual.data, 0, sizeof(uint16_t) * actual.width * actual.height);
+            struct disparity_roi rois[] = {{0, 96, 30, 33}, {10, 12, 0, 72}, {0, 1, 0, 1}, {95, 96, 71, 72}};
+            block_match_roi_edge(&crop[c][0], &crop[c][1], &actual, BLOCK_SIZE, rois, 4, edges[e]);
+            int mismatches = 0;
+            for (int r = 0; r < 4; r++)
+            {
+                for (int y = rois[r].y_start; y < rois[r].y_end; y++)
+                {
+                    for (int x = rois[r].x_start; x < rois[r].x_end; x++)
+                    {
+                        mismatches += *disparity_map_at(&actual, x, y) != *disparity_map_at(&expected, x, y);
+                    }
+                }
+            }
+            printf(", roi %s\n", mismatches ? "FAIL" : "PASS");
+            failures += mismatches != 0;
+        }
+    }
+    window_kernels_use_specialized(1);
+
+    thread_pool_destroy(&pool);
+    free_disparity_map(&expected);
+    free_disparity_map(&actual);
+    free_ppm_array(&census[0]);
+    free_ppm_array(&census[1]);
+    free_ppm_array(&grey[0]);
+    free_ppm_array(&grey[1]);
+    free(left->data);
+    free(left);
+    free(right->data);
+    free(right);
+    return failures;
+}
+
+// Checks the fixed-point disparity conversions and the legacy layout.
+int test_disparity_fixed()
+{
+    int failures = 0;
+    printf("disparity_map fixed point\n");
+
+    int rounding = disparity_from_fixed(disparity_to_fixed(12.3)) == 12.3125 && disparity_to_fixed(-0.2) == 0 &&
+                   disparity_to_fixed(4095.875) == 0xfffe;
+    int invalid = disparity_to_fixed(NAN) == DISPARITY_INVALID && disparity_to_fixed(INFINITY) == DISPARITY_INVALID &&
+                  disparity_to_fixed(5000) == DISPARITY_INVALID && isnan(disparity_from_fixed(DISPARITY_INVALID));
+    printf("\tTest rounding %s, invalid %s", rounding ? "PASS" : "FAIL", invalid ? "PASS" : "FAIL");
+    failures += !rounding;
+    failures += !invalid;
+
+    struct disparity_map map = {3, 5};
+    struct disparity_map_double legacy = {3, 5};
+    allocate_disparity_map(&map);
+    allocate_disparity_map_double(&legacy);
+    for (int y = 0; y < map.height; y++)
+    {
+        for (int x = 0; x < map.width; x++)
+        {
+            *disparity_map_at(&map, x, y) = x == y ? DISPARITY_INVALID : disparity_to_fixed(x + y * 0.25);
+        }
+    }
+    disparity_map_to_double(&map, &legacy);
+    int layout = get_max_disparity(&map) == 4.5;
+    for (int y = 0; y < map.height; y++)
+    {
+        for (int x = 0; x < map.width; x++)
+        {
+            layout &= x == y ? isnan(legacy.arr[x][y]) : legacy.arr[x][y] == x + y * 0.25;
+        }
+    }
+    printf(", legacy layout %s\n", layout ? "PASS" : "FAIL");
+    failures += !layout;
+    free_disparity_map(&map);
+    free_disparity_map_double(&legacy);
+    return failures;
+}
+
+// Integer reference of resize_down_half(): floor(sum / 100) of the 3x3 
+// Gaussian with weights 1, 8 and 64 and black outside the image, then the 2x2
+// block average rounded down. Allocates out.
+void reference_resize_down_half(struct ppm_array *img_in, struct ppm_array *out)
+{
+    out->height = img_in->height / 2;
+    out->width = img_in->width / 2;
+    out->channels = img_in->channels;
+    ppm_array_allocate(out);
+    int weight[3] = {1, 8, 1};
+    for (int j = 0; j < out->height; j++)
+    {
+        for (int i = 0; i < out->width; i++)
+        {
+            for (int c = 0; c < img_in->channels; c++)
+            {
+                int block = 0;
+                for (int by = 2 * j; by <= 2 * j + 1; by++)
+                {
+                    for (int bx = 2 * i; bx <= 2 * i + 1; bx++)
+                    {
+                        int sum = 0;
+                        for (int dy = -1; dy <= 1; dy++)
+                        {
+                            for (int dx = -1; dx <= 1; dx++)
+                            {
+                                int x = bx + dx, y = by + dy;
+                                if (x >= 0 && y >= 0 && x < img_in->width && y < img_in->height)
+                                {
+                                    sum += weight[dx + 1] * weight[dy + 1] * ppm_array_at(img_in, x, y)[c];
+                                }
+                            }
+                        }
+                        block += sum / 100;
+                    }
+                }
+                ppm_array_at(out, i, j)[c] = block / 4;
+            }
+        }
+    }
+}
+
+// Checks that every kernel set converts to greyscale and halves RGB and 
+// greyscale images of awkward sizes exactly like the integer reference, and 
+// that the fused preprocess_grey_half() matches them without allocating.
+int test_preprocess()
+{
+    int failures = 0;
+    printf("preprocess\n");
+    struct ppm_image *image = readPPM("tsukuba/scene1.row3.col3.ppm");
+    struct ppm_array tsukuba;
+    ppm_array_wrap(image, &tsukuba);
+
+    // Tsukuba, then random images of odd sizes around the tile width
+    int sizes[][2] = {{0, 0}, {301, 77}, {258, 9}, {3, 5}, {1, 1}};
+    srand(18);
+    for (int s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++)
+    {
+        struct ppm_array rgb = tsukuba;
+        if (s > 0)
+        {
+            rgb.width = sizes[s][0];
+            rgb.height = sizes[s][1];
+            rgb.channels = 3;
+            ppm_array_allocate(&rgb);
+            for (int y = 0; y < rgb.height; y++)
+            {
+                for (int x = 0; x < rgb.width * 3; x++)
+                {
+                    ppm_array_at(&rgb, 0, y)[x] = rand() & 0xff;
+                }
+            }
+        }
+
+        struct ppm_array expected_grey;
+        expected_grey.width = rgb.width;
+        expected_grey.height = rgb.height;
+        expected_grey.channels = 1;
+        ppm_array_allocate(&expected_grey);
+        for (int y = 0; y < rgb.height; y++)
+        {
+            for (int x = 0; x < rgb.width; x++)
+            {
+                unsigned char *pix = ppm_array_at(&rgb, x, y);
+                *ppm_array_at(&expected_grey, x, y) = (pix[0] + pix[1] + pix[2]) / 3;
+            }
+        }
+        struct ppm_array expected_rgb_half, expected_half;
+        reference_resize_down_half(&rgb, &expected_rgb_half);
+        reference_resize_down_half(&expected_grey, &expected_half);
+
+        struct ppm_array grey, half;
+        grey.width = rgb.width;
+        grey.height = rgb.height;
+        grey.channels = 1;
+        ppm_array_allocate(&grey);
+        half.width = rgb.width / 2;
+        half.height = rgb.height / 2;
+        half.channels = 1;
+        ppm_array_allocate(&half);
+
+        for (int k = 0; sad_kernels_all[k]; k++)
+        {
+            if (!sad_kernels_use(sad_kernels_all[k]->name))
+            {
+                printf("\tTest %dx%d %s: not supported, skipped\n", rgb.width, rgb.height, sad_kernels_all[k]->name);
+                continue;
+            }
+            printf("\tTest %dx%d %s", rgb.width, rgb.height, sad_kernels_all[k]->name);
+            struct ppm_array out;
+            to_greyscale_plane(&rgb, &out);
+            int mismatches = ppm_array_mismatches(&expected_grey, &out);
+            free_ppm_array(&out);
+            resize_down_half(&rgb, &out);
+            mismatches += ppm_array_mismatches(&expected_rgb_half, &out);
+            free_ppm_array(&out);
+            resize_down_half(&expected_grey, &out);
+            mismatches += ppm_array_mismatches(&expected_half, &out);
+            free_ppm_array(&out);
+            printf(", separate %s", mismatches ? "FAIL" : "PASS");
+            failures += mismatches != 0;
+
+            // Fused, from RGB and from greyscale
+            int before = allocations;
+            preprocess_grey_half(&rgb, &grey, &half);
+            mismatches = ppm_array_mismatches(&expected_grey, &grey) + ppm_array_mismatches(&expected_half, &half);
+            memset(half.buffer, 0, (size_t)half.stride * (half.height + 2 * IMAGE_PAD));
+            preprocess_grey_half(&expected_grey, &grey, &half);
+            mismatches += ppm_array_mismatches(&expected_grey, &grey) + ppm_array_mismatches(&expected_half, &half);
+            int allocated = allocations - before;
+            printf(", fused %s", mismatches ? "FAIL" : "PASS");
+            printf(", %d allocations %s\n", allocated, allocated ? "FAIL" : "PASS");
+            failures += (mismatches != 0) + (allocated != 0);
+        }
+        sad_kernels_use(NULL);
+
+        free_ppm_array(&expected_grey);
+        free_ppm_array(&expected_rgb_half);
+        free_ppm_array(&expected_half);
+        free_ppm_array(&grey);
+        free_ppm_array(&half);
+        if (s > 0)
+        {
+            free_ppm_array(&rgb);
+        }
+    }
+    free(image->data);
+    free(image);
+    return failures;
+}
+
+int main(int argc, char *argv[])
+{
+    int failures = 0;
+    failures += test_disparity_fixed();
+    failures += test_block_match_kernels();
+    failures += test_block_match_parallel();
+    failures += test_block_match_tiled();
+    failures += test_block_match_roi();
+    failures += test_confidence();
+    failures += test_image_pyramid();
+    failures += test_pyramid_block_match();
+    failures += test_sgm_match();
+    failures += test_census_match();
+    failures += test_allocation_free();
+    failures += test_stereo_stream();
+    failures += test_range_scan();
+    failures += test_rectify();
+    failures += test_image_io();
+    failures += test_preprocess();
+    failures += test_dataset();
+    failures += test_temporal_match();
+    failures += test_search_ranges();
+    failures += test_speckle_filter();
+    failures += test_stereo_context();
+    failures += test_window_kernels();
+    printf(failures ? "%d FAILED\n" : "ALL PASSED\n", failures);
+    return failures != 0;
+}
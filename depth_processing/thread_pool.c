@@ -0,0 +1,232 @@
+// Persistent worker threads for splitting a job into independent tasks. The
+// threads are started once and sleep between jobs, so handing out work every
+// frame only costs a wake up.
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+struct thread_pool;
+
+// Start information for one worker thread
+struct thread_pool_worker
+{
+    struct thread_pool *pool;
+    int index;
+};
+
+struct thread_pool
+{
+    int workers;
+    pthread_t *threads;
+    struct thread_pool_worker *info;
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t finish;
+
+    // Current job. task is called once for every index in [0, tasks) with the
+    // index of the worker running it.
+    void (*task)(void *arg, int index, int worker);
+    void *arg;
+    int tasks;
+    int next_task;
+    int unfinished;
+    // Incremented for every job, so sleeping workers can tell a new one apart
+    // from a spurious wake up
+    int generation;
+    int quit;
+};
+
+static void *thread_pool_main(void *arg)
+{
+    struct thread_pool_worker *info = (struct thread_pool_worker *)arg;
+    struct thread_pool *pool = info->pool;
+    int generation = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1)
+    {
+        while (!pool->quit && pool->generation == generation)
+        {
+            pthread_cond_wait(&pool->start, &pool->lock);
+        }
+        if (pool->quit)
+        {
+            break;
+        }
+        generation = pool->generation;
+
+        // Claim tasks until the job is handed out
+        while (pool->next_task < pool->tasks)
+        {
+            int index = pool->next_task++;
+            pthread_mutex_unlock(&pool->lock);
+            pool->task(pool->arg, index, info->index);
+            pthread_mutex_lock(&pool->lock);
+            if (--pool->unfinished == 0)
+            {
+                pthread_cond_signal(&pool->finish);
+            }
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+// Pins a worker to one of the CPUs in cpu_mask (bit n set allows CPU n) that
+// this process may run on, spreading the workers round robin. Does nothing if
+// none of the CPUs in the mask are available.
+static void thread_pool_pin(pthread_t thread, int worker, unsigned long cpu_mask)
+{
+    cpu_set_t allowed;
+    int cpus[sizeof(unsigned long) * 8];
+    int count = 0;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+    {
+        return;
+    }
+    for (int cpu = 0; cpu < (int)(sizeof(unsigned long) * 8) && cpu < CPU_SETSIZE; cpu++)
+    {
+        if ((cpu_mask >> cpu & 1) && CPU_ISSET(cpu, &allowed))
+        {
+            cpus[count++] = cpu;
+        }
+    }
+    if (count == 0)
+    {
+        return;
+    }
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpus[worker % count], &cpuset);
+    pthread_setaffinity_np(thread, sizeof(cpuset), &cpuset);
+}
+
+// Starts the given number of worker threads. If cpu_mask is non-zero each
+// worker is pinned to one of the CPUs it selects (bit n for CPU n), e.g. 0x7
+// keeps the workers off CPU 3 where control/Realtime.h puts the realtime
+// process.
+void thread_pool_create(struct thread_pool *pool, int workers, unsigned long cpu_mask)
+{
+    if (workers < 1)
+    {
+        workers = 1;
+    }
+    pool->workers = workers;
+    pool->threads = (pthread_t *)malloc(sizeof(pthread_t) * workers);
+    pool->info = (struct thread_pool_worker *)malloc(sizeof(struct thread_pool_worker) * workers);
+    if (!pool->threads || !pool->info)
+    {
+        fprintf(stderr, "Unable to allocate memory\n");
+        exit(1);
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->finish, NULL);
+    pool->tasks = pool->next_task = pool->unfinished = 0;
+    pool->generation = 0;
+    pool->quit = 0;
+
+    for (int i = 0; i < workers; i++)
+    {
+        pool->info[i].pool = pool;
+        pool->info[i].index = i;
+        if (pthread_create(&pool->threads[i], NULL, thread_pool_main, &pool->info[i]) != 0)
+        {
+            fprintf(stderr, "Unable to start worker thread\n");
+            exit(1);
+        }
+        if (cpu_mask)
+        {
+            thread_pool_pin(pool->threads[i], i, cpu_mask);
+        }
+    }
+}
+
+// Runs task(arg, index, worker) for every index in [0, tasks) on the workers,
+// returning once all of them have finished.
+void thread_pool_run(struct thread_pool *pool, void (*task)(void *arg, int index, int worker), void *arg, int tasks)
+{
+    if (tasks <= 0)
+    {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->task = task;
+    pool->arg = arg;
+    pool->tasks = tasks;
+    pool->next_task = 0;
+    pool->unfinished = tasks;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    while (pool->unfinished > 0)
+    {
+        pthread_cond_wait(&pool->finish, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Shared state of one thread_pool_run_each() job
+struct thread_pool_each
+{
+    void (*task)(void *arg, int worker);
+    void *arg;
+    int workers;
+    int started;
+    pthread_mutex_t lock;
+    pthread_cond_t all_started;
+};
+
+// Holds its worker until every worker has claimed a task, so no worker can
+// claim two
+static void thread_pool_each_task(void *arg, int index, int worker)
+{
+    struct thread_pool_each *each = (struct thread_pool_each *)arg;
+    pthread_mutex_lock(&each->lock);
+    if (++each->started == each->workers)
+    {
+        pthread_cond_broadcast(&each->all_started);
+    }
+    while (each->started < each->workers)
+    {
+        pthread_cond_wait(&each->all_started, &each->lock);
+    }
+    pthread_mutex_unlock(&each->lock);
+    each->task(each->arg, worker);
+}
+
+// Runs task(arg, worker) exactly once on every worker, returning once all of
+// them have finished. Used to set up per-thread state, such as scratch 
+// buffers, before the first real job.
+void thread_pool_run_each(struct thread_pool *pool, void (*task)(void *arg, int worker), void *arg)
+{
+    struct thread_pool_each each;
+    each.task = task;
+    each.arg = arg;
+    each.workers = pool->workers;
+    each.started = 0;
+    pthread_mutex_init(&each.lock, NULL);
+    pthread_cond_init(&each.all_started, NULL);
+    thread_pool_run(pool, thread_pool_each_task, &each, pool->workers);
+    pthread_mutex_destroy(&each.lock);
+    pthread_cond_destroy(&each.all_started);
+}
+
+// Stops the worker threads and frees the pool.
+void thread_pool_destroy(struct thread_pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->workers; i++)
+    {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->finish);
+    free(pool->threads);
+    free(pool->info);
+}
@@ -0,0 +1,372 @@
+// Matching window kernels specialized for one window size. The SAD engine and
+// the per pixel search take the window edge at runtime, so their loops can't
+// be unrolled for it and test its bounds on every pixel. Each size from 3x3 to
+// (2 * WINDOW_KERNELS_MAX_EDGE + 1) squared gets its own copy of the window
+// loops, made by WINDOW_KERNELS() from one always inlined body with the edge
+// and channels as constants, so every loop has a fixed trip count.
+// window_kernels_get() picks the copy for the window being matched at runtime,
+// any other size gets the generic loops. All copies give the same sums.
+//
+// Only block_match_edge(), block_match_roi_edge() and the per pixel searches
+// (get_disparity_edge(), get_disparity_window_edge()) take the edge at 
+// runtime. The tiled, stream, search range, temporal and pyramid matchers keep
+// KERNEL_EDGE_SIZE and semi-global matching SGM_KERNEL_EDGE_SIZE, so they
+// always get the same copy.
+//
+// The disparity range isn't specialized: the engine works on a whole row per
+// disparity, so there is no short disparity loop to unroll.
+
+// Largest window edge with specialized kernels, a 15x15 window
+#define WINDOW_KERNELS_MAX_EDGE 7
+
+// Kernels for one window size, [0] for 1 and [1] for 3 values per pixel
+struct window_kernels
+{
+    // Window edge size the kernels are for, 0 for the generic kernels
+    int edge;
+    // Window sums along a row of one disparity's column sums, col holding
+    // channels sums per pixel:
+    //   cost[x] = sum of the channels of col[i] for i in [x - edge, x + edge]
+    // for x in [x_start, x_end), counting only the columns in [start, end).
+    // col_pixel is a row of scratch.
+    void (*aggregate[2])(const uint16_t *col, uint32_t *col_pixel, uint32_t *cost, int edge, int start, int end,
+                         int x_start, int x_end);
+    // Returns the sum of |a[i] - b[i]| over a whole window of 2 * edge + 1 rows
+    // of 2 * edge + 1 pixels, the rows of a and b are a_stride and b_stride
+    // bytes apart. Nothing outside the window is read.
+    uint32_t (*sad[2])(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int edge);
+};
+
+// Column sum of pixel x, channels == 1 sums are read straight from col
+static inline __attribute__((always_inline)) uint32_t window_column(const uint16_t *col, const uint32_t *col_pixel,
+                                                                    int x, int channels)
+{
+    return channels == 1 ? col[x] : col_pixel[x];
+}
+
+static inline __attribute__((always_inline)) void window_aggregate_body(const uint16_t *col, uint32_t *col_pixel,
+                                                                        uint32_t *cost, int edge, int channels,
+                                                                        int start, int end, int x_start, int x_end)
+{
+    if (channels != 1)
+    {
+        for (int x = start; x < end; x++)
+        {
+            uint32_t sum = 0;
+            for (int c = 0; c < channels; c++)
+            {
+                sum += col[x * channels + c];
+            }
+            col_pixel[x] = sum;
+        }
+    }
+    int x = x_start;
+    uint32_t sum = 0;
+    for (int i = x - edge; i <= x + edge; i++)
+    {
+        if (i >= start && i < end)
+        {
+            sum += window_column(col, col_pixel, i, channels);
+        }
+    }
+    cost[x] = sum;
+
+    // Only pixels near the ends of [start, end) have a column entering or
+    // leaving the window outside of it, the ones in between need no checks
+    int inside_start = start + edge + 1 > x + 1 ? start + edge + 1 : x + 1;
+    int inside_end = end - edge < x_end ? end - edge : x_end;
+    for (x++; x < x_end && (x < inside_start || x >= inside_end); x++)
+    {
+        if (x + edge < end)
+        {
+            sum += window_column(col, col_pixel, x + edge, channels);
+        }
+        if (x - edge - 1 >= start)
+        {
+            sum -= window_column(col, col_pixel, x - edge - 1, channels);
+        }
+        cost[x] = sum;
+    }
+    for (; x < inside_end; x++)
+    {
+        sum += window_column(col, col_pixel, x + edge, channels) - window_column(col, col_pixel, x - edge - 1, channels);
+        cost[x] = sum;
+    }
+    for (; x < x_end; x++)
+    {
+        if (x + edge < end)
+        {
+            sum += window_column(col, col_pixel, x + edge, channels);
+        }
+        if (x - edge - 1 >= start)
+        {
+            sum -= window_column(col, col_pixel, x - edge - 1, channels);
+        }
+        cost[x] = sum;
+    }
+}
+
+static inline __attribute__((always_inline)) uint32_t window_sad_scalar_body(const uint8_t *a, int a_stride,
+                                                                             const uint8_t *b, int b_stride,
+                                                                             int edge, int channels)
+{
+    uint32_t sum = 0;
+    for (int j = 0; j <= 2 * edge; j++, a += a_stride, b += b_stride)
+    {
+        for (int i = 0; i < (2 * edge + 1) * channels; i++)
+        {
+            sum += sad_abs_dif(a[i], b[i]);
+        }
+    }
+    return sum;
+}
+
+static void window_aggregate_generic_1(const uint16_t *col, uint32_t *col_pixel, uint32_t *cost, int edge, int start,
+                                       int end, int x_start, int x_end)
+{
+    window_aggregate_body(col, col_pixel, cost, edge, 1, start, end, x_start, x_end);
+}
+
+static void window_aggregate_generic_3(const uint16_t *col, uint32_t *col_pixel, uint32_t *cost, int edge, int start,
+                                       int end, int x_start, int x_end)
+{
+    window_aggregate_body(col, col_pixel, cost, edge, 3, start, end, x_start, x_end);
+}
+
+static uint32_t window_sad_generic_1(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int edge)
+{
+    return sad_kernels_get()->block_sad(a, a_stride, b, b_stride, 2 * edge + 1, 2 * edge + 1);
+}
+
+static uint32_t window_sad_generic_3(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int edge)
+{
+    return sad_kernels_get()->block_sad(a, a_stride, b, b_stride, 3 * (2 * edge + 1), 2 * edge + 1);
+}
+
+static const struct window_kernels window_kernels_generic = {
+    0,
+    {window_aggregate_generic_1, window_aggregate_generic_3},
+    {window_sad_generic_1, window_sad_generic_3},
+};
+
+#if defined(SAD_KERNELS_X86) || defined(SAD_KERNELS_NEON)
+// Byte masks of the overlapping loads that finish a row, loading 16 bytes from
+// window_tail_mask + r keeps the last r
+static const uint8_t window_tail_mask[32] = {
+    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+};
+#endif
+
+#ifdef SAD_KERNELS_X86
+// Rows of 16 bytes or more are summed 16 bytes at a time, and a row that
+// isn't a multiple of 16 ends with a load of its last 16 bytes, masked to the
+// ones not summed yet. Rows of 8 to 15 bytes do the same with 8 byte loads.
+__attribute__((target("sse2"))) static inline __attribute__((always_inline)) uint32_t
+window_sad_sse2_body(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int edge, int channels)
+{
+    const int n = (2 * edge + 1) * channels;
+    if (n < 8)
+    {
+        return window_sad_scalar_body(a, a_stride, b, b_stride, edge, channels);
+    }
+    __m128i acc = _mm_setzero_si128();
+    if (n < 16)
+    {
+        __m128i mask = _mm_loadl_epi64((const __m128i *)(window_tail_mask + n));
+        for (int j = 0; j <= 2 * edge; j++, a += a_stride, b += b_stride)
+        {
+            __m128i a_row = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *)a),
+                                               _mm_and_si128(_mm_loadl_epi64((const __m128i *)(a + n - 8)), mask));
+            __m128i b_row = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *)b),
+                                               _mm_and_si128(_mm_loadl_epi64((const __m128i *)(b + n - 8)), mask));
+            acc = _mm_add_epi64(acc, _mm_sad_epu8(a_row, b_row));
+        }
+    }
+    else
+    {
+        __m128i mask = _mm_loadu_si128((const __m128i *)(window_tail_mask + n % 16));
+        for (int j = 0; j <= 2 * edge; j++, a += a_stride, b += b_stride)
+        {
+            for (int i = 0; i + 16 <= n; i += 16)
+            {
+                acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(a + i)),
+                                                      _mm_loadu_si128((const __m128i *)(b + i))));
+            }
+            if (n % 16)
+            {
+                __m128i a_tail = _mm_and_si128(_mm_loadu_si128((const __m128i *)(a + n - 16)), mask);
+                __m128i b_tail = _mm_and_si128(_mm_loadu_si128((const __m128i *)(b + n - 16)), mask);
+                acc = _mm_add_epi64(acc, _mm_sad_epu8(a_tail, b_tail));
+            }
+        }
+    }
+    return _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+}
+#endif
+
+#ifdef SAD_KERNELS_NEON
+// The same loads as the SSE2 version. The 16 bit sums can't overflow: a lane
+// gets at most 2 differences per load, 3 loads per row and 15 rows in the
+// largest window.
+static inline __attribute__((always_inline)) uint32_t window_sad_neon_body(const uint8_t *a, int a_stride,
+                                                                           const uint8_t *b, int b_stride,
+                                                                           int edge, int channels)
+{
+    const int n = (2 * edge + 1) * channels;
+    if (n < 8)
+    {
+        return window_sad_scalar_body(a, a_stride, b, b_stride, edge, channels);
+    }
+    uint16x8_t acc = vdupq_n_u16(0);
+    if (n < 16)
+    {
+        uint8x8_t mask = vld1_u8(window_tail_mask + n);
+        for (int j = 0; j <= 2 * edge; j++, a += a_stride, b += b_stride)
+        {
+            acc = vabal_u8(acc, vld1_u8(a), vld1_u8(b));
+            acc = vabal_u8(acc, vand_u8(vld1_u8(a + n - 8), mask), vand_u8(vld1_u8(b + n - 8), mask));
+        }
+    }
+    else
+    {
+        uint8x16_t mask = vld1q_u8(window_tail_mask + n % 16);
+        for (int j = 0; j <= 2 * edge; j++, a += a_stride, b += b_stride)
+        {
+            for (int i = 0; i + 16 <= n; i += 16)
+            {
+                acc = vpadalq_u8(acc, vabdq_u8(vld1q_u8(a + i), vld1q_u8(b + i)));
+            }
+            if (n % 16)
+            {
+                acc = vpadalq_u8(acc, vandq_u8(vabdq_u8(vld1q_u8(a + n - 16), vld1q_u8(b + n - 16)), mask));
+            }
+        }
+    }
+    uint32x4_t sum = vpaddlq_u16(acc);
+    return vgetq_lane_u32(sum, 0) + vgetq_lane_u32(sum, 1) + vgetq_lane_u32(sum, 2) + vgetq_lane_u32(sum, 3);
+}
+#endif
+
+// Instantiates the kernels of one window edge size. The SAD kernels come in
+// the instruction sets of sad_kernels.c, AVX2 uses the SSE2 ones as 16 byte
+// loads already cover the row of a window.
+#define WINDOW_KERNELS_COMMON(EDGE)                                                                                    \
+    static void window_aggregate_##EDGE##_1(const uint16_t *col, uint32_t *col_pixel, uint32_t *cost, int edge,        \
+                                            int start, int end, int x_start, int x_end)                                \
+    {                                                                                                                  \
+        (void)edge;                                                                                                    \
+        window_aggregate_body(col, col_pixel, cost, EDGE, 1, start, end, x_start, x_end);                              \
+    }                                                                                                                  \
+    static void window_aggregate_##EDGE##_3(const uint16_t *col, uint32_t *col_pixel, uint32_t *cost, int edge,        \
+                                            int start, int end, int x_start, int x_end)                                \
+    {                                                                                                                  \
+        (void)edge;                                                                                                    \
+        window_aggregate_body(col, col_pixel, cost, EDGE, 3, start, end, x_start, x_end);                              \
+    }                                                                                                                  \
+    static uint32_t window_sad_scalar_##EDGE##_1(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride,       \
+                                                 int edge)                                                             \
+    {                                                                                                                  \
+        (void)edge;                                                                                                    \
+        return window_sad_scalar_body(a, a_stride, b, b_stride, EDGE, 1);                                              \
+    }                                                                                                                  \
+    static uint32_t window_sad_scalar_##EDGE##_3(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride,       \
+                                                 int edge)                                                             \
+    {                                                                                                                  \
+        (void)edge;                                                                                                    \
+        return window_sad_scalar_body(a, a_stride, b, b_stride, EDGE, 3);                                              \
+    }
+
+#ifdef SAD_KERNELS_X86
+#define WINDOW_KERNELS(EDGE)                                                                                           \
+    WINDOW_KERNELS_COMMON(EDGE)                                                                                        \
+    __attribute__((target("sse2"))) static uint32_t window_sad_sse2_##EDGE##_1(const uint8_t *a, int a_stride,         \
+                                                                               const uint8_t *b, int b_stride,         \
+                                                                               int edge)                               \
+    {                                                                                                                  \
+        (void)edge;                                                                                                    \
+        return window_sad_sse2_body(a, a_stride, b, b_stride, EDGE, 1);                                                \
+    }                                                                                                                  \
+    __attribute__((target("sse2"))) static uint32_t window_sad_sse2_##EDGE##_3(const uint8_t *a, int a_stride,         \
+                                                                               const uint8_t *b, int b_stride,         \
+                                                                               int edge)                               \
+    {                                                                                                                  \
+        (void)edge;                                                                                                    \
+        return window_sad_sse2_body(a, a_stride, b, b_stride, EDGE, 3);                                                \
+    }
+#define WINDOW_KERNELS_SIMD(EDGE, CHANNELS) window_sad_sse2_##EDGE##_##CHANNELS
+#elif defined(SAD_KERNELS_NEON)
+#define WINDOW_KERNELS(EDGE)                                                                                           \
+    WINDOW_KERNELS_COMMON(EDGE)                                                                                        \
+    static uint32_t window_sad_neon_##EDGE##_1(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride,         \
+                                               int edge)                                                               \
+    {                                                                                                                  \
+        (void)edge;                                                                                                    \
+        return window_sad_neon_body(a, a_stride, b, b_stride, EDGE, 1);                                                \
+    }                                                                                                                  \
+    static uint32_t window_sad_neon_##EDGE##_3(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride,         \
+                                               int edge)                                                               \
+    {                                                                                                                  \
+        (void)edge;                                                                                                    \
+        return window_sad_neon_body(a, a_stride, b, b_stride, EDGE, 3);                                                \
+    }
+#define WINDOW_KERNELS_SIMD(EDGE, CHANNELS) window_sad_neon_##EDGE##_##CHANNELS
+#else
+#define WINDOW_KERNELS(EDGE) WINDOW_KERNELS_COMMON(EDGE)
+#define WINDOW_KERNELS_SIMD(EDGE, CHANNELS) window_sad_scalar_##EDGE##_##CHANNELS
+#endif
+
+WINDOW_KERNELS(1)
+WINDOW_KERNELS(2)
+WINDOW_KERNELS(3)
+WINDOW_KERNELS(4)
+WINDOW_KERNELS(5)
+WINDOW_KERNELS(6)
+WINDOW_KERNELS(7)
+
+// Table entry of the kernels of one edge size, with the scalar or the
+// vectorized window SAD
+#define WINDOW_KERNELS_SCALAR_ENTRY(EDGE)                                                                              \
+    {EDGE,                                                                                                             \
+     {window_aggregate_##EDGE##_1, window_aggregate_##EDGE##_3},                                                       \
+     {window_sad_scalar_##EDGE##_1, window_sad_scalar_##EDGE##_3}}
+#define WINDOW_KERNELS_SIMD_ENTRY(EDGE)                                                                                \
+    {EDGE,                                                                                                             \
+     {window_aggregate_##EDGE##_1, window_aggregate_##EDGE##_3},                                                       \
+     {WINDOW_KERNELS_SIMD(EDGE, 1), WINDOW_KERNELS_SIMD(EDGE, 3)}}
+
+// Specialized kernels by edge size, for the scalar kernel set and for the
+// vectorized ones
+static const struct window_kernels window_kernels_scalar[WINDOW_KERNELS_MAX_EDGE] = {
+    WINDOW_KERNELS_SCALAR_ENTRY(1), WINDOW_KERNELS_SCALAR_ENTRY(2), WINDOW_KERNELS_SCALAR_ENTRY(3),
+    WINDOW_KERNELS_SCALAR_ENTRY(4), WINDOW_KERNELS_SCALAR_ENTRY(5), WINDOW_KERNELS_SCALAR_ENTRY(6),
+    WINDOW_KERNELS_SCALAR_ENTRY(7),
+};
+static const struct window_kernels window_kernels_simd[WINDOW_KERNELS_MAX_EDGE] = {
+    WINDOW_KERNELS_SIMD_ENTRY(1), WINDOW_KERNELS_SIMD_ENTRY(2), WINDOW_KERNELS_SIMD_ENTRY(3),
+    WINDOW_KERNELS_SIMD_ENTRY(4), WINDOW_KERNELS_SIMD_ENTRY(5), WINDOW_KERNELS_SIMD_ENTRY(6),
+    WINDOW_KERNELS_SIMD_ENTRY(7),
+};
+
+// Whether window_kernels_get() hands out the specialized kernels
+static int window_kernels_specialized = 1;
+
+// Returns the kernels for windows of the given edge size: the specialized ones
+// matching the active kernel set if there are any for it, otherwise the
+// generic ones.
+static inline const struct window_kernels *window_kernels_get(int edge)
+{
+    if (!window_kernels_specialized || edge < 1 || edge > WINDOW_KERNELS_MAX_EDGE)
+    {
+        return &window_kernels_generic;
+    }
+    return sad_kernels_get() == &sad_kernels_scalar ? &window_kernels_scalar[edge - 1]
+                                                    : &window_kernels_simd[edge - 1];
+}
+
+// Turns the specialized kernels on or off, off matches every window size with
+// the generic kernels, e.g. to compare the two.
+void window_kernels_use_specialized(int specialized)
+{
+    window_kernels_specialized = specialized;
+}
@@ -17,16 +17,20 @@
 #define NUM_PARTICLES 7000
 // Sensor offset for the side sensors in radians
 #define SENSOR_OFFSET 0.2
+// Number of sensor rays of the simulated agent
+#define NUM_SENSORS 3
 
-// Agent object.
+// Agent object. The sensor rays use the layout of the depth processing range
+// scan (disparity_to_range_scan in depth_processing/range_scan.c), so a scan
+// from the cameras can be passed to calc_weights as it is.
 typedef struct agent
 {
     double x;
     double y;
-    double angle;    // Rotation in radians
-    double length_c; // length of the sensor ray
-    double length_l; // length of the sensor ray
-    double length_r; // length of the sensor ray
+    double angle;                 // Rotation in radians
+    double bearing[NUM_SENSORS];  // Angle of each sensor ray from the agent's
+                                  // angle, in radians, left to right
+    double range[NUM_SENSORS];    // length of each sensor ray, NAN if unknown
 } agent;
 
 // Particle object
@@ -254,8 +258,10 @@ double get_normal(double half_life, double target, double input)
 }
 
 // Calculate the weights of the particles based on the sensor readings of the
-// agent and each pixel.
-double calc_weights(particle (*particles)[NUM_PARTICLES], SDL_Rect (*walls)[], agent robot)
+// agent and each pixel. The readings are a range scan of count rays, ray i
+// pointing bearing[i] radians from the agent's angle and measuring range[i].
+// Rays with a NAN range are skipped.
+double calc_weights(particle (*particles)[NUM_PARTICLES], SDL_Rect (*walls)[], const double *bearing, const double *range, int count)
 {
     double weight_sum = 0;
     double max_weight = 0;
@@ -268,9 +274,14 @@ double calc_weights(particle (*particles)[NUM_PARTICLES], SDL_Rect (*walls)[], a
         else
         {
             // Complicated, only uses sensor inputs.
-            (*particles)[i].weight = get_normal(10, robot.length_c, get_ray_len(walls, (*particles)[i].x, (*particles)[i].y, (*particles)[i].angle));
-            (*particles)[i].weight += get_normal(10, robot.length_r, get_ray_len(walls, (*particles)[i].x, (*particles)[i].y, (*particles)[i].angle + SENSOR_OFFSET));
-            (*particles)[i].weight += get_normal(10, robot.length_l, get_ray_len(walls, (*particles)[i].x, (*particles)[i].y, (*particles)[i].angle - SENSOR_OFFSET));
+            (*particles)[i].weight = 0;
+            for (int r = 0; r < count; r++)
+            {
+                if (!isnan(range[r]))
+                {
+                    (*particles)[i].weight += get_normal(10, range[r], get_ray_len(walls, (*particles)[i].x, (*particles)[i].y, (*particles)[i].angle + bearing[r]));
+                }
+            }
 
             // Simple (cheating) for debugging
             // (*particles)[i].weight = get_normal(50, robot.x, (*particles)[i].x);
@@ -635,6 +646,10 @@ int main(int argc, char *argv[])
     robot.x = rand_in_range(10, 990);
     robot.y = rand_in_range(10, 990);
     robot.angle = rand_in_range(0, 2 * M_PI);
+    for (int r = 0; r < NUM_SENSORS; r++)
+    {
+        robot.bearing[r] = (r - (NUM_SENSORS - 1) / 2) * SENSOR_OFFSET;
+    }
 
     // Set the paths inital coordinates
     connection path = {0, 0, 0, 500, 500, NULL};
@@ -761,13 +776,14 @@ int main(int argc, char *argv[])
         }
 
         // Calculate the lengths of the agent sensors
-        robot.length_c = get_ray_len(&walls, robot.x, robot.y, robot.angle);
-        robot.length_r = get_ray_len(&walls, robot.x, robot.y, robot.angle + SENSOR_OFFSET);
-        robot.length_l = get_ray_len(&walls, robot.x, robot.y, robot.angle - SENSOR_OFFSET);
+        for (int r = 0; r < NUM_SENSORS; r++)
+        {
+            robot.range[r] = get_ray_len(&walls, robot.x, robot.y, robot.angle + robot.bearing[r]);
+        }
 
         // Move particles and update weights
         predict_particles(&particles, movement_estimate);
-        max_weight = calc_weights(&particles, &walls, robot);
+        max_weight = calc_weights(&particles, &walls, robot.bearing, robot.range, NUM_SENSORS);
 
         // find the best-guess particle for drawing
         double weight = 0;
@@ -819,9 +835,10 @@ int main(int argc, char *argv[])
         SDL_SetRenderDrawColor(rend, 255, 255, 255, 255);
         DrawCircle(rend, robot.x, robot.y, 15);
         SDL_SetRenderDrawColor(rend, 255, 0, 0, 255);
-        DrawRay(rend, robot.x, robot.y, robot.length_c, robot.angle);
-        DrawRay(rend, robot.x, robot.y, robot.length_r, robot.angle + SENSOR_OFFSET);
-        DrawRay(rend, robot.x, robot.y, robot.length_l, robot.angle - SENSOR_OFFSET);
+        for (int r = 0; r < NUM_SENSORS; r++)
+        {
+            DrawRay(rend, robot.x, robot.y, robot.range[r], robot.angle + robot.bearing[r]);
+        }
 
         // Draw best-guess robot
         SDL_SetRenderDrawColor(rend, 100, 255, 100, 255);